@@ -22,6 +22,11 @@ var MessageRouter = function() {
   this.sendMessageFn = null;
   this.isInitialized = false;
   this.initializeResolver = getPromiseResolver();
+
+  // When batching is enabled requests sent in the same turn of the event
+  // loop are posted to the NaCl module as a single array.
+  this.batchRequests = false;
+  this.pendingRequests = [];
 };
 
 MessageRouter.prototype.initialize = function(sendMessageFn) {
@@ -34,6 +39,35 @@ MessageRouter.prototype.initialize = function(sendMessageFn) {
   this.initializeResolver.resolve();
 };
 
+MessageRouter.prototype.enableBatching = function() {
+  log.debug('Enabling request batching in message router');
+  this.batchRequests = true;
+};
+
+MessageRouter.prototype.postMessage_ = function(message) {
+  if (!this.batchRequests) {
+    this.sendMessageFn(message);
+    return;
+  }
+
+  this.pendingRequests.push(message);
+  if (this.pendingRequests.length == 1) {
+    setTimeout(this.flushRequests_.bind(this), 0);
+  }
+};
+
+MessageRouter.prototype.flushRequests_ = function() {
+  var requests = this.pendingRequests;
+  this.pendingRequests = [];
+
+  if (requests.length == 1) {
+    this.sendMessageFn(requests[0]);
+  } else if (requests.length > 1) {
+    log.debug('Sending ' + requests.length + ' batched requests');
+    this.sendMessageFn(requests);
+  }
+};
+
 MessageRouter.prototype.sendMessageWithRetry = function(
     message, opt_processDataFn) {
   var operation = message.functionName + '[' + message.messageId + ']';
@@ -59,21 +93,30 @@ MessageRouter.prototype.sendMessage = function(message, opt_processDataFn) {
 
   // Always make sure initialization is complete before sending messages.
   this.initializeResolver.promise.then(function() {
-    this.sendMessageFn(message);
+    this.postMessage_(message);
   }.bind(this));
 
   return this.messages[messageId].resolver.promise;
 };
 
 MessageRouter.prototype.handleMessage = function(message) {
-  var messageId = message.data.messageId;
+  // The NaCl module may coalesce several responses into one array message.
+  if (Array.isArray(message.data)) {
+    message.data.forEach(this.handleResponse_.bind(this));
+  } else {
+    this.handleResponse_(message.data);
+  }
+};
+
+MessageRouter.prototype.handleResponse_ = function(response) {
+  var messageId = response.messageId;
 
   if (!(messageId in this.messages)) {
     log.warning('Ignoring message with unknown id ' + messageId);
     return;
   }
 
-  var error = message.data.result.error;
+  var error = response.result.error;
   var failed = false;
   if (error) {
     failed = true;
@@ -84,27 +127,27 @@ MessageRouter.prototype.handleMessage = function(message) {
 
     if (isDef(processDataFn)) {
       log.debug('streaming data for ' + messageId);
-      this.messages[messageId].processDataFn(message.data);
+      this.messages[messageId].processDataFn(response);
 
-      if (!message.data.hasMore) {
+      if (!response.hasMore) {
         // TODO(zentaro): Accumulate results here so that the final resolution
         // also gets the full data set.
         this.messages[messageId].resolver.resolve(null);
       }
     } else {
-      if (message.data.hasMore) {
+      if (response.hasMore) {
         failed = true;
         var errorMessage =
             'No processing function supplied for streamed message ' + messageId;
         log.error(errorMessage);
         this.messages[messageId].resolver.reject(errorMessage);
       } else {
-        this.messages[messageId].resolver.resolve(message.data);
+        this.messages[messageId].resolver.resolve(response);
       }
     }
   }
 
-  if (failed || !message.data.hasMore) {
+  if (failed || !response.hasMore) {
     log.debug('Deleting state for message ' + messageId);
     delete this.messages[messageId];
   }
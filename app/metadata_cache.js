@@ -16,17 +16,19 @@
 
 
 /**
- * Class to cache EntryMetadata. Currently only relevant for caching
- * individual getMetadata requests. readDirectory calls currently don't use the
- * cache (but could with some modification).
+ * Class to cache EntryMetadata. Individual getMetadata requests are answered
+ * from it, and a readDirectory refresh of a cached directory only fetches
+ * the changes and applies them here.
  */
 MetadataCache = function() {
   this.cache = {};
 };
 
 
+// opt_versionToken is the one readDirectory returned with the listing. It
+// lets a later refresh ask for just the changes with custom_readDirectoryDiff.
 MetadataCache.prototype.cacheDirectoryContents = function(
-    fileSystemId, directoryPath, entries, currentTime) {
+    fileSystemId, directoryPath, entries, currentTime, opt_versionToken) {
   if (!(fileSystemId in this.cache)) {
     log.debug('Starting cache for ' + fileSystemId);
     this.cache[fileSystemId] = {};
@@ -37,14 +39,16 @@ MetadataCache.prototype.cacheDirectoryContents = function(
   this.cache[fileSystemId][directoryPath] = {
     'timeCached': currentTime,
     'entries': {},
-    'incomplete_entries': {}
+    'incomplete_entries': {},
+    'versionToken': opt_versionToken || null
   };
 
   entries.forEach(function(entry) {
     // Make sure the full entry path is stored in the entry for convenience.
     entry['entryPath'] = this.joinEntryPath_(directoryPath, entry.name);
     this.cache[fileSystemId][directoryPath]['entries'][entry.name] = entry;
-    if (entry.size == -1) {
+    // Entries without stat() info have no size or a size of -1.
+    if (!isDef(entry.size) || entry.size == -1) {
       log.debug('Adding incomplete entry for ' + entry.name);
       this.cache[fileSystemId][directoryPath]['incomplete_entries']
                 [entry.name] = true;
@@ -52,6 +56,107 @@ MetadataCache.prototype.cacheDirectoryContents = function(
   }.bind(this));
 };
 
+// Returns the version token of the cached listing of directoryPath or null
+// when there isn't a current one.
+MetadataCache.prototype.getVersionToken = function(
+    fileSystemId, directoryPath, currentTime) {
+  var fsCache = this.cache[fileSystemId];
+  var dirCache = fsCache ? fsCache[directoryPath] : null;
+  if (!dirCache ||
+      currentTime >= dirCache['timeCached'] +
+          this.getCacheTimeMs_(directoryPath)) {
+    return null;
+  }
+
+  return dirCache['versionToken'];
+};
+
+// Forgets the version token of the cached listing of directoryPath so the
+// next refresh reads the whole directory.
+MetadataCache.prototype.clearVersionToken = function(
+    fileSystemId, directoryPath) {
+  var fsCache = this.cache[fileSystemId];
+  var dirCache = fsCache ? fsCache[directoryPath] : null;
+  if (dirCache) {
+    dirCache['versionToken'] = null;
+  }
+};
+
+// Returns a copy of the cached entries of directoryPath keyed by name, or
+// null when it isn't cached. Later changes to the cache don't affect it.
+MetadataCache.prototype.getDirectoryEntries = function(
+    fileSystemId, directoryPath) {
+  var fsCache = this.cache[fileSystemId];
+  var dirCache = fsCache ? fsCache[directoryPath] : null;
+  if (!dirCache) {
+    return null;
+  }
+
+  var entries = {};
+  for (var name in dirCache['entries']) {
+    entries[name] = dirCache['entries'][name];
+  }
+
+  return entries;
+};
+
+// Brings the cached listing of directoryPath up to date with a
+// custom_readDirectoryDiff response asked for with versionToken, and returns
+// every entry in the directory. Returns null when the cached listing is no
+// longer the one the diff is against.
+MetadataCache.prototype.applyDirectoryDiff = function(
+    fileSystemId, directoryPath, versionToken, diff, currentTime) {
+  var fsCache = this.cache[fileSystemId];
+  var dirCache = fsCache ? fsCache[directoryPath] : null;
+  if (!dirCache || dirCache['versionToken'] != versionToken) {
+    return null;
+  }
+
+  diff.removed.forEach(function(name) {
+    var oldEntry = dirCache['entries'][name];
+    if (oldEntry && oldEntry['stat_resolver']) {
+      oldEntry['stat_resolver'].reject('NOT_FOUND');
+    }
+
+    delete dirCache['entries'][name];
+    delete dirCache['incomplete_entries'][name];
+  });
+
+  diff.added.concat(diff.modified).forEach(function(entry) {
+    entry['entryPath'] = this.joinEntryPath_(directoryPath, entry.name);
+    var oldEntry = dirCache['entries'][entry.name];
+    var statResolver = oldEntry ? oldEntry['stat_resolver'] : null;
+    dirCache['entries'][entry.name] = entry;
+    if (!isDef(entry.size) || entry.size == -1) {
+      // A batched stat() still in flight resolves it later.
+      if (statResolver) {
+        entry['stat_resolver'] = statResolver;
+      } else {
+        dirCache['incomplete_entries'][entry.name] = true;
+      }
+    } else {
+      if (statResolver) {
+        statResolver.resolve(entry);
+      }
+      delete dirCache['incomplete_entries'][entry.name];
+    }
+  }.bind(this));
+
+  log.debug(
+      'Applied diff to ' + fileSystemId + '|' + directoryPath + ' +' +
+      diff.added.length + ' ~' + diff.modified.length + ' -' +
+      diff.removed.length);
+  dirCache['timeCached'] = currentTime;
+  dirCache['versionToken'] = diff.versionToken || null;
+
+  var entries = [];
+  for (var name in dirCache['entries']) {
+    entries.push(dirCache['entries'][name]);
+  }
+
+  return entries;
+};
+
 MetadataCache.prototype.lookupMetadata = function(
     fileSystemId, entryPath, currentTime) {
   var pathParts = this.splitEntryPath_(entryPath);
@@ -135,6 +240,12 @@ MetadataCache.prototype.updateMetadata = function(
       }
     }
 
+    // The module doesn't know about an entry it didn't list so diffs
+    // against its listing would no longer apply.
+    if (!oldEntry) {
+      dirCache['versionToken'] = null;
+    }
+
     // Assumption is that updateMetadata is only called with complete entries.
     dirCache['entries'][entry['name']] = entry;
 
@@ -144,7 +255,10 @@ MetadataCache.prototype.updateMetadata = function(
   }
 };
 
-MetadataCache.prototype.invalidateEntry = function(fileSystemId, entryPath) {
+// When opt_error is given any request waiting on a batched stat() of the
+// entry is rejected with it.
+MetadataCache.prototype.invalidateEntry = function(
+    fileSystemId, entryPath, opt_error) {
   var pathParts = this.splitEntryPath_(entryPath);
   var dirCache = this.getDirectoryCache_(fileSystemId, pathParts);
 
@@ -153,6 +267,10 @@ MetadataCache.prototype.invalidateEntry = function(fileSystemId, entryPath) {
   }
 
   log.debug('Invalidating metadata entry for ' + entryPath);
+  var oldEntry = dirCache['entries'][pathParts['name']];
+  if (opt_error && oldEntry && oldEntry['stat_resolver']) {
+    oldEntry['stat_resolver'].reject(opt_error);
+  }
 
   // NOTE: Currently invalidation just deletes the entry in the dirCache which
   // is fine since we only use the cache for individual metadata requests. When
@@ -163,6 +281,31 @@ MetadataCache.prototype.invalidateEntry = function(fileSystemId, entryPath) {
   // would refresh the cache in all cases.
   delete dirCache['entries'][pathParts['name']];
   delete dirCache['incomplete_entries'][pathParts['name']];
+  // A diff wouldn't bring the entry back if it is unchanged.
+  dirCache['versionToken'] = null;
+};
+
+// Gives up on a batched stat() of the entry without dropping it. Anyone
+// waiting on the batch is rejected with error and the entry can go in the
+// next batch.
+MetadataCache.prototype.releaseEntry = function(
+    fileSystemId, entryPath, error) {
+  var pathParts = this.splitEntryPath_(entryPath);
+  var dirCache = this.getDirectoryCache_(fileSystemId, pathParts);
+  var entry = dirCache ? dirCache['entries'][pathParts['name']] : null;
+
+  if (!entry) {
+    return;
+  }
+
+  if (entry['stat_resolver']) {
+    entry['stat_resolver'].reject(error);
+    delete entry['stat_resolver'];
+  }
+
+  if (!isDef(entry.size) || entry.size == -1) {
+    dirCache['incomplete_entries'][pathParts['name']] = true;
+  }
 };
 
 // Returns how long in ms a directories cache entries are valid.
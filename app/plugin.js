@@ -132,10 +132,16 @@ function listenForFileSystemEvents() {
       // multiple mounts.
       log.debug(
           'Calling SambaClient.enumerateFileShares from the background via message');
-      smbfs.enumerateFileShares(message.hostMap).then(function(response) {
-        log.debug('Send enumerateFileShares response to popup');
-        sendResponse(response);
-      });
+      var sharesFound = function(shares) {
+        chrome.runtime.sendMessage(
+            {functionName: 'fileSharesFound', shares: shares});
+      };
+
+      smbfs.enumerateFileShares(message.hostMap, sharesFound)
+          .then(function(response) {
+            log.debug('Send enumerateFileShares response to popup');
+            sendResponse(response);
+          });
     } else {
       log.error('ERROR: Unknown message passed.');
       log.error(message);
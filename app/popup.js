@@ -165,16 +165,24 @@ function enumerateFileShares() {
 
     var message = {functionName: 'enumerateFileShares', hostMap: hostIPMap};
 
+    // Shares are added as each host answers. The final response only says
+    // that every host is done.
+    chrome.runtime.onMessage.addListener(function(message) {
+      if (message.functionName == 'fileSharesFound') {
+        addFoundShares(message.shares);
+      }
+    });
+
     log.debug('enumerateFileShares sending message to background');
     chrome.runtime.sendMessage(message, function(response) {
       if (response.result) {
         log.info('enumerateFileShares succeeded');
-        addFoundShares(response.result.value);
       } else {
         log.error('enumerateFileShares failed with ' + response.error);
-        var sharesDropdown = document.getElementById("shareDropdown");
-        sharesDropdown.setLoading(false);
       }
+
+      var sharesDropdown = document.getElementById("shareDropdown");
+      sharesDropdown.setLoading(false);
     });
   });
 }
@@ -186,7 +194,6 @@ function addFoundShares(shares) {
       sharesDropdown.addShare(share.fullPath);
     });
   }
-  sharesDropdown.setLoading(false);
 }
 
 function onDefaultPopupLoaded() {
@@ -21,8 +21,17 @@
 // doing that for NETWORK providers.
 // This work around is to supply an icon but make it bogus so it falls back to
 // the generic icon.
+// The NaCl module now reads the EXIF thumbnail out of the header of the
+// formats below so this is only used for files that don't have one.
 var UNKNOWN_IMAGE_DATA_URI = 'data:image/png;base64,X';
 
+// Files that can have an EXIF thumbnail. Must stay in sync with the list
+// in ExifThumbnail.cc.
+var THUMBNAIL_EXTENSIONS = [
+  'arw', 'cr2', 'dng', 'heic', 'heif', 'jpe', 'jpeg', 'jpg', 'nef', 'nrw',
+  'pef', 'srw', 'tif', 'tiff'
+];
+
 // The names of the fields in an EntryMetadata.
 var METADATA_FIELDS = [
   'name', 'size', 'modificationTime', 'thumbnail', 'mimeType', 'isDirectory'
@@ -39,6 +48,57 @@ var METADATA_FIELD_BITS = {
   'mimeType': 32
 };
 
+// The NaCl module only sends the fields in the mask. These are always
+// asked for on top of what the Files app wants since the metadata cache
+// is keyed by name and needs complete stat() info.
+var DIRECTORY_CACHE_FIELD_BITS =
+    METADATA_FIELD_BITS['name'] | METADATA_FIELD_BITS['isDirectory'];
+var STAT_CACHE_FIELD_BITS = DIRECTORY_CACHE_FIELD_BITS |
+    METADATA_FIELD_BITS['size'] | METADATA_FIELD_BITS['modificationTime'];
+
+// How many incomplete cache entries are stat()'d along with a cache miss.
+// The NaCl module spreads them over several connections and reports an
+// error per entry so large batches are cheap.
+var STAT_BATCH_SIZE = 256;
+
+// getMetadata requests the NaCl module hasn't started within this long are
+// failed without a stat(). The Files app gives up on a request after about
+// 10s, and by then the entry has usually been scrolled out of view.
+var METADATA_EXPIRY_MS = 10000;
+
+// Messages that are not tied to a mounted file system and go straight to
+// the NaCl module.
+var PASS_THROUGH_FUNCTIONS = [
+  'mount', 'unmount', 'custom_enumerateFileShares', 'custom_configure',
+  'custom_getStats', 'custom_getMemoryReport', 'custom_reapIdle',
+  'custom_startTrace', 'custom_stopTrace', 'custom_batchMount'
+];
+
+// Responses are coalesced by the NaCl module for up to this long or until
+// this many are pending.
+var RESPONSE_BATCH_WINDOW_MICROS = 2000;
+var RESPONSE_BATCH_MAX = 64;
+
+// Share enumeration talks to this many hosts at once and gives up on any
+// host that hasn't answered in time.
+var ENUMERATE_MAX_CONCURRENT_HOSTS = 16;
+var ENUMERATE_HOST_TIMEOUT_MS = 5000;
+
+// Saved shares are remounted together at startup, this many at a time.
+var REMOUNT_MAX_CONCURRENT = 8;
+var REMOUNT_TIMEOUT_MS = 5000;
+
+// The NaCl module fails requests that outlived their expiresInMs option with
+// DEADLINE_EXCEEDED. The Files app only knows the FSP errors so it sees them
+// as aborted.
+var toProviderError = function(err) {
+  return err == 'DEADLINE_EXCEEDED' ? 'ABORT' : err;
+};
+
+// The NaCl module only runs while handling messages so it is reminded this
+// often to close connections and files that have been idle too long.
+var REAP_IDLE_INTERVAL_MS = 60000;
+
 var SambaClient = function() {
   log.info('Initializing samba client');
   this.messageId_ = 0;
@@ -54,6 +114,44 @@ var SambaClient = function() {
 SambaClient.prototype.initialize = function(sendMessageFn) {
   log.debug('Setting sendMessageFn in SambaClient with ' + sendMessageFn);
   this.router.initialize(sendMessageFn);
+  this.enableBatching_();
+  setInterval(this.reapIdle_.bind(this), REAP_IDLE_INTERVAL_MS);
+};
+
+SambaClient.prototype.reapIdle_ = function() {
+  this.sendMessage_('custom_reapIdle', [{}])
+      .then(
+          function(response) {
+            var reaped = response.result.value;
+            if (reaped.handlesReaped > 0 || reaped.sessionsClosed) {
+              log.info(
+                  'Reaped ' + reaped.handlesReaped + ' idle files' +
+                  (reaped.sessionsClosed ? ' and idle connections' : ''));
+            }
+          },
+          function(err) {
+            log.error('Reaping idle sessions failed: ' + err);
+          });
+};
+
+SambaClient.prototype.enableBatching_ = function() {
+  var options = {
+    batching: {
+      enabled: true,
+      maxResponses: RESPONSE_BATCH_MAX,
+      windowMicros: RESPONSE_BATCH_WINDOW_MICROS
+    }
+  };
+
+  this.sendMessage_('custom_configure', [options])
+      .then(
+          function() {
+            // Only batch requests once the module is known to unpack them.
+            this.router.enableBatching();
+          }.bind(this),
+          function(err) {
+            log.error('Enabling batching failed: ' + err);
+          });
 };
 
 SambaClient.prototype.regenerateMountInfo_ = function(sharePath) {
@@ -122,6 +220,7 @@ SambaClient.prototype.populateMounts_ = function() {
   this.fsp.getAll(function(fileSystems) {
     log.debug('Found ' + fileSystems.length + ' file systems mounted.');
     var unmountPromises = [];
+    var remountFileSystems = [];
     fileSystems.forEach(function(fileSystem) {
       // If there aren't saved credentials for this share then unmount it.
       // Shares that don't need a password still have a credential entry
@@ -129,6 +228,7 @@ SambaClient.prototype.populateMounts_ = function() {
       if (this.credentials.exists(fileSystem.fileSystemId)) {
         fileSystem['mountPromise'] = null;
         this.mounts[fileSystem.fileSystemId] = fileSystem;
+        remountFileSystems.push(fileSystem);
       } else {
         log.debug(
             'No credentials for ' + fileSystem.fileSystemId + '. Unmounting.');
@@ -156,6 +256,91 @@ SambaClient.prototype.populateMounts_ = function() {
     attachResolver(
         joinAllIgnoringRejects(unmountPromises), this.populateResolver);
 
+    this.batchRemount_(remountFileSystems);
+  }.bind(this));
+};
+
+/**
+ * Remounts all the saved shares with a single message so the NaCl module
+ * can check them in parallel instead of one by one on first access. Each
+ * mountPromise is set before anything is sent so requests that arrive in
+ * the meantime wait for it. A share that fails gets its mountPromise
+ * cleared so the next request retries it through remountShare_.
+ */
+SambaClient.prototype.batchRemount_ = function(fileSystems) {
+  if (fileSystems.length == 0) {
+    return;
+  }
+
+  var resolvers = {};
+  fileSystems.forEach(function(fileSystem) {
+    var resolver = getPromiseResolver();
+    resolvers[fileSystem.fileSystemId] = resolver;
+    fileSystem['mountPromise'] = resolver.promise;
+  });
+
+  var settleRemount = function(fileSystemId, err) {
+    var resolver = resolvers[fileSystemId];
+    if (!resolver) {
+      return;
+    }
+
+    delete resolvers[fileSystemId];
+    if (!err) {
+      log.debug('Remounted ' + fileSystemId);
+      resolver.resolve();
+      return;
+    }
+
+    log.error('Remounting ' + fileSystemId + ' failed with ' + err);
+    var fileSystem = this.mounts[fileSystemId];
+    if (fileSystem && fileSystem['mountPromise'] === resolver.promise) {
+      fileSystem['mountPromise'] = null;
+    }
+
+    resolver.reject(err);
+  }.bind(this);
+
+  var settleRemaining = function(err) {
+    for (var fileSystemId in resolvers) {
+      settleRemount(fileSystemId, err);
+    }
+  };
+
+  var sharePromises = fileSystems.map(function(fileSystem) {
+    return this.regenerateMountInfo_(fileSystem.fileSystemId)
+        .then(function(mountInfo) {
+          var options = {
+            fileSystemId: fileSystem.fileSystemId,
+            displayName: fileSystem.displayName,
+            writable: true
+          };
+
+          return {options: options, mountInfo: mountInfo};
+        });
+  }.bind(this));
+
+  var processMounted = function(response) {
+    var mounted = response.result.value;
+    if (mounted) {
+      settleRemount(mounted.fileSystemId, mounted.error);
+    }
+  };
+
+  var options = {
+    maxConcurrentMounts: REMOUNT_MAX_CONCURRENT,
+    mountTimeoutMs: REMOUNT_TIMEOUT_MS
+  };
+
+  Promise.all(sharePromises).then(function(shares) {
+    log.info('Remounting ' + shares.length + ' shares');
+    this.sendMessage_('custom_batchMount', [shares, options], processMounted)
+        .then(
+            function() {
+              // Every share should have been reported already.
+              settleRemaining('FAILED');
+            },
+            settleRemaining);
   }.bind(this));
 };
 
@@ -168,16 +353,20 @@ SambaClient.prototype.sendMessage_ = function(fnName, args, opt_processDataFn) {
     // On the mount message scrub the password before logging.
     cleansedArgs = JSON.parse(JSON.stringify(args));
     cleansedArgs[1]['password'] = '***********';
+  } else if (fnName == 'custom_batchMount') {
+    cleansedArgs = JSON.parse(JSON.stringify(args));
+    cleansedArgs[0].forEach(function(share) {
+      share.mountInfo['password'] = '***********';
+    });
   }
 
   log.debug(
       'Sending to NaCl fn=' + fnName + ' id=' + messageId + ' args=' +
       JSON.stringify(cleansedArgs));
-  if (fnName == 'mount' || fnName == 'unmount' ||
-      fnName == 'custom_enumerateFileShares') {
-    log.debug('Passing through mount/unmount messages');
+  if (PASS_THROUGH_FUNCTIONS.indexOf(fnName) != -1) {
+    log.debug('Passing through ' + fnName + ' message');
     // These messages pass straight through.
-    return this.router.sendMessageWithRetry(message);
+    return this.router.sendMessageWithRetry(message, opt_processDataFn);
   }
 
   var resolver = getPromiseResolver();
@@ -316,15 +505,236 @@ SambaClient.prototype.noParamsHandler_ = function(
           });
 };
 
-SambaClient.prototype.enumerateFileShares = function(hostMap) {
+/**
+ * Finds the shares on every host in hostMap (host name to IP). The NaCl
+ * module asks the hosts in parallel and streams each host's shares back as
+ * it answers; opt_sharesFoundFn is called with each batch. The promise
+ * resolves with all of them once every host answered or timed out.
+ */
+SambaClient.prototype.enumerateFileShares = function(
+    hostMap, opt_sharesFoundFn) {
   var resolver = getPromiseResolver();
+  var allShares = [];
+  var options = {
+    maxConcurrentHosts: ENUMERATE_MAX_CONCURRENT_HOSTS,
+    hostTimeoutMs: ENUMERATE_HOST_TIMEOUT_MS
+  };
 
-  this.sendMessage_('custom_enumerateFileShares', [hostMap])
-      .then(function(response) { resolver.resolve(response); });
+  var processShares = function(response) {
+    var shares = response.result.value;
+    if (shares.length == 0) {
+      return;
+    }
+
+    allShares = allShares.concat(shares);
+    if (opt_sharesFoundFn) {
+      opt_sharesFoundFn(shares);
+    }
+  };
+
+  this.sendMessage_(
+          'custom_enumerateFileShares', [hostMap, options], processShares)
+      .then(
+          function() { resolver.resolve({result: {value: allShares}}); },
+          function(err) { resolver.resolve({error: err}); });
 
   return resolver.promise;
 };
 
+/**
+ * Searches the tree under directoryPath for names matching a case
+ * insensitive glob ('*' and '?'). Matches are passed to opt_matchesFn as
+ * they are found and the promise resolves with a summary that says whether
+ * a limit cut the search short. opt_limits may set maxDepth, maxResults and
+ * timeLimitMs.
+ */
+SambaClient.prototype.find = function(
+    fileSystemId, directoryPath, pattern, opt_limits, opt_matchesFn) {
+  var options = opt_limits ? JSON.parse(JSON.stringify(opt_limits)) : {};
+  options.fileSystemId = fileSystemId;
+  options.directoryPath = directoryPath;
+  options.pattern = pattern;
+
+  // The router resolves streamed messages with null so the summary in the
+  // last response is kept here.
+  var summary = null;
+  var processMatches = function(response) {
+    if (!response.hasMore) {
+      summary = response.result.value;
+    } else if (opt_matchesFn) {
+      opt_matchesFn(response.result.value);
+    }
+  };
+
+  return this.sendMessage_('custom_find', [options], processMatches)
+      .then(function() { return {result: {value: summary}}; });
+};
+
+/**
+ * Adds up the bytes, files and directories under directoryPath. Running
+ * totals are passed to opt_progressFn while the tree is walked and the
+ * promise resolves with the final totals, which say whether they are
+ * complete.
+ */
+SambaClient.prototype.computeTreeSize = function(
+    fileSystemId, directoryPath, opt_progressFn) {
+  var options = {fileSystemId: fileSystemId, directoryPath: directoryPath};
+
+  var totals = null;
+  var processTotals = function(response) {
+    if (!response.hasMore) {
+      totals = response.result.value;
+    } else if (opt_progressFn) {
+      opt_progressFn(response.result.value);
+    }
+  };
+
+  return this.sendMessage_('custom_computeTreeSize', [options], processTotals)
+      .then(function() { return {result: {value: totals}}; });
+};
+
+/**
+ * Hashes one file inside the module so only the digest crosses into JS.
+ * algorithm is 'sha256', 'crc32c' or 'xxh64' and defaults to 'sha256'.
+ * Resolves with {digest, size}.
+ */
+SambaClient.prototype.hashFile = function(
+    fileSystemId, filePath, opt_algorithm) {
+  return this.sendMessage_('custom_hashFile', [{
+    fileSystemId: fileSystemId,
+    filePath: filePath,
+    algorithm: opt_algorithm || 'sha256'
+  }]);
+};
+
+/**
+ * Hashes a list of files, several at a time. Results are passed to
+ * opt_digestsFn in batches as {filePath, digest, size} or {filePath, error}
+ * in the order the files finish. The promise resolves with the number of
+ * files, failed files and bytes read.
+ */
+SambaClient.prototype.hashFiles = function(
+    fileSystemId, filePaths, opt_algorithm, opt_digestsFn) {
+  var options = {
+    fileSystemId: fileSystemId,
+    entries: filePaths,
+    algorithm: opt_algorithm || 'sha256'
+  };
+
+  var summary = null;
+  var processDigests = function(response) {
+    if (!response.hasMore) {
+      summary = response.result.value;
+    } else if (opt_digestsFn) {
+      opt_digestsFn(response.result.value);
+    }
+  };
+
+  return this.sendMessage_('custom_hashFiles', [options], processDigests)
+      .then(function() { return {result: {value: summary}}; });
+};
+
+/**
+ * Lists the members of a zip file without downloading it. Only the end of
+ * the archive and its central directory are read. Members are passed to
+ * opt_entriesFn in batches of {name, fullPath, isDirectory, size,
+ * modificationTime} and the promise resolves with {entries, bytesRead}.
+ */
+SambaClient.prototype.listArchive = function(
+    fileSystemId, archivePath, opt_entriesFn) {
+  var options = {fileSystemId: fileSystemId, archivePath: archivePath};
+
+  var summary = null;
+  var processEntries = function(response) {
+    if (!response.hasMore) {
+      summary = response.result.value;
+    } else if (opt_entriesFn) {
+      opt_entriesFn(response.result.value);
+    }
+  };
+
+  return this.sendMessage_('custom_listArchive', [options], processEntries)
+      .then(function() { return {result: {value: summary}}; });
+};
+
+/**
+ * Extracts one member of a zip file, or opt_length bytes of it from
+ * opt_offset. The member is inflated in the module so only its compressed
+ * bytes are read from the share. ArrayBuffers are passed to opt_dataFn as
+ * they arrive; without it they are joined into summary.data. Resolves with
+ * {size, memberSize, crcChecked}.
+ */
+SambaClient.prototype.readArchiveMember = function(
+    fileSystemId, archivePath, memberPath, opt_offset, opt_length,
+    opt_dataFn) {
+  var options = {
+    fileSystemId: fileSystemId,
+    archivePath: archivePath,
+    memberPath: memberPath,
+    offset: opt_offset || 0,
+    length: opt_length === undefined ? -1 : opt_length
+  };
+
+  var chunks = [];
+  var summary = null;
+  var processData = function(response) {
+    if (!response.hasMore) {
+      summary = response.result.value;
+    } else if (opt_dataFn) {
+      opt_dataFn(response.result.value);
+    } else {
+      chunks.push(new Uint8Array(response.result.value));
+    }
+  };
+
+  return this.sendMessage_('custom_readArchiveMember', [options], processData)
+      .then(function() {
+        if (!opt_dataFn) {
+          var data = new Uint8Array(summary.size);
+          var offset = 0;
+          for (var i = 0; i < chunks.length; i++) {
+            data.set(chunks[i], offset);
+            offset += chunks[i].length;
+          }
+          summary.data = data.buffer;
+        }
+        return {result: {value: summary}};
+      });
+};
+
+/**
+ * Starts recording every request the NaCl module receives into a binary
+ * trace in the app's persistent html5 file system. When hashPaths is set
+ * path components are hashed so the trace can be shared.
+ */
+SambaClient.prototype.startTrace = function(path, hashPaths) {
+  return this.sendMessage_(
+      'custom_startTrace', [{path: path, hashPaths: !!hashPaths}]);
+};
+
+SambaClient.prototype.stopTrace = function() {
+  return this.sendMessage_('custom_stopTrace', [{}]);
+};
+
+/**
+ * Changes how verbose libsmbclient logging is. Level 0 is the default as
+ * anything higher slows every request down.
+ */
+SambaClient.prototype.setDebugLevel = function(level) {
+  return this.sendMessage_('custom_configure', [{samba: {debugLevel: level}}]);
+};
+
+// Resolves with counters from the NaCl module, grouped by subsystem.
+SambaClient.prototype.getStats = function() {
+  return this.sendMessage_('custom_getStats', [{}]);
+};
+
+// Resolves with the NaCl module's memory use against its budget, broken down
+// by subsystem.
+SambaClient.prototype.getMemoryReport = function() {
+  return this.sendMessage_('custom_getMemoryReport', [{}]);
+};
+
 SambaClient.prototype.unmount = function(options, successFn, errorFn) {
   log.info('Unmounting');
   var resolver = getPromiseResolver();
@@ -372,20 +782,40 @@ SambaClient.prototype.filterRequestedData_ = function(options, entry) {
 
   METADATA_FIELDS.forEach(addFieldIfRequested);
 
+  // The NaCl module leaves out the mimeType when it couldn't tell and the
+  // Files app rejects an empty one.
+  if (!result['mimeType']) {
+    delete result['mimeType'];
+  }
+
   // Workaround to prevent Files.app downloading the entire file
   // to generate a thumb.
-  // The original entry won't have the thumbnail so inject a broken
-  // URI.
-  if (getDefault(options, 'thumbnail', true)) {
+  // When the NaCl module found no thumbnail inject a broken URI.
+  if (getDefault(options, 'thumbnail', true) && !result['thumbnail']) {
     result['thumbnail'] = UNKNOWN_IMAGE_DATA_URI;
   }
 
   return result;
 };
 
+SambaClient.prototype.mayHaveThumbnail_ = function(entryPath) {
+  var dot = entryPath.lastIndexOf('.');
+  if (dot == -1) {
+    return false;
+  }
+
+  var extension = entryPath.substring(dot + 1).toLowerCase();
+  return THUMBNAIL_EXTENSIONS.indexOf(extension) != -1;
+};
+
+SambaClient.prototype.requestNeedsThumbnail_ = function(options, entry) {
+  // Identify when the native side should be asked for a thumbnail that
+  // isn't cached yet.
+  return getDefault(options, 'thumbnail', true) && !entry['thumbnail'] &&
+      this.mayHaveThumbnail_(options.entryPath);
+};
+
 SambaClient.prototype.isEmptyRequest_ = function(options) {
-  // TODO(zentaro): Maybe clear the mimeType flag since this
-  // extension never delivers that data.
   return options['fieldMask'] == 0;
 };
 
@@ -394,9 +824,11 @@ SambaClient.prototype.isThumbOnlyRequest_ = function(options) {
   return options['fieldMask'] == METADATA_FIELD_BITS['thumbnail'];
 };
 
-SambaClient.prototype.isMimeTypeOnlyRequest_ = function(options) {
-  // Identify when only a mimeType is being requested.
-  return options['fieldMask'] == METADATA_FIELD_BITS['mimeType'];
+SambaClient.prototype.requestNeedsMimeType_ = function(options, entry) {
+  // readDirectory only resolves known extensions so other files are sent
+  // to the NaCl module to be sniffed.
+  return getDefault(options, 'mimeType', true) && !entry['isDirectory'] &&
+      !('mimeType' in entry);
 };
 
 SambaClient.prototype.requestNeedsStat_ = function(options) {
@@ -441,8 +873,14 @@ SambaClient.prototype.getMetadataHandler = function(
   var cachedEntry = this.metadataCache.lookupMetadata(
       options.fileSystemId, options.entryPath, window.performance.now());
 
-  if (cachedEntry) {
-    var cacheHasStat = (cachedEntry.size != -1);
+  if (cachedEntry &&
+      (this.requestNeedsThumbnail_(options, cachedEntry) ||
+       this.requestNeedsMimeType_(options, cachedEntry))) {
+    // Entries from readDirectory never have a thumbnail or a sniffed
+    // mimeType so ask for this one directly instead of batching stat() calls.
+    log.debug('getMetadata[thumbnail/mimeType miss] ' + options.entryPath);
+  } else if (cachedEntry) {
+    var cacheHasStat = isDef(cachedEntry.size) && cachedEntry.size != -1;
     if (cacheHasStat || !this.requestNeedsStat_(options)) {
       // Either the cache already has stat() info or the request
       // doesn't need it.
@@ -466,7 +904,7 @@ SambaClient.prototype.getMetadataHandler = function(
             }.bind(this),
             function(err) {
               log.error('batchGetMetadata[stat_resolver] failed with ' + err);
-              errorFn(err);
+              errorFn(toProviderError(err));
               delete cachedEntry['stat_resolver'];
             });
 
@@ -480,40 +918,67 @@ SambaClient.prototype.getMetadataHandler = function(
       // Since there is going to be a round trip anyway
       // ask the cache for a batch of entries that could be updated.
       var batch = this.metadataCache.getBatchToUpdate(
-          options.fileSystemId, options.entryPath, 64);
+          options.fileSystemId, options.entryPath, STAT_BATCH_SIZE);
       if (batch.length > 0) {
         var batchOptions = cloneObject(options);
         batchOptions['entries'] = batch;
+        batchOptions['fieldMask'] |= STAT_CACHE_FIELD_BITS;
+        batchOptions['expiresInMs'] = METADATA_EXPIRY_MS;
         delete batchOptions['entryPath'];
 
         this.sendMessage_('batchGetMetadata', [batchOptions])
             .then(
                 function(response) {
                   log.debug('batchGetMetadata succeeded');
-                  var sentRequestedResult = false;
-                  response.result.value.forEach(function(entry) {
+                  // The first item in the batch is the cache miss that
+                  // triggered the batch so fire that off.
+                  response.result.value.forEach(function(entry, index) {
+                    if (entry.error) {
+                      // Only this entry failed so drop it from the cache
+                      // and fail anyone waiting on it.
+                      log.error(
+                          'batchGetMetadata ' + batch[index] + ' failed with ' +
+                          entry.error);
+                      this.metadataCache.invalidateEntry(
+                          options.fileSystemId, batch[index], entry.error);
+                      if (index == 0) {
+                        errorFn(toProviderError(entry.error));
+                      }
+
+                      return;
+                    }
+
                     var result = this.handleStatEntry_(
                         options, options.entryPath, entry);
-                    // The first item in the batch is the cache miss that
-                    // triggered the batch so fire that off.
-                    if (!sentRequestedResult) {
+                    if (index == 0) {
                       log.info('getMetadata[cache miss] ' + options.entryPath);
                       successFn(result);
-                      sentRequestedResult = true;
                     }
                   }.bind(this));
                 }.bind(this),
                 function(err) {
                   log.error('batchGetMetadata failed with ' + err);
-                  errorFn(err);
-                });
+                  batch.forEach(function(entryPath) {
+                    // An expired batch says nothing about the entries so
+                    // they stay cached for a later batch to stat().
+                    if (err == 'DEADLINE_EXCEEDED') {
+                      this.metadataCache.releaseEntry(
+                          options.fileSystemId, entryPath, err);
+                    } else {
+                      this.metadataCache.invalidateEntry(
+                          options.fileSystemId, entryPath, err);
+                    }
+                  }.bind(this));
+                  errorFn(toProviderError(err));
+                }.bind(this));
 
         return;
       }
     }
   }
 
-  if (this.isThumbOnlyRequest_(options)) {
+  if (this.isThumbOnlyRequest_(options) &&
+      !this.mayHaveThumbnail_(options.entryPath)) {
     // Assumption is that the files app would never do this
     // on a non-existant file. Because if it did then
     // the error callback should be called instead.
@@ -522,15 +987,10 @@ SambaClient.prototype.getMetadataHandler = function(
     return;
   }
 
-  if (this.isMimeTypeOnlyRequest_(options)) {
-    // This extension doesn't know mime types so always return
-    // nothing.
-    log.debug('Mime type only request');
-    successFn({});
-    return;
-  }
-
-  this.sendMessage_('getMetadata', [options])
+  var nativeOptions = cloneObject(options);
+  nativeOptions['fieldMask'] |= STAT_CACHE_FIELD_BITS;
+  nativeOptions['expiresInMs'] = METADATA_EXPIRY_MS;
+  this.sendMessage_('getMetadata', [nativeOptions])
       .then(
           function(response) {
             log.info('getMetadata succeeded');
@@ -541,7 +1001,7 @@ SambaClient.prototype.getMetadataHandler = function(
           }.bind(this),
           function(err) {
             log.error('getMetadata failed with ' + err);
-            errorFn(err);
+            errorFn(toProviderError(err));
           });
 };
 
@@ -552,14 +1012,17 @@ SambaClient.prototype.handleStatEntry_ = function(options, entryPath, entry) {
   entry.modificationTime = new Date(entry.modificationTime * 1000);
 
   // Workaround to prevent Files.app downloading the entire file
-  // to generate a thumb.
-  // TODO(zentaro): Turns out the app will ask for the thumb for all
-  // files but ignore it for everything except images and vids. So
-  // don't bother sending it for other cases.
-  if (options.thumbnail) {
+  // to generate a thumb. When the NaCl module didn't find a thumbnail the
+  // broken URI is cached so the file isn't asked about again.
+  if (options.thumbnail && !entry.thumbnail) {
     entry.thumbnail = UNKNOWN_IMAGE_DATA_URI;
   }
 
+  // Remember that the NaCl module was asked so the file isn't sniffed again.
+  if (options.mimeType && !entry.isDirectory && !entry.mimeType) {
+    entry.mimeType = null;
+  }
+
   var result = this.filterRequestedData_(options, entry);
   this.metadataCache.updateMetadata(options.fileSystemId, entryPath, entry);
 
@@ -581,15 +1044,32 @@ SambaClient.prototype.readDirectoryHandler = function(
     options, successFn, errorFn) {
   log.debug('readDirectoryHandler called');
 
+  // TODO(zentaro): Potentially could remove the raw fields so
+  // they don't have to get marshalled.
+  options['fieldMask'] =
+      this.createFieldMask_(options) | DIRECTORY_CACHE_FIELD_BITS;
+  // log.debug('ReadDirectory Fields=' + options['fieldMask']);
+
+  // A directory that is still cached only needs what changed since.
+  var versionToken = this.metadataCache.getVersionToken(
+      options.fileSystemId, options.directoryPath, window.performance.now());
+  if (versionToken) {
+    this.readDirectoryDiff_(options, versionToken, successFn, errorFn);
+  } else {
+    this.readFullDirectory_(options, successFn, errorFn);
+  }
+};
+
+SambaClient.prototype.readFullDirectory_ = function(
+    options, successFn, errorFn) {
   var entries = [];
+  var versionToken = null;
+  var stale = false;
   var startTime = window.performance.now();
   var processDataFn = function(response) {
     // Convert the date types to be dates from string
-    response.result.value = response.result.value.map(function(elem) {
-      elem.modificationTime = new Date(elem.modificationTime * 1000);
-
-      return elem;
-    });
+    response.result.value =
+        response.result.value.map(this.parseModificationTime_);
 
     // Accumulate the entries so they can be set in the cache at the end.
     var elapsed = window.performance.now() - startTime;
@@ -598,36 +1078,14 @@ SambaClient.prototype.readDirectoryHandler = function(
         (entries.length + response.result.value.length) + '][' + elapsed +
         'ms] ' + options.directoryPath);
     entries = extendArray(entries, response.result.value);
-
-    var desiredBatchSize = 64;
-    var batch = response.result.value;
-    var filteredBatch = batch.map(function (entry) {
-      return this.filterRequestedData_(options, entry);
-    }.bind(this));
-    var currentBatchSize = filteredBatch.length;
-    var upto = 0;
-    if (currentBatchSize <= desiredBatchSize) {
-      // Just send it without doing anything for small batches.
-      successFn(filteredBatch, response.hasMore);
-    } else {
-      while (upto < currentBatchSize) {
-        // Take a copy of a slice of the array.
-        var newBatch = sliceArray(filteredBatch, upto, desiredBatchSize);
-        successFn(newBatch, true);
-        upto += desiredBatchSize;
-      }
-
-      // For simplicity just send an empty batch with hasMore=false.
-      if (!response.hasMore) {
-        successFn([], false);
-      }
+    if (!response.hasMore) {
+      versionToken = response.result.versionToken;
+      stale = response.result.stale;
     }
-  }.bind(this);
 
-  // TODO(zentaro): Potentially could remove the raw fields so
-  // they don't have to get marshalled.
-  options['fieldMask'] = this.createFieldMask_(options);
-  // log.debug('ReadDirectory Fields=' + options['fieldMask']);
+    this.sendDirectoryEntries_(
+        options, response.result.value, response.hasMore, successFn);
+  }.bind(this);
 
   this.sendMessage_('readDirectory', [options], processDataFn)
       .then(
@@ -637,7 +1095,10 @@ SambaClient.prototype.readDirectoryHandler = function(
                 options.directoryPath);
             this.metadataCache.cacheDirectoryContents(
                 options.fileSystemId, options.directoryPath,
-                entries, window.performance.now());
+                entries, window.performance.now(), versionToken);
+            if (stale && versionToken) {
+              this.refreshSavedListing_(options, versionToken);
+            }
           }.bind(this),
           function(err) {
             log.error('readDirectory failed with ' + err);
@@ -647,6 +1108,188 @@ SambaClient.prototype.readDirectoryHandler = function(
           });
 };
 
+// Refreshes a cached directory by fetching only the entries that were
+// added, changed or removed since the listing versionToken belongs to.
+// Each batch is passed on as it arrives, with the entries that didn't
+// change taken from the cache. The module sends everything when it no
+// longer has that listing.
+SambaClient.prototype.readDirectoryDiff_ = function(
+    options, versionToken, successFn, errorFn) {
+  var cachedEntries = this.metadataCache.getDirectoryEntries(
+      options.fileSystemId, options.directoryPath) || {};
+  var diff = {'added': [], 'modified': [], 'removed': []};
+  var entries = [];
+  var missing = 0;
+  var batches = 0;
+  var startTime = window.performance.now();
+  var processDataFn = function(response) {
+    var value = response.result.value;
+    var added = value.added.map(this.parseModificationTime_);
+    var modified = value.modified.map(this.parseModificationTime_);
+    var unchanged = [];
+    value.unchanged.forEach(function(name) {
+      if (name in cachedEntries) {
+        unchanged.push(cachedEntries[name]);
+      } else {
+        missing++;
+      }
+    });
+
+    diff.added = extendArray(diff.added, added);
+    diff.modified = extendArray(diff.modified, modified);
+    diff.removed = extendArray(diff.removed, value.removed);
+    diff.full = value.full;
+    if (!response.hasMore) {
+      diff.versionToken = value.versionToken;
+      diff.stale = value.stale;
+    }
+
+    var batch = added.concat(modified, unchanged);
+    entries = extendArray(entries, batch);
+    batches++;
+    this.sendDirectoryEntries_(options, batch, response.hasMore, successFn);
+  }.bind(this);
+
+  var diffOptions = {
+    'fileSystemId': options.fileSystemId,
+    'directoryPath': options.directoryPath,
+    'fieldMask': options.fieldMask,
+    'versionToken': versionToken
+  };
+  this.sendMessage_('custom_readDirectoryDiff', [diffOptions], processDataFn)
+      .then(
+          function() {
+            var now = window.performance.now();
+            if (missing) {
+              log.error(
+                  'readDirectoryDiff: ' + missing + ' unchanged entries ' +
+                  'were not cached');
+            }
+
+            // When everything was sent, or the cached listing was replaced
+            // while the diff was being made, cache what was sent instead.
+            // Without all the entries the module's listing doesn't match.
+            if (diff.full || missing ||
+                !this.metadataCache.applyDirectoryDiff(
+                    options.fileSystemId, options.directoryPath,
+                    versionToken, diff, now)) {
+              this.metadataCache.cacheDirectoryContents(
+                  options.fileSystemId, options.directoryPath, entries, now,
+                  missing ? null : diff.versionToken);
+            }
+
+            if (diff.stale && diff.versionToken && !missing) {
+              this.refreshSavedListing_(options, diff.versionToken);
+            }
+
+            log.info(
+                'readDirectoryDiff[+' + diff.added.length + ' ~' +
+                diff.modified.length + ' -' + diff.removed.length + ' of ' +
+                entries.length + '][' + (now - startTime) + 'ms] ' +
+                options.directoryPath);
+          }.bind(this),
+          function(err) {
+            log.error('readDirectoryDiff failed with ' + err);
+
+            // The module no longer has the listing to compare with. Until
+            // the Files app has been sent something it can still be given
+            // the whole directory instead.
+            this.metadataCache.clearVersionToken(
+                options.fileSystemId, options.directoryPath);
+            if (err != 'NOT_FOUND' && !batches) {
+              this.readFullDirectory_(options, successFn, errorFn);
+            } else {
+              errorFn(toProviderError(err));
+            }
+          }.bind(this));
+};
+
+// The module answers from a listing saved in an earlier session when the
+// directory hasn't changed since, but the sizes and times of its entries
+// can have. This asks for what changed since that listing, without holding
+// up the Files app, and brings the cache up to date with it.
+SambaClient.prototype.refreshSavedListing_ = function(options, versionToken) {
+  var diff = {'added': [], 'modified': [], 'removed': []};
+  var processDataFn = function(response) {
+    var value = response.result.value;
+    diff.added =
+        extendArray(diff.added, value.added.map(this.parseModificationTime_));
+    diff.modified = extendArray(
+        diff.modified, value.modified.map(this.parseModificationTime_));
+    diff.removed = extendArray(diff.removed, value.removed);
+    diff.full = value.full;
+    if (!response.hasMore) {
+      diff.versionToken = value.versionToken;
+    }
+  }.bind(this);
+
+  var diffOptions = {
+    'fileSystemId': options.fileSystemId,
+    'directoryPath': options.directoryPath,
+    'fieldMask': options.fieldMask,
+    'versionToken': versionToken
+  };
+  this.sendMessage_('custom_readDirectoryDiff', [diffOptions], processDataFn)
+      .then(
+          function() {
+            var now = window.performance.now();
+            if (diff.full) {
+              this.metadataCache.cacheDirectoryContents(
+                  options.fileSystemId, options.directoryPath, diff.added,
+                  now, diff.versionToken);
+            } else if (!this.metadataCache.applyDirectoryDiff(
+                           options.fileSystemId, options.directoryPath,
+                           versionToken, diff, now)) {
+              // The cache moved on while this was being made.
+              return;
+            }
+
+            log.info(
+                'refreshSavedListing[~' + diff.modified.length + '] ' +
+                options.directoryPath);
+          }.bind(this),
+          function(err) {
+            log.error('refreshSavedListing failed with ' + err);
+            this.metadataCache.clearVersionToken(
+                options.fileSystemId, options.directoryPath);
+          }.bind(this));
+};
+
+SambaClient.prototype.parseModificationTime_ = function(entry) {
+  if (isDef(entry.modificationTime)) {
+    entry.modificationTime = new Date(entry.modificationTime * 1000);
+  }
+
+  return entry;
+};
+
+// Passes entries on to the Files app in batches of up to 64.
+SambaClient.prototype.sendDirectoryEntries_ = function(
+    options, entries, hasMore, successFn) {
+  var desiredBatchSize = 64;
+  var filteredBatch = entries.map(function (entry) {
+    return this.filterRequestedData_(options, entry);
+  }.bind(this));
+  var currentBatchSize = filteredBatch.length;
+  var upto = 0;
+  if (currentBatchSize <= desiredBatchSize) {
+    // Just send it without doing anything for small batches.
+    successFn(filteredBatch, hasMore);
+  } else {
+    while (upto < currentBatchSize) {
+      // Take a copy of a slice of the array.
+      var newBatch = sliceArray(filteredBatch, upto, desiredBatchSize);
+      successFn(newBatch, true);
+      upto += desiredBatchSize;
+    }
+
+    // For simplicity just send an empty batch with hasMore=false.
+    if (!hasMore) {
+      successFn([], false);
+    }
+  }
+};
+
 SambaClient.prototype.openFileHandler = function(options, successFn, errorFn) {
   // TODO(zentaro): Could be smarter and only do this when opened for write.
   this.metadataCache.invalidateEntry(options.fileSystemId, options.filePath);
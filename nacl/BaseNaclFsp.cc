@@ -14,20 +14,175 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "BaseNaclFsp.h"
+#include <string.h>
+#include <algorithm>
+
+#include "PersistentStorage.h"
+#include "VarKeys.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/cpp/var_dictionary.h"
 #include "util.h"
 
-#include "ppapi_simple/ps.h"
-#include "ppapi_simple/ps_interface.h"
 
 namespace NaclFsp {
 
-BaseNaclFsp::BaseNaclFsp() { this->logger.Info("BaseNaclFsp constructor"); }
+// NOTE: Must stay sorted by function name.
+const BaseNaclFsp::MessageHandlerEntry BaseNaclFsp::kMessageHandlers[] = {
+    {"batchGetMetadata",
+     &BaseNaclFsp::HandleOperation<BatchGetMetadataOptions,
+                                   &BaseNaclFsp::batchGetMetadata>},
+    {"closeFile", &BaseNaclFsp::HandleOperation<CloseFileOptions,
+                                                &BaseNaclFsp::closeFile>},
+    {"copyEntry", &BaseNaclFsp::HandleOperation<CopyEntryOptions,
+                                                &BaseNaclFsp::copyEntry>},
+    {"createDirectory",
+     &BaseNaclFsp::HandleOperation<CreateDirectoryOptions,
+                                   &BaseNaclFsp::createDirectory>},
+    {"createFile", &BaseNaclFsp::HandleOperation<CreateFileOptions,
+                                                 &BaseNaclFsp::createFile>},
+    {"custom_configure", &BaseNaclFsp::HandleConfigure},
+    {"custom_getMemoryReport", &BaseNaclFsp::HandleGetMemoryReport},
+    {"custom_getStats", &BaseNaclFsp::HandleGetStats},
+    {"custom_reapIdle", &BaseNaclFsp::HandleReapIdle},
+    {"custom_startTrace", &BaseNaclFsp::HandleStartTrace},
+    {"custom_stopTrace", &BaseNaclFsp::HandleStopTrace},
+    {"deleteEntry", &BaseNaclFsp::HandleOperation<DeleteEntryOptions,
+                                                  &BaseNaclFsp::deleteEntry>},
+    {"getMetadata", &BaseNaclFsp::HandleOperation<GetMetadataOptions,
+                                                  &BaseNaclFsp::getMetadata>},
+    // NOTE: HandleMount takes all the args because it handles additional
+    // data in the second arg.
+    {"mount", &BaseNaclFsp::HandleMount},
+    {"moveEntry", &BaseNaclFsp::HandleOperation<MoveEntryOptions,
+                                                &BaseNaclFsp::moveEntry>},
+    {"openFile", &BaseNaclFsp::HandleOperation<OpenFileOptions,
+                                               &BaseNaclFsp::openFile>},
+    {"readDirectory",
+     &BaseNaclFsp::HandleStreamedOperation<ReadDirectoryOptions,
+                                           &BaseNaclFsp::readDirectory>},
+    {"readFile", &BaseNaclFsp::HandleStreamedOperation<
+                     ReadFileOptions, &BaseNaclFsp::readFile>},
+    {"truncate", &BaseNaclFsp::HandleOperation<TruncateOptions,
+                                               &BaseNaclFsp::truncate>},
+    {"unmount", &BaseNaclFsp::HandleOperation<UnmountOptions,
+                                              &BaseNaclFsp::unmount>},
+    {"writeFile", &BaseNaclFsp::HandleOperation<WriteFileOptions,
+                                                &BaseNaclFsp::writeFile>}};
+
+const size_t BaseNaclFsp::kMessageHandlerCount =
+    sizeof(BaseNaclFsp::kMessageHandlers) /
+    sizeof(BaseNaclFsp::kMessageHandlers[0]);
+
+// Error for requests that ran past the deadline from their expiresInMs
+// option.
+static const char kDeadlineExceeded[] = "DEADLINE_EXCEEDED";
+
+// Pending responses are trimmed first since trimming just posts them.
+static const int kResponsesMemoryPriority = 0;
+
+BaseNaclFsp::BaseNaclFsp()
+    : memoryBudget(MemoryBudget::kDefaultLimitBytes),
+      currentDeadlineMicros(0),
+      expiredQueued(0),
+      expiredRunning(0) {
+  this->logger.Info("BaseNaclFsp constructor");
+  this->memoryBudget.Register("responses", &this->responseBatcher,
+                              kResponsesMemoryPriority);
+}
+
+bool BaseNaclFsp::HasPendingWork() const {
+  uint64_t dueMicros = this->responseBatcher.DueMicros();
+  return !this->requestQueue.IsEmpty() ||
+         (dueMicros != 0 && dueMicros <= Util::monotonicMicros()) ||
+         this->hasBackgroundWork();
+}
+
+uint64_t BaseNaclFsp::NextWakeupMicros() const {
+  uint64_t batchMicros = this->responseBatcher.DueMicros();
+  uint64_t backgroundMicros = this->backgroundWorkDueMicros();
+  if (batchMicros == 0 || backgroundMicros == 0) {
+    return std::max(batchMicros, backgroundMicros);
+  }
+
+  return std::min(batchMicros, backgroundMicros);
+}
+
+void BaseNaclFsp::OnIdle() {
+  // Everything that arrived while the last request ran has been queued by
+  // now so its result can't be shared any more.
+  this->requestQueue.ExpireCompleted();
+  if (!this->requestQueue.IsEmpty()) {
+    this->handleNextRequest();
+    return;
+  }
+
+  this->responseBatcher.FlushIfDue();
+  if (this->hasBackgroundWork()) {
+    this->doBackgroundWork();
+    this->memoryBudget.Enforce();
+  }
+}
+
+void BaseNaclFsp::ExpireCompletedRequests() {
+  this->requestQueue.ExpireCompleted();
+}
+
+void BaseNaclFsp::FlushResponses() { this->responseBatcher.Flush(); }
+
+bool BaseNaclFsp::messageHandlerLess(const MessageHandlerEntry& entry,
+                                     const char* functionName) {
+  return strcmp(entry.functionName, functionName) < 0;
+}
+
+BaseNaclFsp::MessageHandler BaseNaclFsp::findMessageHandler(
+    const std::string& functionName) {
+  const MessageHandlerEntry* end = kMessageHandlers + kMessageHandlerCount;
+  const MessageHandlerEntry* entry = std::lower_bound(
+      kMessageHandlers, end, functionName.c_str(), messageHandlerLess);
+
+  if (entry != end && functionName == entry->functionName) {
+    return entry->handler;
+  }
+
+  return NULL;
+}
+
+template <typename OptionsType,
+          void (INaclFsp::*Method)(const OptionsType&, pp::VarDictionary*)>
+bool BaseNaclFsp::HandleOperation(const pp::VarArray& args, int messageId,
+                                  pp::VarDictionary* result) {
+  if (!this->prepareForOperation(result)) {
+    return false;
+  }
 
-void BaseNaclFsp::HandleMount(const pp::VarArray& args,
+  OptionsType options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+  (this->*Method)(options, result);
+  return false;
+}
+
+template <typename OptionsType,
+          bool (INaclFsp::*Method)(const OptionsType&, int,
+                                   pp::VarDictionary*)>
+bool BaseNaclFsp::HandleStreamedOperation(const pp::VarArray& args,
+                                          int messageId,
+                                          pp::VarDictionary* result) {
+  if (!this->prepareForOperation(result)) {
+    return false;
+  }
+
+  OptionsType options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+  return (this->*Method)(options, messageId, result);
+}
+
+bool BaseNaclFsp::HandleMount(const pp::VarArray& args, int messageId,
                               pp::VarDictionary* result) {
+  if (!this->prepareForOperation(result)) {
+    return false;
+  }
+
   MountOptions options;
   pp::VarDictionary optionsDict(args.Get(0));
   this->logger.Info("Setting mount options");
@@ -39,136 +194,360 @@ void BaseNaclFsp::HandleMount(const pp::VarArray& args,
   // and handled by the specific provider.
   pp::VarDictionary mountInfo(args.Get(1));
   this->mount(options, mountInfo, result);
+  return false;
 }
 
-void BaseNaclFsp::HandleUnmount(const pp::VarDictionary& optionsDict,
-                                pp::VarDictionary* result) {
-  UnmountOptions options;
-  options.Set(optionsDict);
-  this->unmount(options, result);
+bool BaseNaclFsp::HandleConfigure(const pp::VarArray& args, int messageId,
+                                  pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary optionsDict(args.Get(0));
+  pp::VarDictionary applied;
+
+  if (optionsDict.HasKey(keys.batching)) {
+    pp::VarDictionary batching(optionsDict.Get(keys.batching));
+    size_t maxResponses = ResponseBatcher::kDefaultMaxResponses;
+    uint64_t windowMicros = ResponseBatcher::kDefaultWindowMicros;
+    if (batching.HasKey(keys.maxResponses)) {
+      maxResponses = batching.Get(keys.maxResponses).AsInt();
+    }
+
+    if (batching.HasKey(keys.windowMicros)) {
+      windowMicros = batching.Get(keys.windowMicros).AsInt();
+    }
+
+    bool enabled = batching.Get(keys.enabled).AsBool();
+    this->logger.Info("configure: batching=" + Util::ToString(enabled) +
+                      " maxResponses=" + Util::ToString(maxResponses) +
+                      " windowMicros=" + Util::ToString(windowMicros));
+    this->responseBatcher.Configure(enabled, maxResponses, windowMicros);
+    applied.Set(keys.batching, pp::Var(enabled));
+  }
+
+  if (optionsDict.HasKey(keys.memory)) {
+    pp::VarDictionary memory(optionsDict.Get(keys.memory));
+    if (memory.HasKey(keys.limitBytes)) {
+      size_t limitBytes =
+          static_cast<size_t>(memory.Get(keys.limitBytes).AsDouble());
+      this->logger.Info("configure: memoryLimitBytes=" +
+                        Util::ToString(limitBytes));
+      this->memoryBudget.SetLimit(limitBytes);
+    }
+
+    applied.Set(keys.memory, pp::Var(true));
+  }
+
+  this->configure(optionsDict, &applied);
+  result->Set(keys.value, applied);
+  return false;
+}
+
+bool BaseNaclFsp::HandleGetStats(const pp::VarArray& args, int messageId,
+                                 pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary batching;
+  batching.Set(keys.responses,
+               static_cast<double>(this->responseBatcher.responsesPosted()));
+  batching.Set(keys.messages,
+               static_cast<double>(this->responseBatcher.messagesPosted()));
+
+  pp::VarDictionary singleFlight;
+  singleFlight.Set(keys.executed,
+                   static_cast<double>(this->requestQueue.executedCount()));
+  singleFlight.Set(keys.joinedQueued,
+                   static_cast<double>(this->requestQueue.joinedQueuedCount()));
+  singleFlight.Set(
+      keys.joinedCompleted,
+      static_cast<double>(this->requestQueue.joinedCompletedCount()));
+
+  pp::VarDictionary deadlines;
+  deadlines.Set(keys.expiredQueued, static_cast<double>(this->expiredQueued));
+  deadlines.Set(keys.expiredRunning, static_cast<double>(this->expiredRunning));
+
+  pp::VarDictionary stats;
+  stats.Set(keys.batching, batching);
+  stats.Set(keys.singleFlight, singleFlight);
+  stats.Set(keys.deadlines, deadlines);
+  this->addStats(&stats);
+  result->Set(keys.value, stats);
+  return false;
+}
+
+bool BaseNaclFsp::HandleGetMemoryReport(const pp::VarArray& args,
+                                        int messageId,
+                                        pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  std::vector<MemoryBudget::Usage> usage;
+  this->memoryBudget.Report(&usage);
+
+  pp::VarDictionary subsystems;
+  for (size_t i = 0; i < usage.size(); i++) {
+    pp::VarDictionary subsystem;
+    subsystem.Set(keys.bytes, static_cast<double>(usage[i].bytes));
+    subsystem.Set(keys.peakBytes, static_cast<double>(usage[i].peakBytes));
+    subsystem.Set(keys.trimmedBytes,
+                  static_cast<double>(usage[i].trimmedBytes));
+    subsystem.Set(keys.priority, usage[i].priority);
+    subsystems.Set(pp::Var(usage[i].name), subsystem);
+  }
+
+  pp::VarDictionary report;
+  report.Set(keys.limitBytes, static_cast<double>(this->memoryBudget.limit()));
+  report.Set(keys.usedBytes,
+             static_cast<double>(this->memoryBudget.TotalBytes()));
+  report.Set(keys.peakBytes,
+             static_cast<double>(this->memoryBudget.peakBytes()));
+  report.Set(keys.trims, static_cast<double>(this->memoryBudget.trimCount()));
+  report.Set(keys.overLimit,
+             static_cast<double>(this->memoryBudget.overLimitCount()));
+  report.Set(keys.subsystems, subsystems);
+  result->Set(keys.value, report);
+  return false;
+}
+
+bool BaseNaclFsp::HandleReapIdle(const pp::VarArray& args, int messageId,
+                                 pp::VarDictionary* result) {
+  pp::VarDictionary reaped;
+  this->reapIdle(&reaped);
+  result->Set(VarKeys::Get().value, reaped);
+  return false;
+}
+
+bool BaseNaclFsp::HandleStartTrace(const pp::VarArray& args, int messageId,
+                                   pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary optionsDict(args.Get(0));
+  if (!PersistentStorage::EnsureMounted()) {
+    this->logger.Error("startTrace: Could not mount persistent storage");
+    this->setErrorResult("FAILED", result);
+    return false;
+  }
+
+  std::string path =
+      PersistentStorage::GetPath(optionsDict.Get(keys.path).AsString());
+  bool hashPaths = optionsDict.Get(keys.hashPaths).AsBool();
+  if (!this->traceRecorder.Start(path, hashPaths)) {
+    this->logger.Error("startTrace: Could not open " + path);
+    this->setErrorResult("FAILED", result);
+    return false;
+  }
+
+  this->logger.Info("startTrace: Recording requests to " + path);
+  result->Set(keys.value, path);
+  return false;
+}
+
+bool BaseNaclFsp::HandleStopTrace(const pp::VarArray& args, int messageId,
+                                  pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  this->traceRecorder.Stop();
+
+  pp::VarDictionary summary;
+  summary.Set(keys.records,
+              static_cast<int32_t>(this->traceRecorder.recordCount()));
+  summary.Set(keys.bytes,
+              static_cast<double>(this->traceRecorder.bytesWritten()));
+  result->Set(keys.value, summary);
+  return false;
 }
 
 void BaseNaclFsp::HandleMessage(pp::Var var_message) {
-  if (var_message.is_string()) {
+  // Anything handled before this call is not concurrent with it.
+  this->requestQueue.ExpireCompleted();
+  this->QueueMessage(var_message);
+  while (!this->requestQueue.IsEmpty()) {
+    this->handleNextRequest();
+  }
+}
+
+void BaseNaclFsp::QueueMessage(const pp::Var& var_message) {
+  if (var_message.is_array()) {
+    // Batched requests from the JS side.
+    pp::VarArray messages(var_message);
+    uint32_t length = messages.GetLength();
+    for (uint32_t i = 0; i < length; i++) {
+      this->QueueMessage(messages.Get(i));
+    }
+  } else if (var_message.is_string()) {
     std::string message = var_message.AsString();
     this->logger.Info("You sent me string '" + message + "'");
   } else if (var_message.is_dictionary()) {
+    const VarKeys& keys = VarKeys::Get();
     pp::VarDictionary message(var_message);
-    std::string functionName = message.Get("functionName").AsString();
-    int messageId = message.Get("messageId").AsInt();
-    pp::VarArray args(message.Get("args"));
-    pp::VarDictionary optionsDict(args.Get(0));
-    pp::VarDictionary result;
-    bool resultsAlreadySent = false;
-
-    // TODO(zentaro): Turn this into a map to function pointers. At the
-    // least reorder by most used.
-    if (functionName == "mount") {
-      // NOTE: HandleMount takes args not optionsDict because it handles
-      // additional data in the second arg.
-      HandleMount(args, &result);
-    } else if (functionName == "unmount") {
-      HandleUnmount(optionsDict, &result);
-    } else if (functionName == "getMetadata") {
-      GetMetadataOptions options;
-      options.Set(optionsDict);
-      this->getMetadata(options, &result);
-    } else if (functionName == "batchGetMetadata") {
-      BatchGetMetadataOptions options;
-      options.Set(optionsDict);
-      this->batchGetMetadata(options, &result);
-    } else if (functionName == "readDirectory") {
-      ReadDirectoryOptions options;
-      options.Set(optionsDict);
-      resultsAlreadySent = this->readDirectory(options, messageId, &result);
-    } else if (functionName == "openFile") {
-      OpenFileOptions options;
-      options.Set(optionsDict);
-      this->openFile(options, &result);
-    } else if (functionName == "readFile") {
-      ReadFileOptions options;
-      options.Set(optionsDict);
-      resultsAlreadySent = this->readFile(options, messageId, &result);
-    } else if (functionName == "writeFile") {
-      WriteFileOptions options;
-      options.Set(optionsDict);
-      this->writeFile(options, &result);
-    } else if (functionName == "closeFile") {
-      CloseFileOptions options;
-      options.Set(optionsDict);
-      this->closeFile(options, &result);
-    } else if (functionName == "createFile") {
-      CreateFileOptions options;
-      options.Set(optionsDict);
-      this->createFile(options, &result);
-    } else if (functionName == "createDirectory") {
-      CreateDirectoryOptions options;
-      options.Set(optionsDict);
-      this->createDirectory(options, &result);
-    } else if (functionName == "deleteEntry") {
-      DeleteEntryOptions options;
-      options.Set(optionsDict);
-      this->deleteEntry(options, &result);
-    } else if (functionName == "truncate") {
-      TruncateOptions options;
-      options.Set(optionsDict);
-      this->truncate(options, &result);
-    } else if (functionName == "moveEntry") {
-      MoveEntryOptions options;
-      options.Set(optionsDict);
-      this->moveEntry(options, &result);
-    } else if (functionName == "copyEntry") {
-      CopyEntryOptions options;
-      options.Set(optionsDict);
-      this->copyEntry(options, &result);
-    } else if (Util::stringStartsWith(functionName, "custom_")) {
-      // Custom message just pass it on.
-      this->handleCustomMessage(functionName, args, &result);
-    } else {
-      this->logger.Info("Unknown function - " + functionName);
+    std::string functionName = message.Get(keys.functionName).AsString();
+    int messageId = message.Get(keys.messageId).AsInt();
+    pp::VarArray args(message.Get(keys.args));
+    uint64_t arrivalMicros = Util::monotonicMicros();
+    uint64_t deadlineMicros = deadlineFromArgs(args, arrivalMicros);
+
+    const RequestQueue::Responses* responses = NULL;
+    if (this->requestQueue.Push(functionName, messageId, args, arrivalMicros,
+                                deadlineMicros, &responses)) {
       return;
     }
 
-    // Successfully streamed messages have already sent all
-    // needed messages.
-    if (!resultsAlreadySent) {
-      this->sendMessage(functionName, messageId, result, false);
+    // An identical request just completed so reuse its responses.
+    for (RequestQueue::Responses::const_iterator it = responses->begin();
+         it != responses->end(); ++it) {
+      this->sendMessage(functionName, messageId, it->first, it->second);
     }
+
+    this->traceRequest(functionName, messageId, args, arrivalMicros);
+  }
+}
+
+void BaseNaclFsp::handleNextRequest() {
+  QueuedRequest request = this->requestQueue.Pop();
+  pp::VarDictionary result;
+  bool resultsAlreadySent = false;
+  this->currentDeadlineMicros = request.deadlineMicros;
+
+  MessageHandler handler = this->findMessageHandler(request.functionName);
+  if (request.deadlineMicros != 0 &&
+      Util::monotonicMicros() >= request.deadlineMicros) {
+    // Nobody is waiting for the result any more so it fails straight away
+    // without going near the server.
+    this->expiredQueued++;
+    this->logger.Debug("Dropping expired " + request.functionName);
+    this->setErrorResult(kDeadlineExceeded, &result);
+  } else if (handler != NULL) {
+    resultsAlreadySent =
+        (this->*handler)(request.args, request.messageId, &result);
+  } else if (Util::stringStartsWith(request.functionName, "custom_")) {
+    // Custom message just pass it on.
+    if (this->prepareForOperation(&result)) {
+      resultsAlreadySent = this->handleCustomMessage(
+          request.functionName, request.args, request.messageId, &result);
+    }
+  } else {
+    this->logger.Info("Unknown function - " + request.functionName);
+    this->requestQueue.Complete();
+    return;
+  }
+
+  // Successfully streamed messages have already sent all
+  // needed messages.
+  if (!resultsAlreadySent) {
+    this->sendMessage(request.functionName, request.messageId, result, false);
+  }
+
+  this->traceRequest(request.functionName, request.messageId, request.args,
+                     request.arrivalMicros);
+
+  // Identical requests that were queued behind this one get the same
+  // responses.
+  const RequestQueue::Responses& responses = this->requestQueue.Complete();
+  for (size_t i = 0; i < request.followers.size(); i++) {
+    int followerId = request.followers[i].first;
+    for (RequestQueue::Responses::const_iterator it = responses.begin();
+         it != responses.end(); ++it) {
+      this->sendMessage(request.functionName, followerId, it->first,
+                        it->second);
+    }
+
+    this->traceRequest(request.functionName, followerId, request.args,
+                       request.followers[i].second);
+  }
+
+  this->currentDeadlineMicros = 0;
+
+  // Caches only grow inside requests and can be trimmed now nothing is
+  // using them.
+  this->memoryBudget.Enforce();
+}
+
+uint64_t BaseNaclFsp::deadlineFromArgs(const pp::VarArray& args,
+                                       uint64_t arrivalMicros) {
+  pp::Var options = args.Get(0);
+  if (!options.is_dictionary()) {
+    return 0;
+  }
+
+  pp::Var expiresInMs = pp::VarDictionary(options).Get(
+      VarKeys::Get().expiresInMs);
+  if (!expiresInMs.is_number() || expiresInMs.AsDouble() < 0) {
+    return 0;
+  }
+
+  return arrivalMicros + static_cast<uint64_t>(expiresInMs.AsDouble() * 1000);
+}
+
+bool BaseNaclFsp::deadlineExceeded(pp::VarDictionary* result) {
+  if (this->currentDeadlineMicros == 0 ||
+      Util::monotonicMicros() < this->currentDeadlineMicros) {
+    return false;
+  }
+
+  this->expiredRunning++;
+  this->logger.Debug("Stopping expired request");
+  this->setErrorResult(kDeadlineExceeded, result);
+  return true;
+}
+
+void BaseNaclFsp::traceRequest(const std::string& functionName,
+                               int messageId, const pp::VarArray& args,
+                               uint64_t arrivalMicros) {
+  if (this->traceRecorder.IsRecording()) {
+    this->traceRecorder.Record(functionName, messageId, args, arrivalMicros,
+                               Util::monotonicMicros() - arrivalMicros);
   }
 }
 
 void BaseNaclFsp::sendMessage(const std::string& functionName, int messageId,
                               const pp::VarDictionary& result, bool hasMore) {
+  const VarKeys& keys = VarKeys::Get();
   pp::VarDictionary response;
-  response.Set(pp::Var("functionName"), functionName);
-  response.Set(pp::Var("messageId"), messageId);
-  response.Set(pp::Var("result"), result);
-  response.Set(pp::Var("hasMore"), hasMore);
+  response.Set(keys.functionName, functionName);
+  response.Set(keys.messageId, messageId);
+  response.Set(keys.result, result);
+  response.Set(keys.hasMore, hasMore);
 
-  PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), response.pp_var());
+  this->requestQueue.RecordResponse(messageId, result, hasMore);
+  this->responseBatcher.Post(response, hasMore);
 }
 
 void BaseNaclFsp::setEntryMetadata(const EntryMetadata& entry,
+                                   uint32_t fieldMask,
                                    pp::VarDictionary* value) {
-  value->Set(pp::Var("isDirectory"), pp::Var(entry.isDirectory));
-  value->Set(pp::Var("name"), pp::Var(entry.name));
-  value->Set(pp::Var("fullPath"), pp::Var(entry.fullPath));
-  value->Set(pp::Var("size"), pp::Var(entry.size));
-  value->Set(pp::Var("modificationTime"), pp::Var(entry.modificationTime));
+  const VarKeys& keys = VarKeys::Get();
+  if (fieldMask & FieldMaskMixin::FIELD_IS_DIRECTORY) {
+    value->Set(keys.isDirectory, pp::Var(entry.isDirectory));
+  }
+  if (fieldMask & FieldMaskMixin::FIELD_NAME) {
+    value->Set(keys.name, pp::Var(entry.name));
+  }
+  if (fieldMask & FieldMaskMixin::FIELD_FULL_PATH) {
+    value->Set(keys.fullPath, pp::Var(entry.fullPath));
+  }
+  if (fieldMask & FieldMaskMixin::FIELD_SIZE) {
+    value->Set(keys.size, pp::Var(entry.size));
+  }
+  if (fieldMask & FieldMaskMixin::FIELD_MODIFICATION_TIME) {
+    value->Set(keys.modificationTime, pp::Var(entry.modificationTime));
+  }
+  // These are left out when nothing was found.
+  if ((fieldMask & FieldMaskMixin::FIELD_MIME_TYPE) &&
+      !entry.mimeType.empty()) {
+    value->Set(keys.mimeType, pp::Var(entry.mimeType));
+  }
+  if ((fieldMask & FieldMaskMixin::FIELD_THUMBNAIL) &&
+      !entry.thumbnail.empty()) {
+    value->Set(keys.thumbnail, pp::Var(entry.thumbnail));
+  }
 }
 
 void BaseNaclFsp::setResultFromEntryMetadata(const EntryMetadata& entry,
+                                             uint32_t fieldMask,
                                              pp::VarDictionary* result) {
   pp::VarDictionary entryDict;
 
-  this->setEntryMetadata(entry, &entryDict);
+  this->setEntryMetadata(entry, fieldMask, &entryDict);
 
-  result->Set(pp::Var("value"), entryDict);
+  result->Set(VarKeys::Get().value, entryDict);
 }
 
 void BaseNaclFsp::setResultFromEntryMetadataVector(
     const std::vector<EntryMetadata>::iterator& rangeStart,
-    const std::vector<EntryMetadata>::iterator& rangeEnd,
+    const std::vector<EntryMetadata>::iterator& rangeEnd, uint32_t fieldMask,
     pp::VarDictionary* result) {
   // TODO(zentaro): Is there an initializer to preset the array size?
   pp::VarArray entriesArray;
@@ -177,22 +556,22 @@ void BaseNaclFsp::setResultFromEntryMetadataVector(
   for (std::vector<EntryMetadata>::iterator it = rangeStart; it != rangeEnd;
        ++it) {
     pp::VarDictionary entryDict;
-    this->setEntryMetadata(*it, &entryDict);
+    this->setEntryMetadata(*it, fieldMask, &entryDict);
     entriesArray.Set(index, entryDict);
     index++;
   }
 
-  result->Set(pp::Var("value"), entriesArray);
+  result->Set(VarKeys::Get().value, entriesArray);
 }
 
 void BaseNaclFsp::setResultFromArrayBuffer(const pp::VarArrayBuffer& buffer,
                                            pp::VarDictionary* result) {
-  result->Set(pp::Var("value"), buffer);
+  result->Set(VarKeys::Get().value, buffer);
 }
 
 void BaseNaclFsp::setErrorResult(const std::string& error,
                                  pp::VarDictionary* result) {
-  result->Set(pp::Var("error"), error);
+  result->Set(VarKeys::Get().error, error);
 }
 
 std::string BaseNaclFsp::stringify(const EntryMetadata& entry) {
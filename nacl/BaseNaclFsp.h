@@ -18,6 +18,10 @@
 
 #include "INaclFsp.h"
 #include "Logger.h"
+#include "MemoryBudget.h"
+#include "RequestQueue.h"
+#include "RequestTrace.h"
+#include "ResponseBatcher.h"
 
 namespace NaclFsp {
 
@@ -28,20 +32,59 @@ class BaseNaclFsp : public INaclFsp {
   // TODO(zentaro): Maybe this shouldn't be virtual??
   virtual void HandleMessage(pp::Var var_message);
 
+  // Queues a message without handling it. The message loop queues every
+  // message that is available and then calls OnIdle() which handles one
+  // request at a time, so identical requests that arrive while one is
+  // being handled can share its result.
+  void QueueMessage(const pp::Var& var_message);
+
+  // Called by the message loop whenever the inbound queue is empty while
+  // HasPendingWork() is true. Never blocks.
+  bool HasPendingWork() const;
+  void OnIdle();
+
+  // When work that waits for a time comes due (monotonic micros), or 0 if
+  // none does. The message loop wakes itself up then.
+  uint64_t NextWakeupMicros() const;
+
+  // Lets background work that finishes on another thread wake up the
+  // message loop. |hook| must be safe to call from any thread.
+  virtual void SetWakeupHook(void (*hook)()) {}
+
+  // Called by the message loop before it blocks waiting for a message.
+  // Requests that arrive after that are not concurrent with any before.
+  void ExpireCompletedRequests();
+
+  void FlushResponses();
+
  protected:
   Logger logger;
 
+  // Subclasses register their caches and reserve the buffers they hold.
+  // Reported by custom_getMemoryReport.
+  MemoryBudget memoryBudget;
+
   void setErrorResult(const std::string& error, pp::VarDictionary* result);
 
-  void setEntryMetadata(const EntryMetadata& entry, pp::VarDictionary* value);
+  // Streamed operations call this between chunks. Once the current request
+  // is past the deadline set by its expiresInMs option this sets the
+  // DEADLINE_EXCEEDED error in |result| and returns true so the operation
+  // can stop and send it.
+  bool deadlineExceeded(pp::VarDictionary* result);
+
+  // Only the fields in |fieldMask| (FieldMaskMixin::MetadataFields) are
+  // serialized.
+  void setEntryMetadata(const EntryMetadata& entry, uint32_t fieldMask,
+                        pp::VarDictionary* value);
 
   void setResultFromEntryMetadata(const EntryMetadata& entry,
+                                  uint32_t fieldMask,
                                   pp::VarDictionary* result);
 
   void setResultFromEntryMetadataVector(
       const std::vector<EntryMetadata>::iterator& rangeStart,
       const std::vector<EntryMetadata>::iterator& rangeEnd,
-      pp::VarDictionary* result);
+      uint32_t fieldMask, pp::VarDictionary* result);
 
   void setResultFromArrayBuffer(const pp::VarArrayBuffer& buffer,
                                 pp::VarDictionary* result);
@@ -51,11 +94,99 @@ class BaseNaclFsp : public INaclFsp {
 
   std::string stringify(const EntryMetadata& entry);
 
+  // Lets subclasses add their own sections to custom_getStats.
+  virtual void addStats(pp::VarDictionary* stats) {}
+
+  // Lets subclasses handle their own sections of custom_configure. Each
+  // section that was applied is noted in |applied|.
+  virtual void configure(const pp::VarDictionary& options,
+                         pp::VarDictionary* applied) {}
+
+  // Called before every file system operation and custom message so
+  // expensive setup can wait until it is needed. Returning false fails the
+  // request with the error set in |result|.
+  virtual bool prepareForOperation(pp::VarDictionary* result) { return true; }
+
+  // Lets subclasses release connections and handles nobody has used for a
+  // while. Called for custom_reapIdle, which JS sends on a timer, and
+  // without prepareForOperation so the tick itself doesn't count as use.
+  virtual void reapIdle(pp::VarDictionary* result) {}
+
+  // Lets subclasses do speculative work while no request is waiting.
+  // hasBackgroundWork is true when there is work to do straight away and
+  // backgroundWorkDueMicros says when work waiting for a time comes due.
+  // Work finishing on another thread calls the wakeup hook instead.
+  // doBackgroundWork is only called from OnIdle with an empty request queue
+  // and must not block so the next message isn't held up.
+  virtual bool hasBackgroundWork() const { return false; }
+  virtual uint64_t backgroundWorkDueMicros() const { return 0; }
+  virtual void doBackgroundWork() {}
+
  private:
+  typedef bool (BaseNaclFsp::*MessageHandler)(const pp::VarArray& args,
+                                              int messageId,
+                                              pp::VarDictionary* result);
+
+  // Maps a functionName to its handler. The table is sorted by name so it
+  // can be binary searched.
+  struct MessageHandlerEntry {
+    const char* functionName;
+    MessageHandler handler;
+  };
+
+  static const MessageHandlerEntry kMessageHandlers[];
+  static const size_t kMessageHandlerCount;
+
+  TraceRecorder traceRecorder;
+  ResponseBatcher responseBatcher;
+  RequestQueue requestQueue;
+
+  // Deadline of the request being handled, zero when it has none.
+  uint64_t currentDeadlineMicros;
+  // Requests that expired before they started and were answered without
+  // touching the server, and those cut short between chunks.
+  uint64_t expiredQueued;
+  uint64_t expiredRunning;
+
+  static bool messageHandlerLess(const MessageHandlerEntry& entry,
+                                 const char* functionName);
+  MessageHandler findMessageHandler(const std::string& functionName);
+
+  void handleNextRequest();
+  // Reads the optional expiresInMs from the options in the first argument.
+  static uint64_t deadlineFromArgs(const pp::VarArray& args,
+                                   uint64_t arrivalMicros);
+  void traceRequest(const std::string& functionName, int messageId,
+                    const pp::VarArray& args, uint64_t arrivalMicros);
+
+  // Generic handlers that decode the options in the first argument and call
+  // the matching API method. The streamed variant returns whether the method
+  // already sent its results.
+  template <typename OptionsType,
+            void (INaclFsp::*Method)(const OptionsType&, pp::VarDictionary*)>
+  bool HandleOperation(const pp::VarArray& args, int messageId,
+                       pp::VarDictionary* result);
+  template <typename OptionsType,
+            bool (INaclFsp::*Method)(const OptionsType&, int,
+                                     pp::VarDictionary*)>
+  bool HandleStreamedOperation(const pp::VarArray& args, int messageId,
+                               pp::VarDictionary* result);
+
   // API Handler Methods
-  void HandleMount(const pp::VarArray& args, pp::VarDictionary* result);
-  void HandleUnmount(const pp::VarDictionary& optionsDict,
-                     pp::VarDictionary* result);
+  bool HandleMount(const pp::VarArray& args, int messageId,
+                   pp::VarDictionary* result);
+  bool HandleConfigure(const pp::VarArray& args, int messageId,
+                       pp::VarDictionary* result);
+  bool HandleGetMemoryReport(const pp::VarArray& args, int messageId,
+                             pp::VarDictionary* result);
+  bool HandleGetStats(const pp::VarArray& args, int messageId,
+                      pp::VarDictionary* result);
+  bool HandleReapIdle(const pp::VarArray& args, int messageId,
+                      pp::VarDictionary* result);
+  bool HandleStartTrace(const pp::VarArray& args, int messageId,
+                        pp::VarDictionary* result);
+  bool HandleStopTrace(const pp::VarArray& args, int messageId,
+                       pp::VarDictionary* result);
 };
 
 }  // namespace NaclFsp
@@ -0,0 +1,152 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "BlockSignatures.h"
+
+#include "FileHash.h"
+
+namespace NaclFsp {
+
+const size_t BlockSignatureCache::BLOCK_BYTES;
+
+BlockSignature BlockSignature::Compute(const uint8_t* data, size_t length) {
+  BlockSignature signature;
+  signature.xxh64 = Xxh64(data, length);
+  signature.crc32c = Crc32c(data, length);
+  signature.known = true;
+  return signature;
+}
+
+BlockSignatureCache::BlockSignatureCache(size_t maxFiles, size_t maxBlocks)
+    : maxFiles(maxFiles), maxBlocks(maxBlocks), totalBlocks(0) {}
+
+void BlockSignatureCache::Validate(const std::string& fullPath,
+                                   time_t modificationTime, double size) {
+  EntryMap::iterator it = this->entries.find(fullPath);
+  if (it == this->entries.end()) {
+    this->makeRoom();
+    it = this->entries.insert(std::make_pair(fullPath, Entry())).first;
+  } else {
+    this->ages.erase(it->second.age);
+  }
+
+  Entry& entry = it->second;
+  entry.age = this->ages.insert(this->ages.end(), fullPath);
+  if (entry.modificationTime != modificationTime || entry.size != size) {
+    this->totalBlocks -= entry.blocks.size();
+    entry.blocks.clear();
+    entry.modificationTime = modificationTime;
+    entry.size = size;
+  }
+}
+
+void BlockSignatureCache::Update(const std::string& fullPath,
+                                 time_t modificationTime, double size) {
+  EntryMap::iterator it = this->entries.find(fullPath);
+  if (it == this->entries.end()) {
+    return;
+  }
+
+  Entry& entry = it->second;
+  entry.modificationTime = modificationTime;
+  entry.size = size;
+
+  size_t fullBlocks = static_cast<size_t>(size / BLOCK_BYTES);
+  if (entry.blocks.size() > fullBlocks) {
+    this->totalBlocks -= entry.blocks.size() - fullBlocks;
+    entry.blocks.resize(fullBlocks);
+  }
+}
+
+void BlockSignatureCache::Invalidate(const std::string& fullPath) {
+  EntryMap::iterator it = this->entries.find(fullPath);
+  if (it != this->entries.end()) {
+    this->totalBlocks -= it->second.blocks.size();
+    this->ages.erase(it->second.age);
+    this->entries.erase(it);
+  }
+}
+
+bool BlockSignatureCache::Lookup(const std::string& fullPath, size_t block,
+                                 BlockSignature* signature) const {
+  EntryMap::const_iterator it = this->entries.find(fullPath);
+  if (it == this->entries.end() || block >= it->second.blocks.size() ||
+      !it->second.blocks[block].known) {
+    return false;
+  }
+
+  *signature = it->second.blocks[block];
+  return true;
+}
+
+void BlockSignatureCache::Store(const std::string& fullPath, size_t block,
+                                const BlockSignature& signature) {
+  EntryMap::iterator it = this->entries.find(fullPath);
+  if (it == this->entries.end()) {
+    return;
+  }
+
+  std::vector<BlockSignature>& blocks = it->second.blocks;
+  if (block >= blocks.size()) {
+    // Older files make room first. A single file bigger than the whole
+    // budget just doesn't get signatures past it.
+    size_t growth = block + 1 - blocks.size();
+    while (this->totalBlocks + growth > this->maxBlocks &&
+           this->ages.front() != fullPath) {
+      this->Invalidate(this->ages.front());
+    }
+
+    if (this->totalBlocks + growth > this->maxBlocks) {
+      return;
+    }
+
+    blocks.resize(block + 1);
+    this->totalBlocks += growth;
+  }
+
+  blocks[block] = signature;
+}
+
+void BlockSignatureCache::Forget(const std::string& fullPath, size_t block) {
+  EntryMap::iterator it = this->entries.find(fullPath);
+  if (it != this->entries.end() && block < it->second.blocks.size()) {
+    it->second.blocks[block] = BlockSignature();
+  }
+}
+
+size_t BlockSignatureCache::MemoryUsage() const {
+  // Each file's path is held by both the map and the age list.
+  size_t bytes = this->totalBlocks * sizeof(BlockSignature);
+  for (EntryMap::const_iterator it = this->entries.begin();
+       it != this->entries.end(); ++it) {
+    bytes += sizeof(Entry) + 2 * it->first.size();
+  }
+
+  return bytes;
+}
+
+void BlockSignatureCache::TrimMemory(size_t targetBytes) {
+  while (!this->ages.empty() && this->MemoryUsage() > targetBytes) {
+    this->Invalidate(this->ages.front());
+  }
+}
+
+void BlockSignatureCache::makeRoom() {
+  while (!this->ages.empty() && this->entries.size() >= this->maxFiles) {
+    this->Invalidate(this->ages.front());
+  }
+}
+
+}  // namespace NaclFsp
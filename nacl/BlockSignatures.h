@@ -0,0 +1,111 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_BLOCK_SIGNATURES_H_
+#define NACL_BLOCK_SIGNATURES_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "MemoryBudget.h"
+
+namespace NaclFsp {
+
+// Identifies the contents of one block of a file. Two independent hashes
+// make 96 bits so a block is only taken as unchanged when both match.
+class BlockSignature {
+ public:
+  BlockSignature() : xxh64(0), crc32c(0), known(false) {}
+
+  static BlockSignature Compute(const uint8_t* data, size_t length);
+
+  bool Matches(const BlockSignature& other) const {
+    return this->known && other.known && this->xxh64 == other.xxh64 &&
+           this->crc32c == other.crc32c;
+  }
+
+  uint64_t xxh64;
+  uint32_t crc32c;
+  bool known;
+};
+
+// Signatures of the fixed size blocks of files that were recently written
+// with delta uploads. A file's signatures are only trusted while it has
+// the modification time and size they were recorded at, so a change made
+// by anyone else throws them away.
+//
+// Only used from the thread handling messages.
+class BlockSignatureCache : public MemoryConsumer {
+ public:
+  static const size_t BLOCK_BYTES = 16 * 1024;
+
+  BlockSignatureCache(size_t maxFiles, size_t maxBlocks);
+
+  // Starts using the signatures of a file that was just opened. They are
+  // dropped unless they were recorded at this modification time and size.
+  void Validate(const std::string& fullPath, time_t modificationTime,
+                double size);
+
+  // Records the modification time and size of a file once a write is
+  // complete. Blocks past the end are dropped.
+  void Update(const std::string& fullPath, time_t modificationTime,
+              double size);
+
+  void Invalidate(const std::string& fullPath);
+
+  // The file must have been passed to Validate first.
+  bool Lookup(const std::string& fullPath, size_t block,
+              BlockSignature* signature) const;
+  void Store(const std::string& fullPath, size_t block,
+             const BlockSignature& signature);
+  void Forget(const std::string& fullPath, size_t block);
+
+  virtual size_t MemoryUsage() const;
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Entry {
+   public:
+    Entry() : modificationTime(0), size(-1) {}
+
+    time_t modificationTime;
+    double size;
+    std::vector<BlockSignature> blocks;
+    std::list<std::string>::iterator age;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  size_t maxFiles;
+  size_t maxBlocks;
+  size_t totalBlocks;
+  EntryMap entries;
+  // Files from least to most recently validated.
+  std::list<std::string> ages;
+
+  void makeRoom();
+
+  // Prevent copy and assignment.
+  BlockSignatureCache(const BlockSignatureCache&);
+  BlockSignatureCache& operator=(const BlockSignatureCache&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_BLOCK_SIGNATURES_H_
@@ -0,0 +1,285 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "DirectoryPrefetcher.h"
+
+#include <errno.h>
+#include <algorithm>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+namespace {
+
+// Two listings at a time keep prefetch from competing with the user's own
+// requests for the server.
+const size_t PREFETCH_WORKER_THREADS = 2;
+
+// Only the first few children are worth guessing at.
+const size_t MAX_PREFETCH_DIRECTORIES = 8;
+
+// Bigger directories are left for readDirectory to stream.
+const size_t MAX_PREFETCH_ENTRIES = 2000;
+
+const int PREFETCH_TIMEOUT_MS = 5000;
+const uint64_t PREFETCH_TTL_MICROS = 15 * 1000 * 1000;
+const size_t MAX_PREFETCH_BYTES = 4 * 1024 * 1024;
+
+// Rough size of a cached entry on top of its strings.
+const size_t ENTRY_OVERHEAD_BYTES = sizeof(EntryMetadata);
+
+}  // namespace
+
+void ListDirectoryTask::Run(SMBCCTX* context) {
+  size_t maxEntries = this->maxEntries;
+  if (maxEntries == 0) {
+    maxEntries = MAX_PREFETCH_ENTRIES;
+  }
+
+  SMBCFILE* dir =
+      smbc_getFunctionOpendir(context)(context, this->directory.c_str());
+  if (dir == NULL) {
+    this->error = errno;
+    return;
+  }
+
+  smbc_getdents_fn getdents = smbc_getFunctionGetdents(context);
+  const int bufferSize = 1024 * 32;
+  std::vector<unsigned char> buffer(bufferSize);
+  int bytesRemaining = 0;
+
+  while (!this->truncated &&
+         (bytesRemaining = getdents(
+              context, dir, reinterpret_cast<struct smbc_dirent*>(&buffer[0]),
+              bufferSize)) > 0) {
+    // Same variable length walk as SambaFsp::listDirectory.
+    struct smbc_dirent* dirent =
+        reinterpret_cast<struct smbc_dirent*>(&buffer[0]);
+
+    while (bytesRemaining > 0) {
+      bool isFile = dirent->smbc_type == SMBC_FILE;
+      bool isDirectory = dirent->smbc_type == SMBC_DIR;
+      std::string name = dirent->name;
+
+      if ((isFile || isDirectory) && name != "." && name != "..") {
+        if (this->entries.size() == maxEntries) {
+          this->truncated = true;
+          break;
+        }
+
+        EntryMetadata entry;
+        entry.name = name;
+        entry.fullPath = this->directory + "/" + name;
+        entry.isDirectory = isDirectory;
+        this->entries.push_back(entry);
+      }
+
+      bytesRemaining -= dirent->dirlen;
+      dirent = reinterpret_cast<struct smbc_dirent*>(
+          reinterpret_cast<uint8_t*>(dirent) + dirent->dirlen);
+    }
+  }
+
+  if (bytesRemaining < 0) {
+    this->error = errno;
+  }
+
+  smbc_getFunctionClosedir(context)(context, dir);
+}
+
+DirectoryPrefetcher::DirectoryPrefetcher(smbc_get_auth_data_fn authFn)
+    : pool(authFn, PREFETCH_WORKER_THREADS),
+      enabled(true),
+      totalBytes(0),
+      started(0),
+      stored(0),
+      cancelled(0),
+      hits(0) {}
+
+DirectoryPrefetcher::~DirectoryPrefetcher() { this->Cancel(); }
+
+void DirectoryPrefetcher::SetEnabled(bool enabled) {
+  this->enabled = enabled;
+  if (!enabled) {
+    this->Clear();
+  }
+}
+
+void DirectoryPrefetcher::Prefetch(
+    const std::vector<std::string>& directories) {
+  if (!this->enabled) {
+    return;
+  }
+
+  this->cancelled += this->queued.size();
+  this->queued.clear();
+
+  size_t count = std::min(directories.size(), MAX_PREFETCH_DIRECTORIES);
+  std::vector<std::string> wanted(directories.begin(),
+                                  directories.begin() + count);
+
+  // Listings of the previous directory's children are no use now.
+  std::vector<ListDirectoryTask*> stillWanted;
+  for (size_t i = 0; i < this->running.size(); i++) {
+    ListDirectoryTask* task = this->running[i];
+    if (std::find(wanted.begin(), wanted.end(), task->directory) !=
+        wanted.end()) {
+      stillWanted.push_back(task);
+    } else {
+      this->pool.Abandon(task);
+      this->cancelled++;
+    }
+  }
+  this->running.swap(stillWanted);
+
+  uint64_t now = Util::monotonicMicros();
+  for (size_t i = 0; i < wanted.size(); i++) {
+    ListingMap::iterator it = this->listings.find(wanted[i]);
+    if (it != this->listings.end() && it->second.expiresMicros > now) {
+      continue;
+    }
+
+    if (!this->isRunning(wanted[i])) {
+      this->queued.push_back(wanted[i]);
+    }
+  }
+}
+
+void DirectoryPrefetcher::Cancel() {
+  this->cancelled += this->queued.size() + this->running.size();
+  this->queued.clear();
+
+  for (size_t i = 0; i < this->running.size(); i++) {
+    this->pool.Abandon(this->running[i]);
+  }
+  this->running.clear();
+}
+
+void DirectoryPrefetcher::Clear() {
+  this->Cancel();
+  this->listings.clear();
+  this->ages.clear();
+  this->totalBytes = 0;
+}
+
+bool DirectoryPrefetcher::HasReadyWork() const {
+  return (!this->queued.empty() &&
+          this->running.size() < PREFETCH_WORKER_THREADS) ||
+         this->pool.HasCompleted();
+}
+
+void DirectoryPrefetcher::Pump(uint64_t maxWaitMicros) {
+  while (this->running.size() < PREFETCH_WORKER_THREADS &&
+         !this->queued.empty()) {
+    ListDirectoryTask* task = new ListDirectoryTask(this->queued.front());
+    this->queued.pop_front();
+    task->timeoutMs = PREFETCH_TIMEOUT_MS;
+    this->pool.Submit(task);
+    this->running.push_back(task);
+    this->started++;
+  }
+
+  if (this->running.empty()) {
+    return;
+  }
+
+  // The pool only ever has this prefetcher's tasks on it.
+  ListDirectoryTask* task = static_cast<ListDirectoryTask*>(
+      this->pool.WaitForCompleted(Util::monotonicMicros() + maxWaitMicros));
+  if (task == NULL) {
+    return;
+  }
+
+  std::vector<ListDirectoryTask*>::iterator it =
+      std::find(this->running.begin(), this->running.end(), task);
+  if (it != this->running.end()) {
+    this->running.erase(it);
+  }
+
+  if (task->error == 0 && !task->truncated) {
+    this->store(task);
+  }
+
+  delete task;
+}
+
+bool DirectoryPrefetcher::Take(const std::string& directory,
+                               std::vector<EntryMetadata>* entries) {
+  ListingMap::iterator it = this->listings.find(directory);
+  if (it == this->listings.end()) {
+    return false;
+  }
+
+  bool fresh = it->second.expiresMicros > Util::monotonicMicros();
+  if (fresh) {
+    entries->swap(it->second.entries);
+    this->hits++;
+  }
+
+  this->erase(it);
+  return fresh;
+}
+
+bool DirectoryPrefetcher::isRunning(const std::string& directory) const {
+  for (size_t i = 0; i < this->running.size(); i++) {
+    if (this->running[i]->directory == directory) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void DirectoryPrefetcher::store(ListDirectoryTask* task) {
+  size_t bytes = task->directory.size();
+  for (size_t i = 0; i < task->entries.size(); i++) {
+    const EntryMetadata& entry = task->entries[i];
+    bytes += ENTRY_OVERHEAD_BYTES + entry.name.size() + entry.fullPath.size();
+  }
+
+  if (bytes > MAX_PREFETCH_BYTES) {
+    return;
+  }
+
+  ListingMap::iterator existing = this->listings.find(task->directory);
+  if (existing != this->listings.end()) {
+    this->erase(existing);
+  }
+
+  this->TrimMemory(MAX_PREFETCH_BYTES - bytes);
+
+  Listing& listing = this->listings[task->directory];
+  listing.expiresMicros = Util::monotonicMicros() + PREFETCH_TTL_MICROS;
+  listing.bytes = bytes;
+  listing.entries.swap(task->entries);
+  listing.age = this->ages.insert(this->ages.end(), task->directory);
+  this->totalBytes += bytes;
+  this->stored++;
+}
+
+void DirectoryPrefetcher::TrimMemory(size_t targetBytes) {
+  while (this->totalBytes > targetBytes) {
+    this->erase(this->listings.find(this->ages.front()));
+  }
+}
+
+void DirectoryPrefetcher::erase(ListingMap::iterator it) {
+  this->totalBytes -= it->second.bytes;
+  this->ages.erase(it->second.age);
+  this->listings.erase(it);
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,143 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_DIRECTORY_PREFETCHER_H_
+#define NACL_DIRECTORY_PREFETCHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "INaclFsp.h"
+#include "MemoryBudget.h"
+#include "SmbWorkerPool.h"
+
+namespace NaclFsp {
+
+// Lists one directory on a prefetch thread. Only names and types are read,
+// the same as SambaFsp::listDirectory.
+class ListDirectoryTask : public SmbTask {
+ public:
+  explicit ListDirectoryTask(const std::string& directory)
+      : directory(directory), maxEntries(0), truncated(false) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  std::string directory;
+  // Zero keeps the usual limit for a prefetch.
+  size_t maxEntries;
+
+  std::vector<EntryMetadata> entries;
+  // Set when the directory was too big to keep.
+  bool truncated;
+};
+
+// Lists the child directories of the folder the user just opened in the
+// background so that moving into one of them doesn't wait for a round
+// trip. It has its own small pool so the listings use their own
+// connections, and it only runs from BaseNaclFsp::OnIdle, so it never
+// delays a request. Starting a new prefetch drops whatever the last one
+// hadn't finished since the user has moved on.
+class DirectoryPrefetcher : public MemoryConsumer {
+ public:
+  explicit DirectoryPrefetcher(smbc_get_auth_data_fn authFn);
+  ~DirectoryPrefetcher();
+
+  void SetEnabled(bool enabled);
+
+  // Replaces the queued work with the first few of |directories|.
+  void Prefetch(const std::vector<std::string>& directories);
+
+  // Drops queued and running listings. Cached ones are kept.
+  void Cancel();
+
+  // Cancel() and forget every cached listing, eg. after a change to the
+  // file system.
+  void Clear();
+
+  bool HasWork() const {
+    return !this->queued.empty() || !this->running.empty();
+  }
+
+  // True if Pump has a listing to start or collect straight away.
+  bool HasReadyWork() const;
+
+  // Called on a prefetch thread whenever a listing finishes.
+  void SetCompletedHook(SmbWorkerPool::CompletedHook hook) {
+    this->pool.SetCompletedHook(hook);
+  }
+
+  // Drops the prefetch workers' connections to servers.
+  void CloseIdleConnections() { this->pool.CloseIdleConnections(); }
+
+  // Starts queued listings and collects finished ones. Waits at most
+  // maxWaitMicros for one to finish.
+  void Pump(uint64_t maxWaitMicros);
+
+  // Moves a fresh listing of |directory| into |entries|. Each listing is
+  // only used once since the next readDirectory of it should go to the
+  // server.
+  bool Take(const std::string& directory, std::vector<EntryMetadata>* entries);
+
+  uint64_t listingsStarted() const { return this->started; }
+  uint64_t listingsStored() const { return this->stored; }
+  uint64_t listingsCancelled() const { return this->cancelled; }
+  uint64_t listingsUsed() const { return this->hits; }
+
+  // Only counts stored listings, the oldest of which are trimmed first.
+  virtual size_t MemoryUsage() const { return this->totalBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Listing {
+   public:
+    uint64_t expiresMicros;
+    size_t bytes;
+    std::vector<EntryMetadata> entries;
+    std::list<std::string>::iterator age;
+  };
+
+  typedef std::map<std::string, Listing> ListingMap;
+
+  SmbWorkerPool pool;
+  bool enabled;
+  std::deque<std::string> queued;
+  std::vector<ListDirectoryTask*> running;
+  ListingMap listings;
+  // Directories from oldest to newest listing.
+  std::list<std::string> ages;
+  size_t totalBytes;
+
+  uint64_t started;
+  uint64_t stored;
+  uint64_t cancelled;
+  uint64_t hits;
+
+  bool isRunning(const std::string& directory) const;
+  void store(ListDirectoryTask* task);
+  void erase(ListingMap::iterator it);
+
+  // Prevent copy and assignment.
+  DirectoryPrefetcher(const DirectoryPrefetcher&);
+  DirectoryPrefetcher& operator=(const DirectoryPrefetcher&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_DIRECTORY_PREFETCHER_H_
@@ -0,0 +1,186 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "DirectoryVersions.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+namespace {
+
+// Orders indexes into a vector of entries by name.
+class NameOrder {
+ public:
+  explicit NameOrder(const std::vector<EntryMetadata>& entries)
+      : entries(entries) {}
+
+  bool operator()(size_t a, size_t b) const {
+    return this->entries[a].name < this->entries[b].name;
+  }
+
+ private:
+  const std::vector<EntryMetadata>& entries;
+};
+
+void sortedIndexes(const std::vector<EntryMetadata>& entries,
+                   std::vector<size_t>* indexes) {
+  indexes->resize(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    (*indexes)[i] = i;
+  }
+  std::sort(indexes->begin(), indexes->end(), NameOrder(entries));
+}
+
+// Finds a name in a recorded listing.
+class VersionedNameOrder {
+ public:
+  bool operator()(const DirectoryVersions::VersionedEntry& entry,
+                  const std::string& name) const {
+    return entry.name < name;
+  }
+};
+
+}  // namespace
+
+DirectoryVersions::DirectoryVersions(size_t maxDirectories, size_t maxEntries)
+    : maxDirectories(maxDirectories),
+      maxEntries(maxEntries),
+      totalEntries(0),
+      totalBytes(0),
+      tokenPrefix(Util::ToString(Util::monotonicMicros()) + "."),
+      nextVersion(1) {}
+
+std::string DirectoryVersions::Record(
+    const std::string& directory, uint32_t fieldMask,
+    const std::vector<EntryMetadata>& entries) {
+  this->Invalidate(directory);
+  if (entries.size() > this->maxEntries) {
+    return "";
+  }
+
+  while (!this->ages.empty() &&
+         (this->listings.size() >= this->maxDirectories ||
+          this->totalEntries + entries.size() > this->maxEntries)) {
+    this->Invalidate(this->ages.front());
+  }
+
+  std::vector<size_t> order;
+  sortedIndexes(entries, &order);
+
+  Listing& listing = this->listings[directory];
+  listing.token = this->tokenPrefix + Util::ToString(this->nextVersion++);
+  listing.fieldMask = fieldMask;
+  listing.entries.resize(order.size());
+  // The path is held by both the map and the age list.
+  listing.bytes = sizeof(Listing) + 2 * directory.size() +
+                  listing.token.size() +
+                  order.size() * sizeof(VersionedEntry);
+  for (size_t i = 0; i < order.size(); i++) {
+    const EntryMetadata& entry = entries[order[i]];
+    VersionedEntry& versioned = listing.entries[i];
+    versioned.name = entry.name;
+    versioned.isDirectory = entry.isDirectory;
+    versioned.size = entry.size;
+    versioned.modificationTime = entry.modificationTime;
+    listing.bytes += entry.name.size();
+  }
+  listing.age = this->ages.insert(this->ages.end(), directory);
+
+  this->totalEntries += order.size();
+  this->totalBytes += listing.bytes;
+  return listing.token;
+}
+
+bool DirectoryVersions::Take(const std::string& directory,
+                             const std::string& token, uint32_t fieldMask,
+                             std::vector<VersionedEntry>* previous) {
+  ListingMap::iterator it = this->listings.find(directory);
+  if (token.empty() || it == this->listings.end() ||
+      it->second.token != token || it->second.fieldMask != fieldMask) {
+    return false;
+  }
+
+  // The entries are gone so the token can't be used again.
+  this->totalEntries -= it->second.entries.size();
+  previous->clear();
+  previous->swap(it->second.entries);
+  this->Invalidate(directory);
+  return true;
+}
+
+void DirectoryVersions::FindRemoved(
+    const std::vector<VersionedEntry>& previous,
+    const std::vector<EntryMetadata>& entries,
+    std::vector<std::string>* removed) {
+  std::vector<size_t> order;
+  sortedIndexes(entries, &order);
+
+  // Both sides are sorted by name so one pass pairs them up.
+  size_t j = 0;
+  for (size_t i = 0; i < previous.size(); i++) {
+    while (j < order.size() && entries[order[j]].name < previous[i].name) {
+      j++;
+    }
+
+    if (j == order.size() || entries[order[j]].name != previous[i].name) {
+      removed->push_back(previous[i].name);
+    }
+  }
+}
+
+DirectoryVersions::Change DirectoryVersions::Compare(
+    const std::vector<VersionedEntry>& previous, EntryMetadata* entry) {
+  std::vector<VersionedEntry>::const_iterator it =
+      std::lower_bound(previous.begin(), previous.end(), entry->name,
+                       VersionedNameOrder());
+  if (it == previous.end() || it->name != entry->name) {
+    return ENTRY_ADDED;
+  }
+
+  if (entry->size < 0 && it->size >= 0 &&
+      entry->isDirectory == it->isDirectory) {
+    entry->size = it->size;
+    entry->modificationTime = it->modificationTime;
+    return ENTRY_UNCHANGED;
+  }
+
+  if (it->isDirectory != entry->isDirectory || it->size != entry->size ||
+      it->modificationTime != entry->modificationTime) {
+    return ENTRY_MODIFIED;
+  }
+
+  return ENTRY_UNCHANGED;
+}
+
+void DirectoryVersions::Invalidate(const std::string& directory) {
+  ListingMap::iterator it = this->listings.find(directory);
+  if (it != this->listings.end()) {
+    this->totalEntries -= it->second.entries.size();
+    this->totalBytes -= it->second.bytes;
+    this->ages.erase(it->second.age);
+    this->listings.erase(it);
+  }
+}
+
+void DirectoryVersions::TrimMemory(size_t targetBytes) {
+  while (!this->ages.empty() && this->totalBytes > targetBytes) {
+    this->Invalidate(this->ages.front());
+  }
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,110 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_DIRECTORY_VERSIONS_H_
+#define NACL_DIRECTORY_VERSIONS_H_
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "INaclFsp.h"
+#include "MemoryBudget.h"
+
+namespace NaclFsp {
+
+// Remembers the last listing sent to JS for each directory so a refresh can
+// send only what changed. Each recorded listing gets a version token which
+// JS hands back with the refresh; when the token is no longer known (the
+// listing was evicted or the module restarted) the caller sends everything.
+//
+// Only used from the thread handling messages.
+class DirectoryVersions : public MemoryConsumer {
+ public:
+  // Just what Compare looks at.
+  class VersionedEntry {
+   public:
+    std::string name;
+    bool isDirectory;
+    double size;
+    int modificationTime;
+  };
+
+  enum Change { ENTRY_ADDED, ENTRY_MODIFIED, ENTRY_UNCHANGED };
+
+  DirectoryVersions(size_t maxDirectories, size_t maxEntries);
+
+  // Stores |entries| as the listing of |directory| and returns its token.
+  // Returns an empty token when the listing is too large to keep.
+  std::string Record(const std::string& directory, uint32_t fieldMask,
+                     const std::vector<EntryMetadata>& entries);
+
+  // Moves the listing recorded under |token| into |previous|, sorted by
+  // name, so it stays valid however the memory budget trims this. Returns
+  // false when the token is unknown or was recorded with a different
+  // |fieldMask|.
+  bool Take(const std::string& directory, const std::string& token,
+            uint32_t fieldMask, std::vector<VersionedEntry>* previous);
+
+  // Fills in the names in |previous| that are not in |entries|.
+  static void FindRemoved(const std::vector<VersionedEntry>& previous,
+                          const std::vector<EntryMetadata>& entries,
+                          std::vector<std::string>* removed);
+
+  // Says how |entry| differs from its namesake in |previous|. An entry
+  // whose stat() failed gets the size and time it had before, so it is
+  // neither sent as changed nor recorded without them.
+  static Change Compare(const std::vector<VersionedEntry>& previous,
+                        EntryMetadata* entry);
+
+  void Invalidate(const std::string& directory);
+
+  virtual size_t MemoryUsage() const { return this->totalBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Listing {
+   public:
+    std::string token;
+    uint32_t fieldMask;
+    // Sorted by name.
+    std::vector<VersionedEntry> entries;
+    size_t bytes;
+    std::list<std::string>::iterator age;
+  };
+
+  typedef std::map<std::string, Listing> ListingMap;
+
+  size_t maxDirectories;
+  size_t maxEntries;
+  size_t totalEntries;
+  size_t totalBytes;
+  // Tokens start with this so ones from an earlier instance never match.
+  std::string tokenPrefix;
+  uint64_t nextVersion;
+  ListingMap listings;
+  // Directories from oldest to newest.
+  std::list<std::string> ages;
+
+  // Prevent copy and assignment.
+  DirectoryVersions(const DirectoryVersions&);
+  DirectoryVersions& operator=(const DirectoryVersions&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_DIRECTORY_VERSIONS_H_
@@ -0,0 +1,591 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ExifThumbnail.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+
+namespace NaclFsp {
+
+namespace {
+
+// Headers are read in chunks of this size so that walking the JPEG
+// segments or TIFF directories rarely needs more than one or two reads.
+const size_t READ_CHUNK_BYTES = 16 * 1024;
+
+// EXIF thumbnails are limited to 64KB since they have to fit in the APP1
+// segment of a JPEG. Anything bigger is a full preview, not a thumbnail.
+const uint32_t MAX_THUMBNAIL_BYTES = 64 * 1024;
+
+const int MAX_JPEG_SEGMENTS = 32;
+const uint16_t MAX_IFD_ENTRIES = 1024;
+const int MAX_HEIF_BOXES = 32;
+const uint64_t MAX_HEIF_META_BYTES = 256 * 1024;
+
+const uint16_t TIFF_TAG_THUMBNAIL_OFFSET = 0x0201;
+const uint16_t TIFF_TAG_THUMBNAIL_LENGTH = 0x0202;
+const uint16_t TIFF_TYPE_SHORT = 3;
+
+// Extensions of formats that can carry an EXIF thumbnail. Raw formats that
+// are TIFF underneath are included.
+const char* const kThumbnailExtensions[] = {
+    "arw", "cr2", "dng", "heic", "heif", "jpe", "jpeg",
+    "jpg", "nef", "nrw", "pef", "srw", "tif", "tiff"};
+
+const char kBase64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+uint16_t readU16(const uint8_t* p, bool littleEndian) {
+  if (littleEndian) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+  }
+
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+uint32_t readU32(const uint8_t* p, bool littleEndian) {
+  if (littleEndian) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+// Bounds checked big endian reader for the boxes inside a HEIF meta box.
+// Once a read runs past the end every later read returns 0 and Failed()
+// is true.
+class ByteCursor {
+ public:
+  ByteCursor(const uint8_t* data, size_t size)
+      : data(data), size(size), position(0), failed(false) {}
+
+  // Reads an unsigned value of 0 to 8 bytes.
+  uint64_t Read(size_t bytes) {
+    if (bytes > 8 || bytes > this->size - this->position) {
+      this->failed = true;
+      this->position = this->size;
+      return 0;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      value = (value << 8) | this->data[this->position++];
+    }
+
+    return value;
+  }
+
+  std::string ReadFourCC() {
+    if (this->size - this->position < 4) {
+      this->failed = true;
+      this->position = this->size;
+      return "";
+    }
+
+    std::string fourCC(
+        reinterpret_cast<const char*>(this->data + this->position), 4);
+    this->position += 4;
+    return fourCC;
+  }
+
+  void Seek(size_t position) {
+    if (position > this->size) {
+      this->failed = true;
+      position = this->size;
+    }
+
+    this->position = position;
+  }
+
+  size_t Position() const { return this->position; }
+  bool Failed() const { return this->failed; }
+
+ private:
+  const uint8_t* data;
+  size_t size;
+  size_t position;
+  bool failed;
+};
+
+// Finds the id of the item of type 'Exif' in the content of an iinf box.
+bool findExifItemId(const uint8_t* data, size_t size, uint32_t* itemId) {
+  ByteCursor cursor(data, size);
+  uint64_t version = cursor.Read(1);
+  cursor.Read(3);  // flags
+  uint64_t count = cursor.Read(version == 0 ? 2 : 4);
+
+  for (uint64_t i = 0; i < count && !cursor.Failed(); i++) {
+    size_t boxStart = cursor.Position();
+    uint64_t boxSize = cursor.Read(4);
+    std::string boxType = cursor.ReadFourCC();
+    if (cursor.Failed() || boxSize < 8) {
+      return false;
+    }
+
+    if (boxType == "infe") {
+      uint64_t infeVersion = cursor.Read(1);
+      cursor.Read(3);  // flags
+      // Only version 2 and later have an item type.
+      if (infeVersion >= 2) {
+        uint64_t id = cursor.Read(infeVersion == 2 ? 2 : 4);
+        cursor.Read(2);  // item_protection_index
+        if (cursor.ReadFourCC() == "Exif" && !cursor.Failed()) {
+          *itemId = static_cast<uint32_t>(id);
+          return true;
+        }
+      }
+    }
+
+    cursor.Seek(boxStart + boxSize);
+  }
+
+  return false;
+}
+
+// Finds the file offset of the first extent of |itemId| in the content of
+// an iloc box. Only items stored directly in the file are supported.
+bool findItemOffset(const uint8_t* data, size_t size, uint32_t itemId,
+                    uint64_t* offset) {
+  ByteCursor cursor(data, size);
+  uint64_t version = cursor.Read(1);
+  cursor.Read(3);  // flags
+  uint64_t sizes = cursor.Read(1);
+  size_t offsetSize = sizes >> 4;
+  size_t lengthSize = sizes & 0xF;
+  sizes = cursor.Read(1);
+  size_t baseOffsetSize = sizes >> 4;
+  bool hasIndex = version == 1 || version == 2;
+  size_t indexSize = hasIndex ? (sizes & 0xF) : 0;
+  uint64_t itemCount = cursor.Read(version < 2 ? 2 : 4);
+
+  for (uint64_t i = 0; i < itemCount && !cursor.Failed(); i++) {
+    uint64_t id = cursor.Read(version < 2 ? 2 : 4);
+    uint64_t constructionMethod = 0;
+    if (hasIndex) {
+      constructionMethod = cursor.Read(2) & 0xF;
+    }
+
+    cursor.Read(2);  // data_reference_index
+    uint64_t baseOffset = cursor.Read(baseOffsetSize);
+    uint64_t extentCount = cursor.Read(2);
+    uint64_t firstExtentOffset = 0;
+    for (uint64_t j = 0; j < extentCount && !cursor.Failed(); j++) {
+      cursor.Read(indexSize);
+      uint64_t extentOffset = cursor.Read(offsetSize);
+      cursor.Read(lengthSize);
+      if (j == 0) {
+        firstExtentOffset = extentOffset;
+      }
+    }
+
+    if (id == itemId) {
+      if (cursor.Failed() || constructionMethod != 0 || extentCount == 0) {
+        return false;
+      }
+
+      *offset = baseOffset + firstExtentOffset;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}  // namespace
+
+ExifThumbnailExtractor::ExifThumbnailExtractor(RangeReader* reader)
+    : reader(reader), bytesRead(0), bufferOffset(0) {}
+
+bool ExifThumbnailExtractor::IsCandidate(const std::string& name) {
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+
+  std::string extension = name.substr(dot + 1);
+  for (size_t i = 0; i < extension.size(); i++) {
+    extension[i] = static_cast<char>(tolower(extension[i]));
+  }
+
+  size_t count = sizeof(kThumbnailExtensions) / sizeof(kThumbnailExtensions[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (extension == kThumbnailExtensions[i]) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string ExifThumbnailExtractor::ToDataUri(
+    const std::vector<uint8_t>& jpeg) {
+  std::string uri = "data:image/jpeg;base64,";
+  uri.reserve(uri.size() + (jpeg.size() + 2) / 3 * 4);
+
+  for (size_t i = 0; i < jpeg.size(); i += 3) {
+    uint32_t group = jpeg[i] << 16;
+    if (i + 1 < jpeg.size()) {
+      group |= jpeg[i + 1] << 8;
+    }
+    if (i + 2 < jpeg.size()) {
+      group |= jpeg[i + 2];
+    }
+
+    uri += kBase64Alphabet[(group >> 18) & 0x3F];
+    uri += kBase64Alphabet[(group >> 12) & 0x3F];
+    uri += i + 1 < jpeg.size() ? kBase64Alphabet[(group >> 6) & 0x3F] : '=';
+    uri += i + 2 < jpeg.size() ? kBase64Alphabet[group & 0x3F] : '=';
+  }
+
+  return uri;
+}
+
+bool ExifThumbnailExtractor::Extract(std::vector<uint8_t>* jpeg) {
+  const uint8_t* magic = this->read(0, 12);
+  if (magic == NULL) {
+    return false;
+  }
+
+  if (magic[0] == 0xFF && magic[1] == 0xD8) {
+    return this->extractFromJpeg(jpeg);
+  }
+
+  if ((magic[0] == 'I' && magic[1] == 'I') ||
+      (magic[0] == 'M' && magic[1] == 'M')) {
+    return this->extractFromTiff(0, jpeg);
+  }
+
+  if (memcmp(magic + 4, "ftyp", 4) == 0) {
+    return this->extractFromHeif(jpeg);
+  }
+
+  return false;
+}
+
+bool ExifThumbnailExtractor::extractFromJpeg(std::vector<uint8_t>* jpeg) {
+  // Walk the segments after SOI looking for the APP1 segment with EXIF.
+  uint64_t offset = 2;
+  for (int i = 0; i < MAX_JPEG_SEGMENTS; i++) {
+    const uint8_t* header = this->read(offset, 4);
+    if (header == NULL || header[0] != 0xFF) {
+      return false;
+    }
+
+    uint8_t marker = header[1];
+    if (marker == 0xFF) {
+      // Fill byte before a marker.
+      offset++;
+      continue;
+    }
+
+    // The image data starts at SOS so EXIF can't come later.
+    if (marker == 0xDA || marker == 0xD9) {
+      return false;
+    }
+
+    uint16_t segmentLength = readU16(header + 2, false);
+    if (segmentLength < 2) {
+      return false;
+    }
+
+    if (marker == 0xE1 && segmentLength >= 2 + 6 + 8) {
+      const uint8_t* id = this->read(offset + 4, 6);
+      if (id != NULL && memcmp(id, "Exif\0\0", 6) == 0) {
+        return this->extractFromTiff(offset + 10, jpeg);
+      }
+    }
+
+    offset += 2 + segmentLength;
+  }
+
+  return false;
+}
+
+bool ExifThumbnailExtractor::extractFromTiff(uint64_t tiffOffset,
+                                             std::vector<uint8_t>* jpeg) {
+  const uint8_t* header = this->read(tiffOffset, 8);
+  if (header == NULL) {
+    return false;
+  }
+
+  bool littleEndian;
+  if (header[0] == 'I' && header[1] == 'I') {
+    littleEndian = true;
+  } else if (header[0] == 'M' && header[1] == 'M') {
+    littleEndian = false;
+  } else {
+    return false;
+  }
+
+  if (readU16(header + 2, littleEndian) != 42) {
+    return false;
+  }
+
+  // The thumbnail is described by IFD1 which follows IFD0.
+  uint64_t ifd0 = tiffOffset + readU32(header + 4, littleEndian);
+  const uint8_t* countBytes = this->read(ifd0, 2);
+  if (countBytes == NULL) {
+    return false;
+  }
+
+  uint16_t count = readU16(countBytes, littleEndian);
+  if (count > MAX_IFD_ENTRIES) {
+    return false;
+  }
+
+  const uint8_t* nextBytes = this->read(ifd0 + 2 + count * 12, 4);
+  if (nextBytes == NULL) {
+    return false;
+  }
+
+  uint32_t ifd1Offset = readU32(nextBytes, littleEndian);
+  if (ifd1Offset == 0) {
+    return false;
+  }
+
+  uint64_t ifd1 = tiffOffset + ifd1Offset;
+  countBytes = this->read(ifd1, 2);
+  if (countBytes == NULL) {
+    return false;
+  }
+
+  count = readU16(countBytes, littleEndian);
+  if (count == 0 || count > MAX_IFD_ENTRIES) {
+    return false;
+  }
+
+  const uint8_t* entries = this->read(ifd1 + 2, count * 12);
+  if (entries == NULL) {
+    return false;
+  }
+
+  uint32_t thumbnailOffset = 0;
+  uint32_t thumbnailLength = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    const uint8_t* entry = entries + i * 12;
+    uint16_t tag = readU16(entry, littleEndian);
+    uint16_t type = readU16(entry + 2, littleEndian);
+    uint32_t value = type == TIFF_TYPE_SHORT ? readU16(entry + 8, littleEndian)
+                                             : readU32(entry + 8, littleEndian);
+    if (tag == TIFF_TAG_THUMBNAIL_OFFSET) {
+      thumbnailOffset = value;
+    } else if (tag == TIFF_TAG_THUMBNAIL_LENGTH) {
+      thumbnailLength = value;
+    }
+  }
+
+  if (thumbnailOffset == 0 || thumbnailLength < 4 ||
+      thumbnailLength > MAX_THUMBNAIL_BYTES) {
+    return false;
+  }
+
+  const uint8_t* data = this->read(tiffOffset + thumbnailOffset,
+                                   thumbnailLength);
+  if (data == NULL || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+
+  jpeg->assign(data, data + thumbnailLength);
+  return true;
+}
+
+bool ExifThumbnailExtractor::extractFromHeif(std::vector<uint8_t>* jpeg) {
+  // The meta box is near the start of the file. Top level boxes before it
+  // are skipped without reading their content.
+  uint64_t offset = 0;
+  for (int i = 0; i < MAX_HEIF_BOXES; i++) {
+    const uint8_t* header = this->read(offset, 8);
+    if (header == NULL) {
+      return false;
+    }
+
+    uint64_t boxSize = readU32(header, false);
+    bool isMeta = memcmp(header + 4, "meta", 4) == 0;
+    uint64_t headerSize = 8;
+    if (boxSize == 1) {
+      const uint8_t* largeSize = this->read(offset + 8, 8);
+      if (largeSize == NULL) {
+        return false;
+      }
+
+      boxSize = (static_cast<uint64_t>(readU32(largeSize, false)) << 32) |
+                readU32(largeSize + 4, false);
+      headerSize = 16;
+    }
+
+    // A size of 0 means the box runs to the end of the file, which only
+    // makes sense for mdat.
+    if (boxSize < headerSize) {
+      return false;
+    }
+
+    if (isMeta) {
+      if (boxSize > MAX_HEIF_META_BYTES) {
+        return false;
+      }
+
+      size_t metaSize = static_cast<size_t>(boxSize - headerSize);
+      const uint8_t* data = this->read(offset + headerSize, metaSize);
+      if (data == NULL) {
+        return false;
+      }
+
+      std::vector<uint8_t> meta(data, data + metaSize);
+      uint64_t exifOffset;
+      if (!this->findHeifExifOffset(meta, &exifOffset)) {
+        return false;
+      }
+
+      // The Exif item starts with the offset of the TIFF header from the
+      // end of this field, which skips the "Exif\0\0" marker.
+      const uint8_t* prefix = this->read(exifOffset, 4);
+      if (prefix == NULL) {
+        return false;
+      }
+
+      return this->extractFromTiff(exifOffset + 4 + readU32(prefix, false),
+                                   jpeg);
+    }
+
+    offset += boxSize;
+  }
+
+  return false;
+}
+
+bool ExifThumbnailExtractor::findHeifExifOffset(
+    const std::vector<uint8_t>& meta, uint64_t* exifOffset) {
+  // meta is a full box so the children start after version and flags.
+  size_t position = 4;
+  bool foundExif = false;
+  uint32_t exifItemId = 0;
+  const uint8_t* iloc = NULL;
+  size_t ilocSize = 0;
+
+  while (position + 8 <= meta.size()) {
+    size_t boxSize = readU32(&meta[position], false);
+    if (boxSize < 8 || boxSize > meta.size() - position) {
+      return false;
+    }
+
+    const uint8_t* content = &meta[position + 8];
+    if (memcmp(&meta[position + 4], "iinf", 4) == 0) {
+      foundExif = findExifItemId(content, boxSize - 8, &exifItemId);
+    } else if (memcmp(&meta[position + 4], "iloc", 4) == 0) {
+      iloc = content;
+      ilocSize = boxSize - 8;
+    }
+
+    position += boxSize;
+  }
+
+  if (!foundExif || iloc == NULL) {
+    return false;
+  }
+
+  return findItemOffset(iloc, ilocSize, exifItemId, exifOffset);
+}
+
+const uint8_t* ExifThumbnailExtractor::read(uint64_t offset, size_t length) {
+  if (length == 0) {
+    return NULL;
+  }
+
+  if (offset >= this->bufferOffset &&
+      offset - this->bufferOffset + length <= this->buffer.size()) {
+    return &this->buffer[offset - this->bufferOffset];
+  }
+
+  std::vector<uint8_t> data;
+  if (!this->reader->ReadRange(offset, std::max(length, READ_CHUNK_BYTES),
+                               &data)) {
+    return NULL;
+  }
+
+  this->bytesRead += data.size();
+  this->buffer.swap(data);
+  this->bufferOffset = offset;
+  if (this->buffer.size() < length) {
+    return NULL;
+  }
+
+  return &this->buffer[0];
+}
+
+ThumbnailCache::ThumbnailCache(size_t maxBytes)
+    : maxBytes(maxBytes), totalBytes(0) {}
+
+bool ThumbnailCache::Lookup(const std::string& path, int modificationTime,
+                            std::string* dataUri) {
+  std::map<std::string, Entry>::iterator it = this->entries.find(path);
+  if (it == this->entries.end()) {
+    return false;
+  }
+
+  if (it->second.modificationTime != modificationTime) {
+    this->erase(it);
+    return false;
+  }
+
+  *dataUri = it->second.dataUri;
+  return true;
+}
+
+void ThumbnailCache::Store(const std::string& path, int modificationTime,
+                           const std::string& dataUri) {
+  std::map<std::string, Entry>::iterator it = this->entries.find(path);
+  if (it != this->entries.end()) {
+    this->erase(it);
+  }
+
+  Entry& entry = this->entries[path];
+  entry.modificationTime = modificationTime;
+  entry.dataUri = dataUri;
+  entry.age = this->ages.insert(this->ages.end(), path);
+  this->totalBytes += path.size() + dataUri.size();
+
+  this->TrimMemory(this->maxBytes);
+}
+
+bool ThumbnailCache::CachedTime(const std::string& path,
+                                int* modificationTime) const {
+  std::map<std::string, Entry>::const_iterator it = this->entries.find(path);
+  if (it == this->entries.end()) {
+    return false;
+  }
+
+  *modificationTime = it->second.modificationTime;
+  return true;
+}
+
+void ThumbnailCache::TrimMemory(size_t targetBytes) {
+  while (this->totalBytes > targetBytes && !this->ages.empty()) {
+    this->erase(this->entries.find(this->ages.front()));
+  }
+}
+
+void ThumbnailCache::erase(std::map<std::string, Entry>::iterator it) {
+  this->totalBytes -= it->first.size() + it->second.dataUri.size();
+  this->ages.erase(it->second.age);
+  this->entries.erase(it);
+}
+
+}  // namespace NaclFsp
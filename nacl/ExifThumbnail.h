@@ -0,0 +1,112 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_EXIF_THUMBNAIL_H_
+#define NACL_EXIF_THUMBNAIL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "MemoryBudget.h"
+#include "RangeReader.h"
+
+namespace NaclFsp {
+
+// Finds the small JPEG preview that cameras embed in the EXIF data of JPEG,
+// TIFF (and TIFF based raw) and HEIF files. Only the file headers and the
+// thumbnail itself are read, in chunks of a few KB.
+class ExifThumbnailExtractor {
+ public:
+  explicit ExifThumbnailExtractor(RangeReader* reader);
+
+  // Returns true and sets |jpeg| if the file has an embedded thumbnail.
+  bool Extract(std::vector<uint8_t>* jpeg);
+
+  uint64_t BytesRead() const { return this->bytesRead; }
+
+  // True if the name has an extension of a format that can carry an EXIF
+  // thumbnail. Avoids opening files that can't have one.
+  static bool IsCandidate(const std::string& name);
+
+  static std::string ToDataUri(const std::vector<uint8_t>& jpeg);
+
+ private:
+  bool extractFromJpeg(std::vector<uint8_t>* jpeg);
+  bool extractFromTiff(uint64_t tiffOffset, std::vector<uint8_t>* jpeg);
+  bool extractFromHeif(std::vector<uint8_t>* jpeg);
+  bool findHeifExifOffset(const std::vector<uint8_t>& meta,
+                          uint64_t* exifOffset);
+
+  // Returns a pointer to |length| bytes at |offset| that stays valid until
+  // the next call. Reads a whole chunk so neighbouring fields are free.
+  const uint8_t* read(uint64_t offset, size_t length);
+
+  RangeReader* reader;
+  uint64_t bytesRead;
+  uint64_t bufferOffset;
+  std::vector<uint8_t> buffer;
+
+  // Prevent copy and assignment.
+  ExifThumbnailExtractor(const ExifThumbnailExtractor&);
+  ExifThumbnailExtractor& operator=(const ExifThumbnailExtractor&);
+};
+
+// Data URIs of thumbnails keyed by path and only valid for the modification
+// time they were read at. Files without a thumbnail are cached as an empty
+// string so they aren't opened again. The oldest entries are dropped once
+// the total size goes over maxBytes.
+class ThumbnailCache : public MemoryConsumer {
+ public:
+  explicit ThumbnailCache(size_t maxBytes);
+
+  bool Lookup(const std::string& path, int modificationTime,
+              std::string* dataUri);
+  void Store(const std::string& path, int modificationTime,
+             const std::string& dataUri);
+  // Sets |modificationTime| to the time the cached thumbnail of |path| was
+  // read at, so a worker can skip files that weren't modified since.
+  bool CachedTime(const std::string& path, int* modificationTime) const;
+
+  virtual size_t MemoryUsage() const { return this->totalBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Entry {
+   public:
+    int modificationTime;
+    std::string dataUri;
+    std::list<std::string>::iterator age;
+  };
+
+  void erase(std::map<std::string, Entry>::iterator it);
+
+  size_t maxBytes;
+  size_t totalBytes;
+  std::map<std::string, Entry> entries;
+  // Paths from oldest to newest.
+  std::list<std::string> ages;
+
+  // Prevent copy and assignment.
+  ThumbnailCache(const ThumbnailCache&);
+  ThumbnailCache& operator=(const ThumbnailCache&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_EXIF_THUMBNAIL_H_
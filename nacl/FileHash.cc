@@ -0,0 +1,524 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "FileHash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define NACL_FILE_HASH_X86 1
+#endif
+
+namespace NaclFsp {
+
+namespace {
+
+// Each smbc_read of this size is split into several SMB reads that
+// libsmbclient keeps in flight together, so one file keeps the link busy.
+const size_t HASH_CHUNK_BYTES = 1024 * 1024;
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+std::string toHex(const uint8_t* bytes, size_t length) {
+  std::string hex(length * 2, '0');
+  for (size_t i = 0; i < length; i++) {
+    hex[i * 2] = HEX_DIGITS[bytes[i] >> 4];
+    hex[i * 2 + 1] = HEX_DIGITS[bytes[i] & 0xf];
+  }
+
+  return hex;
+}
+
+std::string toHex(uint64_t value, size_t length) {
+  uint8_t bytes[8];
+  for (size_t i = 0; i < length; i++) {
+    bytes[i] = static_cast<uint8_t>(value >> ((length - 1 - i) * 8));
+  }
+
+  return toHex(bytes, length);
+}
+
+// The loads below assume a little endian CPU, like every NaCl target.
+inline uint32_t load32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t load64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint32_t loadBigEndian32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+inline uint32_t rotateRight32(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+inline uint64_t rotateLeft64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// SHA-256 as in FIPS 180-4.
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+class Sha256Hasher : public Hasher {
+ public:
+  Sha256Hasher() : bufferedBytes(0), totalBytes(0) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+    memcpy(this->state, initial, sizeof(this->state));
+  }
+
+  virtual void Update(const uint8_t* data, size_t length) {
+    this->totalBytes += length;
+    if (this->bufferedBytes > 0) {
+      size_t count =
+          std::min(length, sizeof(this->buffer) - this->bufferedBytes);
+      memcpy(this->buffer + this->bufferedBytes, data, count);
+      this->bufferedBytes += count;
+      data += count;
+      length -= count;
+      if (this->bufferedBytes < sizeof(this->buffer)) {
+        return;
+      }
+
+      this->compress(this->buffer);
+      this->bufferedBytes = 0;
+    }
+
+    for (; length >= sizeof(this->buffer); length -= sizeof(this->buffer)) {
+      this->compress(data);
+      data += sizeof(this->buffer);
+    }
+
+    memcpy(this->buffer, data, length);
+    this->bufferedBytes = length;
+  }
+
+  virtual std::string HexDigest() {
+    uint64_t totalBits = this->totalBytes * 8;
+    uint8_t padding[sizeof(this->buffer) + 8] = {0x80};
+    size_t paddingBytes = (this->bufferedBytes < 56 ? 56 : 120) -
+                          this->bufferedBytes;
+    for (int i = 0; i < 8; i++) {
+      padding[paddingBytes + i] =
+          static_cast<uint8_t>(totalBits >> ((7 - i) * 8));
+    }
+
+    this->Update(padding, paddingBytes + 8);
+
+    uint8_t digest[32];
+    for (int i = 0; i < 8; i++) {
+      digest[i * 4] = static_cast<uint8_t>(this->state[i] >> 24);
+      digest[i * 4 + 1] = static_cast<uint8_t>(this->state[i] >> 16);
+      digest[i * 4 + 2] = static_cast<uint8_t>(this->state[i] >> 8);
+      digest[i * 4 + 3] = static_cast<uint8_t>(this->state[i]);
+    }
+
+    return toHex(digest, sizeof(digest));
+  }
+
+ private:
+  void compress(const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = loadBigEndian32(block + i * 4);
+    }
+
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotateRight32(w[i - 15], 7) ^
+                    rotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotateRight32(w[i - 2], 17) ^
+                    rotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = this->state[0];
+    uint32_t b = this->state[1];
+    uint32_t c = this->state[2];
+    uint32_t d = this->state[3];
+    uint32_t e = this->state[4];
+    uint32_t f = this->state[5];
+    uint32_t g = this->state[6];
+    uint32_t h = this->state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotateRight32(e, 6) ^ rotateRight32(e, 11) ^
+                    rotateRight32(e, 25);
+      uint32_t choose = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + choose + SHA256_K[i] + w[i];
+      uint32_t s0 = rotateRight32(a, 2) ^ rotateRight32(a, 13) ^
+                    rotateRight32(a, 22);
+      uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    this->state[0] += a;
+    this->state[1] += b;
+    this->state[2] += c;
+    this->state[3] += d;
+    this->state[4] += e;
+    this->state[5] += f;
+    this->state[6] += g;
+    this->state[7] += h;
+  }
+
+  uint32_t state[8];
+  uint8_t buffer[64];
+  size_t bufferedBytes;
+  uint64_t totalBytes;
+};
+
+// CRC32C (Castagnoli). CPUs with SSE4.2 have an instruction for it that
+// does 8 bytes at a time, otherwise slicing-by-8 tables are used. The
+// choice is made once, the first time a hasher is created.
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const uint8_t* data,
+                                   size_t length);
+
+const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;
+
+pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+uint32_t crc32cTable[8][256];
+Crc32cFunction crc32cUpdate = NULL;
+const char* crc32cKernel = "";
+
+uint32_t crc32cTables(uint32_t crc, const uint8_t* data, size_t length) {
+  for (; length > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0;
+       length--) {
+    crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+
+  for (; length >= 8; length -= 8) {
+    uint32_t low = crc ^ load32(data);
+    uint32_t high = load32(data + 4);
+    crc = crc32cTable[7][low & 0xff] ^ crc32cTable[6][(low >> 8) & 0xff] ^
+          crc32cTable[5][(low >> 16) & 0xff] ^ crc32cTable[4][low >> 24] ^
+          crc32cTable[3][high & 0xff] ^ crc32cTable[2][(high >> 8) & 0xff] ^
+          crc32cTable[1][(high >> 16) & 0xff] ^ crc32cTable[0][high >> 24];
+    data += 8;
+  }
+
+  for (; length > 0; length--) {
+    crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#if defined(NACL_FILE_HASH_X86)
+// Only register operands are used so the NaCl x86-64 sandbox has no memory
+// references in the asm to rewrite.
+uint32_t crc32cSse42(uint32_t crc, const uint8_t* data, size_t length) {
+  for (; length > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0;
+       length--) {
+    uint32_t byte = *data++;
+    __asm__("crc32b %b1, %0" : "+r"(crc) : "r"(byte));
+  }
+
+#if defined(__x86_64__)
+  uint64_t wide = crc;
+  for (; length >= 8; length -= 8) {
+    uint64_t word = load64(data);
+    __asm__("crc32q %1, %0" : "+r"(wide) : "r"(word));
+    data += 8;
+  }
+  crc = static_cast<uint32_t>(wide);
+#endif
+
+  for (; length >= 4; length -= 4) {
+    uint32_t word = load32(data);
+    __asm__("crc32l %1, %0" : "+r"(crc) : "r"(word));
+    data += 4;
+  }
+
+  for (; length > 0; length--) {
+    uint32_t byte = *data++;
+    __asm__("crc32b %b1, %0" : "+r"(crc) : "r"(byte));
+  }
+
+  return crc;
+}
+
+bool cpuHasSse42() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0 &&
+         (ecx & (1 << 20)) != 0;
+}
+#endif
+
+void initCrc32c() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) != 0 ? CRC32C_POLYNOMIAL : 0);
+    }
+    crc32cTable[0][i] = crc;
+  }
+
+  for (int slice = 1; slice < 8; slice++) {
+    for (int i = 0; i < 256; i++) {
+      uint32_t previous = crc32cTable[slice - 1][i];
+      crc32cTable[slice][i] =
+          (previous >> 8) ^ crc32cTable[0][previous & 0xff];
+    }
+  }
+
+  crc32cUpdate = crc32cTables;
+  crc32cKernel = "tables";
+#if defined(NACL_FILE_HASH_X86)
+  if (cpuHasSse42()) {
+    crc32cUpdate = crc32cSse42;
+    crc32cKernel = "sse4.2";
+  }
+#endif
+}
+
+class Crc32cHasher : public Hasher {
+ public:
+  Crc32cHasher() : crc(0xffffffff) { pthread_once(&crc32cOnce, initCrc32c); }
+
+  virtual void Update(const uint8_t* data, size_t length) {
+    this->crc = crc32cUpdate(this->crc, data, length);
+  }
+
+  virtual std::string HexDigest() { return toHex(~this->crc, 4); }
+
+ private:
+  uint32_t crc;
+};
+
+// XXH64 with a zero seed. The four lanes are independent so the compiler
+// keeps them in flight together; it runs well past network speed without
+// vector code.
+const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+inline uint64_t xxhRound(uint64_t accumulator, uint64_t input) {
+  accumulator += input * XXH_PRIME2;
+  return rotateLeft64(accumulator, 31) * XXH_PRIME1;
+}
+
+inline uint64_t xxhMerge(uint64_t hash, uint64_t lane) {
+  hash ^= xxhRound(0, lane);
+  return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+class Xxh64Hasher : public Hasher {
+ public:
+  Xxh64Hasher() : bufferedBytes(0), totalBytes(0) {
+    this->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    this->lanes[1] = XXH_PRIME2;
+    this->lanes[2] = 0;
+    this->lanes[3] = -XXH_PRIME1;
+  }
+
+  virtual void Update(const uint8_t* data, size_t length) {
+    this->totalBytes += length;
+    if (this->bufferedBytes > 0) {
+      size_t count =
+          std::min(length, sizeof(this->buffer) - this->bufferedBytes);
+      memcpy(this->buffer + this->bufferedBytes, data, count);
+      this->bufferedBytes += count;
+      data += count;
+      length -= count;
+      if (this->bufferedBytes < sizeof(this->buffer)) {
+        return;
+      }
+
+      this->consume(this->buffer, sizeof(this->buffer));
+      this->bufferedBytes = 0;
+    }
+
+    size_t whole = length - length % sizeof(this->buffer);
+    this->consume(data, whole);
+    memcpy(this->buffer, data + whole, length - whole);
+    this->bufferedBytes = length - whole;
+  }
+
+  virtual std::string HexDigest() { return toHex(this->Digest(), 8); }
+
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (this->totalBytes >= sizeof(this->buffer)) {
+      hash = rotateLeft64(this->lanes[0], 1) +
+             rotateLeft64(this->lanes[1], 7) +
+             rotateLeft64(this->lanes[2], 12) +
+             rotateLeft64(this->lanes[3], 18);
+      for (int i = 0; i < 4; i++) {
+        hash = xxhMerge(hash, this->lanes[i]);
+      }
+    } else {
+      hash = XXH_PRIME5;
+    }
+
+    hash += this->totalBytes;
+
+    const uint8_t* p = this->buffer;
+    const uint8_t* end = this->buffer + this->bufferedBytes;
+    for (; p + 8 <= end; p += 8) {
+      hash ^= xxhRound(0, load64(p));
+      hash = rotateLeft64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+
+    if (p + 4 <= end) {
+      hash ^= load32(p) * XXH_PRIME1;
+      hash = rotateLeft64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+      p += 4;
+    }
+
+    for (; p < end; p++) {
+      hash ^= *p * XXH_PRIME5;
+      hash = rotateLeft64(hash, 11) * XXH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+ private:
+  void consume(const uint8_t* data, size_t length) {
+    uint64_t lane0 = this->lanes[0];
+    uint64_t lane1 = this->lanes[1];
+    uint64_t lane2 = this->lanes[2];
+    uint64_t lane3 = this->lanes[3];
+    for (const uint8_t* end = data + length; data < end; data += 32) {
+      lane0 = xxhRound(lane0, load64(data));
+      lane1 = xxhRound(lane1, load64(data + 8));
+      lane2 = xxhRound(lane2, load64(data + 16));
+      lane3 = xxhRound(lane3, load64(data + 24));
+    }
+
+    this->lanes[0] = lane0;
+    this->lanes[1] = lane1;
+    this->lanes[2] = lane2;
+    this->lanes[3] = lane3;
+  }
+
+  uint64_t lanes[4];
+  uint8_t buffer[32];
+  size_t bufferedBytes;
+  uint64_t totalBytes;
+};
+
+}  // namespace
+
+Hasher* Hasher::Create(const std::string& algorithm) {
+  if (algorithm == "sha256") {
+    return new Sha256Hasher();
+  } else if (algorithm == "crc32c") {
+    return new Crc32cHasher();
+  } else if (algorithm == "xxh64") {
+    return new Xxh64Hasher();
+  }
+
+  return NULL;
+}
+
+uint64_t Xxh64(const uint8_t* data, size_t length) {
+  Xxh64Hasher hasher;
+  hasher.Update(data, length);
+  return hasher.Digest();
+}
+
+uint32_t Crc32c(const uint8_t* data, size_t length) {
+  pthread_once(&crc32cOnce, initCrc32c);
+  return ~crc32cUpdate(0xffffffff, data, length);
+}
+
+bool Hasher::IsSupported(const std::string& algorithm) {
+  return algorithm == "sha256" || algorithm == "crc32c" ||
+         algorithm == "xxh64";
+}
+
+const char* Hasher::Crc32cKernel() {
+  pthread_once(&crc32cOnce, initCrc32c);
+  return crc32cKernel;
+}
+
+void HashFileTask::Run(SMBCCTX* context) {
+  Hasher* hasher = Hasher::Create(this->algorithm);
+  if (hasher == NULL) {
+    this->error = EINVAL;
+    return;
+  }
+
+  SMBCFILE* file = smbc_getFunctionOpen(context)(
+      context, this->fullPath.c_str(), O_RDONLY, 0);
+  if (file == NULL) {
+    this->error = errno;
+    delete hasher;
+    return;
+  }
+
+  smbc_read_fn readFn = smbc_getFunctionRead(context);
+  std::vector<uint8_t> chunk(HASH_CHUNK_BYTES);
+  for (;;) {
+    ssize_t count = readFn(context, file, &chunk[0], chunk.size());
+    if (count < 0) {
+      this->error = errno;
+      break;
+    } else if (count == 0) {
+      this->digest = hasher->HexDigest();
+      break;
+    }
+
+    hasher->Update(&chunk[0], count);
+    this->size += count;
+  }
+
+  smbc_getFunctionClose(context)(context, file);
+  delete hasher;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,70 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_FILE_HASH_H_
+#define NACL_FILE_HASH_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "SmbWorkerPool.h"
+
+namespace NaclFsp {
+
+// Incremental digest of a stream of bytes. Only used from one thread.
+class Hasher {
+ public:
+  virtual ~Hasher() {}
+
+  virtual void Update(const uint8_t* data, size_t length) = 0;
+
+  // Lower case hex of the digest. The checksums are written most
+  // significant byte first, the way their reference tools print them.
+  virtual std::string HexDigest() = 0;
+
+  // Returns NULL for an unknown algorithm. The names are "sha256",
+  // "crc32c" and "xxh64".
+  static Hasher* Create(const std::string& algorithm);
+  static bool IsSupported(const std::string& algorithm);
+
+  // Names the CRC32C implementation picked for this CPU, for the stats.
+  static const char* Crc32cKernel();
+};
+
+// One shot forms of two of the above, for hashing blocks of a file.
+uint64_t Xxh64(const uint8_t* data, size_t length);
+uint32_t Crc32c(const uint8_t* data, size_t length);
+
+// Reads one file start to end on a worker thread and hashes it. Only the
+// digest comes back, the data never leaves the worker.
+class HashFileTask : public SmbTask {
+ public:
+  HashFileTask(size_t index, const std::string& fullPath,
+               const std::string& algorithm)
+      : index(index), fullPath(fullPath), algorithm(algorithm), size(0) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  // Position of the file in the batch.
+  size_t index;
+  std::string fullPath;
+  std::string algorithm;
+  std::string digest;
+  double size;
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_FILE_HASH_H_
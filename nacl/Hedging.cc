@@ -0,0 +1,148 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Hedging.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+namespace {
+
+// Latencies the delay is picked from, and how many have to be seen first.
+const size_t LATENCY_WINDOW = 256;
+const size_t MIN_SAMPLES = 32;
+// The percentile is only worked out again after this many new latencies.
+const size_t UPDATE_INTERVAL = 16;
+// A hedge sooner than this would mostly race a reply that is on its way.
+const uint64_t MIN_DELAY_MICROS = 5000;
+// Unused hedges are only saved up to this many so a quiet spell can't
+// turn into a burst of hedges.
+const double MAX_BUDGET = 5;
+
+}  // namespace
+
+HedgePolicy::HedgePolicy(double percentile, double maxHedgeFraction)
+    : percentile(percentile),
+      maxHedgeFraction(maxHedgeFraction),
+      budget(0),
+      nextSample(0),
+      samplesSinceUpdate(0),
+      delayMicros(0),
+      requestCount(0),
+      hedgeCount(0),
+      winCount(0),
+      skippedCount(0) {
+  this->samples.reserve(LATENCY_WINDOW);
+}
+
+uint64_t HedgePolicy::DelayMicros() {
+  if (this->samples.size() < MIN_SAMPLES) {
+    return 0;
+  }
+
+  if (this->delayMicros == 0 || this->samplesSinceUpdate >= UPDATE_INTERVAL) {
+    this->updateDelay();
+  }
+
+  return this->delayMicros;
+}
+
+void HedgePolicy::AddRequest() {
+  this->requestCount++;
+  this->budget = std::min(this->budget + this->maxHedgeFraction, MAX_BUDGET);
+}
+
+bool HedgePolicy::TakeHedge() {
+  if (this->budget < 1) {
+    this->skippedCount++;
+    return false;
+  }
+
+  this->budget -= 1;
+  this->hedgeCount++;
+  return true;
+}
+
+void HedgePolicy::RecordReply(uint64_t micros, bool hedgeWon) {
+  if (hedgeWon) {
+    this->winCount++;
+  }
+
+  if (this->samples.size() < LATENCY_WINDOW) {
+    this->samples.push_back(micros);
+  } else {
+    this->samples[this->nextSample] = micros;
+    this->nextSample = (this->nextSample + 1) % LATENCY_WINDOW;
+  }
+  this->samplesSinceUpdate++;
+}
+
+void HedgePolicy::updateDelay() {
+  std::vector<uint64_t> sorted(this->samples);
+  size_t index = std::min(
+      static_cast<size_t>(this->percentile * sorted.size()), sorted.size() - 1);
+  std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+  this->delayMicros = std::max(sorted[index], MIN_DELAY_MICROS);
+  this->samplesSinceUpdate = 0;
+}
+
+SmbTask* RunHedged(SmbWorkerPool* pool, HedgePolicy* policy, SmbTask* primary,
+                   SmbTask* hedge, uint64_t timeoutMicros) {
+  uint64_t startMicros = Util::monotonicMicros();
+  uint64_t deadlineMicros = startMicros + timeoutMicros;
+  policy->AddRequest();
+  pool->Submit(primary);
+
+  // Nothing else is running on the pool while a request is handled so the
+  // next task to complete is one of these two.
+  SmbTask* first = NULL;
+  bool hedged = false;
+  uint64_t delayMicros = policy->DelayMicros();
+  if (delayMicros > 0 && delayMicros < timeoutMicros) {
+    first = pool->WaitForCompleted(startMicros + delayMicros);
+    if (first == NULL && policy->TakeHedge()) {
+      pool->Submit(hedge);
+      hedged = true;
+    }
+  }
+
+  if (!hedged) {
+    delete hedge;
+  }
+
+  if (first == NULL) {
+    first = pool->WaitForCompleted(deadlineMicros);
+  }
+
+  if (first == NULL) {
+    pool->Abandon(primary);
+    if (hedged) {
+      pool->Abandon(hedge);
+    }
+    return NULL;
+  }
+
+  if (hedged) {
+    pool->Abandon(first == primary ? hedge : primary);
+  }
+
+  policy->RecordReply(Util::monotonicMicros() - startMicros, first == hedge);
+  return first;
+}
+
+}  // namespace NaclFsp
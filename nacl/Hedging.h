@@ -0,0 +1,92 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_HEDGING_H_
+#define NACL_HEDGING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "SmbWorkerPool.h"
+
+namespace NaclFsp {
+
+// Decides when a request on the worker pool has been slow enough to be
+// worth sending again on another connection. The hedge goes out once the
+// primary has taken longer than a high percentile of recent latencies, so
+// only the stragglers are hedged, and a budget that refills by a fraction
+// of a hedge per request caps hedges to that share of the traffic. No hedge
+// is sent until enough latencies have been seen to pick the delay.
+//
+// Only used from the thread handling messages.
+class HedgePolicy {
+ public:
+  // |percentile| is between 0 and 1.
+  HedgePolicy(double percentile, double maxHedgeFraction);
+
+  // How long to wait for the primary before hedging, or zero for no hedge.
+  uint64_t DelayMicros();
+
+  // Counts a request and adds its share to the hedge budget.
+  void AddRequest();
+
+  // Takes one hedge from the budget. Returns false when it is used up.
+  bool TakeHedge();
+
+  // Called with the time to the first reply of every request.
+  void RecordReply(uint64_t micros, bool hedgeWon);
+
+  uint64_t requests() const { return this->requestCount; }
+  uint64_t hedgesSent() const { return this->hedgeCount; }
+  uint64_t hedgeWins() const { return this->winCount; }
+  // Hedges that were due but over the budget.
+  uint64_t hedgesSkipped() const { return this->skippedCount; }
+  uint64_t currentDelayMicros() const { return this->delayMicros; }
+
+ private:
+  double percentile;
+  double maxHedgeFraction;
+  double budget;
+
+  // The most recent latencies, used as a ring.
+  std::vector<uint64_t> samples;
+  size_t nextSample;
+  size_t samplesSinceUpdate;
+  uint64_t delayMicros;
+
+  uint64_t requestCount;
+  uint64_t hedgeCount;
+  uint64_t winCount;
+  uint64_t skippedCount;
+
+  void updateDelay();
+
+  // Prevent copy and assignment.
+  HedgePolicy(const HedgePolicy&);
+  HedgePolicy& operator=(const HedgePolicy&);
+};
+
+// Runs |primary| on |pool|. If it hasn't finished within the policy's delay
+// and the budget allows, |hedge|, which must do the same thing, is run too
+// and whichever finishes first is returned. The other one is abandoned.
+// Returns NULL when neither finished within timeoutMicros. Takes ownership
+// of both tasks; the caller owns the one returned.
+SmbTask* RunHedged(SmbWorkerPool* pool, HedgePolicy* policy, SmbTask* primary,
+                   SmbTask* hedge, uint64_t timeoutMicros);
+
+}  // namespace NaclFsp
+
+#endif  // NACL_HEDGING_H_
@@ -13,6 +13,9 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#ifndef NACL_INACL_FSP_H_
+#define NACL_INACL_FSP_H_
+
 #include <string>
 
 #include "Options.h"
@@ -51,8 +54,9 @@ class INaclFsp {
   virtual void HandleMessage(pp::Var var_message) = 0;
 
  protected:
-  virtual void handleCustomMessage(const std::string& functionName,
-                                   const pp::VarArray& args,
+  // Returns true if the results were already streamed with sendMessage.
+  virtual bool handleCustomMessage(const std::string& functionName,
+                                   const pp::VarArray& args, int messageId,
                                    pp::VarDictionary* result) = 0;
 
   // API Methods
@@ -89,3 +93,5 @@ class INaclFsp {
                          pp::VarDictionary* result) = 0;
 };
 }
+
+#endif  // NACL_INACL_FSP_H_
@@ -0,0 +1,472 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Inflate.h"
+
+#include <string.h>
+#include <vector>
+
+namespace NaclFsp {
+
+namespace {
+
+const int MAX_CODE_BITS = 15;
+// Codes up to this long are decoded with one table lookup. Longer ones
+// are rare and walk the canonical code instead.
+const int FAST_BITS = 9;
+const size_t WINDOW_BYTES = 32 * 1024;
+const size_t OUTPUT_BYTES = 4 * WINDOW_BYTES;
+const size_t INPUT_BYTES = 64 * 1024;
+
+const uint16_t LENGTH_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                  1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                  4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DISTANCE_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,
+                                    4, 4, 5, 5, 6, 6, 7, 7,  8,  8,
+                                    9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                       11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+// A canonical Huffman code. |fast| maps the next FAST_BITS bits of input
+// to (length << 9) | symbol, or 0 when the code is longer.
+class HuffmanCode {
+ public:
+  bool Build(const uint8_t* lengths, int count);
+
+  uint16_t fast[1 << FAST_BITS];
+  uint16_t counts[MAX_CODE_BITS + 1];
+  uint16_t symbols[288];
+};
+
+bool HuffmanCode::Build(const uint8_t* lengths, int count) {
+  memset(this->counts, 0, sizeof(this->counts));
+  for (int i = 0; i < count; i++) {
+    this->counts[lengths[i]]++;
+  }
+  this->counts[0] = 0;
+
+  // Over-subscribed codes are invalid. Incomplete ones are allowed since a
+  // distance code can have a single symbol.
+  int left = 1;
+  for (int length = 1; length <= MAX_CODE_BITS; length++) {
+    left = (left << 1) - this->counts[length];
+    if (left < 0) {
+      return false;
+    }
+  }
+
+  uint16_t offsets[MAX_CODE_BITS + 1];
+  offsets[1] = 0;
+  for (int length = 1; length < MAX_CODE_BITS; length++) {
+    offsets[length + 1] = offsets[length] + this->counts[length];
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (lengths[i] != 0) {
+      this->symbols[offsets[lengths[i]]++] = i;
+    }
+  }
+
+  // Input bits arrive least significant first, so the table is indexed by
+  // each short code bit reversed.
+  memset(this->fast, 0, sizeof(this->fast));
+  int code = 0;
+  int index = 0;
+  for (int length = 1; length <= FAST_BITS; length++) {
+    for (int i = 0; i < this->counts[length]; i++, index++, code++) {
+      int reversed = 0;
+      for (int bit = 0; bit < length; bit++) {
+        reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+      }
+
+      for (int slot = reversed; slot < (1 << FAST_BITS);
+           slot += 1 << length) {
+        this->fast[slot] = (length << 9) | this->symbols[index];
+      }
+    }
+    code <<= 1;
+  }
+
+  return true;
+}
+
+class Inflater {
+ public:
+  Inflater(InflateSource* source, InflateSink* sink)
+      : source(source),
+        sink(sink),
+        input(INPUT_BYTES),
+        inputPosition(0),
+        inputEnd(0),
+        bitBuffer(0),
+        bitCount(0),
+        paddingBits(0),
+        readFailed(false),
+        output(OUTPUT_BYTES),
+        outputPosition(0),
+        flushedPosition(0) {}
+
+  InflateResult Run();
+
+ private:
+  // Each step returns false with |result| set when inflating has to stop.
+  bool storedBlock();
+  bool fixedCodes(HuffmanCode* literals, HuffmanCode* distances);
+  bool dynamicCodes(HuffmanCode* literals, HuffmanCode* distances);
+  bool codedBlock(const HuffmanCode& literals, const HuffmanCode& distances);
+
+  bool put(uint8_t byte) {
+    this->output[this->outputPosition++] = byte;
+    return this->outputPosition < OUTPUT_BYTES || this->flush(true);
+  }
+
+  bool flush(bool keepWindow);
+
+  uint8_t nextByte();
+
+  void refill() {
+    while (this->bitCount <= 56) {
+      this->bitBuffer |= static_cast<uint64_t>(this->nextByte())
+                         << this->bitCount;
+      this->bitCount += 8;
+    }
+  }
+
+  // Running into the zeros added after the end of the input means the
+  // stream was cut short.
+  bool consume(int count) {
+    this->bitBuffer >>= count;
+    this->bitCount -= count;
+    if (this->bitCount < this->paddingBits) {
+      this->result = this->readFailed ? INFLATE_READ_FAILED : INFLATE_BAD_DATA;
+      return false;
+    }
+    return true;
+  }
+
+  bool bits(int count, uint32_t* value) {
+    this->refill();
+    *value = static_cast<uint32_t>(this->bitBuffer & ((1u << count) - 1));
+    return this->consume(count);
+  }
+
+  bool decode(const HuffmanCode& code, int* symbol);
+
+  InflateSource* source;
+  InflateSink* sink;
+  InflateResult result;
+
+  std::vector<uint8_t> input;
+  size_t inputPosition;
+  size_t inputEnd;
+  uint64_t bitBuffer;
+  int bitCount;
+  int paddingBits;
+  bool readFailed;
+
+  // Holds at least the last WINDOW_BYTES of output for back references.
+  std::vector<uint8_t> output;
+  size_t outputPosition;
+  size_t flushedPosition;
+};
+
+uint8_t Inflater::nextByte() {
+  if (this->inputPosition == this->inputEnd && !this->readFailed &&
+      this->paddingBits == 0) {
+    ssize_t count = this->source->Read(&this->input[0], this->input.size());
+    this->readFailed = count < 0;
+    this->inputPosition = 0;
+    this->inputEnd = count > 0 ? count : 0;
+  }
+
+  if (this->inputPosition == this->inputEnd) {
+    this->paddingBits += 8;
+    return 0;
+  }
+
+  return this->input[this->inputPosition++];
+}
+
+bool Inflater::flush(bool keepWindow) {
+  if (this->outputPosition > this->flushedPosition &&
+      !this->sink->Write(&this->output[this->flushedPosition],
+                         this->outputPosition - this->flushedPosition)) {
+    this->result = INFLATE_STOPPED;
+    return false;
+  }
+
+  this->flushedPosition = this->outputPosition;
+  if (keepWindow && this->outputPosition > WINDOW_BYTES) {
+    memmove(&this->output[0],
+            &this->output[this->outputPosition - WINDOW_BYTES], WINDOW_BYTES);
+    this->outputPosition = WINDOW_BYTES;
+    this->flushedPosition = WINDOW_BYTES;
+  }
+
+  return true;
+}
+
+bool Inflater::decode(const HuffmanCode& code, int* symbol) {
+  this->refill();
+  uint16_t entry = code.fast[this->bitBuffer & ((1 << FAST_BITS) - 1)];
+  if (entry != 0) {
+    *symbol = entry & 0x1ff;
+    return this->consume(entry >> 9);
+  }
+
+  // Walks the code one bit at a time, as in zlib's puff.c.
+  int value = 0;
+  int first = 0;
+  int index = 0;
+  for (int length = 1; length <= MAX_CODE_BITS; length++) {
+    value |= static_cast<int>((this->bitBuffer >> (length - 1)) & 1);
+    int count = code.counts[length];
+    if (value - count < first) {
+      *symbol = code.symbols[index + (value - first)];
+      return this->consume(length);
+    }
+
+    index += count;
+    first = (first + count) << 1;
+    value <<= 1;
+  }
+
+  this->result = INFLATE_BAD_DATA;
+  return false;
+}
+
+bool Inflater::storedBlock() {
+  uint32_t skipped;
+  uint32_t length;
+  uint32_t complement;
+  if (!this->bits(this->bitCount % 8, &skipped) ||
+      !this->bits(16, &length) || !this->bits(16, &complement)) {
+    return false;
+  }
+
+  if (length != (~complement & 0xffff)) {
+    this->result = INFLATE_BAD_DATA;
+    return false;
+  }
+
+  for (uint32_t i = 0; i < length; i++) {
+    uint32_t byte;
+    if (!this->bits(8, &byte) || !this->put(static_cast<uint8_t>(byte))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Inflater::fixedCodes(HuffmanCode* literals, HuffmanCode* distances) {
+  uint8_t lengths[288];
+  memset(lengths, 8, 144);
+  memset(lengths + 144, 9, 112);
+  memset(lengths + 256, 7, 24);
+  memset(lengths + 280, 8, 8);
+  literals->Build(lengths, 288);
+
+  memset(lengths, 5, 30);
+  distances->Build(lengths, 30);
+  return true;
+}
+
+bool Inflater::dynamicCodes(HuffmanCode* literals, HuffmanCode* distances) {
+  uint32_t literalCount;
+  uint32_t distanceCount;
+  uint32_t codeLengthCount;
+  if (!this->bits(5, &literalCount) || !this->bits(5, &distanceCount) ||
+      !this->bits(4, &codeLengthCount)) {
+    return false;
+  }
+
+  literalCount += 257;
+  distanceCount += 1;
+  codeLengthCount += 4;
+  if (literalCount > 286 || distanceCount > 30) {
+    this->result = INFLATE_BAD_DATA;
+    return false;
+  }
+
+  uint8_t lengths[286 + 30];
+  memset(lengths, 0, 19);
+  for (uint32_t i = 0; i < codeLengthCount; i++) {
+    uint32_t length;
+    if (!this->bits(3, &length)) {
+      return false;
+    }
+    lengths[CODE_LENGTH_ORDER[i]] = length;
+  }
+
+  HuffmanCode lengthCode;
+  if (!lengthCode.Build(lengths, 19)) {
+    this->result = INFLATE_BAD_DATA;
+    return false;
+  }
+
+  uint32_t total = literalCount + distanceCount;
+  for (uint32_t i = 0; i < total;) {
+    int symbol;
+    if (!this->decode(lengthCode, &symbol)) {
+      return false;
+    }
+
+    if (symbol < 16) {
+      lengths[i++] = symbol;
+      continue;
+    }
+
+    uint8_t repeated = 0;
+    uint32_t repeat;
+    bool ok;
+    if (symbol == 16) {
+      if (i == 0) {
+        this->result = INFLATE_BAD_DATA;
+        return false;
+      }
+      repeated = lengths[i - 1];
+      ok = this->bits(2, &repeat);
+      repeat += 3;
+    } else if (symbol == 17) {
+      ok = this->bits(3, &repeat);
+      repeat += 3;
+    } else {
+      ok = this->bits(7, &repeat);
+      repeat += 11;
+    }
+
+    if (!ok) {
+      return false;
+    } else if (i + repeat > total) {
+      this->result = INFLATE_BAD_DATA;
+      return false;
+    }
+
+    memset(lengths + i, repeated, repeat);
+    i += repeat;
+  }
+
+  // A block has to be able to end.
+  if (lengths[256] == 0 || !literals->Build(lengths, literalCount) ||
+      !distances->Build(lengths + literalCount, distanceCount)) {
+    this->result = INFLATE_BAD_DATA;
+    return false;
+  }
+
+  return true;
+}
+
+bool Inflater::codedBlock(const HuffmanCode& literals,
+                          const HuffmanCode& distances) {
+  for (;;) {
+    int symbol;
+    if (!this->decode(literals, &symbol)) {
+      return false;
+    }
+
+    if (symbol < 256) {
+      if (!this->put(static_cast<uint8_t>(symbol))) {
+        return false;
+      }
+      continue;
+    } else if (symbol == 256) {
+      return true;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) {
+      this->result = INFLATE_BAD_DATA;
+      return false;
+    }
+
+    uint32_t length;
+    if (!this->bits(LENGTH_EXTRA[symbol], &length)) {
+      return false;
+    }
+    length += LENGTH_BASE[symbol];
+
+    uint32_t distance;
+    if (!this->decode(distances, &symbol)) {
+      return false;
+    } else if (symbol >= 30) {
+      this->result = INFLATE_BAD_DATA;
+      return false;
+    } else if (!this->bits(DISTANCE_EXTRA[symbol], &distance)) {
+      return false;
+    }
+    distance += DISTANCE_BASE[symbol];
+
+    if (distance > this->outputPosition) {
+      this->result = INFLATE_BAD_DATA;
+      return false;
+    }
+
+    // The copy can overlap what it writes so it goes a byte at a time.
+    for (uint32_t i = 0; i < length; i++) {
+      if (!this->put(this->output[this->outputPosition - distance])) {
+        return false;
+      }
+    }
+  }
+}
+
+InflateResult Inflater::Run() {
+  HuffmanCode literals;
+  HuffmanCode distances;
+  uint32_t last = 0;
+  while (last == 0) {
+    uint32_t type;
+    if (!this->bits(1, &last) || !this->bits(2, &type)) {
+      return this->result;
+    }
+
+    bool ok;
+    if (type == 0) {
+      ok = this->storedBlock();
+    } else if (type == 1) {
+      ok = this->fixedCodes(&literals, &distances) &&
+           this->codedBlock(literals, distances);
+    } else if (type == 2) {
+      ok = this->dynamicCodes(&literals, &distances) &&
+           this->codedBlock(literals, distances);
+    } else {
+      this->result = INFLATE_BAD_DATA;
+      ok = false;
+    }
+
+    if (!ok) {
+      return this->result;
+    }
+  }
+
+  return this->flush(false) ? INFLATE_DONE : this->result;
+}
+
+}  // namespace
+
+InflateResult Inflate(InflateSource* source, InflateSink* sink) {
+  Inflater inflater(source, sink);
+  return inflater.Run();
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,55 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_INFLATE_H_
+#define NACL_INFLATE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace NaclFsp {
+
+// Supplies compressed bytes to Inflate.
+class InflateSource {
+ public:
+  virtual ~InflateSource() {}
+
+  // Returns the number of bytes put in |buffer|, 0 at the end or -1 on
+  // error.
+  virtual ssize_t Read(uint8_t* buffer, size_t length) = 0;
+};
+
+// Takes the bytes Inflate produces. Returning false stops it.
+class InflateSink {
+ public:
+  virtual ~InflateSink() {}
+  virtual bool Write(const uint8_t* data, size_t length) = 0;
+};
+
+enum InflateResult {
+  INFLATE_DONE,
+  INFLATE_STOPPED,
+  INFLATE_BAD_DATA,
+  INFLATE_READ_FAILED
+};
+
+// Decompresses a raw DEFLATE stream (RFC 1951), as stored in zip files,
+// from |source| to |sink|. Only the 32KB window is kept in memory so
+// members of any size can be streamed.
+InflateResult Inflate(InflateSource* source, InflateSink* sink);
+
+}  // namespace NaclFsp
+
+#endif  // NACL_INFLATE_H_
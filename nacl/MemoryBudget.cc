@@ -0,0 +1,170 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MemoryBudget.h"
+
+#include <algorithm>
+
+namespace NaclFsp {
+
+const size_t MemoryBudget::kDefaultLimitBytes;
+
+MemoryBudget::Reservation::Reservation(MemoryBudget* budget,
+                                       const std::string& name, size_t bytes)
+    : budget(budget), name(name), bytes(bytes) {
+  this->budget->reserve(this->name, this->bytes);
+}
+
+MemoryBudget::Reservation::~Reservation() {
+  this->budget->release(this->name, this->bytes);
+}
+
+void MemoryBudget::Reservation::Resize(size_t bytes) {
+  if (bytes > this->bytes) {
+    this->budget->reserve(this->name, bytes - this->bytes);
+  } else {
+    this->budget->release(this->name, this->bytes - bytes);
+  }
+
+  this->bytes = bytes;
+}
+
+MemoryBudget::MemoryBudget(size_t limitBytes)
+    : limitBytes(limitBytes),
+      reservedBytes(0),
+      peak(0),
+      trims(0),
+      overLimit(0) {}
+
+void MemoryBudget::SetLimit(size_t limitBytes) {
+  this->limitBytes = limitBytes;
+  this->Enforce();
+}
+
+void MemoryBudget::Register(const std::string& name, MemoryConsumer* consumer,
+                            int priority) {
+  Consumer entry;
+  entry.name = name;
+  entry.consumer = consumer;
+  entry.priority = priority;
+  entry.peakBytes = 0;
+  entry.trimmedBytes = 0;
+
+  // Keeps the order of registration among equal priorities.
+  std::vector<Consumer>::iterator it = this->consumers.begin();
+  while (it != this->consumers.end() && it->priority <= priority) {
+    ++it;
+  }
+
+  this->consumers.insert(it, entry);
+}
+
+void MemoryBudget::Unregister(MemoryConsumer* consumer) {
+  for (size_t i = 0; i < this->consumers.size(); i++) {
+    if (this->consumers[i].consumer == consumer) {
+      this->consumers.erase(this->consumers.begin() + i);
+      return;
+    }
+  }
+}
+
+bool MemoryBudget::Enforce() {
+  size_t total = this->reservedBytes;
+  for (size_t i = 0; i < this->consumers.size(); i++) {
+    Consumer& entry = this->consumers[i];
+    size_t bytes = entry.consumer->MemoryUsage();
+    entry.peakBytes = std::max(entry.peakBytes, bytes);
+    total += bytes;
+  }
+
+  this->peak = std::max(this->peak, total);
+  if (total <= this->limitBytes) {
+    return true;
+  }
+
+  this->trims++;
+  size_t over = total - this->limitBytes;
+  for (size_t i = 0; i < this->consumers.size() && over > 0; i++) {
+    Consumer& entry = this->consumers[i];
+    size_t before = entry.consumer->MemoryUsage();
+    if (before == 0) {
+      continue;
+    }
+
+    entry.consumer->TrimMemory(before > over ? before - over : 0);
+    size_t after = entry.consumer->MemoryUsage();
+    if (after < before) {
+      entry.trimmedBytes += before - after;
+      over -= std::min(before - after, over);
+    }
+  }
+
+  if (over > 0) {
+    this->overLimit++;
+    return false;
+  }
+
+  return true;
+}
+
+size_t MemoryBudget::TotalBytes() const {
+  size_t total = this->reservedBytes;
+  for (size_t i = 0; i < this->consumers.size(); i++) {
+    total += this->consumers[i].consumer->MemoryUsage();
+  }
+
+  return total;
+}
+
+void MemoryBudget::Report(std::vector<Usage>* usage) const {
+  for (size_t i = 0; i < this->consumers.size(); i++) {
+    const Consumer& entry = this->consumers[i];
+    Usage item;
+    item.name = entry.name;
+    item.priority = entry.priority;
+    item.bytes = entry.consumer->MemoryUsage();
+    item.peakBytes = std::max(entry.peakBytes, item.bytes);
+    item.trimmedBytes = entry.trimmedBytes;
+    usage->push_back(item);
+  }
+
+  for (std::map<std::string, Reserved>::const_iterator it =
+           this->reserved.begin();
+       it != this->reserved.end(); ++it) {
+    Usage item;
+    item.name = it->first;
+    item.bytes = it->second.bytes;
+    item.peakBytes = it->second.peakBytes;
+    usage->push_back(item);
+  }
+}
+
+void MemoryBudget::reserve(const std::string& name, size_t bytes) {
+  Reserved& entry = this->reserved[name];
+  entry.bytes += bytes;
+  entry.peakBytes = std::max(entry.peakBytes, entry.bytes);
+  this->reservedBytes += bytes;
+  if (bytes > 0) {
+    this->Enforce();
+  }
+}
+
+void MemoryBudget::release(const std::string& name, size_t bytes) {
+  // The entry is kept so its peak is still reported.
+  this->reserved[name].bytes -= bytes;
+  this->reservedBytes -= bytes;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,151 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_MEMORY_BUDGET_H_
+#define NACL_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace NaclFsp {
+
+// Something holding memory that can be given back, eg. a cache.
+class MemoryConsumer {
+ public:
+  virtual ~MemoryConsumer() {}
+
+  // Roughly how many bytes are held.
+  virtual size_t MemoryUsage() const = 0;
+
+  // Drops what it can, least useful first, until MemoryUsage() is at most
+  // |targetBytes|.
+  virtual void TrimMemory(size_t targetBytes) = 0;
+};
+
+// One limit on the memory of the whole module. Each cache has its own
+// limit as well but those add up to more than a NaCl process can spare, so
+// once the total is over the limit the budget trims the caches, lowest
+// priority first.
+//
+// Buffers that are in use, like a listing that is being streamed, can't be
+// trimmed. They are counted with a Reservation while they are held and
+// make room for themselves by trimming the caches. They are never refused
+// since failing the request would free nothing that the caches couldn't.
+//
+// Consumers are trimmed when a reservation is made and after each request,
+// never in the middle of one, so a pointer into a cache stays valid for
+// the rest of the request that looked it up.
+//
+// Only used from the thread handling messages.
+class MemoryBudget {
+ public:
+  static const size_t kDefaultLimitBytes = 64 * 1024 * 1024;
+
+  // Counts |bytes| under |name| until it is destroyed.
+  class Reservation {
+   public:
+    Reservation(MemoryBudget* budget, const std::string& name, size_t bytes);
+    ~Reservation();
+
+    // Changes the size of the reservation, eg. as a listing grows.
+    void Resize(size_t bytes);
+
+   private:
+    MemoryBudget* budget;
+    std::string name;
+    size_t bytes;
+
+    // Prevent copy and assignment.
+    Reservation(const Reservation&);
+    Reservation& operator=(const Reservation&);
+  };
+
+  class Usage {
+   public:
+    Usage() : priority(-1), bytes(0), peakBytes(0), trimmedBytes(0) {}
+
+    std::string name;
+    // -1 for buffers in use.
+    int priority;
+    size_t bytes;
+    size_t peakBytes;
+    uint64_t trimmedBytes;
+  };
+
+  explicit MemoryBudget(size_t limitBytes);
+
+  void SetLimit(size_t limitBytes);
+  size_t limit() const { return this->limitBytes; }
+
+  // Lower priorities are trimmed first. The consumer must outlive the
+  // budget or be unregistered.
+  void Register(const std::string& name, MemoryConsumer* consumer,
+                int priority);
+  void Unregister(MemoryConsumer* consumer);
+
+  // Trims consumers until the total is within the limit or there is
+  // nothing left to trim. Returns false when it is still over.
+  bool Enforce();
+
+  size_t TotalBytes() const;
+  size_t peakBytes() const { return this->peak; }
+  // Times Enforce had to trim, and times trimming wasn't enough.
+  uint64_t trimCount() const { return this->trims; }
+  uint64_t overLimitCount() const { return this->overLimit; }
+
+  // Consumers in the order they are trimmed followed by the buffers in use.
+  void Report(std::vector<Usage>* usage) const;
+
+ private:
+  class Consumer {
+   public:
+    std::string name;
+    MemoryConsumer* consumer;
+    int priority;
+    size_t peakBytes;
+    uint64_t trimmedBytes;
+  };
+
+  class Reserved {
+   public:
+    Reserved() : bytes(0), peakBytes(0) {}
+
+    size_t bytes;
+    size_t peakBytes;
+  };
+
+  size_t limitBytes;
+  // Sorted by priority.
+  std::vector<Consumer> consumers;
+  std::map<std::string, Reserved> reserved;
+  size_t reservedBytes;
+  size_t peak;
+  uint64_t trims;
+  uint64_t overLimit;
+
+  void reserve(const std::string& name, size_t bytes);
+  void release(const std::string& name, size_t bytes);
+
+  // Prevent copy and assignment.
+  MemoryBudget(const MemoryBudget&);
+  MemoryBudget& operator=(const MemoryBudget&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_MEMORY_BUDGET_H_
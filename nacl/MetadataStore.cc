@@ -0,0 +1,318 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MetadataStore.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "PersistentStorage.h"
+
+namespace NaclFsp {
+
+namespace {
+
+const char MAGIC[] = "NFSPMDC";
+const size_t MAGIC_LENGTH = 7;
+const uint8_t VERSION = 1;
+
+const char STORE_DIRECTORY[] = "metadata";
+
+const uint8_t ENTRY_FLAG_DIRECTORY = 1;
+
+// Anything bigger than this is not a file this class wrote.
+const long MAX_FILE_BYTES = 64 * 1024 * 1024;
+
+std::string hashName(const std::string& name) {
+  // 64 bit FNV-1a, same as the trace path hashing.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < name.size(); i++) {
+    hash ^= static_cast<uint8_t>(name[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return hex;
+}
+
+uint64_t zigZag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unZigZag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void writeVarint(uint64_t value, std::vector<uint8_t>* buffer) {
+  while (value >= 0x80) {
+    buffer->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+
+  buffer->push_back(static_cast<uint8_t>(value));
+}
+
+// Reads from a listing file held in memory. Every read fails once the end
+// is reached so a truncated file is rejected instead of misread.
+class ListingReader {
+ public:
+  explicit ListingReader(const std::vector<uint8_t>& data)
+      : data(data), offset(0) {}
+
+  bool ReadVarint(uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (this->offset >= this->data.size()) {
+        return false;
+      }
+
+      uint8_t byte = this->data[this->offset++];
+      *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  bool ReadBytes(size_t length, const uint8_t** bytes) {
+    if (length > this->data.size() - this->offset) {
+      return false;
+    }
+
+    *bytes = &this->data[this->offset];
+    this->offset += length;
+    return true;
+  }
+
+ private:
+  const std::vector<uint8_t>& data;
+  size_t offset;
+};
+
+bool nameLess(const EntryMetadata* a, const EntryMetadata* b) {
+  return a->name < b->name;
+}
+
+bool readFile(const std::string& path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+
+  bool success = false;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long length = ftell(file);
+    if (length > 0 && length <= MAX_FILE_BYTES &&
+        fseek(file, 0, SEEK_SET) == 0) {
+      data->resize(length);
+      success = fread(&(*data)[0], 1, length, file) ==
+                static_cast<size_t>(length);
+    }
+  }
+
+  fclose(file);
+  return success;
+}
+
+}  // namespace
+
+MetadataStore::MetadataStore()
+    : enabled(true), hits(0), misses(0), saved(0), written(0) {}
+
+void MetadataStore::SetEnabled(bool enabled) { this->enabled = enabled; }
+
+bool MetadataStore::Load(const std::string& mountRoot,
+                         const std::string& directory, int modificationTime,
+                         std::vector<EntryMetadata>* entries) {
+  if (!this->enabled || !this->ensureStorage()) {
+    return false;
+  }
+
+  std::vector<uint8_t> data;
+  std::string path = this->mountPath(mountRoot) + "/" + hashName(directory);
+  if (!readFile(path, &data)) {
+    this->misses++;
+    return false;
+  }
+
+  ListingReader reader(data);
+  const uint8_t* magic;
+  const uint8_t* version;
+  uint64_t savedTime;
+  uint64_t count;
+  if (!reader.ReadBytes(MAGIC_LENGTH, &magic) ||
+      memcmp(magic, MAGIC, MAGIC_LENGTH) != 0 ||
+      !reader.ReadBytes(1, &version) || *version != VERSION ||
+      !reader.ReadVarint(&savedTime) || !reader.ReadVarint(&count) ||
+      unZigZag(savedTime) != modificationTime) {
+    this->misses++;
+    return false;
+  }
+
+  // Each entry takes at least five bytes.
+  if (count > data.size() / 5) {
+    this->misses++;
+    return false;
+  }
+
+  std::vector<EntryMetadata> loaded(count);
+  std::string name;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t sharedLength;
+    uint64_t suffixLength;
+    const uint8_t* suffix;
+    const uint8_t* flags;
+    uint64_t size;
+    uint64_t timeDelta;
+    if (!reader.ReadVarint(&sharedLength) || sharedLength > name.size() ||
+        !reader.ReadVarint(&suffixLength) ||
+        !reader.ReadBytes(suffixLength, &suffix) ||
+        !reader.ReadBytes(1, &flags) || !reader.ReadVarint(&size) ||
+        !reader.ReadVarint(&timeDelta)) {
+      this->misses++;
+      return false;
+    }
+
+    name.resize(sharedLength);
+    name.append(reinterpret_cast<const char*>(suffix), suffixLength);
+
+    EntryMetadata& entry = loaded[i];
+    entry.name = name;
+    entry.fullPath = directory + "/" + name;
+    entry.isDirectory = (*flags & ENTRY_FLAG_DIRECTORY) != 0;
+    entry.size = static_cast<double>(size);
+    entry.modificationTime =
+        static_cast<int>(modificationTime + unZigZag(timeDelta));
+  }
+
+  entries->swap(loaded);
+  this->hits++;
+  return true;
+}
+
+bool MetadataStore::Has(const std::string& mountRoot,
+                        const std::string& directory) {
+  if (!this->enabled || !this->ensureStorage()) {
+    return false;
+  }
+
+  std::string path = this->mountPath(mountRoot) + "/" + hashName(directory);
+  return access(path.c_str(), F_OK) == 0;
+}
+
+void MetadataStore::Save(const std::string& mountRoot,
+                         const std::string& directory, int modificationTime,
+                         const std::vector<EntryMetadata>& entries) {
+  if (!this->enabled || !this->ensureStorage()) {
+    return;
+  }
+
+  std::vector<const EntryMetadata*> sorted(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    sorted[i] = &entries[i];
+  }
+  std::sort(sorted.begin(), sorted.end(), nameLess);
+
+  std::vector<uint8_t> buffer;
+  buffer.reserve(32 + entries.size() * 16);
+  buffer.insert(buffer.end(), MAGIC, MAGIC + MAGIC_LENGTH);
+  buffer.push_back(VERSION);
+  writeVarint(zigZag(modificationTime), &buffer);
+  writeVarint(sorted.size(), &buffer);
+
+  const std::string* previous = NULL;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    const EntryMetadata& entry = *sorted[i];
+    size_t shared = 0;
+    if (previous != NULL) {
+      size_t limit = std::min(previous->size(), entry.name.size());
+      while (shared < limit && (*previous)[shared] == entry.name[shared]) {
+        shared++;
+      }
+    }
+
+    writeVarint(shared, &buffer);
+    writeVarint(entry.name.size() - shared, &buffer);
+    buffer.insert(buffer.end(), entry.name.begin() + shared, entry.name.end());
+    buffer.push_back(entry.isDirectory ? ENTRY_FLAG_DIRECTORY : 0);
+    writeVarint(static_cast<uint64_t>(std::max(entry.size, 0.0)), &buffer);
+    writeVarint(zigZag(static_cast<int64_t>(entry.modificationTime) -
+                       modificationTime),
+                &buffer);
+    previous = &entry.name;
+  }
+
+  // Written to the side and renamed so a reader never sees half a file.
+  std::string path = this->mountPath(mountRoot) + "/" + hashName(directory);
+  std::string tempPath = path + ".tmp";
+  FILE* file = fopen(tempPath.c_str(), "wb");
+  if (file == NULL) {
+    return;
+  }
+
+  bool success = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+  success = fclose(file) == 0 && success;
+  if (!success || rename(tempPath.c_str(), path.c_str()) != 0) {
+    unlink(tempPath.c_str());
+    return;
+  }
+
+  this->saved++;
+  this->written += buffer.size();
+}
+
+void MetadataStore::Forget(const std::string& mountRoot) {
+  if (!this->ensureStorage()) {
+    return;
+  }
+
+  std::string path = PersistentStorage::GetPath(
+      std::string(STORE_DIRECTORY) + "/" + hashName(mountRoot));
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent* dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    std::string name = dirent->d_name;
+    if (name != "." && name != "..") {
+      unlink((path + "/" + name).c_str());
+    }
+  }
+
+  closedir(dir);
+  rmdir(path.c_str());
+}
+
+bool MetadataStore::ensureStorage() {
+  return PersistentStorage::EnsureMounted();
+}
+
+std::string MetadataStore::mountPath(const std::string& mountRoot) {
+  // The trailing slash makes GetPath create the directory.
+  std::string path = PersistentStorage::GetPath(
+      std::string(STORE_DIRECTORY) + "/" + hashName(mountRoot) + "/");
+  return path;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,88 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_METADATA_STORE_H_
+#define NACL_METADATA_STORE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "INaclFsp.h"
+
+namespace NaclFsp {
+
+// Keeps directory listings with their stat info in persistent storage so a
+// folder that was open before the module restarted can be shown without
+// listing and stat()ing it over the network again.
+//
+// Each directory is its own file so only the directories that are opened
+// get loaded. A listing is only used while the directory's modification
+// time matches the one it was saved with, which changes whenever an entry
+// is added, removed or renamed.
+//
+// File layout (integers are unsigned LEB128 varints as in RequestTrace):
+//
+//   Header: "NFSPMDC" <version:1 byte> <zig-zag directory mtime> <count>
+//   Entry:  <shared name prefix length> <suffix length> <suffix bytes>
+//           <flags> <size> <zig-zag mtime - directory mtime>
+//
+// Entries are sorted by name and each name only stores what differs from
+// the one before it, so a large folder costs a few bytes per entry.
+class MetadataStore {
+ public:
+  MetadataStore();
+
+  void SetEnabled(bool enabled);
+  bool IsEnabled() const { return this->enabled; }
+
+  // Fills |entries| from the listing saved for |directory| under the mount
+  // at |mountRoot| if it was saved at |modificationTime|.
+  bool Load(const std::string& mountRoot, const std::string& directory,
+            int modificationTime, std::vector<EntryMetadata>* entries);
+
+  // Says if anything is saved for |directory|, without reading it.
+  bool Has(const std::string& mountRoot, const std::string& directory);
+
+  // Every entry must have stat info.
+  void Save(const std::string& mountRoot, const std::string& directory,
+            int modificationTime, const std::vector<EntryMetadata>& entries);
+
+  // Removes everything saved for a mount.
+  void Forget(const std::string& mountRoot);
+
+  uint64_t loadHits() const { return this->hits; }
+  uint64_t loadMisses() const { return this->misses; }
+  uint64_t listingsSaved() const { return this->saved; }
+  uint64_t bytesSaved() const { return this->written; }
+
+ private:
+  bool enabled;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t saved;
+  uint64_t written;
+
+  bool ensureStorage();
+  std::string mountPath(const std::string& mountRoot);
+
+  // Prevent copy and assignment.
+  MetadataStore(const MetadataStore&);
+  MetadataStore& operator=(const MetadataStore&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_METADATA_STORE_H_
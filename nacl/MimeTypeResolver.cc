@@ -0,0 +1,257 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "MimeTypeResolver.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+
+namespace NaclFsp {
+
+namespace {
+
+class ExtensionMimeType {
+ public:
+  const char* extension;
+  const char* mimeType;
+};
+
+// Must stay sorted by extension since lookups are a binary search.
+const ExtensionMimeType kExtensionMimeTypes[] = {
+    {"3gp", "video/3gpp"},
+    {"7z", "application/x-7z-compressed"},
+    {"aac", "audio/aac"},
+    {"arw", "image/x-sony-arw"},
+    {"avi", "video/x-msvideo"},
+    {"bmp", "image/bmp"},
+    {"bz2", "application/x-bzip2"},
+    {"c", "text/x-c"},
+    {"cc", "text/x-c++"},
+    {"cpp", "text/x-c++"},
+    {"cr2", "image/x-canon-cr2"},
+    {"css", "text/css"},
+    {"csv", "text/csv"},
+    {"dng", "image/x-adobe-dng"},
+    {"doc", "application/msword"},
+    {"docx",
+     "application/vnd.openxmlformats-officedocument."
+     "wordprocessingml.document"},
+    {"eml", "message/rfc822"},
+    {"epub", "application/epub+zip"},
+    {"flac", "audio/flac"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"h", "text/x-c"},
+    {"heic", "image/heic"},
+    {"heif", "image/heif"},
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"ico", "image/x-icon"},
+    {"jpe", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"m4a", "audio/mp4"},
+    {"m4v", "video/mp4"},
+    {"md", "text/markdown"},
+    {"mkv", "video/x-matroska"},
+    {"mov", "video/quicktime"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"nef", "image/x-nikon-nef"},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"oga", "audio/ogg"},
+    {"ogg", "audio/ogg"},
+    {"ogv", "video/ogg"},
+    {"opus", "audio/ogg"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx",
+     "application/vnd.openxmlformats-officedocument."
+     "presentationml.presentation"},
+    {"ps", "application/postscript"},
+    {"py", "text/x-python"},
+    {"rar", "application/x-rar-compressed"},
+    {"rtf", "application/rtf"},
+    {"sh", "application/x-sh"},
+    {"svg", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"tgz", "application/gzip"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"ts", "video/mp2t"},
+    {"txt", "text/plain"},
+    {"wav", "audio/wav"},
+    {"webm", "video/webm"},
+    {"webp", "image/webp"},
+    {"wma", "audio/x-ms-wma"},
+    {"wmv", "video/x-ms-wmv"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx",
+     "application/vnd.openxmlformats-officedocument."
+     "spreadsheetml.sheet"},
+    {"xml", "text/xml"},
+    {"zip", "application/zip"}};
+
+bool extensionLess(const ExtensionMimeType& entry, const char* extension) {
+  return strcmp(entry.extension, extension) < 0;
+}
+
+class MagicNumber {
+ public:
+  size_t offset;
+  const char* bytes;
+  size_t length;
+  const char* mimeType;
+};
+
+#define MAGIC(offset, bytes, mimeType) \
+  { offset, bytes, sizeof(bytes) - 1, mimeType }
+
+// Checked in order so longer signatures go before their prefixes. RIFF and
+// ISO media files are recognised by sniffContainer instead.
+const MagicNumber kMagicNumbers[] = {
+    MAGIC(0, "\x89PNG\r\n\x1a\n", "image/png"),
+    MAGIC(0, "\xff\xd8\xff", "image/jpeg"),
+    MAGIC(0, "GIF87a", "image/gif"),
+    MAGIC(0, "GIF89a", "image/gif"),
+    MAGIC(0, "II*\0", "image/tiff"),
+    MAGIC(0, "MM\0*", "image/tiff"),
+    MAGIC(0, "%PDF-", "application/pdf"),
+    MAGIC(0, "%!PS", "application/postscript"),
+    MAGIC(0, "PK\x03\x04", "application/zip"),
+    MAGIC(0, "\x1f\x8b", "application/gzip"),
+    MAGIC(0, "BZh", "application/x-bzip2"),
+    MAGIC(0, "7z\xbc\xaf\x27\x1c", "application/x-7z-compressed"),
+    MAGIC(0, "Rar!\x1a\x07", "application/x-rar-compressed"),
+    MAGIC(257, "ustar", "application/x-tar"),
+    MAGIC(0, "ID3", "audio/mpeg"),
+    MAGIC(0, "fLaC", "audio/flac"),
+    MAGIC(0, "OggS", "audio/ogg"),
+    MAGIC(0, "\x1a\x45\xdf\xa3", "video/webm"),
+    MAGIC(0, "<?xml", "text/xml"),
+    MAGIC(0, "BM", "image/bmp")};
+
+#undef MAGIC
+
+bool matchesAt(const uint8_t* data, size_t length, size_t offset,
+               const char* bytes, size_t bytesLength) {
+  return offset + bytesLength <= length &&
+         memcmp(data + offset, bytes, bytesLength) == 0;
+}
+
+// RIFF and ISO base media files share a container header and say what they
+// hold a few bytes in.
+std::string sniffContainer(const uint8_t* data, size_t length) {
+  if (matchesAt(data, length, 0, "RIFF", 4)) {
+    if (matchesAt(data, length, 8, "WEBP", 4)) {
+      return "image/webp";
+    } else if (matchesAt(data, length, 8, "WAVE", 4)) {
+      return "audio/wav";
+    } else if (matchesAt(data, length, 8, "AVI ", 4)) {
+      return "video/x-msvideo";
+    }
+
+    return "";
+  }
+
+  if (matchesAt(data, length, 4, "ftyp", 4) && length >= 12) {
+    const char* brand = reinterpret_cast<const char*>(data + 8);
+    if (memcmp(brand, "heic", 4) == 0 || memcmp(brand, "heix", 4) == 0 ||
+        memcmp(brand, "mif1", 4) == 0) {
+      return "image/heic";
+    } else if (memcmp(brand, "qt  ", 4) == 0) {
+      return "video/quicktime";
+    } else if (memcmp(brand, "M4A ", 4) == 0) {
+      return "audio/mp4";
+    } else if (memcmp(brand, "3gp", 3) == 0) {
+      return "video/3gpp";
+    }
+
+    return "video/mp4";
+  }
+
+  return "";
+}
+
+// Same idea as the binary check of most sniffers: text has no control
+// characters other than whitespace and escape. UTF-8 bytes are allowed.
+bool looksLikeText(const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = data[i];
+    if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' &&
+        c != 0x1b) {
+      return false;
+    }
+  }
+
+  return length > 0;
+}
+
+}  // namespace
+
+std::string MimeTypeResolver::FromExtension(const std::string& name) {
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos || dot + 1 == name.size()) {
+    return "";
+  }
+
+  std::string extension = name.substr(dot + 1);
+  for (size_t i = 0; i < extension.size(); i++) {
+    extension[i] = static_cast<char>(tolower(extension[i]));
+  }
+
+  const ExtensionMimeType* begin = kExtensionMimeTypes;
+  const ExtensionMimeType* end =
+      begin + sizeof(kExtensionMimeTypes) / sizeof(kExtensionMimeTypes[0]);
+  const ExtensionMimeType* it =
+      std::lower_bound(begin, end, extension.c_str(), extensionLess);
+  if (it == end || extension != it->extension) {
+    return "";
+  }
+
+  return it->mimeType;
+}
+
+std::string MimeTypeResolver::FromContent(const uint8_t* data,
+                                          size_t length) {
+  size_t count = sizeof(kMagicNumbers) / sizeof(kMagicNumbers[0]);
+  for (size_t i = 0; i < count; i++) {
+    const MagicNumber& magic = kMagicNumbers[i];
+    if (matchesAt(data, length, magic.offset, magic.bytes, magic.length)) {
+      return magic.mimeType;
+    }
+  }
+
+  std::string mimeType = sniffContainer(data, length);
+  if (!mimeType.empty()) {
+    return mimeType;
+  }
+
+  if (looksLikeText(data, length)) {
+    return "text/plain";
+  }
+
+  return "";
+}
+
+}  // namespace NaclFsp
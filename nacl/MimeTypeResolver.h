@@ -0,0 +1,47 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_MIME_TYPE_RESOLVER_H_
+#define NACL_MIME_TYPE_RESOLVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace NaclFsp {
+
+// Works out the MIME type of a file so the app doesn't have to open it.
+// The extension is looked up first since it needs no I/O. Files with an
+// unknown or missing extension can be sniffed from their first bytes.
+class MimeTypeResolver {
+ public:
+  // How much of the start of a file FromContent wants to see.
+  static const size_t SNIFF_BYTES = 512;
+
+  // Returns the MIME type for the extension of |name| or "" if unknown.
+  static std::string FromExtension(const std::string& name);
+
+  // Returns the MIME type recognised from the first bytes of a file or ""
+  // if nothing matched.
+  static std::string FromContent(const uint8_t* data, size_t length);
+
+ private:
+  // Only static methods.
+  MimeTypeResolver();
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_MIME_TYPE_RESOLVER_H_
@@ -0,0 +1,124 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "NamePattern.h"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace NaclFsp {
+
+namespace {
+
+const uint64_t ONES = 0x0101010101010101ULL;
+const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+
+// Sets 0x20 in every byte of |word| that is 'A'-'Z'. Adding to the low
+// seven bits of a byte never carries into the next byte so each byte's
+// high bit says how it compares.
+uint64_t foldWord(uint64_t word) {
+  uint64_t low = word & ~HIGH_BITS;
+  uint64_t atLeastA = low + (0x80 - 'A') * ONES;
+  uint64_t aboveZ = low + (0x80 - 'Z' - 1) * ONES;
+  uint64_t isUpper = atLeastA & ~aboveZ & ~word & HIGH_BITS;
+  return word | (isUpper >> 2);
+}
+
+}  // namespace
+
+NamePattern::NamePattern(const std::string& pattern) {
+  FoldCase(pattern, &this->pattern);
+  this->matchesAll = !this->pattern.empty() &&
+                     this->pattern.find_first_not_of('*') == std::string::npos;
+
+  size_t start = 0;
+  while (start < this->pattern.size()) {
+    size_t end = this->pattern.find_first_of("*?", start);
+    if (end == std::string::npos) {
+      end = this->pattern.size();
+    }
+
+    if (end - start > this->literal.size()) {
+      this->literal = this->pattern.substr(start, end - start);
+    }
+
+    start = end + 1;
+  }
+}
+
+bool NamePattern::Matches(const std::string& name) const {
+  if (this->matchesAll) {
+    return true;
+  }
+
+  std::string folded;
+  FoldCase(name, &folded);
+  if (!this->literal.empty() &&
+      folded.find(this->literal) == std::string::npos) {
+    return false;
+  }
+
+  // Standard glob match. On a mismatch after a '*' the star absorbs one
+  // more character and matching resumes from just after it.
+  const std::string& pattern = this->pattern;
+  size_t p = 0;
+  size_t n = 0;
+  size_t starAt = std::string::npos;
+  size_t starMatched = 0;
+  while (n < folded.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == folded[n])) {
+      p++;
+      n++;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      starAt = p++;
+      starMatched = n;
+    } else if (starAt != std::string::npos) {
+      p = starAt + 1;
+      n = ++starMatched;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    p++;
+  }
+
+  return p == pattern.size();
+}
+
+void NamePattern::FoldCase(const std::string& value, std::string* folded) {
+  folded->resize(value.size());
+  if (value.empty()) {
+    return;
+  }
+
+  const char* in = value.data();
+  char* out = &(*folded)[0];
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= value.size(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, in + i, sizeof(word));
+    word = foldWord(word);
+    memcpy(out + i, &word, sizeof(word));
+  }
+
+  for (; i < value.size(); i++) {
+    char c = in[i];
+    out[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+  }
+}
+
+}  // namespace NaclFsp
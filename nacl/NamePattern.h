@@ -0,0 +1,48 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_NAME_PATTERN_H_
+#define NACL_NAME_PATTERN_H_
+
+#include <string>
+
+namespace NaclFsp {
+
+// A case insensitive glob for file names where '*' matches any run of
+// characters and '?' matches one. Only ASCII letters are folded, the same
+// as an SMB server does for a search mask.
+//
+// Patterns are used by several worker threads at once so Matches() is
+// const and keeps no state.
+class NamePattern {
+ public:
+  explicit NamePattern(const std::string& pattern);
+
+  bool Matches(const std::string& name) const;
+
+  // Lower cases ASCII letters eight bytes at a time.
+  static void FoldCase(const std::string& value, std::string* folded);
+
+ private:
+  std::string pattern;
+  // The longest run of the pattern without wildcards. Most names don't
+  // contain it, so looking for it first skips the full match.
+  std::string literal;
+  bool matchesAll;
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_NAME_PATTERN_H_
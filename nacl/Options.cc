@@ -14,6 +14,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "Options.h"
+#include "VarKeys.h"
 
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array.h"
@@ -22,85 +23,225 @@
 
 namespace NaclFsp {
 
-void BaseOptions::Set(const pp::VarDictionary& optionsDict) {
-  fileSystemId = optionsDict.Get("fileSystemId").AsString();
-}
+namespace {
 
-void TrackedOperationOptions::Set(const pp::VarDictionary& optionsDict) {
-  BaseOptions::Set(optionsDict);
-  requestId = optionsDict.Get("requestId").AsInt();
-}
+template <typename T, size_t N>
+void decodeOptionFields(const pp::VarDictionary& optionsDict,
+                        const OptionField<T>(&fields)[N], T* options) {
+  const VarKeys& keys = VarKeys::Get();
 
-void DirectoryOperationOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  directoryPath = optionsDict.Get("directoryPath").AsString();
-}
+  for (size_t i = 0; i < N; i++) {
+    const OptionField<T>& field = fields[i];
+    pp::Var value = optionsDict.Get(keys.*field.key);
 
-void OpenFileOperationOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  openRequestId = optionsDict.Get("openRequestId").AsInt();
+    switch (field.type) {
+      case OPTION_STRING:
+        options->*field.stringMember = value.AsString();
+        break;
+      case OPTION_INT:
+        options->*field.intMember = value.AsInt();
+        break;
+      case OPTION_OPTIONAL_INT:
+        // Keeps the default from the constructor when missing.
+        if (value.is_int()) {
+          options->*field.intMember = value.AsInt();
+        }
+        break;
+      case OPTION_UINT32:
+        options->*field.uint32Member = value.AsInt();
+        break;
+      case OPTION_DOUBLE:
+        options->*field.doubleMember = value.AsDouble();
+        break;
+      case OPTION_OPTIONAL_DOUBLE:
+        // Keeps the default from the constructor when missing.
+        if (value.is_number()) {
+          options->*field.doubleMember = value.AsDouble();
+        }
+        break;
+      case OPTION_BOOL:
+        options->*field.boolMember = value.AsBool();
+        break;
+      case OPTION_STRING_ARRAY: {
+        pp::VarArray array(value);
+        std::vector<std::string>& strings = options->*field.stringArrayMember;
+        strings.reserve(array.GetLength());
+        for (uint32_t j = 0; j < array.GetLength(); j++) {
+          strings.push_back(array.Get(j).AsString());
+        }
+        break;
+      }
+    }
+  }
 }
 
-void FileIOOperationOptions::Set(const pp::VarDictionary& optionsDict) {
-  OpenFileOperationOptions::Set(optionsDict);
-  offset = optionsDict.Get("offset").AsDouble();
+const OptionField<MountOptions> kMountFields[] = {
+    OPTION_STRING_FIELD(MountOptions, fileSystemId),
+    OPTION_STRING_FIELD(MountOptions, displayName),
+    OPTION_BOOL_FIELD(MountOptions, writable),
+    OPTION_OPTIONAL_INT_FIELD(MountOptions, openedFilesLimit)};
 
-  // NOTE: The base class holds this member but the derived class sets it
-  // because in the write case it comes from the size of the ArrayBuffer.
-  length = -1;
-}
+const OptionField<UnmountOptions> kUnmountFields[] = {
+    OPTION_STRING_FIELD(UnmountOptions, fileSystemId)};
 
-void MountOptions::Set(const pp::VarDictionary& optionsDict) {
-  BaseOptions::Set(optionsDict);
-  displayName = optionsDict.Get("displayName").AsString();
-  writable = optionsDict.Get("writable").AsBool();
-  pp::Var openLimitVar(optionsDict.Get("openedFilesLimit"));
+const OptionField<GetMetadataOptions> kGetMetadataFields[] = {
+    OPTION_STRING_FIELD(GetMetadataOptions, fileSystemId),
+    OPTION_INT_FIELD(GetMetadataOptions, requestId),
+    OPTION_UINT32_FIELD(GetMetadataOptions, fieldMask),
+    OPTION_STRING_FIELD(GetMetadataOptions, entryPath)};
 
-  if (openLimitVar.is_int()) {
-    openedFilesLimit = optionsDict.Get("openedFilesLimit").AsInt();
-  } else {
-    openedFilesLimit = 0;
-  }
+const OptionField<BatchGetMetadataOptions> kBatchGetMetadataFields[] = {
+    OPTION_STRING_FIELD(BatchGetMetadataOptions, fileSystemId),
+    OPTION_INT_FIELD(BatchGetMetadataOptions, requestId),
+    OPTION_UINT32_FIELD(BatchGetMetadataOptions, fieldMask),
+    OPTION_STRING_ARRAY_FIELD(BatchGetMetadataOptions, entries)};
+
+const OptionField<ReadDirectoryOptions> kReadDirectoryFields[] = {
+    OPTION_STRING_FIELD(ReadDirectoryOptions, fileSystemId),
+    OPTION_INT_FIELD(ReadDirectoryOptions, requestId),
+    OPTION_STRING_FIELD(ReadDirectoryOptions, directoryPath),
+    OPTION_UINT32_FIELD(ReadDirectoryOptions, fieldMask)};
+
+const OptionField<CreateDirectoryOptions> kCreateDirectoryFields[] = {
+    OPTION_STRING_FIELD(CreateDirectoryOptions, fileSystemId),
+    OPTION_INT_FIELD(CreateDirectoryOptions, requestId),
+    OPTION_STRING_FIELD(CreateDirectoryOptions, directoryPath),
+    OPTION_BOOL_FIELD(CreateDirectoryOptions, recursive)};
+
+// The mode is a string in JS so OpenFileOptions::Set maps it separately.
+const OptionField<OpenFileOptions> kOpenFileFields[] = {
+    OPTION_STRING_FIELD(OpenFileOptions, fileSystemId),
+    OPTION_INT_FIELD(OpenFileOptions, requestId),
+    OPTION_STRING_FIELD(OpenFileOptions, filePath)};
+
+const OptionField<CreateFileOptions> kCreateFileFields[] = {
+    OPTION_STRING_FIELD(CreateFileOptions, fileSystemId),
+    OPTION_INT_FIELD(CreateFileOptions, requestId),
+    OPTION_STRING_FIELD(CreateFileOptions, filePath)};
+
+const OptionField<CloseFileOptions> kCloseFileFields[] = {
+    OPTION_STRING_FIELD(CloseFileOptions, fileSystemId),
+    OPTION_INT_FIELD(CloseFileOptions, requestId),
+    OPTION_INT_FIELD(CloseFileOptions, openRequestId)};
+
+const OptionField<ReadFileOptions> kReadFileFields[] = {
+    OPTION_STRING_FIELD(ReadFileOptions, fileSystemId),
+    OPTION_INT_FIELD(ReadFileOptions, requestId),
+    OPTION_INT_FIELD(ReadFileOptions, openRequestId),
+    OPTION_DOUBLE_FIELD(ReadFileOptions, offset),
+    OPTION_DOUBLE_FIELD(ReadFileOptions, length)};
+
+// The length of a write comes from the size of the data ArrayBuffer which
+// WriteFileOptions::Set maps separately.
+const OptionField<WriteFileOptions> kWriteFileFields[] = {
+    OPTION_STRING_FIELD(WriteFileOptions, fileSystemId),
+    OPTION_INT_FIELD(WriteFileOptions, requestId),
+    OPTION_INT_FIELD(WriteFileOptions, openRequestId),
+    OPTION_DOUBLE_FIELD(WriteFileOptions, offset)};
+
+const OptionField<DeleteEntryOptions> kDeleteEntryFields[] = {
+    OPTION_STRING_FIELD(DeleteEntryOptions, fileSystemId),
+    OPTION_INT_FIELD(DeleteEntryOptions, requestId),
+    OPTION_STRING_FIELD(DeleteEntryOptions, entryPath),
+    OPTION_BOOL_FIELD(DeleteEntryOptions, recursive)};
+
+const OptionField<CopyEntryOptions> kCopyEntryFields[] = {
+    OPTION_STRING_FIELD(CopyEntryOptions, fileSystemId),
+    OPTION_INT_FIELD(CopyEntryOptions, requestId),
+    OPTION_STRING_FIELD(CopyEntryOptions, sourcePath),
+    OPTION_STRING_FIELD(CopyEntryOptions, targetPath)};
+
+const OptionField<MoveEntryOptions> kMoveEntryFields[] = {
+    OPTION_STRING_FIELD(MoveEntryOptions, fileSystemId),
+    OPTION_INT_FIELD(MoveEntryOptions, requestId),
+    OPTION_STRING_FIELD(MoveEntryOptions, sourcePath),
+    OPTION_STRING_FIELD(MoveEntryOptions, targetPath)};
+
+const OptionField<TruncateOptions> kTruncateFields[] = {
+    OPTION_STRING_FIELD(TruncateOptions, fileSystemId),
+    OPTION_INT_FIELD(TruncateOptions, requestId),
+    OPTION_STRING_FIELD(TruncateOptions, filePath),
+    OPTION_DOUBLE_FIELD(TruncateOptions, length)};
+
+const OptionField<EnumerateFileSharesOptions> kEnumerateFileSharesFields[] = {
+    OPTION_OPTIONAL_INT_FIELD(EnumerateFileSharesOptions, maxConcurrentHosts),
+    OPTION_OPTIONAL_INT_FIELD(EnumerateFileSharesOptions, hostTimeoutMs),
+    OPTION_OPTIONAL_INT_FIELD(EnumerateFileSharesOptions, cacheTtlSeconds)};
+
+const OptionField<FindOptions> kFindFields[] = {
+    OPTION_STRING_FIELD(FindOptions, fileSystemId),
+    OPTION_STRING_FIELD(FindOptions, directoryPath),
+    OPTION_STRING_FIELD(FindOptions, pattern),
+    OPTION_OPTIONAL_INT_FIELD(FindOptions, maxDepth),
+    OPTION_OPTIONAL_INT_FIELD(FindOptions, maxResults),
+    OPTION_OPTIONAL_INT_FIELD(FindOptions, timeLimitMs)};
+
+const OptionField<TreeSizeOptions> kTreeSizeFields[] = {
+    OPTION_STRING_FIELD(TreeSizeOptions, fileSystemId),
+    OPTION_STRING_FIELD(TreeSizeOptions, directoryPath),
+    OPTION_OPTIONAL_INT_FIELD(TreeSizeOptions, timeLimitMs)};
+
+const OptionField<HashFileOptions> kHashFileFields[] = {
+    OPTION_STRING_FIELD(HashFileOptions, fileSystemId),
+    OPTION_STRING_FIELD(HashFileOptions, filePath),
+    OPTION_STRING_FIELD(HashFileOptions, algorithm)};
+
+const OptionField<HashFilesOptions> kHashFilesFields[] = {
+    OPTION_STRING_FIELD(HashFilesOptions, fileSystemId),
+    OPTION_STRING_ARRAY_FIELD(HashFilesOptions, entries),
+    OPTION_STRING_FIELD(HashFilesOptions, algorithm)};
+
+const OptionField<ListArchiveOptions> kListArchiveFields[] = {
+    OPTION_STRING_FIELD(ListArchiveOptions, fileSystemId),
+    OPTION_STRING_FIELD(ListArchiveOptions, archivePath)};
+
+const OptionField<ReadArchiveMemberOptions> kReadArchiveMemberFields[] = {
+    OPTION_STRING_FIELD(ReadArchiveMemberOptions, fileSystemId),
+    OPTION_STRING_FIELD(ReadArchiveMemberOptions, archivePath),
+    OPTION_STRING_FIELD(ReadArchiveMemberOptions, memberPath),
+    OPTION_OPTIONAL_DOUBLE_FIELD(ReadArchiveMemberOptions, offset),
+    OPTION_OPTIONAL_DOUBLE_FIELD(ReadArchiveMemberOptions, length)};
+
+const OptionField<ReadDirectoryDiffOptions> kReadDirectoryDiffFields[] = {
+    OPTION_STRING_FIELD(ReadDirectoryDiffOptions, fileSystemId),
+    OPTION_STRING_FIELD(ReadDirectoryDiffOptions, directoryPath),
+    OPTION_UINT32_FIELD(ReadDirectoryDiffOptions, fieldMask),
+    OPTION_STRING_FIELD(ReadDirectoryDiffOptions, versionToken)};
+
+const OptionField<BatchMountOptions> kBatchMountFields[] = {
+    OPTION_OPTIONAL_INT_FIELD(BatchMountOptions, maxConcurrentMounts),
+    OPTION_OPTIONAL_INT_FIELD(BatchMountOptions, mountTimeoutMs)};
+
+}  // namespace
+
+void MountOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kMountFields, this);
 }
 
 void UnmountOptions::Set(const pp::VarDictionary& optionsDict) {
-  BaseOptions::Set(optionsDict);
+  decodeOptionFields(optionsDict, kUnmountFields, this);
 }
 
 void GetMetadataOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  FieldMaskMixin::Set(optionsDict);
-  entryPath = optionsDict.Get("entryPath").AsString();
+  decodeOptionFields(optionsDict, kGetMetadataFields, this);
 }
 
 void BatchGetMetadataOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  FieldMaskMixin::Set(optionsDict);
-  pp::VarArray entriesArray(optionsDict.Get("entries"));
-
-  for (size_t i = 0; i < entriesArray.GetLength(); i++) {
-    entries.push_back(entriesArray.Get(i).AsString());
-  }
-}
-
-void FieldMaskMixin::Set(const pp::VarDictionary& optionsDict) {
-  fieldMask = optionsDict.Get("fieldMask").AsInt();
+  decodeOptionFields(optionsDict, kBatchGetMetadataFields, this);
 }
 
 void ReadDirectoryOptions::Set(const pp::VarDictionary& optionsDict) {
-  DirectoryOperationOptions::Set(optionsDict);
-  FieldMaskMixin::Set(optionsDict);
+  decodeOptionFields(optionsDict, kReadDirectoryFields, this);
 }
 
 void CreateDirectoryOptions::Set(const pp::VarDictionary& optionsDict) {
-  DirectoryOperationOptions::Set(optionsDict);
-  recursive = optionsDict.Get("recursive").AsBool();
+  decodeOptionFields(optionsDict, kCreateDirectoryFields, this);
 }
 
 void OpenFileOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  filePath = optionsDict.Get("filePath").AsString();
-  std::string fileMode = optionsDict.Get("mode").AsString();
+  decodeOptionFields(optionsDict, kOpenFileFields, this);
+
+  std::string fileMode = optionsDict.Get(VarKeys::Get().mode).AsString();
   if (fileMode == "READ") {
     mode = FILE_MODE_READ;
   } else {
@@ -110,55 +251,82 @@ void OpenFileOptions::Set(const pp::VarDictionary& optionsDict) {
 }
 
 void CreateFileOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
   // TODO(zentaro): Can maybe consolidate filePath with OpenFileOptions.
-  filePath = optionsDict.Get("filePath").AsString();
+  decodeOptionFields(optionsDict, kCreateFileFields, this);
 }
 
 void CloseFileOptions::Set(const pp::VarDictionary& optionsDict) {
-  OpenFileOperationOptions::Set(optionsDict);
+  decodeOptionFields(optionsDict, kCloseFileFields, this);
 }
 
 void ReadFileOptions::Set(const pp::VarDictionary& optionsDict) {
-  FileIOOperationOptions::Set(optionsDict);
-
-  // NOTE: Even though this is in the base class it is set here because the
-  // derived write class gets this field from the length of the passed in
-  // ArrayBuffer.
-  length = optionsDict.Get("length").AsDouble();
+  decodeOptionFields(optionsDict, kReadFileFields, this);
 }
 
 void WriteFileOptions::Set(const pp::VarDictionary& optionsDict) {
-  FileIOOperationOptions::Set(optionsDict);
+  decodeOptionFields(optionsDict, kWriteFileFields, this);
 
-  // TODO(zentaro): Investigate if there might be an extra copy happening here.
-  pp::VarArrayBuffer buffer(optionsDict.Get("data"));
-  data = buffer.Map();
-  length = buffer.ByteLength();
+  this->buffer = pp::VarArrayBuffer(optionsDict.Get(VarKeys::Get().data));
+  data = this->buffer.Map();
+  length = this->buffer.ByteLength();
+}
+
+WriteFileOptions::~WriteFileOptions() {
+  if (data != NULL) {
+    this->buffer.Unmap();
+  }
 }
 
 void DeleteEntryOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  entryPath = optionsDict.Get("entryPath").AsString();
-  recursive = optionsDict.Get("recursive").AsBool();
+  decodeOptionFields(optionsDict, kDeleteEntryFields, this);
 }
 
 void CopyEntryOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  sourcePath = optionsDict.Get("sourcePath").AsString();
-  targetPath = optionsDict.Get("targetPath").AsString();
+  decodeOptionFields(optionsDict, kCopyEntryFields, this);
 }
 
 void MoveEntryOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  sourcePath = optionsDict.Get("sourcePath").AsString();
-  targetPath = optionsDict.Get("targetPath").AsString();
+  decodeOptionFields(optionsDict, kMoveEntryFields, this);
 }
 
 void TruncateOptions::Set(const pp::VarDictionary& optionsDict) {
-  TrackedOperationOptions::Set(optionsDict);
-  filePath = optionsDict.Get("filePath").AsString();
-  length = optionsDict.Get("length").AsDouble();
+  decodeOptionFields(optionsDict, kTruncateFields, this);
+}
+
+void EnumerateFileSharesOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kEnumerateFileSharesFields, this);
+}
+
+void FindOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kFindFields, this);
+}
+
+void TreeSizeOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kTreeSizeFields, this);
+}
+
+void HashFileOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kHashFileFields, this);
+}
+
+void HashFilesOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kHashFilesFields, this);
+}
+
+void ListArchiveOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kListArchiveFields, this);
+}
+
+void ReadArchiveMemberOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kReadArchiveMemberFields, this);
+}
+
+void ReadDirectoryDiffOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kReadDirectoryDiffFields, this);
+}
+
+void BatchMountOptions::Set(const pp::VarDictionary& optionsDict) {
+  decodeOptionFields(optionsDict, kBatchMountFields, this);
 }
 
 }  // namespace NaclFsp
@@ -13,22 +13,77 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#ifndef NACL_OPTIONS_H_
+#define NACL_OPTIONS_H_
+
 #include <stdint.h>
 #include <string>
 #include <vector>
 
+#include "ppapi/cpp/var_array_buffer.h"
+
 namespace pp {
+class Var;
 class VarDictionary;
 }
 
 namespace NaclFsp {
 
+class VarKeys;
+
+enum OptionFieldType {
+  OPTION_STRING,
+  OPTION_INT,
+  OPTION_OPTIONAL_INT,
+  OPTION_UINT32,
+  OPTION_DOUBLE,
+  OPTION_OPTIONAL_DOUBLE,
+  OPTION_BOOL,
+  OPTION_STRING_ARRAY
+};
+
+// Describes how one key of an options dictionary maps onto a member of an
+// options class. Each concrete options class has a table of these and
+// Set() just walks it. Only the member pointer matching |type| is set.
+template <typename T>
+struct OptionField {
+  pp::Var VarKeys::*key;
+  OptionFieldType type;
+  std::string T::*stringMember;
+  int T::*intMember;
+  uint32_t T::*uint32Member;
+  double T::*doubleMember;
+  bool T::*boolMember;
+  std::vector<std::string> T::*stringArrayMember;
+};
+
+// Helpers to build OptionField table rows. The dictionary key is always the
+// same as the member name.
+#define OPTION_STRING_FIELD(T, member) \
+  { &VarKeys::member, OPTION_STRING, &T::member, 0, 0, 0, 0, 0 }
+#define OPTION_INT_FIELD(T, member) \
+  { &VarKeys::member, OPTION_INT, 0, &T::member, 0, 0, 0, 0 }
+#define OPTION_OPTIONAL_INT_FIELD(T, member) \
+  { &VarKeys::member, OPTION_OPTIONAL_INT, 0, &T::member, 0, 0, 0, 0 }
+#define OPTION_UINT32_FIELD(T, member) \
+  { &VarKeys::member, OPTION_UINT32, 0, 0, &T::member, 0, 0, 0 }
+#define OPTION_DOUBLE_FIELD(T, member) \
+  { &VarKeys::member, OPTION_DOUBLE, 0, 0, 0, &T::member, 0, 0 }
+#define OPTION_OPTIONAL_DOUBLE_FIELD(T, member) \
+  { &VarKeys::member, OPTION_OPTIONAL_DOUBLE, 0, 0, 0, &T::member, 0, 0 }
+#define OPTION_BOOL_FIELD(T, member) \
+  { &VarKeys::member, OPTION_BOOL, 0, 0, 0, 0, &T::member, 0 }
+#define OPTION_STRING_ARRAY_FIELD(T, member) \
+  { &VarKeys::member, OPTION_STRING_ARRAY, 0, 0, 0, 0, 0, &T::member }
+
 class BaseOptions {
  protected:
   BaseOptions() {}
-  virtual void Set(const pp::VarDictionary& optionsDict);
 
  public:
+  virtual ~BaseOptions() {}
+  virtual void Set(const pp::VarDictionary& optionsDict) = 0;
+
   std::string fileSystemId;
 
  private:
@@ -40,7 +95,6 @@ class BaseOptions {
 class TrackedOperationOptions : public BaseOptions {
  protected:
   TrackedOperationOptions() : requestId(-1) {}
-  virtual void Set(const pp::VarDictionary& optionsDict);
 
  public:
   int requestId;
@@ -49,7 +103,6 @@ class TrackedOperationOptions : public BaseOptions {
 class DirectoryOperationOptions : public TrackedOperationOptions {
  protected:
   DirectoryOperationOptions() {}
-  virtual void Set(const pp::VarDictionary& optionsDict);
 
  public:
   std::string directoryPath;
@@ -58,7 +111,6 @@ class DirectoryOperationOptions : public TrackedOperationOptions {
 class OpenFileOperationOptions : public TrackedOperationOptions {
  protected:
   OpenFileOperationOptions() {}
-  virtual void Set(const pp::VarDictionary& optionsDict);
 
  public:
   int openRequestId;
@@ -67,7 +119,6 @@ class OpenFileOperationOptions : public TrackedOperationOptions {
 class FileIOOperationOptions : public OpenFileOperationOptions {
  protected:
   FileIOOperationOptions() {}
-  virtual void Set(const pp::VarDictionary& optionsDict);
 
  public:
   double offset;
@@ -97,22 +148,23 @@ class FieldMaskMixin {
  public:
   uint32_t fieldMask;
 
-  virtual void Set(const pp::VarDictionary& optionsDict);
-
   // If either size or modification time is required then
   // a call to stat() is required.
   bool needsStat() const {
-    return ((this->fieldMask & FIELD_SIZE) != 0) &&
+    return ((this->fieldMask & FIELD_SIZE) != 0) ||
            ((this->fieldMask & FIELD_MODIFICATION_TIME) != 0);
   }
 
+  // Must stay in sync with METADATA_FIELD_BITS in samba.js.
   enum MetadataFields {
     FIELD_NAME = 1,
     FIELD_IS_DIRECTORY = 2,
     FIELD_SIZE = 4,
     FIELD_MODIFICATION_TIME = 8,
     FIELD_THUMBNAIL = 16,
-    FIELD_MIME_TYPE = 32
+    FIELD_MIME_TYPE = 32,
+    // Only used inside the module, eg. for the share list in the popup.
+    FIELD_FULL_PATH = 64
   };
 };
 
@@ -175,11 +227,18 @@ class ReadFileOptions : public FileIOOperationOptions {
   virtual void Set(const pp::VarDictionary& optionsDict);
 };
 
+// Holds a reference to the data ArrayBuffer and keeps it mapped for as long
+// as the options exist, so |data| points straight at the bytes that came
+// from JS and they are never copied in the module.
 class WriteFileOptions : public FileIOOperationOptions {
  public:
-  WriteFileOptions() {}
+  WriteFileOptions() : data(NULL) {}
+  virtual ~WriteFileOptions();
   virtual void Set(const pp::VarDictionary& optionsDict);
   const void* data;
+
+ private:
+  pp::VarArrayBuffer buffer;
 };
 
 class DeleteEntryOptions : public TrackedOperationOptions {
@@ -214,4 +273,98 @@ class TruncateOptions : public TrackedOperationOptions {
   double length;
 };
 
+// Optional second argument to custom_enumerateFileShares.
+class EnumerateFileSharesOptions : public BaseOptions {
+ public:
+  EnumerateFileSharesOptions()
+      : maxConcurrentHosts(16), hostTimeoutMs(5000), cacheTtlSeconds(30) {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  int maxConcurrentHosts;
+  int hostTimeoutMs;
+  int cacheTtlSeconds;
+};
+
+// Argument to custom_find. The limits keep a search of a huge share from
+// running forever; the defaults apply when they are missing.
+class FindOptions : public BaseOptions {
+ public:
+  FindOptions() : maxDepth(-1), maxResults(10000), timeLimitMs(120000) {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string directoryPath;
+  std::string pattern;
+  // Negative for no limit.
+  int maxDepth;
+  int maxResults;
+  int timeLimitMs;
+};
+
+// Argument to custom_computeTreeSize.
+class TreeSizeOptions : public BaseOptions {
+ public:
+  TreeSizeOptions() : timeLimitMs(300000) {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string directoryPath;
+  int timeLimitMs;
+};
+
+// Argument to custom_hashFile. |algorithm| is one of the names taken by
+// Hasher::Create and defaults to "sha256" when empty.
+class HashFileOptions : public BaseOptions {
+ public:
+  HashFileOptions() {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string filePath;
+  std::string algorithm;
+};
+
+// Argument to custom_hashFiles. |entries| are file paths.
+class HashFilesOptions : public BaseOptions {
+ public:
+  HashFilesOptions() {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::vector<std::string> entries;
+  std::string algorithm;
+};
+
+// Argument to custom_listArchive.
+class ListArchiveOptions : public BaseOptions {
+ public:
+  ListArchiveOptions() {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string archivePath;
+};
+
+// Argument to custom_readArchiveMember. |offset| and |length| are in the
+// uncompressed member; a negative length reads to the end.
+class ReadArchiveMemberOptions : public BaseOptions {
+ public:
+  ReadArchiveMemberOptions() : offset(0), length(-1) {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string archivePath;
+  std::string memberPath;
+  double offset;
+  double length;
+};
+
+// Argument to custom_readDirectoryDiff. |versionToken| is the one returned
+// with the listing the caller already has; empty asks for a full listing.
+class ReadDirectoryDiffOptions : public BaseOptions, public FieldMaskMixin {
+ public:
+  ReadDirectoryDiffOptions() {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  std::string directoryPath;
+  std::string versionToken;
+};
+
+// Optional second argument to custom_batchMount.
+class BatchMountOptions : public BaseOptions {
+ public:
+  BatchMountOptions() : maxConcurrentMounts(8), mountTimeoutMs(5000) {}
+  virtual void Set(const pp::VarDictionary& optionsDict);
+  int maxConcurrentMounts;
+  int mountTimeoutMs;
+};
+
 }  // namespace NaclFsp
+
+#endif  // NACL_OPTIONS_H_
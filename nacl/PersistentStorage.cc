@@ -0,0 +1,70 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "PersistentStorage.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "sys/mount.h"
+
+namespace NaclFsp {
+
+namespace {
+
+const char MOUNT_POINT[] = "/persistent";
+
+// The app has the unlimitedStorage permission so this is only a hint.
+const char MOUNT_DATA[] = "type=PERSISTENT,expected_size=104857600";
+
+}  // namespace
+
+bool PersistentStorage::mounted = false;
+
+bool PersistentStorage::EnsureMounted() {
+  if (mounted) {
+    return true;
+  }
+
+  if (::mount("", MOUNT_POINT, "html5fs", 0, MOUNT_DATA) != 0) {
+    return false;
+  }
+
+  mounted = true;
+  return true;
+}
+
+std::string PersistentStorage::GetPath(const std::string& relativePath) {
+  std::string path = MOUNT_POINT;
+  size_t start = 0;
+  while (start < relativePath.size()) {
+    size_t slashAt = relativePath.find('/', start);
+    if (slashAt == std::string::npos) {
+      path += "/" + relativePath.substr(start);
+      break;
+    }
+
+    if (slashAt > start) {
+      path += "/" + relativePath.substr(start, slashAt - start);
+      // EEXIST is expected for every call after the first.
+      mkdir(path.c_str(), 0755);
+    }
+
+    start = slashAt + 1;
+  }
+
+  return path;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,40 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_PERSISTENT_STORAGE_H_
+#define NACL_PERSISTENT_STORAGE_H_
+
+#include <string>
+
+namespace NaclFsp {
+
+// Owns the html5fs mount that holds anything the module wants to keep
+// across restarts. The mount is created on first use since most sessions
+// never need it.
+class PersistentStorage {
+ public:
+  static bool EnsureMounted();
+
+  // Returns the absolute path in the nacl_io tree for a path relative to
+  // the persistent root, creating any missing parent directories.
+  static std::string GetPath(const std::string& relativePath);
+
+ private:
+  static bool mounted;
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_PERSISTENT_STORAGE_H_
@@ -0,0 +1,41 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_RANGE_READER_H_
+#define NACL_RANGE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace NaclFsp {
+
+// Source of the bytes of one file. SambaFsp implements it over an open
+// samba file so only the ranges that are asked for go over the network.
+// Used by the readers of file formats that only need parts of a file, like
+// ExifThumbnailExtractor and the zip directory reader.
+class RangeReader {
+ public:
+  virtual ~RangeReader() {}
+
+  // Reads up to |length| bytes at |offset|. Fewer bytes are returned at the
+  // end of the file. Returns false on error.
+  virtual bool ReadRange(uint64_t offset, size_t length,
+                         std::vector<uint8_t>* data) = 0;
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_RANGE_READER_H_
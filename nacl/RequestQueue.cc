@@ -0,0 +1,219 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "RequestQueue.h"
+
+#include <algorithm>
+
+#include "VarKeys.h"
+#include "util.h"
+
+namespace NaclFsp {
+
+namespace {
+
+// Read only requests where identical arguments give identical results.
+const char* const kDedupableFunctions[] = {"getMetadata", "readDirectory",
+                                           "custom_readDirectoryDiff"};
+
+// These differ between otherwise identical requests so they are left out
+// of the key.
+const char kRequestIdKey[] = "requestId";
+const char kExpiresInMsKey[] = "expiresInMs";
+
+}  // namespace
+
+RequestQueue::RequestQueue()
+    : currentMessageId(-1), executed(0), joinedQueued(0), joinedCompleted(0) {}
+
+bool RequestQueue::Push(const std::string& functionName, int messageId,
+                        const pp::VarArray& args, uint64_t arrivalMicros,
+                        uint64_t deadlineMicros, const Responses** responses) {
+  std::string flightKey;
+  if (isDedupable(functionName)) {
+    flightKey = makeFlightKey(functionName, args);
+
+    std::map<std::string, Responses>::iterator completed =
+        this->completedFlights.find(flightKey);
+    if (completed != this->completedFlights.end()) {
+      this->joinedCompleted++;
+      *responses = &completed->second;
+      return false;
+    }
+
+    std::map<std::string, RequestList::iterator>::iterator open =
+        this->openFlights.find(flightKey);
+    if (open != this->openFlights.end()) {
+      this->joinedQueued++;
+      QueuedRequest& leader = *open->second;
+      leader.followers.push_back(std::make_pair(messageId, arrivalMicros));
+      if (leader.deadlineMicros != 0) {
+        leader.deadlineMicros =
+            deadlineMicros == 0
+                ? 0
+                : std::max(leader.deadlineMicros, deadlineMicros);
+      }
+      return true;
+    }
+  } else {
+    this->openFlights.clear();
+    this->completedFlights.clear();
+  }
+
+  QueuedRequest request;
+  request.functionName = functionName;
+  request.messageId = messageId;
+  request.args = args;
+  request.arrivalMicros = arrivalMicros;
+  request.deadlineMicros = deadlineMicros;
+  request.flightKey = flightKey;
+  this->queue.push_back(request);
+
+  if (!flightKey.empty()) {
+    RequestList::iterator last = this->queue.end();
+    this->openFlights[flightKey] = --last;
+  }
+
+  return true;
+}
+
+QueuedRequest RequestQueue::Pop() {
+  QueuedRequest request = this->queue.front();
+  this->queue.pop_front();
+  this->executed++;
+
+  if (!request.flightKey.empty()) {
+    this->openFlights.erase(request.flightKey);
+  }
+
+  this->currentKey = request.flightKey;
+  this->currentMessageId = request.messageId;
+  this->currentResponses.clear();
+  return request;
+}
+
+void RequestQueue::RecordResponse(int messageId,
+                                  const pp::VarDictionary& result,
+                                  bool hasMore) {
+  if (this->currentKey.empty() || messageId != this->currentMessageId) {
+    return;
+  }
+
+  this->currentResponses.push_back(std::make_pair(result, hasMore));
+}
+
+const RequestQueue::Responses& RequestQueue::Complete() {
+  this->currentMessageId = -1;
+  if (this->currentKey.empty()) {
+    return this->currentResponses;
+  }
+
+  std::string key;
+  key.swap(this->currentKey);
+  if (isFailed(this->currentResponses)) {
+    // Followers still get the error but nothing later does.
+    return this->currentResponses;
+  }
+
+  Responses& completed = this->completedFlights[key];
+  completed.swap(this->currentResponses);
+  this->currentResponses.clear();
+  return completed;
+}
+
+void RequestQueue::ExpireCompleted() { this->completedFlights.clear(); }
+
+bool RequestQueue::isFailed(const Responses& responses) {
+  const pp::Var& errorKey = VarKeys::Get().error;
+  for (Responses::const_iterator it = responses.begin();
+       it != responses.end(); ++it) {
+    if (it->first.HasKey(errorKey)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool RequestQueue::isDedupable(const std::string& functionName) {
+  const char* const* end =
+      kDedupableFunctions +
+      sizeof(kDedupableFunctions) / sizeof(kDedupableFunctions[0]);
+  for (const char* const* it = kDedupableFunctions; it != end; ++it) {
+    if (functionName == *it) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string RequestQueue::makeFlightKey(const std::string& functionName,
+                                        const pp::VarArray& args) {
+  std::string key = functionName;
+  key += '(';
+  appendVarKey(args, &key);
+  key += ')';
+  return key;
+}
+
+void RequestQueue::appendVarKey(const pp::Var& value, std::string* key) {
+  if (value.is_string()) {
+    std::string s = value.AsString();
+    *key += 's' + Util::ToString(s.length()) + ':' + s;
+  } else if (value.is_int()) {
+    *key += 'i' + Util::ToString(value.AsInt()) + ';';
+  } else if (value.is_double()) {
+    *key += 'd' + Util::ToString(value.AsDouble()) + ';';
+  } else if (value.is_bool()) {
+    *key += value.AsBool() ? 't' : 'f';
+  } else if (value.is_array()) {
+    pp::VarArray array(value);
+    uint32_t length = array.GetLength();
+    *key += '[';
+    for (uint32_t i = 0; i < length; i++) {
+      appendVarKey(array.Get(i), key);
+    }
+    *key += ']';
+  } else if (value.is_dictionary()) {
+    // Key order isn't defined so sort them first.
+    pp::VarDictionary dict(value);
+    pp::VarArray keys = dict.GetKeys();
+    uint32_t length = keys.GetLength();
+    std::vector<std::string> names;
+    names.reserve(length);
+    for (uint32_t i = 0; i < length; i++) {
+      names.push_back(keys.Get(i).AsString());
+    }
+    std::sort(names.begin(), names.end());
+
+    *key += '{';
+    for (size_t i = 0; i < names.size(); i++) {
+      if (names[i] == kRequestIdKey || names[i] == kExpiresInMsKey) {
+        continue;
+      }
+
+      *key += 's' + Util::ToString(names[i].length()) + ':' + names[i];
+      appendVarKey(dict.Get(pp::Var(names[i])), key);
+    }
+    *key += '}';
+  } else {
+    // Null, undefined and anything that doesn't appear in dedupable
+    // requests.
+    *key += 'n';
+  }
+}
+
+}  // namespace NaclFsp
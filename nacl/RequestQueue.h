@@ -0,0 +1,131 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_REQUEST_QUEUE_H_
+#define NACL_REQUEST_QUEUE_H_
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_dictionary.h"
+
+namespace NaclFsp {
+
+class QueuedRequest {
+ public:
+  QueuedRequest() : messageId(0), arrivalMicros(0), deadlineMicros(0) {}
+
+  std::string functionName;
+  int messageId;
+  pp::VarArray args;
+  uint64_t arrivalMicros;
+
+  // When nobody is waiting for the result any more, from the expiresInMs
+  // option. Zero when the request doesn't expire. A flight lasts until the
+  // last of its requests expires.
+  uint64_t deadlineMicros;
+
+  // Identifies identical requests. Empty when the request can't be shared.
+  std::string flightKey;
+
+  // Requests identical to this one that arrived before it ran. They get
+  // a copy of every response sent for it.
+  std::vector<std::pair<int, uint64_t> > followers;
+};
+
+// Holds requests that have been read from the message queue but not handled
+// yet, and collapses identical concurrent reads into a single flight.
+//
+// The module only handles one request at a time so two requests are
+// concurrent when the second one arrived before the first one finished:
+// either it was already queued when the first one started, or it was read
+// right after the first one completed. In the first case it joins the queued
+// request as a follower. In the second case it is answered from the
+// responses recorded for the completed request, which are kept until the
+// next request starts or the message loop next waits. A flight that failed
+// is not kept since a later request could well succeed, eg. after a
+// DEADLINE_EXCEEDED or a SHOULD_RETRY.
+//
+// Any request that is not in the dedupable set (ie. anything that can
+// change the file system) closes all open flights so a read is never
+// answered with a result from before a write.
+class RequestQueue {
+ public:
+  typedef std::vector<std::pair<pp::VarDictionary, bool> > Responses;
+
+  RequestQueue();
+
+  // Queues a request. Returns false if it was answered by a flight that
+  // just completed, in which case *responses are the responses to send.
+  bool Push(const std::string& functionName, int messageId,
+            const pp::VarArray& args, uint64_t arrivalMicros,
+            uint64_t deadlineMicros, const Responses** responses);
+
+  bool IsEmpty() const { return this->queue.empty(); }
+
+  // Removes the next request and starts recording its responses.
+  QueuedRequest Pop();
+
+  // Called for every response sent. Records the ones for the current
+  // flight.
+  void RecordResponse(int messageId, const pp::VarDictionary& result,
+                      bool hasMore);
+
+  // Ends the current flight. Returns the responses recorded for it.
+  const Responses& Complete();
+
+  // Drops the results of completed flights. Called before starting the next
+  // request since anything read after that is no longer concurrent.
+  void ExpireCompleted();
+
+  uint64_t executedCount() const { return this->executed; }
+  uint64_t joinedQueuedCount() const { return this->joinedQueued; }
+  uint64_t joinedCompletedCount() const { return this->joinedCompleted; }
+
+ private:
+  typedef std::list<QueuedRequest> RequestList;
+
+  RequestList queue;
+  std::map<std::string, RequestList::iterator> openFlights;
+  std::map<std::string, Responses> completedFlights;
+
+  std::string currentKey;
+  int currentMessageId;
+  Responses currentResponses;
+
+  uint64_t executed;
+  uint64_t joinedQueued;
+  uint64_t joinedCompleted;
+
+  static bool isDedupable(const std::string& functionName);
+  static bool isFailed(const Responses& responses);
+  static std::string makeFlightKey(const std::string& functionName,
+                                   const pp::VarArray& args);
+  static void appendVarKey(const pp::Var& value, std::string* key);
+
+  // Prevent copy and assignment.
+  RequestQueue(const RequestQueue&);
+  RequestQueue& operator=(const RequestQueue&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_REQUEST_QUEUE_H_
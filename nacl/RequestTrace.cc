@@ -0,0 +1,544 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "RequestTrace.h"
+
+#include <string.h>
+
+#include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_array_buffer.h"
+#include "ppapi/cpp/var_dictionary.h"
+
+namespace NaclFsp {
+
+namespace {
+
+const size_t FLUSH_THRESHOLD = 64 * 1024;
+
+// Guards against malformed traces recursing forever.
+const int MAX_VALUE_DEPTH = 16;
+
+// Keys whose values are never written to a trace.
+const char* const kCredentialKeys[] = {"domain", "user", "password"};
+
+// Keys whose string values are paths or names and get hashed on request.
+const char* const kPathKeys[] = {
+    "fileSystemId", "entryPath", "directoryPath", "filePath", "sourcePath",
+    "targetPath", "entries", "sharePath", "server", "serverIP", "path",
+    "share", "displayName", "archivePath", "memberPath"};
+
+// The first argument of this is keyed by host name.
+const char kHostMapFunction[] = "custom_enumerateFileShares";
+
+bool keyInList(const std::string& key, const char* const* list, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (key == list[i]) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#define KEY_IN(key, list) keyInList(key, list, sizeof(list) / sizeof(list[0]))
+
+std::string hashComponent(const std::string& component) {
+  // 64 bit FNV-1a.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < component.size(); i++) {
+    hash ^= static_cast<uint8_t>(component[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return std::string("h") + hex;
+}
+
+// Hashes each component of a path but keeps the separators and any URL
+// scheme so the replayed paths still nest the same way.
+std::string hashPath(const std::string& path) {
+  std::string hashed;
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t slashAt = path.find('/', start);
+    if (slashAt == std::string::npos) {
+      slashAt = path.size();
+    }
+
+    std::string component = path.substr(start, slashAt - start);
+    bool isScheme = !component.empty() &&
+                    component[component.size() - 1] == ':' &&
+                    start == 0;
+    if (component.empty() || isScheme) {
+      hashed += component;
+    } else {
+      hashed += hashComponent(component);
+    }
+
+    if (slashAt < path.size()) {
+      hashed += "/";
+    }
+
+    start = slashAt + 1;
+  }
+
+  return hashed;
+}
+
+}  // namespace
+
+const char TraceFormat::kMagic[] = "NFSPTRC";
+
+TraceRecorder::TraceRecorder()
+    : file(NULL),
+      hashPaths(false),
+      lastArrivalMicros(0),
+      records(0),
+      written(0) {}
+
+TraceRecorder::~TraceRecorder() { this->Stop(); }
+
+bool TraceRecorder::Start(const std::string& path, bool hashPaths) {
+  this->Stop();
+
+  this->file = fopen(path.c_str(), "wb");
+  if (this->file == NULL) {
+    return false;
+  }
+
+  this->hashPaths = hashPaths;
+  this->lastArrivalMicros = 0;
+  this->records = 0;
+  this->written = 0;
+  this->internedStrings.clear();
+  this->buffer.clear();
+
+  this->writeBytes(TraceFormat::kMagic, TraceFormat::kMagicLength);
+  uint8_t version = TraceFormat::kVersion;
+  uint8_t flags = hashPaths ? TraceFormat::TRACE_FLAG_HASHED_PATHS : 0;
+  this->writeBytes(&version, 1);
+  this->writeBytes(&flags, 1);
+  this->flush();
+
+  return true;
+}
+
+void TraceRecorder::Stop() {
+  if (this->file == NULL) {
+    return;
+  }
+
+  this->flush();
+  fclose(this->file);
+  this->file = NULL;
+}
+
+void TraceRecorder::Record(const std::string& functionName, int messageId,
+                           const pp::VarArray& args, uint64_t arrivalMicros,
+                           uint64_t serviceMicros) {
+  if (this->file == NULL) {
+    return;
+  }
+
+  uint64_t delta = 0;
+  if (this->records > 0 && arrivalMicros > this->lastArrivalMicros) {
+    delta = arrivalMicros - this->lastArrivalMicros;
+  }
+
+  this->lastArrivalMicros = arrivalMicros;
+  this->writeVarint(delta);
+  this->writeVarint(serviceMicros);
+  this->writeVarint(static_cast<uint32_t>(messageId));
+  this->writeInterned(functionName);
+  if (functionName == kHostMapFunction && args.Get(0).is_dictionary()) {
+    uint8_t tag = TraceFormat::TAG_ARRAY;
+    this->writeBytes(&tag, 1);
+    this->writeVarint(args.GetLength());
+    this->writeHostMap(pp::VarDictionary(args.Get(0)));
+    for (uint32_t i = 1; i < args.GetLength(); i++) {
+      this->writeValue(args.Get(i), "");
+    }
+  } else {
+    this->writeValue(args, "");
+  }
+  this->records++;
+
+  if (this->buffer.size() >= FLUSH_THRESHOLD) {
+    this->flush();
+  }
+}
+
+void TraceRecorder::writeVarint(uint64_t value) {
+  while (value >= 0x80) {
+    this->buffer.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+
+  this->buffer.push_back(static_cast<uint8_t>(value));
+}
+
+void TraceRecorder::writeBytes(const void* data, size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  this->buffer.insert(this->buffer.end(), bytes, bytes + length);
+}
+
+void TraceRecorder::writeInterned(const std::string& value) {
+  std::map<std::string, uint32_t>::iterator it =
+      this->internedStrings.find(value);
+  if (it != this->internedStrings.end()) {
+    this->writeVarint(static_cast<uint64_t>(it->second) << 1);
+    return;
+  }
+
+  uint32_t id = this->internedStrings.size();
+  this->internedStrings[value] = id;
+  this->writeVarint((static_cast<uint64_t>(id) << 1) | 1);
+  this->writeVarint(value.size());
+  this->writeBytes(value.data(), value.size());
+}
+
+void TraceRecorder::writeString(const std::string& value) {
+  this->writeVarint(value.size());
+  this->writeBytes(value.data(), value.size());
+}
+
+std::string TraceRecorder::scrub(const std::string& key,
+                                 const std::string& value) {
+  if (KEY_IN(key, kCredentialKeys)) {
+    return "";
+  }
+
+  if (!this->hashPaths) {
+    return value;
+  }
+
+  if (KEY_IN(key, kPathKeys)) {
+    return hashPath(value);
+  }
+
+  return value;
+}
+
+void TraceRecorder::writeValue(const pp::Var& value, const std::string& key) {
+  uint8_t tag;
+  if (value.is_bool()) {
+    tag = value.AsBool() ? TraceFormat::TAG_TRUE : TraceFormat::TAG_FALSE;
+    this->writeBytes(&tag, 1);
+  } else if (value.is_int()) {
+    int32_t intValue = value.AsInt();
+    tag = TraceFormat::TAG_INT;
+    this->writeBytes(&tag, 1);
+    uint32_t zigzag = (static_cast<uint32_t>(intValue) << 1) ^
+                      static_cast<uint32_t>(intValue >> 31);
+    this->writeVarint(zigzag);
+  } else if (value.is_double()) {
+    double doubleValue = value.AsDouble();
+    tag = TraceFormat::TAG_DOUBLE;
+    this->writeBytes(&tag, 1);
+    this->writeBytes(&doubleValue, sizeof(doubleValue));
+  } else if (value.is_string()) {
+    tag = TraceFormat::TAG_STRING;
+    this->writeBytes(&tag, 1);
+    this->writeString(this->scrub(key, value.AsString()));
+  } else if (value.is_array()) {
+    pp::VarArray array(value);
+    tag = TraceFormat::TAG_ARRAY;
+    this->writeBytes(&tag, 1);
+    this->writeVarint(array.GetLength());
+    for (uint32_t i = 0; i < array.GetLength(); i++) {
+      // Array elements inherit the key of the array (eg. "entries").
+      this->writeValue(array.Get(i), key);
+    }
+  } else if (value.is_dictionary()) {
+    pp::VarDictionary dict(value);
+    pp::VarArray keys = dict.GetKeys();
+    tag = TraceFormat::TAG_DICTIONARY;
+    this->writeBytes(&tag, 1);
+    this->writeVarint(keys.GetLength());
+    for (uint32_t i = 0; i < keys.GetLength(); i++) {
+      std::string childKey = keys.Get(i).AsString();
+      this->writeInterned(childKey);
+      this->writeValue(dict.Get(keys.Get(i)), childKey);
+    }
+  } else if (value.is_array_buffer()) {
+    pp::VarArrayBuffer arrayBuffer(value);
+    tag = TraceFormat::TAG_ARRAY_BUFFER;
+    this->writeBytes(&tag, 1);
+    this->writeVarint(arrayBuffer.ByteLength());
+  } else if (value.is_null()) {
+    tag = TraceFormat::TAG_NULL;
+    this->writeBytes(&tag, 1);
+  } else {
+    tag = TraceFormat::TAG_UNDEFINED;
+    this->writeBytes(&tag, 1);
+  }
+}
+
+void TraceRecorder::writeHostMap(const pp::VarDictionary& hostMap) {
+  pp::VarArray hosts = hostMap.GetKeys();
+  uint8_t tag = TraceFormat::TAG_DICTIONARY;
+  this->writeBytes(&tag, 1);
+  this->writeVarint(hosts.GetLength());
+  for (uint32_t i = 0; i < hosts.GetLength(); i++) {
+    std::string host = hosts.Get(i).AsString();
+    this->writeInterned(this->scrub("server", host));
+    this->writeValue(hostMap.Get(hosts.Get(i)), "serverIP");
+  }
+}
+
+void TraceRecorder::flush() {
+  if (this->file == NULL || this->buffer.empty()) {
+    return;
+  }
+
+  size_t count = fwrite(&this->buffer[0], 1, this->buffer.size(), this->file);
+  this->written += count;
+  fflush(this->file);
+  this->buffer.clear();
+}
+
+TraceReader::TraceReader() : file(NULL), flags(0), fileBytes(0) {}
+
+TraceReader::~TraceReader() {
+  if (this->file != NULL) {
+    fclose(this->file);
+  }
+}
+
+bool TraceReader::Open(const std::string& path) {
+  this->file = fopen(path.c_str(), "rb");
+  if (this->file == NULL) {
+    return false;
+  }
+
+  long length = -1;
+  if (fseek(this->file, 0, SEEK_END) == 0) {
+    length = ftell(this->file);
+  }
+
+  if (length < 0 || fseek(this->file, 0, SEEK_SET) != 0) {
+    fclose(this->file);
+    this->file = NULL;
+    return false;
+  }
+
+  this->fileBytes = length;
+  char magic[TraceFormat::kMagicLength];
+  uint8_t version;
+  if (!this->readBytes(magic, sizeof(magic)) ||
+      memcmp(magic, TraceFormat::kMagic, sizeof(magic)) != 0 ||
+      !this->readBytes(&version, 1) || version != TraceFormat::kVersion ||
+      !this->readBytes(&this->flags, 1)) {
+    fclose(this->file);
+    this->file = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+bool TraceReader::Next(TraceRecord* record) {
+  if (this->file == NULL) {
+    return false;
+  }
+
+  uint64_t messageId;
+  if (!this->readVarint(&record->arrivalDeltaMicros) ||
+      !this->readVarint(&record->serviceMicros) ||
+      !this->readVarint(&messageId) ||
+      !this->readInterned(&record->functionName) ||
+      !this->readValue(&record->args, 0)) {
+    return false;
+  }
+
+  record->messageId = static_cast<int>(messageId);
+  return true;
+}
+
+bool TraceReader::readVarint(uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = fgetc(this->file);
+    if (byte == EOF) {
+      return false;
+    }
+
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool TraceReader::readBytes(void* data, size_t length) {
+  return fread(data, 1, length, this->file) == length;
+}
+
+bool TraceReader::readString(std::string* value) {
+  uint64_t length;
+  if (!this->readVarint(&length)) {
+    return false;
+  }
+
+  long offset = ftell(this->file);
+  if (offset < 0 || length > this->fileBytes - offset) {
+    return false;
+  }
+
+  value->resize(length);
+  return length == 0 || this->readBytes(&(*value)[0], length);
+}
+
+bool TraceReader::readInterned(std::string* value) {
+  uint64_t reference;
+  if (!this->readVarint(&reference)) {
+    return false;
+  }
+
+  if (reference & 1) {
+    if (!this->readString(value)) {
+      return false;
+    }
+
+    this->internedStrings.push_back(*value);
+    return true;
+  }
+
+  size_t id = reference >> 1;
+  if (id >= this->internedStrings.size()) {
+    return false;
+  }
+
+  *value = this->internedStrings[id];
+  return true;
+}
+
+bool TraceReader::readValue(pp::Var* value, int depth) {
+  if (depth > MAX_VALUE_DEPTH) {
+    return false;
+  }
+
+  uint8_t tag;
+  if (!this->readBytes(&tag, 1)) {
+    return false;
+  }
+
+  switch (tag) {
+    case TraceFormat::TAG_UNDEFINED:
+      *value = pp::Var();
+      return true;
+    case TraceFormat::TAG_NULL:
+      *value = pp::Var(pp::Var::Null());
+      return true;
+    case TraceFormat::TAG_FALSE:
+    case TraceFormat::TAG_TRUE:
+      *value = pp::Var(tag == TraceFormat::TAG_TRUE);
+      return true;
+    case TraceFormat::TAG_INT: {
+      uint64_t encoded;
+      if (!this->readVarint(&encoded)) {
+        return false;
+      }
+
+      uint32_t zigzag = static_cast<uint32_t>(encoded);
+      *value = pp::Var(static_cast<int32_t>((zigzag >> 1) ^ -(zigzag & 1)));
+      return true;
+    }
+    case TraceFormat::TAG_DOUBLE: {
+      double doubleValue;
+      if (!this->readBytes(&doubleValue, sizeof(doubleValue))) {
+        return false;
+      }
+
+      *value = pp::Var(doubleValue);
+      return true;
+    }
+    case TraceFormat::TAG_STRING: {
+      std::string stringValue;
+      if (!this->readString(&stringValue)) {
+        return false;
+      }
+
+      *value = pp::Var(stringValue);
+      return true;
+    }
+    case TraceFormat::TAG_ARRAY: {
+      uint64_t count;
+      if (!this->readVarint(&count)) {
+        return false;
+      }
+
+      pp::VarArray array;
+      for (uint64_t i = 0; i < count; i++) {
+        pp::Var element;
+        if (!this->readValue(&element, depth + 1)) {
+          return false;
+        }
+
+        array.Set(static_cast<uint32_t>(i), element);
+      }
+
+      *value = array;
+      return true;
+    }
+    case TraceFormat::TAG_DICTIONARY: {
+      uint64_t count;
+      if (!this->readVarint(&count)) {
+        return false;
+      }
+
+      pp::VarDictionary dict;
+      for (uint64_t i = 0; i < count; i++) {
+        std::string key;
+        if (!this->readInterned(&key)) {
+          return false;
+        }
+
+        pp::Var element;
+        if (!this->readValue(&element, depth + 1)) {
+          return false;
+        }
+
+        dict.Set(pp::Var(key), element);
+      }
+
+      *value = dict;
+      return true;
+    }
+    case TraceFormat::TAG_ARRAY_BUFFER: {
+      uint64_t byteLength;
+      if (!this->readVarint(&byteLength)) {
+        return false;
+      }
+
+      // Contents are never recorded so replay with zeroes.
+      pp::VarArrayBuffer buffer(static_cast<uint32_t>(byteLength));
+      if (byteLength > 0) {
+        memset(buffer.Map(), 0, byteLength);
+        buffer.Unmap();
+      }
+
+      *value = buffer;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,163 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_REQUEST_TRACE_H_
+#define NACL_REQUEST_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ppapi/cpp/var.h"
+
+namespace pp {
+class VarArray;
+class VarDictionary;
+}
+
+namespace NaclFsp {
+
+// Request traces are a compact binary log of the messages that arrived at
+// the module. They are captured from real Files app sessions and replayed
+// against a host build (see replay/) to compare builds on realistic load.
+//
+// File layout (all multi byte integers are unsigned LEB128 varints):
+//
+//   Header: "NFSPTRC" <version:1 byte> <flags:1 byte>
+//   Record: <arrivalDeltaMicros> <serviceMicros> <messageId>
+//           <string functionName> <value args>
+//
+// Strings that repeat a lot (function names and dictionary keys) are
+// interned. The first use writes (id << 1 | 1) followed by the length and
+// bytes, later uses just write (id << 1).
+//
+// Values are a tag byte followed by a payload. ArrayBuffer contents are
+// never written, only their length. Credentials are always dropped, and when
+// TRACE_FLAG_HASHED_PATHS is set every path component is replaced by a hash
+// so the trace keeps the shape of the tree without leaking names. Key names
+// are kept so options added later still replay, except for the host names
+// custom_enumerateFileShares is keyed by.
+class TraceFormat {
+ public:
+  static const char kMagic[];
+  static const size_t kMagicLength = 7;
+  static const uint8_t kVersion = 1;
+
+  enum Flags { TRACE_FLAG_HASHED_PATHS = 1 };
+
+  enum Tag {
+    TAG_UNDEFINED = 0,
+    TAG_NULL = 1,
+    TAG_FALSE = 2,
+    TAG_TRUE = 3,
+    TAG_INT = 4,  // Zig-zag encoded varint.
+    TAG_DOUBLE = 5,  // 8 raw bytes.
+    TAG_STRING = 6,  // Varint length and bytes.
+    TAG_ARRAY = 7,  // Varint count and values.
+    TAG_DICTIONARY = 8,  // Varint count and (interned key, value) pairs.
+    TAG_ARRAY_BUFFER = 9  // Varint byte length only.
+  };
+};
+
+class TraceRecorder {
+ public:
+  TraceRecorder();
+  ~TraceRecorder();
+
+  bool Start(const std::string& path, bool hashPaths);
+  void Stop();
+  bool IsRecording() const { return this->file != NULL; }
+
+  // Appends a record for a request that arrived at arrivalMicros (monotonic)
+  // and took serviceMicros to handle.
+  void Record(const std::string& functionName, int messageId,
+              const pp::VarArray& args, uint64_t arrivalMicros,
+              uint64_t serviceMicros);
+
+  size_t recordCount() const { return this->records; }
+  uint64_t bytesWritten() const { return this->written; }
+
+ private:
+  FILE* file;
+  bool hashPaths;
+  uint64_t lastArrivalMicros;
+  size_t records;
+  uint64_t written;
+  std::vector<uint8_t> buffer;
+  std::map<std::string, uint32_t> internedStrings;
+
+  void writeVarint(uint64_t value);
+  void writeBytes(const void* data, size_t length);
+  void writeInterned(const std::string& value);
+  void writeString(const std::string& value);
+  void writeValue(const pp::Var& value, const std::string& key);
+  // Writes the host name to IP map of custom_enumerateFileShares.
+  void writeHostMap(const pp::VarDictionary& hostMap);
+  void flush();
+
+  std::string scrub(const std::string& key, const std::string& value);
+
+  // Prevent copy and assignment.
+  TraceRecorder(const TraceRecorder&);
+  TraceRecorder& operator=(const TraceRecorder&);
+};
+
+class TraceRecord {
+ public:
+  TraceRecord() : arrivalDeltaMicros(0), serviceMicros(0), messageId(0) {}
+
+  uint64_t arrivalDeltaMicros;
+  uint64_t serviceMicros;
+  int messageId;
+  std::string functionName;
+  pp::Var args;
+};
+
+class TraceReader {
+ public:
+  TraceReader();
+  ~TraceReader();
+
+  bool Open(const std::string& path);
+  bool hasHashedPaths() const {
+    return (this->flags & TraceFormat::TRACE_FLAG_HASHED_PATHS) != 0;
+  }
+
+  // Returns false at the end of the trace or if the record was malformed.
+  bool Next(TraceRecord* record);
+
+ private:
+  FILE* file;
+  uint8_t flags;
+  // So a corrupt length can't ask for more than the file holds.
+  uint64_t fileBytes;
+  std::vector<std::string> internedStrings;
+
+  bool readVarint(uint64_t* value);
+  bool readBytes(void* data, size_t length);
+  bool readInterned(std::string* value);
+  bool readString(std::string* value);
+  bool readValue(pp::Var* value, int depth);
+
+  // Prevent copy and assignment.
+  TraceReader(const TraceReader&);
+  TraceReader& operator=(const TraceReader&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_REQUEST_TRACE_H_
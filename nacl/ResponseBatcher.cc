@@ -0,0 +1,125 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ResponseBatcher.h"
+
+#include "VarKeys.h"
+#include "util.h"
+
+#include "ppapi/cpp/var_array_buffer.h"
+#include "ppapi_simple/ps.h"
+#include "ppapi_simple/ps_interface.h"
+
+namespace NaclFsp {
+
+ResponseBatcher::ResponseBatcher()
+    : enabled(false),
+      maxResponses(kDefaultMaxResponses),
+      windowMicros(kDefaultWindowMicros),
+      firstPendingMicros(0),
+      pendingCount(0),
+      pendingBytes(0),
+      responses(0),
+      messages(0) {}
+
+void ResponseBatcher::Configure(bool enabled, size_t maxResponses,
+                                uint64_t windowMicros) {
+  // Don't strand anything queued under the old settings.
+  this->Flush();
+
+  this->enabled = enabled;
+  this->maxResponses = maxResponses > 0 ? maxResponses : 1;
+  this->windowMicros = windowMicros;
+}
+
+void ResponseBatcher::Post(const pp::VarDictionary& response, bool hasMore) {
+  this->responses++;
+  if (!this->enabled || hasMore) {
+    this->Flush();
+    this->postMessage(response);
+    return;
+  }
+
+  uint64_t now = Util::monotonicMicros();
+  if (this->pendingCount == 0) {
+    this->firstPendingMicros = now;
+  }
+
+  this->pending.Set(this->pendingCount++, response);
+  const VarKeys& keys = VarKeys::Get();
+  pp::Var value = pp::VarDictionary(response.Get(keys.result)).Get(keys.value);
+  if (value.is_array_buffer()) {
+    this->pendingBytes += pp::VarArrayBuffer(value).ByteLength();
+  }
+
+  // The idle loop only gets to look at the window between requests, so a
+  // handler sending many replies has to check it here too.
+  if (this->pendingCount >= this->maxResponses ||
+      now - this->firstPendingMicros >= this->windowMicros) {
+    this->Flush();
+  }
+}
+
+uint64_t ResponseBatcher::FlushIfDue() {
+  if (this->pendingCount == 0) {
+    return 0;
+  }
+
+  uint64_t elapsed = Util::monotonicMicros() - this->firstPendingMicros;
+  if (elapsed >= this->windowMicros) {
+    this->Flush();
+    return 0;
+  }
+
+  return this->windowMicros - elapsed;
+}
+
+uint64_t ResponseBatcher::DueMicros() const {
+  if (this->pendingCount == 0) {
+    return 0;
+  }
+
+  return this->firstPendingMicros + this->windowMicros;
+}
+
+void ResponseBatcher::Flush() {
+  if (this->pendingCount == 0) {
+    return;
+  }
+
+  // A lone response goes out as is so the JS side skips the unpacking.
+  if (this->pendingCount == 1) {
+    this->postMessage(this->pending.Get(0));
+  } else {
+    this->postMessage(this->pending);
+  }
+
+  this->pending = pp::VarArray();
+  this->pendingCount = 0;
+  this->pendingBytes = 0;
+}
+
+void ResponseBatcher::TrimMemory(size_t targetBytes) {
+  if (this->pendingBytes > targetBytes) {
+    this->Flush();
+  }
+}
+
+void ResponseBatcher::postMessage(const pp::Var& message) {
+  this->messages++;
+  PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), message.pp_var());
+}
+
+}  // namespace NaclFsp
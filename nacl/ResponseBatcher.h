@@ -0,0 +1,87 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_RESPONSE_BATCHER_H_
+#define NACL_RESPONSE_BATCHER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "MemoryBudget.h"
+#include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_dictionary.h"
+
+namespace NaclFsp {
+
+// Coalesces responses into a single array message so a burst of small
+// replies (eg. getMetadata for every thumbnail in a folder) costs one
+// PostMessage instead of one each. Responses are held until maxResponses
+// are pending or windowMicros have passed since the first one was queued.
+// A streamed response with more to follow is posted straight away, along
+// with anything before it, since the rest of its request can take a while.
+// When disabled every response is posted immediately.
+//
+// File data held in pending responses counts against the memory budget
+// and trimming just posts them early.
+class ResponseBatcher : public MemoryConsumer {
+ public:
+  static const size_t kDefaultMaxResponses = 64;
+  static const uint64_t kDefaultWindowMicros = 2000;
+
+  ResponseBatcher();
+
+  void Configure(bool enabled, size_t maxResponses, uint64_t windowMicros);
+  bool IsEnabled() const { return this->enabled; }
+  bool HasPending() const { return this->pendingCount > 0; }
+
+  void Post(const pp::VarDictionary& response, bool hasMore);
+
+  // Posts the pending responses if the window has expired. Returns how many
+  // micros remain until it expires or 0 if nothing is pending.
+  uint64_t FlushIfDue();
+  void Flush();
+
+  // When the window of the pending responses expires (monotonic micros),
+  // or 0 if nothing is pending.
+  uint64_t DueMicros() const;
+
+  uint64_t responsesPosted() const { return this->responses; }
+  uint64_t messagesPosted() const { return this->messages; }
+
+  virtual size_t MemoryUsage() const { return this->pendingBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  bool enabled;
+  size_t maxResponses;
+  uint64_t windowMicros;
+  uint64_t firstPendingMicros;
+  pp::VarArray pending;
+  uint32_t pendingCount;
+  // Bytes of the ArrayBuffers in pending responses.
+  size_t pendingBytes;
+  uint64_t responses;
+  uint64_t messages;
+
+  void postMessage(const pp::Var& message);
+
+  // Prevent copy and assignment.
+  ResponseBatcher(const ResponseBatcher&);
+  ResponseBatcher& operator=(const ResponseBatcher&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_RESPONSE_BATCHER_H_
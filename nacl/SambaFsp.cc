@@ -17,9 +17,15 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <set>
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/cpp/var_dictionary.h"
+#include "MimeTypeResolver.h"
+#include "VarKeys.h"
 #include "util.h"
 #include "sys/mount.h"
 #include <fstream>
@@ -27,14 +33,565 @@ namespace NaclFsp {
 
 // Define static
 SambaFsp::CredentialStore SambaFsp::Credentials;
+pthread_mutex_t SambaFsp::CredentialsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Upper bound on threads used for work that fans out across servers.
+static const size_t MAX_WORKER_THREADS = 32;
+
+// Verbose samba logging is very slow so it is off unless custom_configure
+// asks for it.
+static const int DEFAULT_DEBUG_LEVEL = 0;
+
+// How long to wait before each reconnect attempt. A blip after a Wi-Fi roam
+// is usually over by the first one.
+static const useconds_t RECONNECT_BACKOFF_MICROS[] = {100000, 400000,
+                                                      1600000};
+static const int MAX_RECOVERY_ATTEMPTS =
+    sizeof(RECONNECT_BACKOFF_MICROS) / sizeof(RECONNECT_BACKOFF_MICROS[0]);
+
+// batchGetMetadata stats this many paths at once, each on its own
+// connection, and gives up on any that take longer than the timeout.
+static const size_t BATCH_STAT_CONCURRENCY = 8;
+static const uint64_t BATCH_STAT_TIMEOUT_MICROS = 10000000;
+
+// When hedging is on a stat or listing slower than the 95th percentile of
+// recent ones is sent again, with at most one in twenty hedged.
+static const double HEDGE_PERCENTILE = 0.95;
+static const double MAX_HEDGE_FRACTION = 0.05;
+static const uint64_t HEDGE_TIMEOUT_MICROS = 30000000;
+// readDirectory isn't limited so neither is a hedged listing.
+static const size_t MAX_HEDGED_LIST_ENTRIES = static_cast<size_t>(-1);
+
+// readDirectory sends the first batch of stat()'d entries once this much
+// time has passed so something shows quickly even on a slow link. Later
+// batches are sized from the measured cost of a stat() to go out about
+// every STAT_BATCH_MICROS.
+static const uint64_t FIRST_STAT_BATCH_MICROS = 100000;
+static const uint64_t STAT_BATCH_MICROS = 250000;
+static const size_t MAX_STAT_BATCH_ENTRIES = 512;
+
+// The popup only needs these to list the shares on a host.
+static const uint32_t SHARE_FIELDS = FieldMaskMixin::FIELD_NAME |
+                                     FieldMaskMixin::FIELD_IS_DIRECTORY |
+                                     FieldMaskMixin::FIELD_FULL_PATH;
+
+// custom_find lists this many directories at once and streams matches in
+// batches of up to FIND_BATCH_ENTRIES or every FIND_BATCH_MICROS.
+static const size_t FIND_CONCURRENCY = 8;
+static const uint64_t FIND_DIRECTORY_TIMEOUT_MICROS = 30000000;
+static const size_t FIND_BATCH_ENTRIES = 200;
+static const uint64_t FIND_BATCH_MICROS = 250000;
+static const uint32_t FIND_FIELDS = FieldMaskMixin::FIELD_NAME |
+                                    FieldMaskMixin::FIELD_IS_DIRECTORY |
+                                    FieldMaskMixin::FIELD_FULL_PATH;
+
+// custom_computeTreeSize walks this many directories at once and sends
+// the running totals every TREE_SIZE_PROGRESS_MICROS. Per directory totals
+// are kept for TREE_SIZE_CACHE_TTL_MICROS.
+static const size_t TREE_SIZE_CONCURRENCY = 8;
+static const uint64_t TREE_SIZE_DIRECTORY_TIMEOUT_MICROS = 60000000;
+static const uint64_t TREE_SIZE_PROGRESS_MICROS = 250000;
+static const size_t TREE_SIZE_CACHE_DIRECTORIES = 20000;
+static const uint64_t TREE_SIZE_CACHE_TTL_MICROS = 600000000;
+
+// custom_hashFiles reads this many files at once and streams the digests
+// in batches of up to HASH_BATCH_ENTRIES or every HASH_BATCH_MICROS. The
+// timeout only catches a connection that has stopped moving so it is long
+// enough to read a big file.
+static const size_t HASH_CONCURRENCY = 4;
+static const uint64_t HASH_FILE_TIMEOUT_MICROS = 3600000000ULL;
+static const size_t HASH_BATCH_ENTRIES = 100;
+static const uint64_t HASH_BATCH_MICROS = 250000;
+static const char DEFAULT_HASH_ALGORITHM[] = "sha256";
+
+// Delta uploads keep block signatures for this many recently written files
+// and this many blocks in all. A truncate waiting for its file to be opened
+// is applied anyway after PENDING_TRUNCATE_MICROS.
+static const size_t BLOCK_SIGNATURE_FILES = 64;
+static const size_t BLOCK_SIGNATURE_BLOCKS = 512 * 1024;
+static const uint64_t PENDING_TRUNCATE_MICROS = 2000000;
+
+// custom_readDirectoryDiff keeps the last listing of this many directories,
+// with up to DIFF_LISTING_ENTRIES entries in all. Entries that need no
+// stat() are streamed in batches of DIFF_BATCH_ENTRIES, the rest as the
+// stat()s finish on the same schedule as readDirectory. When more than
+// this percentage of the stat()s fail the refresh fails rather than keep
+// so much of the old listing.
+static const size_t DIFF_LISTING_DIRECTORIES = 32;
+static const size_t DIFF_LISTING_ENTRIES = 200000;
+static const size_t DIFF_BATCH_ENTRIES = 500;
+static const size_t DIFF_MAX_FAILED_STAT_PERCENT = 25;
+
+// The central directories of this many recently opened archives, with up
+// to ARCHIVE_CACHE_ENTRIES members in all, are kept. Listings are streamed
+// in batches of ARCHIVE_BATCH_ENTRIES and members in ARCHIVE_CHUNK_BYTES.
+static const size_t ARCHIVE_CACHE_ARCHIVES = 16;
+static const size_t ARCHIVE_CACHE_ENTRIES = 200000;
+static const size_t ARCHIVE_BATCH_ENTRIES = 500;
+static const size_t ARCHIVE_CHUNK_BYTES = 512 * 1024;
+static const uint32_t ARCHIVE_FIELDS =
+    FieldMaskMixin::FIELD_NAME | FieldMaskMixin::FIELD_IS_DIRECTORY |
+    FieldMaskMixin::FIELD_SIZE | FieldMaskMixin::FIELD_MODIFICATION_TIME |
+    FieldMaskMixin::FIELD_FULL_PATH;
+
+// Thumbnails of recently viewed folders are kept up to this size.
+static const size_t THUMBNAIL_CACHE_BYTES = 8 * 1024 * 1024;
+
+// custom_reapIdle closes connections nobody has used for this long, and
+// files that haven't been read or written for this long are taken to have
+// lost their closeFile. Both can be changed with custom_configure.
+static const uint64_t DEFAULT_IDLE_SESSION_MICROS = 600000000;
+static const uint64_t DEFAULT_IDLE_HANDLE_MICROS = 1800000000;
+
+// After this long without a request the servers are checked with a short
+// timeout first, so a connection that died in the meantime is replaced
+// straight away rather than after the next request times out on it.
+static const uint64_t PROBE_AFTER_IDLE_MICROS = 60000000;
+static const int PROBE_TIMEOUT_MS = 2000;
+
+// Order the caches are trimmed in when the module is over its memory
+// budget. Prefetched listings are a guess and cheapest to lose; block
+// signatures cost a whole file read to get back.
+static const int PREFETCH_MEMORY_PRIORITY = 10;
+static const int THUMBNAIL_MEMORY_PRIORITY = 20;
+static const int TREE_SIZE_MEMORY_PRIORITY = 30;
+static const int LISTING_VERSION_MEMORY_PRIORITY = 35;
+static const int ARCHIVE_MEMORY_PRIORITY = 40;
+static const int BLOCK_SIGNATURE_MEMORY_PRIORITY = 50;
+
+static bool isConnectionError(int error) {
+  return error == ECONNABORTED || error == ECONNRESET || error == ETIMEDOUT;
+}
+
+static void setEntryStatInfo(const struct stat& statInfo,
+                             EntryMetadata* entry) {
+  // TODO(zentaro): Handle some special file types, links etc???
+  entry->isDirectory = S_ISDIR(statInfo.st_mode);
+  entry->size = entry->isDirectory ? 0 : statInfo.st_size;
+  entry->modificationTime = statInfo.st_mtime;
+}
+
+// The value of one custom_readDirectoryDiff message.
+static pp::VarDictionary diffValue(const DiffMessage& message, bool full) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary value;
+  value.Set(keys.added, message.added);
+  value.Set(keys.modified, message.modified);
+  value.Set(keys.unchanged, message.unchanged);
+  value.Set(keys.removed, message.removed);
+  value.Set(keys.full, full);
+  return value;
+}
+
+// Same estimate DirectoryPrefetcher uses for a stored listing.
+static size_t listingBytes(const std::vector<EntryMetadata>& entries) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    bytes += sizeof(EntryMetadata) + entries[i].name.size() +
+             entries[i].fullPath.size();
+  }
+
+  return bytes;
+}
+
+static pp::VarDictionary hedgeStats(const HedgePolicy& policy) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary stats;
+  stats.Set(keys.requests, static_cast<double>(policy.requests()));
+  stats.Set(keys.hedgesSent, static_cast<double>(policy.hedgesSent()));
+  stats.Set(keys.hedgeWins, static_cast<double>(policy.hedgeWins()));
+  stats.Set(keys.hedgesSkipped, static_cast<double>(policy.hedgesSkipped()));
+  stats.Set(keys.delayMicros, static_cast<double>(policy.currentDelayMicros()));
+  return stats;
+}
+
+namespace {
+
+// Ranged reads of a file opened with smbc_open for ExifThumbnailExtractor
+// and the zip reader.
+class SambaFileRangeReader : public RangeReader {
+ public:
+  explicit SambaFileRangeReader(int fileId) : fileId(fileId), bytesRead(0) {}
+
+  virtual bool ReadRange(uint64_t offset, size_t length,
+                         std::vector<uint8_t>* data) {
+    if (smbc_lseek(this->fileId, offset, SEEK_SET) < 0) {
+      return false;
+    }
+
+    data->resize(length);
+    size_t total = 0;
+    while (total < length) {
+      ssize_t bytesRead =
+          smbc_read(this->fileId, &(*data)[total], length - total);
+      if (bytesRead < 0) {
+        return false;
+      }
+
+      if (bytesRead == 0) {
+        break;
+      }
+
+      total += bytesRead;
+    }
+
+    data->resize(total);
+    this->bytesRead += total;
+    return true;
+  }
+
+  uint64_t BytesRead() const { return this->bytesRead; }
+
+ private:
+  int fileId;
+  uint64_t bytesRead;
+};
+
+// The same over a file opened on a worker pool context.
+class ContextFileRangeReader : public RangeReader {
+ public:
+  ContextFileRangeReader(SMBCCTX* context, SMBCFILE* file)
+      : context(context), file(file) {}
+
+  virtual bool ReadRange(uint64_t offset, size_t length,
+                         std::vector<uint8_t>* data) {
+    if (smbc_getFunctionLseek(this->context)(this->context, this->file,
+                                             offset, SEEK_SET) < 0) {
+      return false;
+    }
+
+    smbc_read_fn readFn = smbc_getFunctionRead(this->context);
+    data->resize(length);
+    size_t total = 0;
+    while (total < length) {
+      ssize_t bytesRead = readFn(this->context, this->file, &(*data)[total],
+                                 length - total);
+      if (bytesRead < 0) {
+        return false;
+      }
+
+      if (bytesRead == 0) {
+        break;
+      }
+
+      total += bytesRead;
+    }
+
+    data->resize(total);
+    return true;
+  }
+
+ private:
+  SMBCCTX* context;
+  SMBCFILE* file;
+};
+
+// Sets |dataUri| to the EXIF thumbnail of the file, or clears it if there
+// is none. Returns the number of bytes read.
+uint64_t readThumbnail(RangeReader* reader, std::string* dataUri) {
+  ExifThumbnailExtractor extractor(reader);
+  std::vector<uint8_t> jpeg;
+  if (extractor.Extract(&jpeg)) {
+    *dataUri = ExifThumbnailExtractor::ToDataUri(jpeg);
+  } else {
+    dataUri->clear();
+  }
+
+  return extractor.BytesRead();
+}
+
+// Guesses the type of a file with an unknown extension from its first
+// bytes. Empty if they don't give it away either.
+std::string sniffMimeType(RangeReader* reader) {
+  std::vector<uint8_t> header;
+  if (!reader->ReadRange(0, MimeTypeResolver::SNIFF_BYTES, &header) ||
+      header.empty()) {
+    return "";
+  }
+
+  return MimeTypeResolver::FromContent(&header[0], header.size());
+}
+
+}  // namespace
+
+void OpenShareTask::Run(SMBCCTX* context) {
+  SMBCFILE* dir = smbc_getFunctionOpendir(context)(
+      context, this->mountConfig.sharePath.c_str());
+  if (dir == NULL) {
+    this->error = errno;
+    return;
+  }
+
+  smbc_getFunctionClosedir(context)(context, dir);
+}
+
+void StatTask::Run(SMBCCTX* context) {
+  if (smbc_getFunctionStat(context)(context, this->fullPath.c_str(),
+                                    &this->statInfo) < 0) {
+    this->error = errno;
+    return;
+  }
+
+  if (S_ISDIR(this->statInfo.st_mode)) {
+    return;
+  }
+
+  bool thumbnail =
+      this->wantThumbnail &&
+      !(this->hasCachedThumbnail &&
+        this->cachedThumbnailTime == this->statInfo.st_mtime);
+  bool sniff = this->wantMimeSniff && this->statInfo.st_size > 0;
+  if (!thumbnail && !sniff) {
+    return;
+  }
+
+  SMBCFILE* file = smbc_getFunctionOpen(context)(
+      context, this->fullPath.c_str(), O_RDONLY, 0);
+  if (file == NULL) {
+    this->openError = errno;
+    return;
+  }
+
+  ContextFileRangeReader reader(context, file);
+  if (sniff) {
+    this->mimeType = sniffMimeType(&reader);
+  }
+
+  if (thumbnail) {
+    this->thumbnailBytesRead = readThumbnail(&reader, &this->thumbnail);
+    this->thumbnailRead = true;
+  }
+
+  smbc_getFunctionClose(context)(context, file);
+}
+
+void FindTask::visitEntry(SMBCCTX* context, const std::string& name,
+                          const std::string& fullPath, bool isDirectory) {
+  if (this->pattern.Matches(name)) {
+    EntryMetadata entry;
+    entry.name = name;
+    entry.fullPath = fullPath;
+    entry.isDirectory = isDirectory;
+    this->matches.push_back(entry);
+  }
+}
+
+bool ArchiveMemberSink::Write(const uint8_t* data, size_t length) {
+  while (length > 0) {
+    // Whole chunks go straight out when nothing is waiting.
+    if (this->pending.empty() && length >= this->chunkBytes) {
+      this->send(data, this->chunkBytes);
+      data += this->chunkBytes;
+      length -= this->chunkBytes;
+      continue;
+    }
+
+    size_t count = std::min(length, this->chunkBytes - this->pending.size());
+    this->pending.insert(this->pending.end(), data, data + count);
+    data += count;
+    length -= count;
+    if (this->pending.size() == this->chunkBytes) {
+      this->Flush();
+    }
+  }
+
+  return true;
+}
+
+void ArchiveMemberSink::Flush() {
+  if (!this->pending.empty()) {
+    this->send(&this->pending[0], this->pending.size());
+    this->pending.clear();
+  }
+}
+
+void ArchiveMemberSink::send(const uint8_t* data, size_t length) {
+  pp::VarArrayBuffer buffer(length);
+  memcpy(buffer.Map(), data, length);
+  buffer.Unmap();
+
+  pp::VarDictionary chunk;
+  this->fsp->setResultFromArrayBuffer(buffer, &chunk);
+  this->fsp->sendMessage("custom_readArchiveMember", this->messageId, chunk,
+                         true);
+  this->sent += length;
+}
+
+SambaFsp::SambaFsp()
+    : context(NULL),
+      debugLevel(DEFAULT_DEBUG_LEVEL),
+      useKerberos(true),
+      sniffMimeTypes(true),
+      workerPool(SambaFsp::auth_fn, MAX_WORKER_THREADS),
+      thumbnailCache(THUMBNAIL_CACHE_BYTES),
+      directoryPrefetcher(SambaFsp::auth_fn),
+      treeSizeCache(TREE_SIZE_CACHE_DIRECTORIES, TREE_SIZE_CACHE_TTL_MICROS),
+      deltaUpload(false),
+      blockSignatures(BLOCK_SIGNATURE_FILES, BLOCK_SIGNATURE_BLOCKS),
+      archiveDirectories(ARCHIVE_CACHE_ARCHIVES, ARCHIVE_CACHE_ENTRIES),
+      directoryVersions(DIFF_LISTING_DIRECTORIES, DIFF_LISTING_ENTRIES),
+      hedging(false),
+      statHedging(HEDGE_PERCENTILE, MAX_HEDGE_FRACTION),
+      listHedging(HEDGE_PERCENTILE, MAX_HEDGE_FRACTION),
+      idleSessionMicros(DEFAULT_IDLE_SESSION_MICROS),
+      idleHandleMicros(DEFAULT_IDLE_HANDLE_MICROS),
+      lastOperationMicros(0),
+      sessionsOpen(false),
+      pendingTruncateLength(0),
+      pendingTruncateMicros(0),
+      failedTruncateError(0),
+      reconnects(0),
+      replayedOperations(0),
+      reopenedFiles(0),
+      thumbnailsExtracted(0),
+      thumbnailsMissing(0),
+      thumbnailCacheHits(0),
+      thumbnailBytesRead(0),
+      filesHashed(0),
+      bytesHashed(0),
+      archivesListed(0),
+      archiveDirectoryHits(0),
+      archiveBytesRead(0),
+      archiveMembersRead(0),
+      archiveBytesInflated(0),
+      listingDiffs(0),
+      fullListings(0),
+      diffEntriesSent(0),
+      diffEntriesUnchanged(0),
+      deltaFiles(0),
+      deltaBytesSaved(0),
+      deltaBytesWritten(0),
+      deltaBytesRead(0),
+      deltaSignatureHits(0),
+      idleSessionsClosed(0),
+      handlesReaped(0),
+      sessionProbes(0),
+      staleSessions(0) {
+  // Nothing talks to samba until the first request arrives. See
+  // ensureContext().
+  this->logger.Debug("SambaFsp constructor");
+
+  this->memoryBudget.Register("prefetchedListings", &this->directoryPrefetcher,
+                              PREFETCH_MEMORY_PRIORITY);
+  this->memoryBudget.Register("thumbnails", &this->thumbnailCache,
+                              THUMBNAIL_MEMORY_PRIORITY);
+  this->memoryBudget.Register("treeSizes", &this->treeSizeCache,
+                              TREE_SIZE_MEMORY_PRIORITY);
+  this->memoryBudget.Register("listingVersions", &this->directoryVersions,
+                              LISTING_VERSION_MEMORY_PRIORITY);
+  this->memoryBudget.Register("archiveDirectories", &this->archiveDirectories,
+                              ARCHIVE_MEMORY_PRIORITY);
+  this->memoryBudget.Register("blockSignatures", &this->blockSignatures,
+                              BLOCK_SIGNATURE_MEMORY_PRIORITY);
+}
+
+bool SambaFsp::prepareForOperation(pp::VarDictionary* result) {
+  if (!this->ensureContext()) {
+    this->setErrorResult("FAILED", result);
+    return false;
+  }
+
+  uint64_t nowMicros = Util::monotonicMicros();
+  if (this->sessionsOpen &&
+      nowMicros - this->lastOperationMicros >= PROBE_AFTER_IDLE_MICROS) {
+    this->probeSessions();
+  }
+
+  this->lastOperationMicros = nowMicros;
+  this->sessionsOpen = true;
+  return true;
+}
+
+void SambaFsp::reapIdle(pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  uint64_t nowMicros = Util::monotonicMicros();
+  double reaped = 0;
+
+  if (this->idleHandleMicros > 0) {
+    std::vector<int> orphaned;
+    for (std::map<int, OpenFileInfo>::iterator it = this->openFiles.begin();
+         it != this->openFiles.end(); ++it) {
+      if (nowMicros - it->second.lastUsedMicros >= this->idleHandleMicros) {
+        orphaned.push_back(it->first);
+      }
+    }
+
+    // Closed the same way closeFile would so a held truncate still lands.
+    for (size_t i = 0; i < orphaned.size(); i++) {
+      this->logger.Info("reapIdle: Closing orphaned file " +
+                        Util::ToString(orphaned[i]));
+      CloseFileOptions options;
+      options.openRequestId = orphaned[i];
+      pp::VarDictionary ignored;
+      this->closeFile(options, &ignored);
+      reaped++;
+    }
+
+    this->handlesReaped += orphaned.size();
+  }
+
+  // Open files keep their connection.
+  bool closeSessions =
+      this->idleSessionMicros > 0 && this->sessionsOpen &&
+      this->openFiles.empty() && this->pendingTruncatePath.empty() &&
+      nowMicros - this->lastOperationMicros >= this->idleSessionMicros;
+  if (closeSessions) {
+    this->logger.Info("reapIdle: Closing idle connections");
+    if (this->context != NULL) {
+      smbc_getFunctionPurgeCachedServers(this->context)(this->context);
+    }
+
+    this->workerPool.CloseIdleConnections();
+    this->directoryPrefetcher.CloseIdleConnections();
+    this->sessionsOpen = false;
+    this->idleSessionsClosed++;
+  }
+
+  result->Set(keys.handlesReaped, reaped);
+  result->Set(keys.sessionsClosed, closeSessions);
+}
+
+bool SambaFsp::hasBackgroundWork() const {
+  uint64_t dueMicros = this->backgroundWorkDueMicros();
+  return this->directoryPrefetcher.HasReadyWork() ||
+         (dueMicros != 0 && dueMicros <= Util::monotonicMicros());
+}
+
+uint64_t SambaFsp::backgroundWorkDueMicros() const {
+  // Listings finishing on the prefetch threads call the wakeup hook.
+  if (this->pendingTruncatePath.empty()) {
+    return 0;
+  }
+
+  return this->pendingTruncateMicros + PENDING_TRUNCATE_MICROS;
+}
+
+void SambaFsp::doBackgroundWork() {
+  uint64_t dueMicros = this->backgroundWorkDueMicros();
+  if (dueMicros != 0 && dueMicros <= Util::monotonicMicros()) {
+    this->flushPendingTruncate();
+  }
+
+  this->directoryPrefetcher.Pump(0);
+}
+
+void SambaFsp::SetWakeupHook(void (*hook)()) {
+  this->directoryPrefetcher.SetCompletedHook(hook);
+}
+
+bool SambaFsp::ensureContext() {
+  if (this->context != NULL) {
+    return true;
+  }
 
-SambaFsp::SambaFsp() {
-  // TODO(zentaro): Move to init function instead?
+  uint64_t startMicros = Util::monotonicMicros();
 
-  // Mounting in-memory file share to load smb.conf
+  // Mounting in-memory file share to load smb.conf. The worker threads
+  // create their own contexts and read the same file.
   ::mount("", "/etc/samba/.smb", "memfs", 0, "");
   std::ofstream myfile;
-  char myEnv[]="HOME=/etc/samba";
+  // putenv keeps the pointer so this must outlive the call.
+  static char myEnv[] = "HOME=/etc/samba";
   putenv(myEnv);
   myfile.open("/etc/samba/.smb/smb.conf", std::fstream::in | std::fstream::out | std::fstream::trunc);
   if (myfile.is_open()) {
@@ -45,34 +602,102 @@ SambaFsp::SambaFsp() {
            "client min protocol = SMB2";
     myfile.close();
   }
-  int debugLevel = 100;
-
-  this->logger.Debug("SambaFsp constructor");
 
   this->logger.Debug("Creating samba context");
   SMBCCTX* context = smbc_new_context();
   if (!context) {
     this->logger.Error("SambaFsp: Could not create context");
-    return;
+    return false;
   }
 
   this->logger.Debug("SambaFsp: Setting debug level");
-  smbc_setDebug(context, debugLevel);
+  smbc_setDebug(context, this->debugLevel);
 
   this->logger.Debug("SambaFsp: Setting up the auth callback function");
   smbc_setFunctionAuthData(context, SambaFsp::auth_fn);
-  smbc_setOptionUseKerberos(context, 1);
+  smbc_setOptionUseKerberos(context, this->useKerberos);
   smbc_setOptionFallbackAfterKerberos(context, 1);
 
   this->logger.Debug("SambaFsp: Initializing the context");
   if (!smbc_init_context(context)) {
     smbc_free_context(context, 0);
     this->logger.Error("SambaFsp: Could not initialize smbc context");
-    return;
+    return false;
   }
 
   this->logger.Debug("SambaFsp: Setting the context");
   smbc_set_context(context);
+  this->context = context;
+
+  this->logger.Info("SambaFsp: Context ready in " +
+                    Util::ToString(Util::monotonicMicros() - startMicros) +
+                    "us");
+  return true;
+}
+
+void SambaFsp::configure(const pp::VarDictionary& options,
+                         pp::VarDictionary* applied) {
+  const VarKeys& keys = VarKeys::Get();
+  if (!options.HasKey(keys.samba)) {
+    return;
+  }
+
+  // Settings apply straight away if the context already exists, otherwise
+  // when it is created.
+  pp::VarDictionary samba(options.Get(keys.samba));
+  if (samba.HasKey(keys.debugLevel)) {
+    this->debugLevel = samba.Get(keys.debugLevel).AsInt();
+    if (this->context != NULL) {
+      smbc_setDebug(this->context, this->debugLevel);
+    }
+  }
+
+  if (samba.HasKey(keys.useKerberos)) {
+    this->useKerberos = samba.Get(keys.useKerberos).AsBool();
+    if (this->context != NULL) {
+      smbc_setOptionUseKerberos(this->context, this->useKerberos);
+    }
+  }
+
+  if (samba.HasKey(keys.sniffMimeTypes)) {
+    this->sniffMimeTypes = samba.Get(keys.sniffMimeTypes).AsBool();
+  }
+
+  if (samba.HasKey(keys.prefetchDirectories)) {
+    this->directoryPrefetcher.SetEnabled(
+        samba.Get(keys.prefetchDirectories).AsBool());
+  }
+
+  if (samba.HasKey(keys.persistentCache)) {
+    this->metadataStore.SetEnabled(samba.Get(keys.persistentCache).AsBool());
+  }
+
+  if (samba.HasKey(keys.deltaUpload)) {
+    this->deltaUpload = samba.Get(keys.deltaUpload).AsBool();
+    if (!this->deltaUpload) {
+      this->flushPendingTruncate();
+    }
+  }
+
+  if (samba.HasKey(keys.hedging)) {
+    this->hedging = samba.Get(keys.hedging).AsBool();
+  }
+
+  if (samba.HasKey(keys.idleSessionSeconds)) {
+    this->idleSessionMicros = static_cast<uint64_t>(
+        samba.Get(keys.idleSessionSeconds).AsDouble() * 1000000);
+  }
+
+  if (samba.HasKey(keys.idleHandleSeconds)) {
+    this->idleHandleMicros = static_cast<uint64_t>(
+        samba.Get(keys.idleHandleSeconds).AsDouble() * 1000000);
+  }
+
+  this->logger.Info("configure: debugLevel=" +
+                    Util::ToString(this->debugLevel) + " useKerberos=" +
+                    Util::ToString(this->useKerberos) + " sniffMimeTypes=" +
+                    Util::ToString(this->sniffMimeTypes));
+  applied->Set(keys.samba, pp::Var(true));
 }
 
 void SambaFsp::auth_fn(const char* srv, const char* shr, char* wg, int wglen,
@@ -80,9 +705,16 @@ void SambaFsp::auth_fn(const char* srv, const char* shr, char* wg, int wglen,
   // TODO(zentaro): Do better than this. Note duplication in saveCredentials.
   std::string lookup = std::string(srv) + "$$$" + std::string(shr);
   printf("TEMP: lookup=%s\n", lookup.c_str());
+  SambaCredTuple creds;
+  pthread_mutex_lock(&SambaFsp::CredentialsMutex);
   CredentialStore::iterator it = SambaFsp::Credentials.find(lookup);
+  bool found = it != SambaFsp::Credentials.end();
+  if (found) {
+    creds = it->second;
+  }
+  pthread_mutex_unlock(&SambaFsp::CredentialsMutex);
 
-  if (it == SambaFsp::Credentials.end()) {
+  if (!found) {
     if (wglen <= 0 || unlen <= 0 || pwlen <= 0) {
       printf("One of the credential buffers has no size.");
       return;
@@ -94,9 +726,9 @@ void SambaFsp::auth_fn(const char* srv, const char* shr, char* wg, int wglen,
     un[0] = '\0';
     pw[0] = '\0';
   } else {
-    std::string domain = it->second.domain;
-    std::string user = it->second.user;
-    std::string password = it->second.password;
+    std::string domain = creds.domain;
+    std::string user = creds.user;
+    std::string password = creds.password;
 
     if ((static_cast<int>(domain.length()) + 1 > wglen) ||
         (static_cast<int>(user.length()) + 1 > unlen) ||
@@ -116,49 +748,139 @@ void SambaFsp::auth_fn(const char* srv, const char* shr, char* wg, int wglen,
   }
 }
 
-void SambaFsp::handleCustomMessage(const std::string& functionName,
-                                   const pp::VarArray& args,
-                                   pp::VarDictionary* result) {
-  if (functionName == "custom_enumerateFileShares") {
-    pp::VarDictionary hostMap(args.Get(0));
-    pp::VarArray hostNames = hostMap.GetKeys();
-    std::vector<EntryMetadata> fileShares;
-    for (size_t i = 0; i < hostNames.GetLength(); i++) {
-      std::string hostName = hostNames.Get(i).AsString();
-      std::string ip = hostMap.Get(hostNames.Get(i)).AsString();
-      pp::VarDictionary tempResult;
-      std::string resolvedRootUrl = "smb://" + ip;
-      std::string namedRootUrl = "\\\\" + hostName + "\\";
-
-      std::vector<EntryMetadata> sharesInRoot;
-      if (this->readFileShares(resolvedRootUrl, &sharesInRoot, &tempResult)) {
-        for (std::vector<EntryMetadata>::iterator it = sharesInRoot.begin();
-             it != sharesInRoot.end(); ++it) {
-          it->fullPath = namedRootUrl + it->name;
-          fileShares.push_back(*it);
-        }
-      } else {
-        this->logger.Error("Failed to find shares in root " + hostName);
-      }
-    }
+// NOTE: Must stay sorted by function name.
+const SambaFsp::CustomMessageHandlerEntry SambaFsp::kCustomMessageHandlers[] = {
+    {"custom_batchMount", &SambaFsp::batchMount},
+    {"custom_computeTreeSize", &SambaFsp::computeTreeSize},
+    {"custom_enumerateFileShares", &SambaFsp::enumerateFileShares},
+    {"custom_find", &SambaFsp::find},
+    {"custom_hashFile", &SambaFsp::hashFile},
+    {"custom_hashFiles", &SambaFsp::hashFiles},
+    {"custom_listArchive", &SambaFsp::listArchive},
+    {"custom_readArchiveMember", &SambaFsp::readArchiveMember},
+    {"custom_readDirectoryDiff", &SambaFsp::readDirectoryDiff}};
+
+const size_t SambaFsp::kCustomMessageHandlerCount =
+    sizeof(SambaFsp::kCustomMessageHandlers) /
+    sizeof(SambaFsp::kCustomMessageHandlers[0]);
+
+bool SambaFsp::customMessageHandlerLess(
+    const CustomMessageHandlerEntry& entry, const char* functionName) {
+  return strcmp(entry.functionName, functionName) < 0;
+}
 
-    this->setResultFromEntryMetadataVector(fileShares.begin(), fileShares.end(),
-                                           result);
+bool SambaFsp::handleCustomMessage(const std::string& functionName,
+                                   const pp::VarArray& args, int messageId,
+                                   pp::VarDictionary* result) {
+  // Custom operations read files and sizes so they see a held truncate.
+  this->flushPendingTruncate();
+  const CustomMessageHandlerEntry* end =
+      kCustomMessageHandlers + kCustomMessageHandlerCount;
+  const CustomMessageHandlerEntry* entry =
+      std::lower_bound(kCustomMessageHandlers, end, functionName.c_str(),
+                       customMessageHandlerLess);
+  if (entry != end && functionName == entry->functionName) {
+    (this->*entry->handler)(args, messageId, result);
   } else {
     this->logger.Error("Unknown custom message " + functionName);
   }
+
+  return false;
+}
+
+void SambaFsp::enumerateFileShares(const pp::VarArray& args, int messageId,
+                                   pp::VarDictionary* result) {
+  pp::VarDictionary hostMap(args.Get(0));
+  pp::VarArray hostNames = hostMap.GetKeys();
+  EnumerateFileSharesOptions options;
+  if (args.GetLength() > 1) {
+    options.Set(pp::VarDictionary(args.Get(1)));
+  }
+
+  size_t maxConcurrentHosts = std::min(
+      static_cast<size_t>(std::max(options.maxConcurrentHosts, 1)),
+      MAX_WORKER_THREADS);
+  uint64_t cacheTtlMicros =
+      static_cast<uint64_t>(options.cacheTtlSeconds) * 1000000;
+
+  // Hosts that were seen recently are answered straight away. The rest are
+  // listed on the worker threads and each one is streamed back as soon as
+  // it answers.
+  SmbTaskRunner runner(&this->workerPool, maxConcurrentHosts,
+                       static_cast<uint64_t>(options.hostTimeoutMs) * 1000);
+  uint64_t now = Util::monotonicMicros();
+  for (size_t i = 0; i < hostNames.GetLength(); i++) {
+    std::string hostName = hostNames.Get(i).AsString();
+    std::string ip = hostMap.Get(hostNames.Get(i)).AsString();
+
+    std::vector<std::string> shares;
+    if (this->shareCache.Lookup(ip, now, &shares)) {
+      this->sendFileShares(hostName, shares, messageId);
+    } else {
+      ListSharesTask* task = new ListSharesTask(hostName, ip);
+      task->timeoutMs = options.hostTimeoutMs;
+      runner.Add(task);
+    }
+  }
+
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  while (runner.Next(&finished, &timedOut)) {
+    ListSharesTask* task = static_cast<ListSharesTask*>(finished);
+    if (timedOut) {
+      this->logger.Error("Timed out finding shares in root " + task->hostName);
+    } else if (task->error == 0) {
+      this->shareCache.Store(task->ip, task->shares,
+                             Util::monotonicMicros() + cacheTtlMicros);
+      this->sendFileShares(task->hostName, task->shares, messageId);
+    } else {
+      this->logger.Error("Failed to find shares in root " + task->hostName +
+                         " errno=" + Util::ToString(task->error));
+    }
+  }
+
+  // Every host has been sent already so the final response is empty.
+  std::vector<EntryMetadata> noShares;
+  this->setResultFromEntryMetadataVector(noShares.begin(), noShares.end(),
+                                         SHARE_FIELDS, result);
+}
+
+void SambaFsp::sendFileShares(const std::string& hostName,
+                              const std::vector<std::string>& shares,
+                              int messageId) {
+  if (shares.empty()) {
+    return;
+  }
+
+  std::string namedRootUrl = "\\\\" + hostName + "\\";
+  std::vector<EntryMetadata> fileShares;
+  for (std::vector<std::string>::const_iterator it = shares.begin();
+       it != shares.end(); ++it) {
+    EntryMetadata entry;
+    entry.name = *it;
+    entry.isDirectory = true;
+    entry.fullPath = namedRootUrl + *it;
+    fileShares.push_back(entry);
+  }
+
+  pp::VarDictionary batchResult;
+  this->setResultFromEntryMetadataVector(fileShares.begin(), fileShares.end(),
+                                         SHARE_FIELDS, &batchResult);
+  this->sendMessage("custom_enumerateFileShares", messageId, batchResult,
+                    true);
 }
 
 void SambaFsp::createMountConfig(const pp::VarDictionary& mountInfo,
                                  SambaMountConfig* mountConfig) {
-  mountConfig->sharePath = mountInfo.Get("sharePath").AsString();
-  mountConfig->domain = mountInfo.Get("domain").AsString();
-  mountConfig->user = mountInfo.Get("user").AsString();
-  mountConfig->password = mountInfo.Get("password").AsString();
-  mountConfig->server = mountInfo.Get("server").AsString();
-  mountConfig->path = mountInfo.Get("path").AsString();
-  mountConfig->share = mountInfo.Get("share").AsString();
-  mountConfig->serverIP = mountInfo.Get("serverIP").AsString();
+  const VarKeys& keys = VarKeys::Get();
+  mountConfig->sharePath = mountInfo.Get(keys.sharePath).AsString();
+  mountConfig->domain = mountInfo.Get(keys.domain).AsString();
+  mountConfig->user = mountInfo.Get(keys.user).AsString();
+  mountConfig->password = mountInfo.Get(keys.password).AsString();
+  mountConfig->server = mountInfo.Get(keys.server).AsString();
+  mountConfig->path = mountInfo.Get(keys.path).AsString();
+  mountConfig->share = mountInfo.Get(keys.share).AsString();
+  mountConfig->serverIP = mountInfo.Get(keys.serverIP).AsString();
 }
 
 void SambaFsp::saveCredentials(const SambaMountConfig& mountConfig) {
@@ -178,7 +900,9 @@ void SambaFsp::saveCredentials(const SambaMountConfig& mountConfig) {
   creds.user = mountConfig.user;
   creds.password = mountConfig.password;
 
+  pthread_mutex_lock(&SambaFsp::CredentialsMutex);
   SambaFsp::Credentials[lookupKey] = creds;
+  pthread_mutex_unlock(&SambaFsp::CredentialsMutex);
 
   this->logger.Debug("Cred store size after saving = " +
                      Util::ToString(SambaFsp::Credentials.size()));
@@ -198,11 +922,15 @@ void SambaFsp::removeCredentials(const SambaMountConfig& mountConfig) {
   std::string lookupKey = createCredentialLookupKey(mountConfig);
   this->logger.Debug("Removing with lookup string=" + lookupKey);
 
+  pthread_mutex_lock(&SambaFsp::CredentialsMutex);
   CredentialStore::iterator it = SambaFsp::Credentials.find(lookupKey);
-
-  if (it != SambaFsp::Credentials.end()) {
+  bool found = it != SambaFsp::Credentials.end();
+  if (found) {
     SambaFsp::Credentials.erase(it);
-  } else {
+  }
+  pthread_mutex_unlock(&SambaFsp::CredentialsMutex);
+
+  if (!found) {
     logger.Error("Creds not found to remove.");
   }
 
@@ -231,6 +959,14 @@ void SambaFsp::mount(const MountOptions& options,
     return;
   }
   this->logger.Info("Opened share with id " + Util::ToString(shareId));
+  this->registerMount(options.fileSystemId, mountConfig, shareId);
+
+  smbc_closedir(shareId);
+}
+
+void SambaFsp::registerMount(const std::string& fileSystemId,
+                             const SambaMountConfig& mountConfig,
+                             int shareId) {
   ShareData data;
 
   // TODO(zentaro): Helper function. What about multiple trailing slashes?
@@ -246,64 +982,818 @@ void SambaFsp::mount(const MountOptions& options,
 
   // TODO(zentaro): Is it even needed to store the shareId?
   data.smbShareId = shareId;
-  this->mounts[options.fileSystemId] = data;
-
-  smbc_closedir(shareId);
+  this->mounts[fileSystemId] = data;
 }
 
-void SambaFsp::unmount(const UnmountOptions& options,
-                       pp::VarDictionary* result) {
-  this->logger.Info("Hello from unmount");
-  MountMap::iterator it = this->mounts.find(options.fileSystemId);
-  if (it != this->mounts.end()) {
-    this->mounts.erase(it);
+void SambaFsp::find(const pp::VarArray& args, int messageId,
+                    pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  FindOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  const std::string& shareRoot = this->mounts[options.fileSystemId].shareRoot;
+  std::string root =
+      getFullPathFromRelativePath(options.fileSystemId, options.directoryPath);
+  NamePattern pattern(options.pattern.empty() ? "*" : options.pattern);
+  this->logger.Info("find: " + options.pattern + " in " + root);
+
+  // libsmbclient always lists with a "*" mask so names are matched here,
+  // on the worker threads as each listing arrives.
+  uint64_t startMicros = Util::monotonicMicros();
+  uint64_t deadlineMicros =
+      startMicros + static_cast<uint64_t>(options.timeLimitMs) * 1000;
+  TreeWalk walk(&this->workerPool, FIND_CONCURRENCY,
+                FIND_DIRECTORY_TIMEOUT_MICROS, options.maxDepth,
+                deadlineMicros);
+  walk.Add(new FindTask(root, 0, pattern));
+
+  size_t maxResults = static_cast<size_t>(std::max(options.maxResults, 0));
+  size_t matchCount = 0;
+  bool resultLimitReached = false;
+  std::vector<EntryMetadata> batch;
+  uint64_t lastSentMicros = startMicros;
+
+  WalkDirectoryTask* finished = NULL;
+  bool timedOut = false;
+  while (!resultLimitReached && walk.Next(&finished, &timedOut)) {
+    if (timedOut || finished->error != 0) {
+      int error = timedOut ? ETIMEDOUT : finished->error;
+      this->logger.Error("find: Could not list " + finished->directory +
+                         " errno=" + Util::ToString(error));
+      continue;
+    }
+
+    FindTask* task = static_cast<FindTask*>(finished);
+    for (size_t i = 0; i < task->matches.size(); i++) {
+      if (matchCount == maxResults) {
+        resultLimitReached = true;
+        break;
+      }
+
+      // Paths go back relative to the mount like every other operation.
+      batch.push_back(task->matches[i]);
+      batch.back().fullPath = batch.back().fullPath.substr(shareRoot.size());
+      matchCount++;
+    }
+
+    uint64_t now = Util::monotonicMicros();
+    if (batch.size() >= FIND_BATCH_ENTRIES ||
+        (!batch.empty() && now - lastSentMicros >= FIND_BATCH_MICROS)) {
+      pp::VarDictionary batchResult;
+      this->setResultFromEntryMetadataVector(batch.begin(), batch.end(),
+                                             FIND_FIELDS, &batchResult);
+      this->sendMessage("custom_find", messageId, batchResult, true);
+      batch.clear();
+      lastSentMicros = now;
+    }
+  }
+
+  if (!batch.empty()) {
+    pp::VarDictionary batchResult;
+    this->setResultFromEntryMetadataVector(batch.begin(), batch.end(),
+                                           FIND_FIELDS, &batchResult);
+    this->sendMessage("custom_find", messageId, batchResult, true);
   }
+
+  this->logger.Info("find: " + Util::ToString(matchCount) + " matches in " +
+                    Util::ToString(walk.directoriesListed()) +
+                    " directories in " +
+                    Util::ToString(Util::monotonicMicros() - startMicros) +
+                    "us");
+
+  // The last response says whether the search covered everything.
+  pp::VarDictionary summary;
+  summary.Set(keys.matches, static_cast<double>(matchCount));
+  summary.Set(keys.directories, static_cast<double>(walk.directoriesListed()));
+  summary.Set(keys.failedDirectories,
+              static_cast<double>(walk.directoriesFailed()));
+  summary.Set(keys.resultLimitReached, resultLimitReached);
+  summary.Set(keys.timeLimitReached, walk.stoppedEarly());
+  result->Set(keys.value, summary);
 }
 
-void SambaFsp::getMetadata(const GetMetadataOptions& options,
-                           pp::VarDictionary* result) {
-  this->logger.Info("getMetadata: " + options.entryPath + " mask=" +
-                    Util::ToString(options.fieldMask));
+void SambaFsp::computeTreeSize(const pp::VarArray& args, int messageId,
+                               pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  TreeSizeOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
 
-  std::string fullPath =
-      getFullPathFromRelativePath(options.fileSystemId, options.entryPath);
+  std::string root =
+      getFullPathFromRelativePath(options.fileSystemId, options.directoryPath);
+  this->logger.Info("computeTreeSize: " + root);
+
+  uint64_t startMicros = Util::monotonicMicros();
+  uint64_t deadlineMicros =
+      startMicros + static_cast<uint64_t>(options.timeLimitMs) * 1000;
+  TreeWalk walk(&this->workerPool, TREE_SIZE_CONCURRENCY,
+                TREE_SIZE_DIRECTORY_TIMEOUT_MICROS, -1, deadlineMicros);
+  walk.Add(new TreeSizeTask(root, 0, &this->treeSizeCache));
+
+  double bytes = 0;
+  uint64_t files = 0;
+  uint64_t directories = 0;
+  size_t failedEntries = 0;
+  size_t cachedDirectories = 0;
+  uint64_t lastSentMicros = startMicros;
+
+  WalkDirectoryTask* finished = NULL;
+  bool timedOut = false;
+  while (walk.Next(&finished, &timedOut)) {
+    if (timedOut || finished->error != 0) {
+      int error = timedOut ? ETIMEDOUT : finished->error;
+      this->logger.Error("computeTreeSize: Could not list " +
+                         finished->directory + " errno=" +
+                         Util::ToString(error));
+      continue;
+    }
 
-  EntryMetadata entry;
-  if (!this->getMetadataEntry(fullPath, &entry, result)) {
-    // Error was already set.
-    return;
+    TreeSizeTask* task = static_cast<TreeSizeTask*>(finished);
+    bytes += task->totals.bytes;
+    files += task->totals.files;
+    directories += task->totals.subdirectories.size();
+    failedEntries += task->failedEntries;
+
+    // A directory with a file that couldn't be stat()'d is counted short
+    // so it isn't kept.
+    if (task->fromCache) {
+      cachedDirectories++;
+    } else if (task->failedEntries == 0) {
+      this->treeSizeCache.Store(task->directory, task->totals);
+    }
+
+    uint64_t now = Util::monotonicMicros();
+    if (now - lastSentMicros >= TREE_SIZE_PROGRESS_MICROS) {
+      pp::VarDictionary totals;
+      this->setTreeSizeTotals(bytes, files, directories, &totals);
+      pp::VarDictionary progress;
+      progress.Set(keys.value, totals);
+      this->sendMessage("custom_computeTreeSize", messageId, progress, true);
+      lastSentMicros = now;
+    }
   }
 
-  this->setResultFromEntryMetadata(entry, result);
+  this->logger.Info("computeTreeSize: " + Util::ToString(files) +
+                    " files in " + Util::ToString(walk.directoriesListed()) +
+                    " directories (" + Util::ToString(cachedDirectories) +
+                    " cached) in " +
+                    Util::ToString(Util::monotonicMicros() - startMicros) +
+                    "us");
+
+  // The last response also says whether the totals cover everything.
+  bool complete = !walk.stoppedEarly() && walk.directoriesFailed() == 0 &&
+                  failedEntries == 0;
+  pp::VarDictionary totals;
+  this->setTreeSizeTotals(bytes, files, directories, &totals);
+  totals.Set(keys.failedEntries, static_cast<double>(failedEntries));
+  totals.Set(keys.failedDirectories,
+             static_cast<double>(walk.directoriesFailed()));
+  totals.Set(keys.cachedDirectories, static_cast<double>(cachedDirectories));
+  totals.Set(keys.complete, complete);
+  result->Set(keys.value, totals);
 }
 
-bool SambaFsp::getMetadataEntry(const std::string& fullPath,
-                                EntryMetadata* entry,
-                                pp::VarDictionary* result) {
-  const std::string& name = this->getNameFromPath(fullPath);
-  if (name == "") {
-    // This is the root.
-    entry->isDirectory = true;
-    entry->name = "";
-    entry->size = 0;
-    entry->modificationTime = 0;
+void SambaFsp::setTreeSizeTotals(double bytes, uint64_t files,
+                                 uint64_t directories,
+                                 pp::VarDictionary* totals) {
+  const VarKeys& keys = VarKeys::Get();
+  totals->Set(keys.bytes, bytes);
+  totals->Set(keys.files, static_cast<double>(files));
+  totals->Set(keys.directories, static_cast<double>(directories));
+}
+
+void SambaFsp::invalidateTreeSize(const std::string& fullPath) {
+  // A write changes the size of a file without changing the time of the
+  // directory it is in, which is what the cache checks.
+  size_t slashAt = fullPath.rfind('/');
+  if (slashAt != std::string::npos) {
+    this->treeSizeCache.Invalidate(fullPath.substr(0, slashAt));
+  }
+}
+
+void SambaFsp::hashFile(const pp::VarArray& args, int messageId,
+                        pp::VarDictionary* result) {
+  HashFileOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  std::string algorithm =
+      options.algorithm.empty() ? DEFAULT_HASH_ALGORITHM : options.algorithm;
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, options.filePath);
+  this->logger.Info("hashFile: " + algorithm + " " + fullPath);
+  if (!Hasher::IsSupported(algorithm)) {
+    this->logger.Error("hashFile: Unknown algorithm " + algorithm);
+    this->setErrorResult("INVALID_OPERATION", result);
+    return;
+  }
+
+  SmbTaskRunner runner(&this->workerPool, 1, HASH_FILE_TIMEOUT_MICROS);
+  runner.Add(new HashFileTask(0, fullPath, algorithm));
+
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  runner.Next(&finished, &timedOut);
+
+  pp::VarDictionary value;
+  if (!this->setHashResult(*static_cast<HashFileTask*>(finished), timedOut,
+                           &value)) {
+    this->setErrorResult(value.Get(VarKeys::Get().error).AsString(), result);
+    return;
+  }
+
+  result->Set(VarKeys::Get().value, value);
+}
+
+void SambaFsp::hashFiles(const pp::VarArray& args, int messageId,
+                         pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  HashFilesOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  std::string algorithm =
+      options.algorithm.empty() ? DEFAULT_HASH_ALGORITHM : options.algorithm;
+  this->logger.Info("hashFiles: " + algorithm + " " +
+                    Util::ToString(options.entries.size()) + " files");
+  if (!Hasher::IsSupported(algorithm)) {
+    this->logger.Error("hashFiles: Unknown algorithm " + algorithm);
+    this->setErrorResult("INVALID_OPERATION", result);
+    return;
+  }
+
+  // Several files are read at once so the link stays busy between the
+  // reads of any one file.
+  uint64_t startMicros = Util::monotonicMicros();
+  SmbTaskRunner runner(&this->workerPool, HASH_CONCURRENCY,
+                       HASH_FILE_TIMEOUT_MICROS);
+  for (size_t i = 0; i < options.entries.size(); i++) {
+    runner.Add(new HashFileTask(
+        i,
+        getFullPathFromRelativePath(options.fileSystemId, options.entries[i]),
+        algorithm));
+  }
+
+  double bytes = 0;
+  size_t failed = 0;
+  pp::VarArray batch;
+  uint64_t lastSentMicros = startMicros;
+
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  while (runner.Next(&finished, &timedOut)) {
+    HashFileTask* task = static_cast<HashFileTask*>(finished);
+    pp::VarDictionary value;
+    if (this->setHashResult(*task, timedOut, &value)) {
+      bytes += task->size;
+    } else {
+      failed++;
+    }
+
+    // The path comes back as it was given, since results arrive in the
+    // order the files finish.
+    value.Set(keys.filePath, options.entries[task->index]);
+    batch.Set(batch.GetLength(), value);
+
+    uint64_t now = Util::monotonicMicros();
+    if (batch.GetLength() >= HASH_BATCH_ENTRIES ||
+        now - lastSentMicros >= HASH_BATCH_MICROS) {
+      pp::VarDictionary batchResult;
+      batchResult.Set(keys.value, batch);
+      this->sendMessage("custom_hashFiles", messageId, batchResult, true);
+      batch = pp::VarArray();
+      lastSentMicros = now;
+    }
+  }
+
+  if (batch.GetLength() > 0) {
+    pp::VarDictionary batchResult;
+    batchResult.Set(keys.value, batch);
+    this->sendMessage("custom_hashFiles", messageId, batchResult, true);
+  }
+
+  this->logger.Info("hashFiles: " + Util::ToString(bytes) + " bytes in " +
+                    Util::ToString(options.entries.size()) + " files (" +
+                    Util::ToString(failed) + " failed) in " +
+                    Util::ToString(Util::monotonicMicros() - startMicros) +
+                    "us");
+
+  pp::VarDictionary summary;
+  summary.Set(keys.files, static_cast<double>(options.entries.size()));
+  summary.Set(keys.failedFiles, static_cast<double>(failed));
+  summary.Set(keys.bytes, bytes);
+  result->Set(keys.value, summary);
+}
+
+bool SambaFsp::setHashResult(const HashFileTask& task, bool timedOut,
+                             pp::VarDictionary* value) {
+  const VarKeys& keys = VarKeys::Get();
+  int error = timedOut ? ETIMEDOUT : task.error;
+  if (error != 0) {
+    this->logger.Error("hashFile: " + task.fullPath + " errno=" +
+                       Util::ToString(error));
+    value->Set(keys.error, this->mapErrorToString(error, "hashFile:read"));
+    return false;
+  }
+
+  this->filesHashed++;
+  this->bytesHashed += task.size;
+  value->Set(keys.digest, task.digest);
+  value->Set(keys.size, task.size);
+  return true;
+}
+
+void SambaFsp::readDirectoryDiff(const pp::VarArray& args, int messageId,
+                                 pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  ReadDirectoryDiffOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, options.directoryPath);
+  this->logger.Info("readDirectoryDiff: " + fullPath);
+
+  // Taken out so trimming the memory budget can't drop it halfway.
+  std::vector<DirectoryVersions::VersionedEntry> previous;
+  bool isDiff = this->directoryVersions.Take(fullPath, options.versionToken,
+                                             options.fieldMask, &previous);
+
+  // A refresh has to ask the server, but without a listing to compare
+  // with this is really a first read and anything readDirectory would use
+  // will do.
+  const std::string& mountRoot = this->mounts[options.fileSystemId].shareRoot;
+  std::vector<EntryMetadata> entries;
+  int directoryTime = -1;
+  bool saved = false;
+  if (!this->getListing(mountRoot, fullPath, options.needsStat(), !isDiff,
+                        &entries, &directoryTime, &saved, result)) {
+    return;
+  }
+
+  MemoryBudget::Reservation listing(&this->memoryBudget, "listings",
+                                    listingBytes(entries));
+  this->prefetchChildDirectories(entries);
+  this->setMimeTypesFromExtension(options.fieldMask, &entries);
+
+  // Removed entries go in the first message.
+  DiffMessage message;
+  std::vector<std::string> removed;
+  DirectoryVersions::FindRemoved(previous, entries, &removed);
+  for (size_t i = 0; i < removed.size(); i++) {
+    message.removed.Set(i, removed[i]);
+  }
+
+  size_t failed = 0;
+  int error = 0;
+  if (options.needsStat() && !saved) {
+    if (!this->statAndStreamDiff(messageId, options.fieldMask, !isDiff,
+                                 previous, &entries, &message, &failed,
+                                 &error, result)) {
+      return;
+    }
+  } else {
+    for (size_t i = 0; i < entries.size(); i++) {
+      this->addDiffEntry(previous, options.fieldMask, &entries[i], &message);
+      if (message.size == DIFF_BATCH_ENTRIES && i + 1 < entries.size()) {
+        this->sendDiffMessage(messageId, !isDiff, &message);
+      }
+    }
+  }
+
+  this->logger.Info("readDirectoryDiff: " + Util::ToString(removed.size()) +
+                    " removed, " + Util::ToString(failed) +
+                    " failed of " + Util::ToString(entries.size()));
+  if (failed * 100 > entries.size() * DIFF_MAX_FAILED_STAT_PERCENT) {
+    // Nothing is recorded so the next refresh sends everything again.
+    errno = error;
+    this->LogErrorAndSetErrorResult("readDirectoryDiff:smbc_stat", result);
+    return;
+  }
+
+  if (isDiff) {
+    this->listingDiffs++;
+  } else {
+    this->fullListings++;
+  }
+
+  if (options.needsStat() && !saved) {
+    this->saveListing(mountRoot, fullPath, directoryTime, entries);
+  }
+
+  pp::VarDictionary value = diffValue(message, !isDiff);
+  value.Set(keys.versionToken,
+            this->directoryVersions.Record(fullPath, options.fieldMask,
+                                           entries));
+  if (saved) {
+    // As with readDirectory JS asks again for what changed since.
+    value.Set(keys.stale, true);
+  }
+  result->Set(keys.value, value);
+}
+
+bool SambaFsp::statAndStreamDiff(
+    int messageId, uint32_t fieldMask, bool full,
+    const std::vector<DirectoryVersions::VersionedEntry>& previous,
+    std::vector<EntryMetadata>* entries, DiffMessage* message,
+    size_t* failed, int* error, pp::VarDictionary* result) {
+  SmbTaskRunner runner(&this->workerPool, BATCH_STAT_CONCURRENCY,
+                       BATCH_STAT_TIMEOUT_MICROS);
+  for (size_t i = 0; i < entries->size(); i++) {
+    runner.Add(new StatTask(i, (*entries)[i].fullPath));
+  }
+
+  uint64_t budgetMicros = FIRST_STAT_BATCH_MICROS;
+  uint64_t batchStartMicros = Util::monotonicMicros();
+  size_t done = 0;
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  while (runner.Next(&finished, &timedOut)) {
+    StatTask* task = static_cast<StatTask*>(finished);
+    EntryMetadata& entry = (*entries)[task->index];
+    if (timedOut || task->error != 0) {
+      // Left without a size, which addDiffEntry fills in from |previous|.
+      *error = timedOut ? ETIMEDOUT : task->error;
+      (*failed)++;
+      this->logger.Error("Failed to stat " + entry.fullPath + " errno:" +
+                         Util::ToString(*error));
+    } else {
+      // Filled in as populateEntryMetadataWithStatInfo does so a listing
+      // from readDirectory compares equal.
+      entry.size = task->statInfo.st_size;
+      entry.modificationTime = task->statInfo.st_mtime;
+    }
+
+    this->addDiffEntry(previous, fieldMask, &entry, message);
+    if (this->deadlineExceeded(result)) {
+      return false;
+    }
+
+    uint64_t nowMicros = Util::monotonicMicros();
+    if (++done < entries->size() &&
+        nowMicros - batchStartMicros >= budgetMicros) {
+      this->sendDiffMessage(messageId, full, message);
+      batchStartMicros = nowMicros;
+      budgetMicros = STAT_BATCH_MICROS;
+    }
+  }
+
+  return true;
+}
+
+void SambaFsp::addDiffEntry(
+    const std::vector<DirectoryVersions::VersionedEntry>& previous,
+    uint32_t fieldMask, EntryMetadata* entry, DiffMessage* message) {
+  DirectoryVersions::Change change =
+      DirectoryVersions::Compare(previous, entry);
+  message->size++;
+  if (change == DirectoryVersions::ENTRY_UNCHANGED) {
+    this->diffEntriesUnchanged++;
+    message->unchanged.Set(message->unchanged.GetLength(), entry->name);
+    return;
+  }
+
+  this->diffEntriesSent++;
+  pp::VarArray& values = change == DirectoryVersions::ENTRY_ADDED
+                             ? message->added
+                             : message->modified;
+  pp::VarDictionary value;
+  this->setEntryMetadata(*entry, fieldMask, &value);
+  values.Set(values.GetLength(), value);
+}
+
+void SambaFsp::sendDiffMessage(int messageId, bool full,
+                               DiffMessage* message) {
+  pp::VarDictionary batchResult;
+  batchResult.Set(VarKeys::Get().value, diffValue(*message, full));
+  this->sendMessage("custom_readDirectoryDiff", messageId, batchResult, true);
+  *message = DiffMessage();
+}
+
+void SambaFsp::listArchive(const pp::VarArray& args, int messageId,
+                           pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  ListArchiveOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, options.archivePath);
+  this->logger.Info("listArchive: " + fullPath);
+
+  double bytesReadBefore = this->archiveBytesRead;
+  int fileId = -1;
+  std::vector<ZipEntry> scratch;
+  const std::vector<ZipEntry>* entries = NULL;
+  if (!this->openArchive(fullPath, "listArchive", &fileId, &scratch, &entries,
+                         result)) {
+    return;
+  }
+
+  smbc_close(fileId);
+  this->archivesListed++;
+
+  // Members are listed with their full path in the archive. Folders that
+  // only appear in the paths of other members are not made up.
+  std::vector<EntryMetadata> batch;
+  for (size_t i = 0; i < entries->size(); i++) {
+    const ZipEntry& member = (*entries)[i];
+    EntryMetadata entry;
+    entry.name = getNameFromPath("/" + member.name);
+    entry.fullPath = "/" + member.name;
+    entry.isDirectory = member.isDirectory;
+    entry.size =
+        member.isDirectory ? 0 : static_cast<double>(member.uncompressedSize);
+    entry.modificationTime = member.modificationTime;
+    batch.push_back(entry);
+
+    if (batch.size() == ARCHIVE_BATCH_ENTRIES) {
+      pp::VarDictionary batchResult;
+      this->setResultFromEntryMetadataVector(batch.begin(), batch.end(),
+                                             ARCHIVE_FIELDS, &batchResult);
+      this->sendMessage("custom_listArchive", messageId, batchResult, true);
+      batch.clear();
+    }
+  }
+
+  if (!batch.empty()) {
+    pp::VarDictionary batchResult;
+    this->setResultFromEntryMetadataVector(batch.begin(), batch.end(),
+                                           ARCHIVE_FIELDS, &batchResult);
+    this->sendMessage("custom_listArchive", messageId, batchResult, true);
+  }
+
+  double bytesRead = this->archiveBytesRead - bytesReadBefore;
+  this->logger.Info("listArchive: " + Util::ToString(entries->size()) +
+                    " members, read " + Util::ToString(bytesRead) + " bytes");
+
+  pp::VarDictionary summary;
+  summary.Set(keys.entries, static_cast<double>(entries->size()));
+  summary.Set(keys.bytesRead, bytesRead);
+  result->Set(keys.value, summary);
+}
+
+void SambaFsp::readArchiveMember(const pp::VarArray& args, int messageId,
+                                 pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  ReadArchiveMemberOptions options;
+  options.Set(pp::VarDictionary(args.Get(0)));
+
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, options.archivePath);
+  std::string memberPath = options.memberPath;
+  if (!memberPath.empty() && memberPath[0] == '/') {
+    memberPath.erase(0, 1);
+  }
+  this->logger.Info("readArchiveMember: " + memberPath + " in " + fullPath);
+
+  int fileId = -1;
+  std::vector<ZipEntry> scratch;
+  const std::vector<ZipEntry>* entries = NULL;
+  if (!this->openArchive(fullPath, "readArchiveMember", &fileId, &scratch,
+                         &entries, result)) {
+    return;
+  }
+
+  const ZipEntry* member = NULL;
+  for (size_t i = 0; i < entries->size() && member == NULL; i++) {
+    if (!(*entries)[i].isDirectory && (*entries)[i].name == memberPath) {
+      member = &(*entries)[i];
+    }
+  }
+
+  if (member == NULL) {
+    smbc_close(fileId);
+    this->logger.Error("readArchiveMember: No member " + memberPath);
+    this->setErrorResult("NOT_FOUND", result);
+    return;
+  }
+
+  uint64_t offset = static_cast<uint64_t>(std::max(options.offset, 0.0));
+  uint64_t length = options.length < 0
+                        ? member->uncompressedSize
+                        : static_cast<uint64_t>(options.length);
+
+  // Only the compressed data up to the end of the range is read, and
+  // nothing from any other member.
+  SambaFileRangeReader reader(fileId);
+  ArchiveMemberSink sink(this, messageId, ARCHIVE_CHUNK_BYTES);
+  ZipResult zipResult = ReadZipMember(&reader, *member, offset, length, &sink);
+  this->archiveBytesRead += reader.BytesRead();
+  if (zipResult == ZIP_READ_FAILED) {
+    LogErrorAndSetErrorResult("readArchiveMember:smbc_read", result);
+    smbc_close(fileId);
+    return;
+  }
+
+  smbc_close(fileId);
+  if (zipResult == ZIP_UNSUPPORTED) {
+    this->logger.Error("readArchiveMember: Can't extract " + memberPath);
+    this->setErrorResult("INVALID_OPERATION", result);
+    return;
+  } else if (zipResult == ZIP_BAD_ARCHIVE) {
+    this->logger.Error("readArchiveMember: " + memberPath + " is damaged");
+    this->setErrorResult("FAILED", result);
+    return;
+  }
+
+  sink.Flush();
+  this->archiveMembersRead++;
+  this->archiveBytesInflated += sink.bytesSent();
+  this->logger.Info("readArchiveMember: Sent " +
+                    Util::ToString(sink.bytesSent()) + " bytes, read " +
+                    Util::ToString(reader.BytesRead()));
+
+  pp::VarDictionary summary;
+  summary.Set(keys.size, sink.bytesSent());
+  summary.Set(keys.memberSize, static_cast<double>(member->uncompressedSize));
+  summary.Set(keys.crcChecked, member->uncompressedSize > 0 && offset == 0 &&
+                                   length >= member->uncompressedSize);
+  result->Set(keys.value, summary);
+}
+
+bool SambaFsp::openArchive(const std::string& fullPath,
+                           const std::string& operationName, int* fileId,
+                           std::vector<ZipEntry>* scratch,
+                           const std::vector<ZipEntry>** entries,
+                           pp::VarDictionary* result) {
+  *fileId = smbc_open(fullPath.c_str(), O_RDONLY, 0);
+  if (*fileId < 0) {
+    LogErrorAndSetErrorResult(operationName + ":smbc_open", result);
+    return false;
+  }
+
+  struct stat statInfo;
+  if (smbc_fstat(*fileId, &statInfo) < 0) {
+    LogErrorAndSetErrorResult(operationName + ":smbc_fstat", result);
+    smbc_close(*fileId);
+    return false;
+  }
+
+  *entries = this->archiveDirectories.Lookup(fullPath, statInfo.st_mtime,
+                                             statInfo.st_size);
+  if (*entries != NULL) {
+    this->archiveDirectoryHits++;
+    return true;
+  }
+
+  SambaFileRangeReader reader(*fileId);
+  ZipResult zipResult = ReadZipDirectory(&reader, statInfo.st_size, scratch);
+  this->archiveBytesRead += reader.BytesRead();
+  if (zipResult == ZIP_READ_FAILED) {
+    LogErrorAndSetErrorResult(operationName + ":smbc_read", result);
+    smbc_close(*fileId);
+    return false;
+  } else if (zipResult != ZIP_OK) {
+    this->logger.Error(operationName + ": Not a zip file that can be read " +
+                       fullPath);
+    this->setErrorResult("INVALID_OPERATION", result);
+    smbc_close(*fileId);
+    return false;
+  }
+
+  *entries = this->archiveDirectories.Store(fullPath, statInfo.st_mtime,
+                                            statInfo.st_size, scratch);
+  if (*entries == NULL) {
+    *entries = scratch;
+  }
+
+  return true;
+}
+
+void SambaFsp::batchMount(const pp::VarArray& args, int messageId,
+                          pp::VarDictionary* result) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarArray shares(args.Get(0));
+  BatchMountOptions options;
+  if (args.GetLength() > 1) {
+    options.Set(pp::VarDictionary(args.Get(1)));
+  }
+
+  size_t maxConcurrentMounts = std::min(
+      static_cast<size_t>(std::max(options.maxConcurrentMounts, 1)),
+      MAX_WORKER_THREADS);
+  SmbTaskRunner runner(&this->workerPool, maxConcurrentMounts,
+                       static_cast<uint64_t>(options.mountTimeoutMs) * 1000);
+
+  // Credentials are saved up front since the workers read them in auth_fn.
+  for (uint32_t i = 0; i < shares.GetLength(); i++) {
+    pp::VarDictionary share(shares.Get(i));
+    MountOptions mountOptions;
+    mountOptions.Set(pp::VarDictionary(share.Get(keys.options)));
+
+    OpenShareTask* task = new OpenShareTask(mountOptions.fileSystemId);
+    this->createMountConfig(pp::VarDictionary(share.Get(keys.mountInfo)),
+                            &task->mountConfig);
+    this->saveCredentials(task->mountConfig);
+    task->timeoutMs = options.mountTimeoutMs;
+    runner.Add(task);
+  }
+
+  // Each share is reported as soon as it answers.
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  while (runner.Next(&finished, &timedOut)) {
+    OpenShareTask* task = static_cast<OpenShareTask*>(finished);
+    pp::VarDictionary mountResult;
+    mountResult.Set(keys.fileSystemId, task->fileSystemId);
+
+    if (timedOut || task->error != 0) {
+      int error = timedOut ? ETIMEDOUT : task->error;
+      this->logger.Error("batchMount: " + task->fileSystemId +
+                         " failed errno=" + Util::ToString(error));
+      this->removeCredentials(task->mountConfig);
+      mountResult.Set(keys.error,
+                      this->mapErrorToString(error, "mount:smbc_opendir"));
+    } else {
+      this->logger.Info("batchMount: Mounted " + task->fileSystemId);
+      this->registerMount(task->fileSystemId, task->mountConfig, -1);
+    }
+
+    pp::VarDictionary batchResult;
+    batchResult.Set(keys.value, mountResult);
+    this->sendMessage("custom_batchMount", messageId, batchResult, true);
+  }
+
+  // Every share has been reported so the final response has no value.
+  result->Set(keys.value, pp::Var(pp::Var::Null()));
+}
+
+void SambaFsp::unmount(const UnmountOptions& options,
+                       pp::VarDictionary* result) {
+  this->logger.Info("Hello from unmount");
+  this->flushPendingTruncate();
+  this->directoryPrefetcher.Clear();
+  MountMap::iterator it = this->mounts.find(options.fileSystemId);
+  if (it != this->mounts.end()) {
+    this->metadataStore.Forget(it->second.shareRoot);
+    this->mounts.erase(it);
+  }
+}
+
+void SambaFsp::getMetadata(const GetMetadataOptions& options,
+                           pp::VarDictionary* result) {
+  this->logger.Info("getMetadata: " + options.entryPath + " mask=" +
+                    Util::ToString(options.fieldMask));
+
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, options.entryPath);
+
+  // A truncate held for a delta upload is applied before the size and the
+  // modification time are read.
+  if (fullPath == this->pendingTruncatePath) {
+    this->flushPendingTruncate();
+  }
+
+  if (!this->takeTruncateError(fullPath, result)) {
+    return;
+  }
+
+  // The stat() is made whatever the mask asks for since it is also how a
+  // missing entry gets reported.
+  EntryMetadata entry;
+  if (!this->getMetadataEntry(fullPath, &entry, result)) {
+    // Error was already set.
+    return;
+  }
+
+  if (options.fieldMask & FieldMaskMixin::FIELD_THUMBNAIL) {
+    this->addThumbnail(fullPath, &entry);
+  }
+
+  if (options.fieldMask & FieldMaskMixin::FIELD_MIME_TYPE) {
+    this->addMimeType(fullPath, &entry);
+  }
+
+  this->setResultFromEntryMetadata(entry, options.fieldMask, result);
+}
+
+bool SambaFsp::getMetadataEntry(const std::string& fullPath,
+                                EntryMetadata* entry,
+                                pp::VarDictionary* result) {
+  const std::string& name = this->getNameFromPath(fullPath);
+  if (name == "") {
+    // This is the root.
+    entry->isDirectory = true;
+    entry->name = "";
+    entry->size = 0;
+    entry->modificationTime = 0;
   } else {
     struct stat statInfo;
     entry->name = name;
     entry->size = 0;
 
-    if (smbc_stat(fullPath.c_str(), &statInfo) < 0) {
-      this->LogErrorAndSetErrorResult("getMetadataEntry:smbc_stat", result);
-      return false;
+    int attempt = 0;
+    int statResult;
+    if (this->hedging) {
+      statResult = this->hedgedStat(fullPath, &statInfo);
     } else {
-      // TODO(zentaro): Handle some special file types, links etc???
-      entry->isDirectory = S_ISDIR(statInfo.st_mode);
-      if (!entry->isDirectory) {
-        entry->size = statInfo.st_size;
+      while ((statResult = smbc_stat(fullPath.c_str(), &statInfo)) < 0 &&
+             this->recoverSession("getMetadataEntry:smbc_stat", &attempt)) {
       }
+    }
 
-      entry->modificationTime = statInfo.st_mtime;
+    if (statResult < 0) {
+      this->LogErrorAndSetErrorResult("getMetadataEntry:smbc_stat", result);
+      return false;
     }
+
+    setEntryStatInfo(statInfo, entry);
   }
 
   this->logger.Debug("getMeta: " + this->stringify(*entry));
@@ -312,32 +1802,200 @@ bool SambaFsp::getMetadataEntry(const std::string& fullPath,
 
 void SambaFsp::batchGetMetadata(const BatchGetMetadataOptions& options,
                                 pp::VarDictionary* result) {
-  std::vector<EntryMetadata> entries;
+  this->flushPendingTruncate();
+  const VarKeys& keys = VarKeys::Get();
+  size_t count = options.entries.size();
+  std::vector<EntryMetadata> entries(count);
+  std::vector<std::string> fullPaths(count);
+  std::vector<int> errors(count, 0);
+  SmbTaskRunner runner(&this->workerPool, BATCH_STAT_CONCURRENCY,
+                       BATCH_STAT_TIMEOUT_MICROS);
+
+  for (size_t i = 0; i < count; i++) {
+    fullPaths[i] =
+        getFullPathFromRelativePath(options.fileSystemId, options.entries[i]);
+    entries[i].name = this->getNameFromPath(fullPaths[i]);
+    if (fullPaths[i] == this->failedTruncatePath) {
+      errors[i] = this->failedTruncateError;
+      this->failedTruncatePath.clear();
+      continue;
+    }
 
-  for (std::vector<std::string>::const_iterator it = options.entries.begin();
-       it != options.entries.end(); ++it) {
-    std::string fullPath =
-        getFullPathFromRelativePath(options.fileSystemId, *it);
-    EntryMetadata entry;
-    if (!this->getMetadataEntry(fullPath, &entry, result)) {
-      // Error was already set.
-      return;
+    if (entries[i].name == "") {
+      // The root is filled in without a stat().
+      this->getMetadataEntry(fullPaths[i], &entries[i], result);
+      continue;
+    }
+
+    StatTask* task = new StatTask(i, fullPaths[i]);
+    if ((options.fieldMask & FieldMaskMixin::FIELD_THUMBNAIL) &&
+        ExifThumbnailExtractor::IsCandidate(entries[i].name)) {
+      task->wantThumbnail = true;
+      task->hasCachedThumbnail = this->thumbnailCache.CachedTime(
+          fullPaths[i], &task->cachedThumbnailTime);
+    }
+
+    task->wantMimeSniff =
+        (options.fieldMask & FieldMaskMixin::FIELD_MIME_TYPE) &&
+        this->sniffMimeTypes &&
+        MimeTypeResolver::FromExtension(entries[i].name).empty();
+    runner.Add(task);
+  }
+
+  SmbTask* finished = NULL;
+  bool timedOut = false;
+  while (runner.Next(&finished, &timedOut)) {
+    StatTask* task = static_cast<StatTask*>(finished);
+    if (timedOut) {
+      errors[task->index] = ETIMEDOUT;
+    } else if (task->error != 0) {
+      errors[task->index] = task->error;
+    } else {
+      setEntryStatInfo(task->statInfo, &entries[task->index]);
+      this->addStatTaskReads(*task, options.fieldMask,
+                             &entries[task->index]);
+    }
+  }
+
+  // Every entry gets either its metadata or its own error so one missing
+  // file doesn't fail the rest of the batch.
+  pp::VarArray values;
+  size_t failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    pp::VarDictionary value;
+    if (errors[i] != 0) {
+      failed++;
+      this->logger.Error("batchGetMetadata: " + fullPaths[i] + " errno=" +
+                         Util::ToString(errors[i]));
+      value.Set(keys.name, entries[i].name);
+      value.Set(keys.error,
+                this->mapErrorToString(errors[i], "batchGetMetadata:stat"));
+    } else {
+      this->setEntryMetadata(entries[i], options.fieldMask, &value);
+    }
+
+    values.Set(i, value);
+  }
+
+  this->logger.Info("batchGetMetadata: " + Util::ToString(count) +
+                    " entries, " + Util::ToString(failed) + " failed");
+  result->Set(keys.value, values);
+}
+
+void SambaFsp::addThumbnail(const std::string& fullPath,
+                            EntryMetadata* entry) {
+  if (entry->isDirectory ||
+      !ExifThumbnailExtractor::IsCandidate(entry->name)) {
+    return;
+  }
+
+  if (this->thumbnailCache.Lookup(fullPath, entry->modificationTime,
+                                  &entry->thumbnail)) {
+    this->thumbnailCacheHits++;
+    return;
+  }
+
+  // A thumbnail is only nice to have so failures are logged and the app
+  // falls back to its generic icon.
+  int fileId = smbc_open(fullPath.c_str(), O_RDONLY, 0);
+  if (fileId < 0) {
+    this->logger.Error("addThumbnail: Can't open " + fullPath + " errno=" +
+                       Util::ToString(errno));
+    return;
+  }
+
+  SambaFileRangeReader reader(fileId);
+  uint64_t bytesRead = readThumbnail(&reader, &entry->thumbnail);
+  smbc_close(fileId);
+  if (entry->thumbnail.empty()) {
+    this->thumbnailsMissing++;
+  } else {
+    this->thumbnailsExtracted++;
+  }
+
+  this->thumbnailBytesRead += bytesRead;
+  this->logger.Debug("addThumbnail: " + fullPath + " read " +
+                     Util::ToString(bytesRead) + " bytes");
+
+  this->thumbnailCache.Store(fullPath, entry->modificationTime,
+                             entry->thumbnail);
+}
+
+void SambaFsp::addMimeType(const std::string& fullPath, EntryMetadata* entry) {
+  if (entry->isDirectory) {
+    return;
+  }
+
+  entry->mimeType = MimeTypeResolver::FromExtension(entry->name);
+  if (!entry->mimeType.empty() || !this->sniffMimeTypes || entry->size == 0) {
+    return;
+  }
+
+  // Unknown extension so look at the first few hundred bytes instead.
+  int fileId = smbc_open(fullPath.c_str(), O_RDONLY, 0);
+  if (fileId < 0) {
+    this->logger.Error("addMimeType: Can't open " + fullPath + " errno=" +
+                       Util::ToString(errno));
+    return;
+  }
+
+  SambaFileRangeReader reader(fileId);
+  entry->mimeType = sniffMimeType(&reader);
+  smbc_close(fileId);
+  this->logger.Debug("addMimeType: Sniffed " + fullPath + " as " +
+                     entry->mimeType);
+}
+
+void SambaFsp::addStatTaskReads(const StatTask& task, uint32_t fieldMask,
+                                EntryMetadata* entry) {
+  if (task.openError != 0) {
+    // Left without a thumbnail or sniffed type like addThumbnail and
+    // addMimeType do.
+    this->logger.Error("batchGetMetadata: Can't open " + task.fullPath +
+                       " errno=" + Util::ToString(task.openError));
+  }
+
+  if ((fieldMask & FieldMaskMixin::FIELD_THUMBNAIL) && task.thumbnailRead) {
+    entry->thumbnail = task.thumbnail;
+    if (entry->thumbnail.empty()) {
+      this->thumbnailsMissing++;
+    } else {
+      this->thumbnailsExtracted++;
     }
 
-    entries.push_back(entry);
+    this->thumbnailBytesRead += task.thumbnailBytesRead;
+    this->thumbnailCache.Store(task.fullPath, entry->modificationTime,
+                               entry->thumbnail);
+  } else if ((fieldMask & FieldMaskMixin::FIELD_THUMBNAIL) &&
+             task.wantThumbnail &&
+             this->thumbnailCache.Lookup(task.fullPath,
+                                         entry->modificationTime,
+                                         &entry->thumbnail)) {
+    this->thumbnailCacheHits++;
   }
 
-  this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
-                                         result);
+  if ((fieldMask & FieldMaskMixin::FIELD_MIME_TYPE) && !entry->isDirectory) {
+    entry->mimeType = MimeTypeResolver::FromExtension(entry->name);
+    if (entry->mimeType.empty()) {
+      entry->mimeType = task.mimeType;
+    }
+  }
 }
 
 void SambaFsp::LogErrorAndSetErrorResult(std::string operationName,
                                          pp::VarDictionary* result) {
+  int error = errno;
   this->logger.Error("Error performing " + operationName + ": errno=" +
-                     Util::ToString(errno) + " errtxt=" + strerror(errno));
+                     Util::ToString(error) + " errtxt=" + strerror(error));
+
+  // TODO(zentaro): Better error code mapping.
+  this->setErrorResult(this->mapErrorToString(error, operationName), result);
+}
 
+std::string SambaFsp::mapErrorToString(int error,
+                                       const std::string& operationName) {
   std::string errorString;
-  switch (errno) {
+  switch (error) {
     case EPERM:
     case EACCES:
       errorString = "ACCESS_DENIED";
@@ -352,6 +2010,8 @@ void SambaFsp::LogErrorAndSetErrorResult(std::string operationName,
     case ECONNABORTED:
     case ECONNRESET:
     case ETIMEDOUT:
+      // The session was already recovered in the module if the operation
+      // could be replayed, so getting here means that failed too.
       // This block of error codes are ones that the JS side should consider
       // retryable. A special "SHOULD_RETRY" error code is returned. Since
       // the ChromeOS will complain that this isn't a valid error type it is
@@ -370,8 +2030,8 @@ void SambaFsp::LogErrorAndSetErrorResult(std::string operationName,
       errorString = "FAILED";
       break;
   }
-  // TODO(zentaro): Better error code mapping.
-  this->setErrorResult(errorString, result);
+
+  return errorString;
 }
 
 std::string SambaFsp::createCredentialLookupKey(
@@ -381,49 +2041,197 @@ std::string SambaFsp::createCredentialLookupKey(
     host = mountConfig.server;
   }
 
-  return host + "$$$" + mountConfig.share;
+  return host + "$$$" + mountConfig.share;
+}
+
+bool SambaFsp::readDirectory(const ReadDirectoryOptions& options, int messageId,
+                             pp::VarDictionary* result) {
+  this->logger.Info("readDirectory: " + options.directoryPath + " mask=" +
+                    Util::ToString(options.fieldMask));
+  this->flushPendingTruncate();
+  std::vector<EntryMetadata> entries;
+  std::string relativePath = options.directoryPath;
+
+  // TODO(zentaro): Possibly expose servers as the root so that the shares
+  // TODO(zentaro): Handle id missing properly.
+  std::string fullPath =
+      getFullPathFromRelativePath(options.fileSystemId, relativePath);
+
+  this->logger.Info("readDirectory: " + fullPath);
+
+  const std::string& mountRoot = this->mounts[options.fileSystemId].shareRoot;
+  int directoryTime = -1;
+  bool saved = false;
+  if (!this->getListing(mountRoot, fullPath, options.needsStat(), true,
+                        &entries, &directoryTime, &saved, result)) {
+    // Parent already set and logged any error but did not send it.
+    // Returning false tells the caller to send the result.
+    return false;
+  }
+
+  // Held until the listing has been sent, which takes a while when every
+  // entry is stat()'d.
+  MemoryBudget::Reservation listing(&this->memoryBudget, "listings",
+                                    listingBytes(entries));
+  this->prefetchChildDirectories(entries);
+  this->setMimeTypesFromExtension(options.fieldMask, &entries);
+
+  // A saved listing already has the stat() information. Entry sizes and
+  // times can change without the directory time changing though, so JS is
+  // told to ask for what changed since straight away.
+  if (saved) {
+    this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
+                                           options.fieldMask, result);
+    this->recordListingVersion(fullPath, options.fieldMask, entries, result);
+    result->Set(VarKeys::Get().stale, true);
+    return false;
+  }
+
+  // Just short circuit when there is nothing to do.
+  if (entries.size() == 0) {
+    this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
+                                           options.fieldMask, result);
+    this->recordListingVersion(fullPath, options.fieldMask, entries, result);
+    return false;
+  }
+
+  if (options.needsStat()) {
+    // If size or modification time was requested entries are stat()'d
+    // and streamed in batches.
+    if (!this->statAndStreamEntryMetadata(messageId, options.fieldMask,
+                                          &entries, result)) {
+      return false;
+    }
+
+    this->logger.Debug("readDirectory: with stat COMPLETE " + fullPath);
+    this->saveListing(mountRoot, fullPath, directoryTime, entries);
+    // The last batch was left in |result|.
+    this->recordListingVersion(fullPath, options.fieldMask, entries, result);
+    return false;
+  } else {
+    // When stat() information is not required just return the
+    // info from getdents (name and isDir).
+    this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
+                                           options.fieldMask, result);
+    this->recordListingVersion(fullPath, options.fieldMask, entries, result);
+    this->logger.Debug("readDirectory: no stat COMPLETE " + fullPath);
+    return false;
+  }
+}
+
+bool SambaFsp::getListing(const std::string& mountRoot,
+                          const std::string& fullPath, bool needsStat,
+                          bool allowSaved,
+                          std::vector<EntryMetadata>* entries,
+                          int* directoryTime, bool* saved,
+                          pp::VarDictionary* result) {
+  // A saved listing is only trusted at the directory's current
+  // modification time. Checking costs one stat(), so it is only done when
+  // there is a saved listing to check.
+  *directoryTime = -1;
+  *saved = false;
+  if (allowSaved && needsStat &&
+      this->metadataStore.Has(mountRoot, fullPath)) {
+    *directoryTime = this->getModificationTime(fullPath);
+  }
+
+  if (*directoryTime != -1 &&
+      this->metadataStore.Load(mountRoot, fullPath, *directoryTime,
+                               entries)) {
+    this->logger.Debug("readDirectory: using saved listing");
+    *saved = true;
+    return true;
+  }
+
+  if (this->directoryPrefetcher.Take(fullPath, entries)) {
+    this->logger.Debug("readDirectory: using prefetched listing");
+    return true;
+  }
+
+  return this->readDirectoryEntries(fullPath, entries, result);
+}
+
+void SambaFsp::recordListingVersion(const std::string& directory,
+                                    uint32_t fieldMask,
+                                    const std::vector<EntryMetadata>& entries,
+                                    pp::VarDictionary* result) {
+  std::string token = this->directoryVersions.Record(directory, fieldMask,
+                                                     entries);
+  if (!token.empty()) {
+    result->Set(VarKeys::Get().versionToken, token);
+  }
+}
+
+void SambaFsp::prefetchChildDirectories(
+    const std::vector<EntryMetadata>& entries) {
+  // The user is likely to open one of the subdirectories next. This also
+  // drops any prefetch for the directory they navigated away from.
+  std::vector<std::string> childDirectories;
+  for (std::vector<EntryMetadata>::const_iterator it = entries.begin();
+       it != entries.end(); ++it) {
+    if (it->isDirectory) {
+      childDirectories.push_back(it->fullPath);
+    }
+  }
+  this->directoryPrefetcher.Prefetch(childDirectories);
+}
+
+void SambaFsp::setMimeTypesFromExtension(uint32_t fieldMask,
+                                         std::vector<EntryMetadata>* entries) {
+  // Only the extension is used here since sniffing would open every file.
+  if (fieldMask & FieldMaskMixin::FIELD_MIME_TYPE) {
+    for (std::vector<EntryMetadata>::iterator it = entries->begin();
+         it != entries->end(); ++it) {
+      if (!it->isDirectory) {
+        it->mimeType = MimeTypeResolver::FromExtension(it->name);
+      }
+    }
+  }
+}
+
+void SambaFsp::saveListing(const std::string& mountRoot,
+                           const std::string& directory, int modificationTime,
+                           const std::vector<EntryMetadata>& entries) {
+  if (!this->metadataStore.IsEnabled()) {
+    return;
+  }
+
+  // A failed stat() leaves an entry without a size and a listing with gaps
+  // would be served as if it were complete.
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].size < 0) {
+      return;
+    }
+  }
+
+  // Read after listing, so a change in between is saved as current. That
+  // only lasts until the refresh that follows serving a saved listing.
+  if (modificationTime == -1) {
+    modificationTime = this->getModificationTime(directory);
+    if (modificationTime == -1) {
+      return;
+    }
+  }
+
+  this->metadataStore.Save(mountRoot, directory, modificationTime, entries);
 }
 
-bool SambaFsp::readDirectory(const ReadDirectoryOptions& options, int messageId,
-                             pp::VarDictionary* result) {
-  this->logger.Info("readDirectory: " + options.directoryPath + " mask=" +
-                    Util::ToString(options.fieldMask));
-  std::vector<EntryMetadata> entries;
-  std::string relativePath = options.directoryPath;
-
-  // TODO(zentaro): Possibly expose servers as the root so that the shares
-  // TODO(zentaro): Handle id missing properly.
-  std::string fullPath =
-      getFullPathFromRelativePath(options.fileSystemId, relativePath);
+int SambaFsp::getModificationTime(const std::string& fullPath) {
+  struct stat statInfo;
+  int attempt = 0;
+  int statResult;
 
-  this->logger.Info("readDirectory: " + fullPath);
-  if (!this->readDirectoryEntries(fullPath, &entries, result)) {
-    // Parent already set and logged any error but did not send it.
-    // Returning false tells the caller to send the result.
-    return false;
+  while ((statResult = smbc_stat(fullPath.c_str(), &statInfo)) < 0 &&
+         this->recoverSession("readDirectory:smbc_stat", &attempt)) {
   }
 
-  // Just short circuit when there is nothing to do.
-  if (entries.size() == 0) {
-    this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
-                                           result);
-    return false;
+  if (statResult < 0) {
+    this->logger.Error("Failed to stat " + fullPath + " errno:" +
+                       Util::ToString(errno));
+    return -1;
   }
 
-  if (options.needsStat()) {
-    // If size or modification time was requested entries are stat()'d
-    // and streamed in batches.
-    this->statAndStreamEntryMetadata(messageId, &entries);
-    this->logger.Debug("readDirectory: with stat COMPLETE " + fullPath);
-    return true;
-  } else {
-    // When stat() information is not required just return the
-    // info from getdents (name and isDir).
-    this->setResultFromEntryMetadataVector(entries.begin(), entries.end(),
-                                           result);
-    this->logger.Debug("readDirectory: no stat COMPLETE " + fullPath);
-    return false;
-  }
+  return statInfo.st_mtime;
 }
 
 void SambaFsp::openFile(const OpenFileOptions& options,
@@ -437,6 +2245,15 @@ void SambaFsp::openFile(const OpenFileOptions& options,
   std::string fullPath =
       getFullPathFromRelativePath(options.fileSystemId, relativePath);
 
+  bool delta = options.mode == FILE_MODE_WRITE && this->deltaUpload;
+  if (!delta || fullPath != this->pendingTruncatePath) {
+    this->flushPendingTruncate();
+  }
+
+  if (!this->takeTruncateError(fullPath, result)) {
+    return;
+  }
+
   int openFileFlags = options.mode == FILE_MODE_READ ? O_RDONLY : O_RDWR;
   this->logger.Info("openFileMode: " + Util::ToString(options.mode));
   // TODO(zentaro): File modes.
@@ -461,6 +2278,23 @@ void SambaFsp::openFile(const OpenFileOptions& options,
   fileInfo.lengthAtOpen = statInfo.st_size;
   fileInfo.offset = 0;
   fileInfo.mode = options.mode;
+  fileInfo.fullPath = fullPath;
+  fileInfo.openFlags = openFileFlags;
+  fileInfo.delta = delta;
+  fileInfo.comparableLength = statInfo.st_size;
+  fileInfo.finalLength = -1;
+  fileInfo.writtenEnd = 0;
+  fileInfo.lastUsedMicros = Util::monotonicMicros();
+
+  if (delta) {
+    this->deltaFiles++;
+    this->blockSignatures.Validate(fullPath, statInfo.st_mtime,
+                                   statInfo.st_size);
+    if (fullPath == this->pendingTruncatePath) {
+      fileInfo.finalLength = this->pendingTruncateLength;
+      this->pendingTruncatePath.clear();
+    }
+  }
 
   this->openFiles[options.requestId] = fileInfo;
 }
@@ -479,13 +2313,15 @@ bool SambaFsp::readFile(const ReadFileOptions& options, int messageId,
     // TODO(zentaro): Check buffer size.
     // TODO(zentaro): API with >2GB file size???
     // TODO(zentaro): Alias it->second
-    int openFileId = it->second.sambaFileId;
+    // NOTE: The sambaFileId changes if the session is recovered so it is
+    // always read from it->second.
     int lengthAtOpen = it->second.lengthAtOpen;
     off_t actualOffset = it->second.offset;
+    it->second.lastUsedMicros = Util::monotonicMicros();
 
     if ((actualOffset < 0) || (actualOffset != options.offset)) {
-      actualOffset =
-          smbc_lseek(openFileId, static_cast<int>(options.offset), SEEK_SET);
+      actualOffset = smbc_lseek(it->second.sambaFileId,
+                                static_cast<int>(options.offset), SEEK_SET);
       if ((actualOffset < 0) || (actualOffset != options.offset)) {
         this->LogErrorAndSetErrorResult("readFile:smbc_lseek", result);
         return false;
@@ -495,6 +2331,9 @@ bool SambaFsp::readFile(const ReadFileOptions& options, int messageId,
         setErrorResult("FAILED", result);
         return false;
       }
+
+      // Tracked so the file can be reopened at the right place.
+      it->second.offset = actualOffset;
     } else {
       this->logger.Debug("readFiles: Skipped redundant seek");
     }
@@ -521,8 +2360,16 @@ bool SambaFsp::readFile(const ReadFileOptions& options, int messageId,
     }
 
     size_t bytesLeftToRead = totalBytesToRead;
+    MemoryBudget::Reservation reading(
+        &this->memoryBudget, "reads",
+        std::min(bytesLeftToRead, MAX_BYTES_PER_READ));
 
     while (bytesLeftToRead > 0) {
+      if (bytesLeftToRead < totalBytesToRead &&
+          this->deadlineExceeded(result)) {
+        return false;
+      }
+
       // TODO(zentaro): Use min.
       size_t bytesToRead = bytesLeftToRead < MAX_BYTES_PER_READ
                                ? bytesLeftToRead
@@ -537,13 +2384,19 @@ bool SambaFsp::readFile(const ReadFileOptions& options, int messageId,
       pp::VarDictionary batchResult;
       pp::VarArrayBuffer buffer(bytesToRead);
       void* buf = static_cast<void*>(buffer.Map());
-      ssize_t bytesRead = smbc_read(openFileId, buf, bytesToRead);
+      int attempt = 0;
+      ssize_t bytesRead;
+
+      // Recovering the session reopens the file at it->second.offset which
+      // is where this read started.
+      while ((bytesRead = smbc_read(it->second.sambaFileId, buf,
+                                    bytesToRead)) < 0 &&
+             this->recoverSession("readFile:smbc_read", &attempt)) {
+      }
       this->logger.Debug("readFiles:Done");
 
       if (bytesRead < 0) {
         it->second.offset = -1;
-        // TODO(zentaro): Might need to check for connection reset here and
-        // retry.
         LogErrorAndSetErrorResult("readFile:smbc_read", result);
         return false;
       }
@@ -583,11 +2436,31 @@ void SambaFsp::closeFile(const CloseFileOptions& options,
       this->openFiles.find(options.openRequestId);
 
   if (it != this->openFiles.end()) {
+    if (it->second.mode == FILE_MODE_WRITE) {
+      this->invalidateTreeSize(it->second.fullPath);
+    }
+
+    if (it->second.finalLength >= 0) {
+      this->applyFinalLength(&it->second, result);
+    }
+
     if (smbc_close(it->second.sambaFileId) < 0) {
       // TODO(zentaro): Should this actually error?
       this->logger.Error("closeFile:smbc_close: Error closing fd");
     }
 
+    // The signatures describe the file as written so they stay good for
+    // the next save as long as nobody else changes it.
+    if (it->second.delta) {
+      struct stat statInfo;
+      if (smbc_stat(it->second.fullPath.c_str(), &statInfo) == 0) {
+        this->blockSignatures.Update(it->second.fullPath, statInfo.st_mtime,
+                                     statInfo.st_size);
+      } else {
+        this->blockSignatures.Invalidate(it->second.fullPath);
+      }
+    }
+
     // TODO(zentaro): Error handling?
     this->openFiles.erase(it);
   } else {
@@ -598,9 +2471,14 @@ void SambaFsp::closeFile(const CloseFileOptions& options,
 void SambaFsp::createFile(const CreateFileOptions& options,
                           pp::VarDictionary* result) {
   this->logger.Info("createFile: " + options.filePath);
+  this->flushPendingTruncate();
   std::string fullPath =
       getFullPathFromRelativePath(options.fileSystemId, options.filePath);
+  if (!this->takeTruncateError(fullPath, result)) {
+    return;
+  }
 
+  this->directoryPrefetcher.Clear();
   int fileId = smbc_creat(fullPath.c_str(), 0755);
 
   if (fileId < 0) {
@@ -618,6 +2496,7 @@ void SambaFsp::createDirectory(const CreateDirectoryOptions& options,
   std::string fullPath =
       getFullPathFromRelativePath(options.fileSystemId, options.directoryPath);
 
+  this->directoryPrefetcher.Clear();
   // TODO(zentaro): Error check. And handles EXISTS error.
   // TODO(zentaro): Handle recursive.
   if (smbc_mkdir(fullPath.c_str(), 0755) < 0) {
@@ -630,11 +2509,18 @@ void SambaFsp::deleteEntry(const DeleteEntryOptions& options,
                            pp::VarDictionary* result) {
   this->logger.Info("deleteEntry: " + options.entryPath + " recurse: " +
                     Util::ToString(options.recursive));
+  this->flushPendingTruncate();
 
   std::string relativePath = options.entryPath;
   std::string fullPath =
       getFullPathFromRelativePath(options.fileSystemId, relativePath);
 
+  // The contents a failed truncate left behind go with the file.
+  if (fullPath == this->failedTruncatePath) {
+    this->failedTruncatePath.clear();
+  }
+
+  this->directoryPrefetcher.Clear();
   deleteEntry(fullPath, options.recursive, result);
 }
 
@@ -745,9 +2631,92 @@ bool SambaFsp::readDirectoryEntries(const std::string& dirFullPath,
                                     bool getShares,
                                     std::vector<EntryMetadata>* entries,
                                     pp::VarDictionary* result) {
+  if (this->hedging && !getShares) {
+    int error = 0;
+    if (!this->hedgedListDirectory(dirFullPath, entries, &error)) {
+      errno = error;
+      this->LogErrorAndSetErrorResult("readDirectory:hedgedListDirectory",
+                                      result);
+      return false;
+    }
+
+    return true;
+  }
+
+  size_t initialCount = entries->size();
+  int attempt = 0;
+  std::string failedOperation;
+
+  while (!this->listDirectory(dirFullPath, getShares, entries,
+                              &failedOperation)) {
+    if (!this->recoverSession(failedOperation, &attempt)) {
+      this->LogErrorAndSetErrorResult(failedOperation, result);
+      return false;
+    }
+
+    // Start the listing again on the new session.
+    entries->resize(initialCount);
+  }
+
+  return true;
+}
+
+int SambaFsp::hedgedStat(const std::string& fullPath, struct stat* statInfo) {
+  SmbTask* task = RunHedged(&this->workerPool, &this->statHedging,
+                            new StatTask(0, fullPath),
+                            new StatTask(0, fullPath), HEDGE_TIMEOUT_MICROS);
+  if (task == NULL) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  StatTask* statTask = static_cast<StatTask*>(task);
+  int error = statTask->error;
+  if (error == 0) {
+    *statInfo = statTask->statInfo;
+  }
+
+  delete statTask;
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return 0;
+}
+
+bool SambaFsp::hedgedListDirectory(const std::string& dirFullPath,
+                                   std::vector<EntryMetadata>* entries,
+                                   int* error) {
+  ListDirectoryTask* primary = new ListDirectoryTask(dirFullPath);
+  ListDirectoryTask* hedge = new ListDirectoryTask(dirFullPath);
+  primary->maxEntries = MAX_HEDGED_LIST_ENTRIES;
+  hedge->maxEntries = MAX_HEDGED_LIST_ENTRIES;
+
+  SmbTask* task = RunHedged(&this->workerPool, &this->listHedging, primary,
+                            hedge, HEDGE_TIMEOUT_MICROS);
+  if (task == NULL) {
+    *error = ETIMEDOUT;
+    return false;
+  }
+
+  ListDirectoryTask* listing = static_cast<ListDirectoryTask*>(task);
+  *error = listing->error;
+  if (*error == 0) {
+    entries->insert(entries->end(), listing->entries.begin(),
+                    listing->entries.end());
+  }
+
+  delete listing;
+  return *error == 0;
+}
+
+bool SambaFsp::listDirectory(const std::string& dirFullPath, bool getShares,
+                             std::vector<EntryMetadata>* entries,
+                             std::string* failedOperation) {
   int dirId = -1;
   if ((dirId = smbc_opendir(dirFullPath.c_str())) < 0) {
-    this->LogErrorAndSetErrorResult("readDirectory:smbc_opendir", result);
+    *failedOperation = "readDirectory:smbc_opendir";
     return false;
   }
 
@@ -809,63 +2778,95 @@ bool SambaFsp::readDirectoryEntries(const std::string& dirFullPath,
   bool success = true;
   if (bytesRemaining < 0) {
     // When numRead is less than 0 an error occured.
-    LogErrorAndSetErrorResult("readDirectory:smbc_getdents", result);
+    *failedOperation = "readDirectory:smbc_getdents";
     success = false;
   }
 
+  // Keep errno from smbc_getdents for the caller.
+  int savedErrno = errno;
   delete[] dirBuf;
   smbc_closedir(dirId);
+  errno = savedErrno;
   return success;
 }
 
-void SambaFsp::statAndStreamEntryMetadata(int messageId,
-                                          std::vector<EntryMetadata>* entries) {
-  // TODO(zentaro): Could be smarter and time how long each batch takes and
-  // adjust based on that. For now just a simple system.
-  const size_t INITIAL_BATCH_SIZE = 16;
-  const size_t LARGE_BATCH_SIZE = 64;
-  const size_t LARGE_BATCH_THRESHOLD = 64;
-  const size_t MAX_ENTRIES = entries->size();
+bool SambaFsp::statAndStreamEntryMetadata(int messageId, uint32_t fieldMask,
+                                          std::vector<EntryMetadata>* entries,
+                                          pp::VarDictionary* result) {
+  const size_t totalEntries = entries->size();
   size_t startIndex = 0;
-  bool hasMore = false;
+  uint64_t budgetMicros = FIRST_STAT_BATCH_MICROS;
+  // Smoothed cost of one stat(). Zero until the first batch is measured.
+  uint64_t statMicros = 0;
+
+  while (startIndex < totalEntries) {
+    if (startIndex > 0 && this->deadlineExceeded(result)) {
+      return false;
+    }
+
+    size_t plannedSize = MAX_STAT_BATCH_ENTRIES;
+    if (statMicros > 0) {
+      plannedSize = std::max(
+          static_cast<size_t>(1),
+          std::min(MAX_STAT_BATCH_ENTRIES,
+                   static_cast<size_t>(budgetMicros / statMicros)));
+    }
+
+    // Stop at the planned size or when the budget runs out, whichever is
+    // first, so a server that suddenly slows down still gets a flush on
+    // time.
+    uint64_t batchStartMicros = Util::monotonicMicros();
+    size_t endIndex = startIndex;
+    uint64_t elapsedMicros = 0;
+    while (endIndex < totalEntries && endIndex - startIndex < plannedSize &&
+           elapsedMicros < budgetMicros) {
+      this->populateEntryMetadataWithStatInfo((*entries)[endIndex]);
+      endIndex++;
+      elapsedMicros = Util::monotonicMicros() - batchStartMicros;
+    }
 
-  while (startIndex < MAX_ENTRIES) {
-    pp::VarDictionary result;
-    int currentBatchSize = LARGE_BATCH_SIZE;
-    if (startIndex < LARGE_BATCH_THRESHOLD) {
-      currentBatchSize = INITIAL_BATCH_SIZE;
+    uint64_t measuredMicros =
+        std::max(static_cast<uint64_t>(1),
+                 elapsedMicros / static_cast<uint64_t>(endIndex - startIndex));
+    if (statMicros == 0) {
+      statMicros = measuredMicros;
+    } else {
+      statMicros = (statMicros * 3 + measuredMicros) / 4;
     }
+    this->logger.Debug("readDirectory: Stat batch of " +
+                       Util::ToString(endIndex - startIndex) + " in " +
+                       Util::ToString(elapsedMicros) + "us");
 
+    pp::VarDictionary batchResult;
     std::vector<EntryMetadata>::iterator rangeStart =
         entries->begin() + startIndex;
     std::vector<EntryMetadata>::iterator rangeEnd =
-        entries->begin() + std::min(startIndex + currentBatchSize, MAX_ENTRIES);
+        entries->begin() + endIndex;
+    this->setResultFromEntryMetadataVector(rangeStart, rangeEnd, fieldMask,
+                                           &batchResult);
+    if (rangeEnd == entries->end()) {
+      *result = batchResult;
+    } else {
+      this->sendMessage("readDirectory", messageId, batchResult, true);
+    }
 
-    this->populateStatInfoVector(rangeStart, rangeEnd);
-    this->setResultFromEntryMetadataVector(rangeStart, rangeEnd, &result);
-    hasMore = (rangeEnd != entries->end());
-    this->sendMessage("readDirectory", messageId, result, hasMore);
-    startIndex += currentBatchSize;
+    startIndex = endIndex;
+    budgetMicros = STAT_BATCH_MICROS;
   }
-}
-
-void SambaFsp::populateStatInfoVector(
-    const std::vector<EntryMetadata>::iterator& rangeStart,
-    const std::vector<EntryMetadata>::iterator& rangeEnd) {
-  this->logger.Debug("readDirectory: Populating stat's() batch of " +
-                     Util::ToString(rangeEnd - rangeStart));
 
-  // TODO(zentaro): Find a way do in parallel or batches.
-  for (std::vector<EntryMetadata>::iterator it = rangeStart; it != rangeEnd;
-       ++it) {
-    this->populateEntryMetadataWithStatInfo(*it);
-  }
+  return true;
 }
 
 void SambaFsp::populateEntryMetadataWithStatInfo(EntryMetadata& entry) {
   struct stat statInfo;
+  int attempt = 0;
+  int statResult;
 
-  if (smbc_stat(entry.fullPath.c_str(), &statInfo) < 0) {
+  while ((statResult = smbc_stat(entry.fullPath.c_str(), &statInfo)) < 0 &&
+         this->recoverSession("readDirectory:smbc_stat", &attempt)) {
+  }
+
+  if (statResult < 0) {
     this->logger.Error("Failed to stat " + entry.fullPath + " errno:" +
                        Util::ToString(errno));
   } else {
@@ -878,13 +2879,18 @@ void SambaFsp::moveEntry(const MoveEntryOptions& options,
                          pp::VarDictionary* result) {
   this->logger.Info("moveEntry: " + options.sourcePath + " to " +
                     options.targetPath);
+  this->flushPendingTruncate();
 
   std::string fullSourcePath =
       getFullPathFromRelativePath(options.fileSystemId, options.sourcePath);
 
   std::string fullTargetPath =
       getFullPathFromRelativePath(options.fileSystemId, options.targetPath);
+  if (!this->takeTruncateError(fullSourcePath, result)) {
+    return;
+  }
 
+  this->directoryPrefetcher.Clear();
   // TODO(zentaro): Error check.
   // TODO(zentaro): NOTE this fails if the rename is cross-share
   if (smbc_rename(fullSourcePath.c_str(), fullTargetPath.c_str()) < 0) {
@@ -917,6 +2923,12 @@ void SambaFsp::truncate(const TruncateOptions& options,
 
   std::string fullPath =
       getFullPathFromRelativePath(options.fileSystemId, options.filePath);
+  this->invalidateTreeSize(fullPath);
+
+  if (this->deltaUpload) {
+    this->deferTruncate(fullPath, options.length, result);
+    return;
+  }
 
   int openFileId = smbc_open(fullPath.c_str(), O_RDWR, 0);
   if (openFileId < 0) {
@@ -941,43 +2953,495 @@ void SambaFsp::writeFile(const WriteFileOptions& options,
       this->openFiles.find(options.openRequestId);
 
   if (it != this->openFiles.end()) {
-    // TODO(zentaro): Error handling.
     // TODO(zentaro): Check buffer size.
     // TODO(zentaro): API with >2GB file size???
-    int openFileId = it->second.sambaFileId;
-    off_t actualOffset = it->second.offset;
+    OpenFileInfo& fileInfo = it->second;
+    fileInfo.lastUsedMicros = Util::monotonicMicros();
 
-    if ((actualOffset < 0) || (actualOffset != options.offset)) {
-      // TODO(zentaro): What happens after EOF?
-      actualOffset =
-          smbc_lseek(openFileId, static_cast<off_t>(options.offset), SEEK_SET);
-      if ((actualOffset < 0) || (actualOffset != options.offset)) {
-        it->second.offset = -1;
-        this->logger.Debug("writeFile: Unexpected offset after seek " +
-                           Util::ToString(actualOffset));
-        this->LogErrorAndSetErrorResult("writeFile:smbc_lseek", result);
-        return;
+    // options.data is the mapped ArrayBuffer so it goes to samba without a
+    // copy.
+    const uint8_t* data = static_cast<const uint8_t*>(options.data);
+    uint32_t length = static_cast<uint32_t>(options.length);
+    MemoryBudget::Reservation writing(&this->memoryBudget, "writes", length);
+
+    // A write past the end of a held truncate has to see the file cut
+    // first, or the gap would keep the old data instead of zeros.
+    if (fileInfo.finalLength >= 0 &&
+        options.offset > std::max(fileInfo.finalLength, fileInfo.writtenEnd) &&
+        !this->applyFinalLength(&fileInfo, result)) {
+      return;
+    }
+
+    bool written = fileInfo.delta
+                       ? this->writeChangedBlocks(&fileInfo, options.offset,
+                                                  data, length, result)
+                       : this->writeRange(&fileInfo, options.offset, data,
+                                          length, result);
+    if (written) {
+      fileInfo.writtenEnd =
+          std::max(fileInfo.writtenEnd, options.offset + length);
+    }
+  } else {
+    this->logger.Error("Invalid FD");
+    this->setErrorResult("INVALID_OPERATION", result);
+    return;
+  }
+}
+
+bool SambaFsp::writeRange(OpenFileInfo* fileInfo, double offset,
+                          const uint8_t* data, uint32_t length,
+                          pp::VarDictionary* result) {
+  // TODO(zentaro): Error handling.
+  int openFileId = fileInfo->sambaFileId;
+  off_t actualOffset = fileInfo->offset;
+
+  if ((actualOffset < 0) || (actualOffset != offset)) {
+    // TODO(zentaro): What happens after EOF?
+    actualOffset = smbc_lseek(openFileId, static_cast<off_t>(offset), SEEK_SET);
+    if ((actualOffset < 0) || (actualOffset != offset)) {
+      fileInfo->offset = -1;
+      this->logger.Debug("writeFile: Unexpected offset after seek " +
+                         Util::ToString(actualOffset));
+      this->LogErrorAndSetErrorResult("writeFile:smbc_lseek", result);
+      return false;
+    }
+
+    fileInfo->offset = actualOffset;
+  } else {
+    this->logger.Debug("writeFile: Skipping redundant seek");
+  }
+
+  // Doesn't seem to like it when it is zero length.
+  uint32_t written = 0;
+  while (written < length) {
+    ssize_t count = smbc_write(openFileId, data + written, length - written);
+    if (count <= 0) {
+      if (count == 0) {
+        // No progress and no error would otherwise loop forever.
+        errno = EIO;
       }
+      fileInfo->offset = -1;
+      this->LogErrorAndSetErrorResult("writeFile:smbc_write", result);
+      return false;
+    }
+
+    written += count;
+    fileInfo->offset += count;
+  }
+
+  return true;
+}
+
+ssize_t SambaFsp::readRange(OpenFileInfo* fileInfo, double offset,
+                            uint8_t* buffer, uint32_t length) {
+  int openFileId = fileInfo->sambaFileId;
+  if (fileInfo->offset != offset) {
+    off_t actualOffset =
+        smbc_lseek(openFileId, static_cast<off_t>(offset), SEEK_SET);
+    if (actualOffset != offset) {
+      fileInfo->offset = -1;
+      return -1;
+    }
+
+    fileInfo->offset = actualOffset;
+  }
+
+  uint32_t bytesRead = 0;
+  while (bytesRead < length) {
+    ssize_t count =
+        smbc_read(openFileId, buffer + bytesRead, length - bytesRead);
+    if (count < 0) {
+      fileInfo->offset = -1;
+      return -1;
+    } else if (count == 0) {
+      break;
+    }
+
+    bytesRead += count;
+    fileInfo->offset += count;
+  }
+
+  return bytesRead;
+}
+
+bool SambaFsp::writeChangedBlocks(OpenFileInfo* fileInfo, double offset,
+                                  const uint8_t* data, uint32_t length,
+                                  pp::VarDictionary* result) {
+  const size_t blockSize = BlockSignatureCache::BLOCK_BYTES;
+  const std::string& fullPath = fileInfo->fullPath;
+  double end = offset + length;
+
+  // Only the whole blocks inside the write are looked at. The pieces of
+  // blocks at either end are always written.
+  size_t firstBlock = static_cast<size_t>(std::ceil(offset / blockSize));
+  size_t endBlock = static_cast<size_t>(end / blockSize);
+  endBlock = std::max(endBlock, firstBlock);
+  size_t comparableEnd = std::min(
+      endBlock, static_cast<size_t>(fileInfo->comparableLength / blockSize));
+
+  // A block is unchanged when its signature matches the one recorded for
+  // the file. Blocks without one are read back from the server in a single
+  // read and compared byte for byte.
+  std::vector<bool> unchanged(endBlock - firstBlock, false);
+  std::vector<BlockSignature> signatures(endBlock - firstBlock);
+  size_t firstUnknown = comparableEnd;
+  size_t endUnknown = firstBlock;
+  for (size_t block = firstBlock; block < endBlock; block++) {
+    size_t i = block - firstBlock;
+    signatures[i] = BlockSignature::Compute(
+        data + static_cast<size_t>(block * blockSize - offset), blockSize);
+
+    BlockSignature known;
+    if (block >= comparableEnd) {
+      continue;
+    } else if (this->blockSignatures.Lookup(fullPath, block, &known)) {
+      unchanged[i] = known.Matches(signatures[i]);
+      this->deltaSignatureHits++;
     } else {
-      this->logger.Debug("writeFile: Skipping redundant seek");
+      firstUnknown = std::min(firstUnknown, block);
+      endUnknown = block + 1;
     }
+  }
 
-    uint32_t length = static_cast<uint32_t>(options.length);
-    if (length > 0) {
-      // Doesn't seem to like it when it is zero length.
-      if (smbc_write(openFileId, options.data, length) < 0) {
-        it->second.offset = -1;
-        this->LogErrorAndSetErrorResult("writeFile:smbc_write", result);
-        return;
+  if (firstUnknown < endUnknown) {
+    double readOffset = static_cast<double>(firstUnknown) * blockSize;
+    uint32_t readLength = (endUnknown - firstUnknown) * blockSize;
+    std::vector<uint8_t> current(readLength);
+    ssize_t count = this->readRange(fileInfo, readOffset, &current[0],
+                                    readLength);
+    if (count > 0) {
+      this->deltaBytesRead += count;
+    }
+
+    // A failed read just means those blocks are all written.
+    for (size_t block = firstUnknown;
+         count > 0 && block < endUnknown &&
+         (block - firstUnknown + 1) * blockSize <=
+             static_cast<size_t>(count);
+         block++) {
+      size_t i = block - firstBlock;
+      unchanged[i] = memcmp(&current[(block - firstUnknown) * blockSize],
+                            data + static_cast<size_t>(block * blockSize -
+                                                       offset),
+                            blockSize) == 0;
+    }
+  }
+
+  // Once written the file holds exactly these blocks. The partial blocks
+  // at either end change in ways that aren't known here.
+  for (size_t block = firstBlock; block < endBlock; block++) {
+    this->blockSignatures.Store(fullPath, block,
+                                signatures[block - firstBlock]);
+  }
+  if (static_cast<double>(firstBlock) * blockSize > offset) {
+    this->blockSignatures.Forget(fullPath, firstBlock - 1);
+  }
+  if (static_cast<double>(endBlock) * blockSize < end) {
+    this->blockSignatures.Forget(fullPath, endBlock);
+  }
+
+  // Everything between the unchanged blocks is written, a run at a time.
+  double runStart = offset;
+  for (size_t block = firstBlock; block <= endBlock; block++) {
+    double runEnd = end;
+    if (block < endBlock) {
+      if (!unchanged[block - firstBlock]) {
+        continue;
+      }
+      runEnd = static_cast<double>(block) * blockSize;
+    }
+
+    if (runEnd > runStart) {
+      uint32_t runLength = static_cast<uint32_t>(runEnd - runStart);
+      const uint8_t* runData = data + static_cast<size_t>(runStart - offset);
+      if (!this->writeRange(fileInfo, runStart, runData, runLength, result)) {
+        this->blockSignatures.Invalidate(fullPath);
+        return false;
       }
 
-      it->second.offset += length;
+      this->deltaBytesWritten += runLength;
     }
-  } else {
-    this->logger.Error("Invalid FD");
-    this->setErrorResult("INVALID_OPERATION", result);
+
+    if (block < endBlock) {
+      this->deltaBytesSaved += blockSize;
+      runStart = runEnd + blockSize;
+    }
+  }
+
+  fileInfo->comparableLength = std::max(fileInfo->comparableLength, end);
+  return true;
+}
+
+bool SambaFsp::applyFinalLength(OpenFileInfo* fileInfo,
+                                pp::VarDictionary* result) {
+  double length = std::max(fileInfo->finalLength, fileInfo->writtenEnd);
+  fileInfo->finalLength = -1;
+  fileInfo->comparableLength = std::min(fileInfo->comparableLength, length);
+  if (smbc_ftruncate(fileInfo->sambaFileId, static_cast<off_t>(length)) < 0) {
+    this->blockSignatures.Invalidate(fileInfo->fullPath);
+    this->LogErrorAndSetErrorResult("truncate:smbc_ftruncate", result);
+    return false;
+  }
+
+  return true;
+}
+
+void SambaFsp::deferTruncate(const std::string& fullPath, double length,
+                             pp::VarDictionary* result) {
+  if (!this->takeTruncateError(fullPath, result)) {
+    return;
+  }
+
+  // An overwrite starts with a truncate. Holding it back keeps the old data
+  // around to compare the writes that follow with. A file that is open for
+  // it is truncated at close, which reports any failure.
+  bool isOpen = false;
+  for (std::map<int, OpenFileInfo>::iterator it = this->openFiles.begin();
+       it != this->openFiles.end(); ++it) {
+    if (it->second.delta && it->second.fullPath == fullPath) {
+      it->second.finalLength = length;
+      // Writes before the truncate are cut by it.
+      it->second.writtenEnd = 0;
+      isOpen = true;
+    }
+  }
+
+  if (isOpen) {
+    return;
+  }
+
+  if (fullPath != this->pendingTruncatePath) {
+    this->flushPendingTruncate();
+  }
+
+  // Opening the file now reports a missing file or one that can't be
+  // written straight away. A failure of the truncate itself goes to the
+  // next request on the path through takeTruncateError.
+  int openFileId = smbc_open(fullPath.c_str(), O_RDWR, 0);
+  if (openFileId < 0) {
+    this->LogErrorAndSetErrorResult("truncate:smbc_open", result);
+    return;
+  }
+
+  smbc_close(openFileId);
+  this->pendingTruncatePath = fullPath;
+  this->pendingTruncateLength = length;
+  this->pendingTruncateMicros = Util::monotonicMicros();
+}
+
+void SambaFsp::flushPendingTruncate() {
+  if (this->pendingTruncatePath.empty()) {
     return;
   }
+
+  std::string fullPath;
+  fullPath.swap(this->pendingTruncatePath);
+  this->blockSignatures.Invalidate(fullPath);
+
+  int openFileId = smbc_open(fullPath.c_str(), O_RDWR, 0);
+  if (openFileId < 0 ||
+      smbc_ftruncate(openFileId,
+                     static_cast<off_t>(this->pendingTruncateLength)) < 0) {
+    this->failedTruncatePath = fullPath;
+    this->failedTruncateError = errno;
+    this->logger.Error("flushPendingTruncate: " + fullPath + " errno=" +
+                       Util::ToString(this->failedTruncateError));
+  }
+
+  if (openFileId >= 0) {
+    smbc_close(openFileId);
+  }
+}
+
+bool SambaFsp::takeTruncateError(const std::string& fullPath,
+                                 pp::VarDictionary* result) {
+  if (this->failedTruncatePath.empty() ||
+      fullPath != this->failedTruncatePath) {
+    return true;
+  }
+
+  this->failedTruncatePath.clear();
+  errno = this->failedTruncateError;
+  this->LogErrorAndSetErrorResult("truncate:smbc_ftruncate", result);
+  return false;
+}
+
+bool SambaFsp::recoverSession(const std::string& operationName,
+                              int* attempt) {
+  int error = errno;
+  if (!isConnectionError(error) || *attempt >= MAX_RECOVERY_ATTEMPTS) {
+    return false;
+  }
+
+  this->logger.Info("recoverSession: " + operationName + " lost connection " +
+                    "(errno=" + Util::ToString(error) + ") attempt " +
+                    Util::ToString(*attempt + 1));
+  usleep(RECONNECT_BACKOFF_MICROS[*attempt]);
+  (*attempt)++;
+
+  this->reconnect();
+  this->replayedOperations++;
+
+  // Leave the original error in place in case the replay doesn't set one.
+  errno = error;
+  return true;
+}
+
+void SambaFsp::reconnect() {
+  this->reconnects++;
+
+  // The handles belong to the dead connection. Closing them first lets the
+  // purge below drop the cached server so the next call connects again.
+  for (std::map<int, OpenFileInfo>::iterator it = this->openFiles.begin();
+       it != this->openFiles.end(); ++it) {
+    if (it->second.sambaFileId >= 0) {
+      smbc_close(it->second.sambaFileId);
+      it->second.sambaFileId = -1;
+    }
+  }
+
+  if (this->context != NULL) {
+    smbc_getFunctionPurgeCachedServers(this->context)(this->context);
+  }
+
+  // Open the tracked files again at their stored offsets.
+  for (std::map<int, OpenFileInfo>::iterator it = this->openFiles.begin();
+       it != this->openFiles.end(); ++it) {
+    OpenFileInfo& fileInfo = it->second;
+    fileInfo.sambaFileId =
+        smbc_open(fileInfo.fullPath.c_str(), fileInfo.openFlags, 0);
+    if (fileInfo.sambaFileId < 0) {
+      this->logger.Error("reconnect: Could not reopen " + fileInfo.fullPath +
+                         " errno=" + Util::ToString(errno));
+      continue;
+    }
+
+    if (fileInfo.offset > 0 &&
+        smbc_lseek(fileInfo.sambaFileId, fileInfo.offset, SEEK_SET) !=
+            fileInfo.offset) {
+      // Forces a seek on the next read or write.
+      fileInfo.offset = -1;
+    }
+
+    this->reopenedFiles++;
+  }
+}
+
+void SambaFsp::probeSessions() {
+  // Shares on the same server use the same connection so one of them is
+  // enough.
+  std::set<std::string> servers;
+  int timeoutMs = smbc_getTimeout(this->context);
+  smbc_setTimeout(this->context, PROBE_TIMEOUT_MS);
+
+  bool stale = false;
+  for (MountMap::const_iterator it = this->mounts.begin();
+       it != this->mounts.end() && !stale; ++it) {
+    const std::string& shareRoot = it->second.shareRoot;
+    std::string server =
+        shareRoot.substr(0, shareRoot.find('/', strlen("smb://")));
+    if (shareRoot.empty() || !servers.insert(server).second) {
+      continue;
+    }
+
+    this->sessionProbes++;
+    struct stat statInfo;
+    if (smbc_stat(shareRoot.c_str(), &statInfo) < 0 &&
+        isConnectionError(errno)) {
+      this->logger.Info("probeSessions: Lost connection to " + server +
+                        " (errno=" + Util::ToString(errno) + ")");
+      stale = true;
+    }
+  }
+
+  smbc_setTimeout(this->context, timeoutMs);
+  if (stale) {
+    this->staleSessions++;
+    this->reconnect();
+  }
+}
+
+void SambaFsp::addStats(pp::VarDictionary* stats) {
+  const VarKeys& keys = VarKeys::Get();
+  pp::VarDictionary session;
+  session.Set(keys.reconnects, static_cast<double>(this->reconnects));
+  session.Set(keys.replayedOperations,
+              static_cast<double>(this->replayedOperations));
+  session.Set(keys.reopenedFiles, static_cast<double>(this->reopenedFiles));
+  session.Set(keys.idleClosed, static_cast<double>(this->idleSessionsClosed));
+  session.Set(keys.handlesReaped, static_cast<double>(this->handlesReaped));
+  session.Set(keys.probes, static_cast<double>(this->sessionProbes));
+  session.Set(keys.staleFound, static_cast<double>(this->staleSessions));
+  stats->Set(keys.session, session);
+
+  pp::VarDictionary thumbnails;
+  thumbnails.Set(keys.extracted,
+                 static_cast<double>(this->thumbnailsExtracted));
+  thumbnails.Set(keys.missing, static_cast<double>(this->thumbnailsMissing));
+  thumbnails.Set(keys.cacheHits, static_cast<double>(this->thumbnailCacheHits));
+  thumbnails.Set(keys.bytesRead, static_cast<double>(this->thumbnailBytesRead));
+  stats->Set(keys.thumbnails, thumbnails);
+
+  pp::VarDictionary persistentCache;
+  persistentCache.Set(keys.hits,
+                      static_cast<double>(this->metadataStore.loadHits()));
+  persistentCache.Set(keys.misses,
+                      static_cast<double>(this->metadataStore.loadMisses()));
+  persistentCache.Set(keys.saved,
+                      static_cast<double>(this->metadataStore.listingsSaved()));
+  persistentCache.Set(keys.bytesSaved,
+                      static_cast<double>(this->metadataStore.bytesSaved()));
+  stats->Set(keys.persistentCache, persistentCache);
+
+  pp::VarDictionary prefetch;
+  prefetch.Set(
+      keys.started,
+      static_cast<double>(this->directoryPrefetcher.listingsStarted()));
+  prefetch.Set(keys.stored,
+               static_cast<double>(this->directoryPrefetcher.listingsStored()));
+  prefetch.Set(
+      keys.cancelled,
+      static_cast<double>(this->directoryPrefetcher.listingsCancelled()));
+  prefetch.Set(keys.used,
+               static_cast<double>(this->directoryPrefetcher.listingsUsed()));
+  stats->Set(keys.prefetch, prefetch);
+
+  pp::VarDictionary hashing;
+  hashing.Set(keys.files, static_cast<double>(this->filesHashed));
+  hashing.Set(keys.bytes, this->bytesHashed);
+  hashing.Set(keys.crc32cKernel, Hasher::Crc32cKernel());
+  stats->Set(keys.hashing, hashing);
+
+  pp::VarDictionary archives;
+  archives.Set(keys.listed, static_cast<double>(this->archivesListed));
+  archives.Set(keys.directoryHits,
+               static_cast<double>(this->archiveDirectoryHits));
+  archives.Set(keys.bytesRead, this->archiveBytesRead);
+  archives.Set(keys.membersRead, static_cast<double>(this->archiveMembersRead));
+  archives.Set(keys.bytesInflated, this->archiveBytesInflated);
+  stats->Set(keys.archives, archives);
+
+  pp::VarDictionary diffs;
+  diffs.Set(keys.diffs, static_cast<double>(this->listingDiffs));
+  diffs.Set(keys.fullListings, static_cast<double>(this->fullListings));
+  diffs.Set(keys.entriesSent, static_cast<double>(this->diffEntriesSent));
+  diffs.Set(keys.entriesUnchanged,
+            static_cast<double>(this->diffEntriesUnchanged));
+  stats->Set(keys.listingDiffs, diffs);
+
+  pp::VarDictionary delta;
+  delta.Set(keys.files, static_cast<double>(this->deltaFiles));
+  delta.Set(keys.bytesSaved, this->deltaBytesSaved);
+  delta.Set(keys.bytesWritten, this->deltaBytesWritten);
+  delta.Set(keys.bytesRead, this->deltaBytesRead);
+  delta.Set(keys.signatureHits, static_cast<double>(this->deltaSignatureHits));
+  stats->Set(keys.delta, delta);
+
+  pp::VarDictionary hedging;
+  hedging.Set(keys.enabled, this->hedging);
+  hedging.Set(keys.stat, hedgeStats(this->statHedging));
+  hedging.Set(keys.list, hedgeStats(this->listHedging));
+  stats->Set(keys.hedging, hedging);
 }
 
 std::string SambaFsp::getNameFromPath(std::string fullPath) {
@@ -13,8 +13,22 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <sys/stat.h>
 #include <cstring>
 #include "BaseNaclFsp.h"
+#include "BlockSignatures.h"
+#include "DirectoryPrefetcher.h"
+#include "DirectoryVersions.h"
+#include "ExifThumbnail.h"
+#include "FileHash.h"
+#include "Hedging.h"
+#include "MetadataStore.h"
+#include "NamePattern.h"
+#include "ShareEnumeration.h"
+#include "SmbWorkerPool.h"
+#include "TreeSize.h"
+#include "TreeWalk.h"
+#include "ZipArchive.h"
 #include "ppapi/cpp/var_dictionary.h"
 #include "samba/libsmbclient.h"
 
@@ -39,6 +53,118 @@ class SambaMountConfig {
   std::string share;
 };
 
+// Checks that a saved share can still be opened so that custom_batchMount
+// can validate many shares in parallel.
+class OpenShareTask : public SmbTask {
+ public:
+  explicit OpenShareTask(const std::string& fileSystemId)
+      : fileSystemId(fileSystemId) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  std::string fileSystemId;
+  SambaMountConfig mountConfig;
+};
+
+// Stats one path for batchGetMetadata so a batch can be spread over the
+// connections of the worker pool. The thumbnail and the sniffed mime type
+// are read here as well, sharing one open of the file.
+class StatTask : public SmbTask {
+ public:
+  StatTask(size_t index, const std::string& fullPath)
+      : index(index),
+        fullPath(fullPath),
+        wantThumbnail(false),
+        hasCachedThumbnail(false),
+        cachedThumbnailTime(0),
+        wantMimeSniff(false),
+        openError(0),
+        thumbnailRead(false),
+        thumbnailBytesRead(0) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  // Position of the entry in the batch.
+  size_t index;
+  std::string fullPath;
+  bool wantThumbnail;
+  // The thumbnail isn't read again if the file still has this time.
+  bool hasCachedThumbnail;
+  int cachedThumbnailTime;
+  // Only set for names with an unknown extension.
+  bool wantMimeSniff;
+
+  struct stat statInfo;
+  int openError;
+  bool thumbnailRead;
+  // Data URI, empty if the file has no thumbnail.
+  std::string thumbnail;
+  uint64_t thumbnailBytesRead;
+  std::string mimeType;
+};
+
+// One message of a custom_readDirectoryDiff response. Unchanged entries are
+// only named since JS already has them.
+class DiffMessage {
+ public:
+  DiffMessage() : size(0) {}
+
+  pp::VarArray added;
+  pp::VarArray modified;
+  pp::VarArray unchanged;
+  pp::VarArray removed;
+  size_t size;
+};
+
+// Lists one directory of a custom_find walk and keeps the entries that
+// match. Each task has its own copy of the pattern since a task that timed
+// out can still be running after the search is over.
+class FindTask : public WalkDirectoryTask {
+ public:
+  FindTask(const std::string& directory, int depth, const NamePattern& pattern)
+      : WalkDirectoryTask(directory, depth), pattern(pattern) {}
+
+  virtual WalkDirectoryTask* CreateChild(const std::string& directory,
+                                         int depth) const {
+    return new FindTask(directory, depth, this->pattern);
+  }
+
+  std::vector<EntryMetadata> matches;
+
+ protected:
+  virtual void visitEntry(SMBCCTX* context, const std::string& name,
+                          const std::string& fullPath, bool isDirectory);
+
+ private:
+  NamePattern pattern;
+};
+
+class SambaFsp;
+
+// Sends the bytes of a member read by custom_readArchiveMember on to JS as
+// ArrayBuffers of |chunkBytes|, each in its own response.
+class ArchiveMemberSink : public InflateSink {
+ public:
+  ArchiveMemberSink(SambaFsp* fsp, int messageId, size_t chunkBytes)
+      : fsp(fsp), messageId(messageId), chunkBytes(chunkBytes), sent(0) {}
+
+  virtual bool Write(const uint8_t* data, size_t length);
+
+  // Sends whatever is left over.
+  void Flush();
+
+  double bytesSent() const { return this->sent; }
+
+ private:
+  SambaFsp* fsp;
+  int messageId;
+  size_t chunkBytes;
+  std::vector<uint8_t> pending;
+  double sent;
+
+  void send(const uint8_t* data, size_t length);
+};
+
 class SambaCredTuple {
  public:
   std::string domain;
@@ -52,18 +178,51 @@ class OpenFileInfo {
   size_t lengthAtOpen;
   off_t offset;
   OpenFileMode mode;
+
+  // Needed to open the file again after the session is recovered.
+  std::string fullPath;
+  int openFlags;
+
+  // Set when the file was opened for writing with delta uploads on. Writes
+  // are then compared with the first |comparableLength| bytes that were
+  // already there and only the blocks that differ are sent.
+  bool delta;
+  double comparableLength;
+
+  // A truncate of a delta file is held until close so the writes that
+  // follow can still be compared with the old data. -1 when there is none.
+  double finalLength;
+  // End of the furthest write since the truncate.
+  double writtenEnd;
+
+  // When the file was opened or last read or written. One left alone for
+  // long enough is taken to have lost its closeFile.
+  uint64_t lastUsedMicros;
 };
 
 class SambaFsp : public BaseNaclFsp {
  public:
   explicit SambaFsp();
 
+  virtual void SetWakeupHook(void (*hook)());
+
+  friend class ArchiveMemberSink;
+
  protected:
+  virtual void addStats(pp::VarDictionary* stats);
+  virtual void configure(const pp::VarDictionary& options,
+                         pp::VarDictionary* applied);
+  virtual bool prepareForOperation(pp::VarDictionary* result);
+  virtual bool hasBackgroundWork() const;
+  virtual uint64_t backgroundWorkDueMicros() const;
+  virtual void doBackgroundWork();
+  virtual void reapIdle(pp::VarDictionary* result);
+
   static void auth_fn(const char* srv, const char* shr, char* wg, int wglen,
                       char* un, int unlen, char* pw, int pwlen);
 
-  virtual void handleCustomMessage(const std::string& functionName,
-                                   const pp::VarArray& args,
+  virtual bool handleCustomMessage(const std::string& functionName,
+                                   const pp::VarArray& args, int messageId,
                                    pp::VarDictionary* result);
   virtual void mount(const MountOptions& options,
                      const pp::VarDictionary& mountInfo,
@@ -98,17 +257,170 @@ class SambaFsp : public BaseNaclFsp {
                          pp::VarDictionary* result);
 
  private:
+  typedef void (SambaFsp::*CustomMessageHandler)(const pp::VarArray& args,
+                                                 int messageId,
+                                                 pp::VarDictionary* result);
+
+  // Maps a custom_ functionName to its handler. Sorted by name like
+  // BaseNaclFsp::kMessageHandlers.
+  struct CustomMessageHandlerEntry {
+    const char* functionName;
+    CustomMessageHandler handler;
+  };
+
+  static const CustomMessageHandlerEntry kCustomMessageHandlers[];
+  static const size_t kCustomMessageHandlerCount;
+
+  static bool customMessageHandlerLess(const CustomMessageHandlerEntry& entry,
+                                       const char* functionName);
+
   typedef std::map<std::string, ShareData> MountMap;
   MountMap mounts;
   std::map<int, OpenFileInfo> openFiles;
+  // Created by ensureContext() on the first request.
+  SMBCCTX* context;
+  int debugLevel;
+  bool useKerberos;
+  bool sniffMimeTypes;
+  SmbWorkerPool workerPool;
+  ShareCache shareCache;
+  ThumbnailCache thumbnailCache;
+  DirectoryPrefetcher directoryPrefetcher;
+  MetadataStore metadataStore;
+  TreeSizeCache treeSizeCache;
+  bool deltaUpload;
+  BlockSignatureCache blockSignatures;
+  ZipDirectoryCache archiveDirectories;
+  // The listings last sent for recently read directories so
+  // custom_readDirectoryDiff can send just what changed since.
+  DirectoryVersions directoryVersions;
+  // Sends stat and directory listings through the worker pool so a slow
+  // one can be hedged on a second connection.
+  bool hedging;
+  HedgePolicy statHedging;
+  HedgePolicy listHedging;
+
+  // How long connections and open files can go unused before reapIdle
+  // closes them. Zero never closes them.
+  uint64_t idleSessionMicros;
+  uint64_t idleHandleMicros;
+  // When the last operation started.
+  uint64_t lastOperationMicros;
+  // False once reapIdle has closed the connections, until they are used.
+  bool sessionsOpen;
+
+  // A truncate that came before its file was opened for the overwrite.
+  std::string pendingTruncatePath;
+  double pendingTruncateLength;
+  uint64_t pendingTruncateMicros;
+  // A deferred truncate that failed after its request got its answer. The
+  // error goes to the next request on the path.
+  std::string failedTruncatePath;
+  int failedTruncateError;
+
+  // Session recovery counters.
+  uint64_t reconnects;
+  uint64_t replayedOperations;
+  uint64_t reopenedFiles;
+
+  // Thumbnail counters.
+  uint64_t thumbnailsExtracted;
+  uint64_t thumbnailsMissing;
+  uint64_t thumbnailCacheHits;
+  uint64_t thumbnailBytesRead;
+
+  // Counters for custom_hashFile(s).
+  uint64_t filesHashed;
+  double bytesHashed;
+
+  // Counters for custom_listArchive and custom_readArchiveMember.
+  uint64_t archivesListed;
+  uint64_t archiveDirectoryHits;
+  double archiveBytesRead;
+  uint64_t archiveMembersRead;
+  double archiveBytesInflated;
+
+  // Counters for custom_readDirectoryDiff.
+  uint64_t listingDiffs;
+  uint64_t fullListings;
+  uint64_t diffEntriesSent;
+  uint64_t diffEntriesUnchanged;
+
+  // Delta upload counters.
+  uint64_t deltaFiles;
+  double deltaBytesSaved;
+  double deltaBytesWritten;
+  double deltaBytesRead;
+  uint64_t deltaSignatureHits;
+
+  // Idle reaping counters.
+  uint64_t idleSessionsClosed;
+  uint64_t handlesReaped;
+  uint64_t sessionProbes;
+  uint64_t staleSessions;
 
   // TODO(zentaro): Use a dedicated class for credentials.
+  // Worker threads read the credentials from auth_fn so access is guarded
+  // by CredentialsMutex.
   typedef std::map<std::string, SambaCredTuple> CredentialStore;
   static CredentialStore Credentials;
+  static pthread_mutex_t CredentialsMutex;
   void saveCredentials(const SambaMountConfig& mountConfig);
   void removeCredentials(const SambaMountConfig& mountConfig);
   std::string createCredentialLookupKey(const SambaMountConfig& mountConfig);
   std::string mapDirectoryTypeToString(unsigned int dirType);
+  bool ensureContext();
+  void enumerateFileShares(const pp::VarArray& args, int messageId,
+                           pp::VarDictionary* result);
+  void find(const pp::VarArray& args, int messageId,
+            pp::VarDictionary* result);
+  void computeTreeSize(const pp::VarArray& args, int messageId,
+                       pp::VarDictionary* result);
+  void setTreeSizeTotals(double bytes, uint64_t files, uint64_t directories,
+                         pp::VarDictionary* totals);
+  void invalidateTreeSize(const std::string& fullPath);
+  void hashFile(const pp::VarArray& args, int messageId,
+                pp::VarDictionary* result);
+  void hashFiles(const pp::VarArray& args, int messageId,
+                 pp::VarDictionary* result);
+  bool setHashResult(const HashFileTask& task, bool timedOut,
+                     pp::VarDictionary* value);
+  void readDirectoryDiff(const pp::VarArray& args, int messageId,
+                         pp::VarDictionary* result);
+  // Stats |entries| on the worker pool and adds each to |message| as it
+  // finishes, sending a message whenever a batch has taken long enough.
+  // Counts the entries that can't be stat()'d in |failed|, with the last
+  // errno in |error|. Returns false with the error in |result| when the
+  // request expired first.
+  bool statAndStreamDiff(
+      int messageId, uint32_t fieldMask, bool full,
+      const std::vector<DirectoryVersions::VersionedEntry>& previous,
+      std::vector<EntryMetadata>* entries, DiffMessage* message,
+      size_t* failed, int* error, pp::VarDictionary* result);
+  // Adds |entry| to |message| by how it compares with |previous|.
+  void addDiffEntry(
+      const std::vector<DirectoryVersions::VersionedEntry>& previous,
+      uint32_t fieldMask, EntryMetadata* entry, DiffMessage* message);
+  void sendDiffMessage(int messageId, bool full, DiffMessage* message);
+  void listArchive(const pp::VarArray& args, int messageId,
+                   pp::VarDictionary* result);
+  void readArchiveMember(const pp::VarArray& args, int messageId,
+                         pp::VarDictionary* result);
+  // Opens the archive at |fullPath| into |fileId| and finds its central
+  // directory, from archiveDirectories when the archive has not changed.
+  // |scratch| holds a directory too big to cache. Returns false with the
+  // error set in |result|, and the archive closed, when it fails.
+  bool openArchive(const std::string& fullPath,
+                   const std::string& operationName, int* fileId,
+                   std::vector<ZipEntry>* scratch,
+                   const std::vector<ZipEntry>** entries,
+                   pp::VarDictionary* result);
+  void batchMount(const pp::VarArray& args, int messageId,
+                  pp::VarDictionary* result);
+  void registerMount(const std::string& fileSystemId,
+                     const SambaMountConfig& mountConfig, int shareId);
+  void sendFileShares(const std::string& hostName,
+                      const std::vector<std::string>& shares, int messageId);
   std::string getNameFromPath(std::string path);
   std::string getFullPathFromRelativePath(const std::string& fileSystemId,
                                           const std::string& relativePath);
@@ -130,12 +442,67 @@ class SambaFsp : public BaseNaclFsp {
                       pp::VarDictionary* result);
   bool getMetadataEntry(const std::string& fullPath, EntryMetadata* entry,
                         pp::VarDictionary* result);
-  void statAndStreamEntryMetadata(int messageId,
-                                  std::vector<EntryMetadata>* entries);
-  void populateStatInfoVector(
-      const std::vector<EntryMetadata>::iterator& rangeStart,
-      const std::vector<EntryMetadata>::iterator& rangeEnd);
+  // Sets entry->thumbnail to a data URI of the EXIF thumbnail if the file
+  // has one. Only the headers of the file are read.
+  void addThumbnail(const std::string& fullPath, EntryMetadata* entry);
+  // Sets entry->mimeType from the extension, or from the first bytes of
+  // the file when the extension is unknown and sniffing is on.
+  void addMimeType(const std::string& fullPath, EntryMetadata* entry);
+  // The same from what a StatTask of batchGetMetadata read.
+  void addStatTaskReads(const StatTask& task, uint32_t fieldMask,
+                        EntryMetadata* entry);
+  // Sends every batch but the last, which is left in |result| for the
+  // caller to add to and send. Returns false with the error in |result|
+  // when the request expired between batches.
+  bool statAndStreamEntryMetadata(int messageId, uint32_t fieldMask,
+                                  std::vector<EntryMetadata>* entries,
+                                  pp::VarDictionary* result);
   void populateEntryMetadataWithStatInfo(EntryMetadata& entry);
+  // Gets the entries of |fullPath| from a saved listing that is still
+  // current when |allowSaved|, else from a prefetched listing or the
+  // server. |saved| says if the saved listing was used and |directoryTime|
+  // is the directory's modification time when it was looked up, else -1.
+  // Returns false with the error in |result| when listing fails.
+  bool getListing(const std::string& mountRoot, const std::string& fullPath,
+                  bool needsStat, bool allowSaved,
+                  std::vector<EntryMetadata>* entries, int* directoryTime,
+                  bool* saved, pp::VarDictionary* result);
+  // Remembers |entries| as the listing JS now has of |directory| and adds
+  // its version token to |result| for a later custom_readDirectoryDiff.
+  void recordListingVersion(const std::string& directory, uint32_t fieldMask,
+                            const std::vector<EntryMetadata>& entries,
+                            pp::VarDictionary* result);
+  void prefetchChildDirectories(const std::vector<EntryMetadata>& entries);
+  void setMimeTypesFromExtension(uint32_t fieldMask,
+                                 std::vector<EntryMetadata>* entries);
+  // Saves |entries| if they all have stat info. |modificationTime| is the
+  // directory's from before it was listed, or -1 to stat() it now.
+  void saveListing(const std::string& mountRoot, const std::string& directory,
+                   int modificationTime,
+                   const std::vector<EntryMetadata>& entries);
+  // Returns the modification time of |fullPath| or -1 if it can't be
+  // stat()'d.
+  int getModificationTime(const std::string& fullPath);
+
+  // Seeks when the file isn't already at |offset| and writes all of |data|.
+  bool writeRange(OpenFileInfo* fileInfo, double offset, const uint8_t* data,
+                  uint32_t length, pp::VarDictionary* result);
+  // Reads up to |length| bytes at |offset| into |buffer|. Returns the
+  // number read, which is short at the end of the file, or -1.
+  ssize_t readRange(OpenFileInfo* fileInfo, double offset, uint8_t* buffer,
+                    uint32_t length);
+  // Writes the blocks of |data| that differ from what the file holds.
+  bool writeChangedBlocks(OpenFileInfo* fileInfo, double offset,
+                          const uint8_t* data, uint32_t length,
+                          pp::VarDictionary* result);
+  bool applyFinalLength(OpenFileInfo* fileInfo, pp::VarDictionary* result);
+  void deferTruncate(const std::string& fullPath, double length,
+                     pp::VarDictionary* result);
+  void flushPendingTruncate();
+  // Returns false with the error in |result| if a deferred truncate of
+  // |fullPath| failed since it was acknowledged.
+  bool takeTruncateError(const std::string& fullPath,
+                         pp::VarDictionary* result);
 
   // TODO(zentaro): I don't think this is used any more.
   std::string flipSlashes(std::string path);
@@ -143,6 +510,26 @@ class SambaFsp : public BaseNaclFsp {
                          SambaMountConfig* mountConfig);
   void LogErrorAndSetErrorResult(std::string operationName,
                                  pp::VarDictionary* result);
+  std::string mapErrorToString(int error, const std::string& operationName);
+
+  // Called after an idempotent operation failed. When errno says the
+  // connection was lost and attempts remain this reconnects and returns true
+  // to tell the caller to replay the operation. Otherwise errno is left
+  // untouched and it returns false.
+  bool recoverSession(const std::string& operationName, int* attempt);
+  void reconnect();
+  // Checks each mounted server with a short timeout and reconnects if one
+  // of the connections has died.
+  void probeSessions();
+  bool listDirectory(const std::string& dirFullPath, bool getShares,
+                     std::vector<EntryMetadata>* entries,
+                     std::string* failedOperation);
+  // Same as smbc_stat but on the worker pool, hedged when it is slow.
+  int hedgedStat(const std::string& fullPath, struct stat* statInfo);
+  // Lists the files and directories in |dirFullPath| on the worker pool,
+  // hedged when it is slow. Returns false with |error| set when it fails.
+  bool hedgedListDirectory(const std::string& dirFullPath,
+                           std::vector<EntryMetadata>* entries, int* error);
 };
 
 }  // namespace NaclFsp
@@ -0,0 +1,83 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ShareEnumeration.h"
+
+#include <errno.h>
+
+namespace NaclFsp {
+
+void ListSharesTask::Run(SMBCCTX* context) {
+  std::string url = "smb://" + this->ip;
+  SMBCFILE* dir = smbc_getFunctionOpendir(context)(context, url.c_str());
+  if (dir == NULL) {
+    this->error = errno;
+    return;
+  }
+
+  smbc_getdents_fn getdents = smbc_getFunctionGetdents(context);
+  const int bufferSize = 1024 * 32;
+  std::vector<unsigned char> dirBuf(bufferSize);
+  int bytesRemaining = 0;
+
+  while ((bytesRemaining = getdents(
+              context, dir, reinterpret_cast<struct smbc_dirent*>(&dirBuf[0]),
+              bufferSize)) > 0) {
+    // Same variable length walk as SambaFsp::readDirectoryEntries.
+    struct smbc_dirent* dirent =
+        reinterpret_cast<struct smbc_dirent*>(&dirBuf[0]);
+    while (bytesRemaining > 0) {
+      if (dirent->smbc_type == SMBC_FILE_SHARE) {
+        this->shares.push_back(dirent->name);
+      }
+
+      bytesRemaining -= dirent->dirlen;
+      dirent = reinterpret_cast<struct smbc_dirent*>(
+          reinterpret_cast<uint8_t*>(dirent) + dirent->dirlen);
+    }
+  }
+
+  if (bytesRemaining < 0) {
+    this->error = errno;
+  }
+
+  smbc_getFunctionClosedir(context)(context, dir);
+}
+
+bool ShareCache::Lookup(const std::string& ip, uint64_t nowMicros,
+                        std::vector<std::string>* shares) {
+  std::map<std::string, Entry>::iterator it = this->entries.find(ip);
+  if (it == this->entries.end()) {
+    return false;
+  }
+
+  if (it->second.expiresMicros <= nowMicros) {
+    this->entries.erase(it);
+    return false;
+  }
+
+  *shares = it->second.shares;
+  return true;
+}
+
+void ShareCache::Store(const std::string& ip,
+                       const std::vector<std::string>& shares,
+                       uint64_t expiresMicros) {
+  Entry& entry = this->entries[ip];
+  entry.expiresMicros = expiresMicros;
+  entry.shares = shares;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,68 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_SHARE_ENUMERATION_H_
+#define NACL_SHARE_ENUMERATION_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SmbWorkerPool.h"
+
+namespace NaclFsp {
+
+// Lists the file shares of one host on a worker thread.
+class ListSharesTask : public SmbTask {
+ public:
+  ListSharesTask(const std::string& hostName, const std::string& ip)
+      : hostName(hostName), ip(ip) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  std::string hostName;
+  std::string ip;
+  std::vector<std::string> shares;
+};
+
+// Remembers the shares found on each host for a short time so reopening
+// the mount dialog doesn't go back to every host on the network.
+class ShareCache {
+ public:
+  ShareCache() {}
+
+  bool Lookup(const std::string& ip, uint64_t nowMicros,
+              std::vector<std::string>* shares);
+  void Store(const std::string& ip, const std::vector<std::string>& shares,
+             uint64_t expiresMicros);
+
+ private:
+  class Entry {
+   public:
+    uint64_t expiresMicros;
+    std::vector<std::string> shares;
+  };
+
+  std::map<std::string, Entry> entries;
+
+  // Prevent copy and assignment.
+  ShareCache(const ShareCache&);
+  ShareCache& operator=(const ShareCache&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_SHARE_ENUMERATION_H_
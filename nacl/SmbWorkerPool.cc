@@ -0,0 +1,322 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "SmbWorkerPool.h"
+
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+namespace {
+
+pthread_once_t threadSupportOnce = PTHREAD_ONCE_INIT;
+
+void initThreadSupport() {
+  // Makes libsmbclient's global state safe to use from several threads.
+  smbc_thread_posix();
+}
+
+}  // namespace
+
+SmbWorkerPool::SmbWorkerPool(smbc_get_auth_data_fn authFn, size_t maxWorkers)
+    : authFn(authFn),
+      maxWorkers(std::max(maxWorkers, static_cast<size_t>(1))),
+      completedHook(NULL),
+      idleWorkers(0),
+      stopping(false),
+      purgeGeneration(0) {
+  pthread_once(&threadSupportOnce, initThreadSupport);
+  pthread_mutex_init(&this->mutex, NULL);
+  pthread_cond_init(&this->workAvailable, NULL);
+  pthread_cond_init(&this->taskCompleted, NULL);
+}
+
+SmbWorkerPool::~SmbWorkerPool() {
+  pthread_mutex_lock(&this->mutex);
+  this->stopping = true;
+  pthread_cond_broadcast(&this->workAvailable);
+  pthread_mutex_unlock(&this->mutex);
+
+  // Workers in the middle of a call finish it (bounded by the context
+  // timeout) before they notice.
+  for (size_t i = 0; i < this->workers.size(); i++) {
+    pthread_join(this->workers[i], NULL);
+  }
+
+  for (size_t i = 0; i < this->pending.size(); i++) {
+    delete this->pending[i];
+  }
+
+  for (size_t i = 0; i < this->completed.size(); i++) {
+    delete this->completed[i];
+  }
+
+  pthread_cond_destroy(&this->taskCompleted);
+  pthread_cond_destroy(&this->workAvailable);
+  pthread_mutex_destroy(&this->mutex);
+}
+
+void SmbWorkerPool::Submit(SmbTask* task) {
+  pthread_mutex_lock(&this->mutex);
+  this->pending.push_back(task);
+
+  if (this->idleWorkers < this->pending.size() &&
+      this->workers.size() < this->maxWorkers) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, SmbWorkerPool::workerMain, this) == 0) {
+      this->workers.push_back(thread);
+    }
+  }
+
+  pthread_cond_signal(&this->workAvailable);
+  pthread_mutex_unlock(&this->mutex);
+}
+
+SmbTask* SmbWorkerPool::WaitForCompleted(uint64_t deadlineMicros) {
+  struct timespec deadline = Util::realtimeDeadline(deadlineMicros);
+  SmbTask* task = NULL;
+
+  pthread_mutex_lock(&this->mutex);
+  while (this->completed.empty()) {
+    if (pthread_cond_timedwait(&this->taskCompleted, &this->mutex,
+                               &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+
+  if (!this->completed.empty()) {
+    task = this->completed.front();
+    this->completed.pop_front();
+  }
+  pthread_mutex_unlock(&this->mutex);
+
+  return task;
+}
+
+bool SmbWorkerPool::HasCompleted() const {
+  pthread_mutex_lock(&this->mutex);
+  bool hasCompleted = !this->completed.empty();
+  pthread_mutex_unlock(&this->mutex);
+  return hasCompleted;
+}
+
+void SmbWorkerPool::SetCompletedHook(CompletedHook hook) {
+  pthread_mutex_lock(&this->mutex);
+  this->completedHook = hook;
+  pthread_mutex_unlock(&this->mutex);
+}
+
+void SmbWorkerPool::Abandon(SmbTask* task) {
+  pthread_mutex_lock(&this->mutex);
+  std::deque<SmbTask*>::iterator it =
+      std::find(this->pending.begin(), this->pending.end(), task);
+  if (it != this->pending.end()) {
+    // Never started.
+    this->pending.erase(it);
+    delete task;
+  } else {
+    it = std::find(this->completed.begin(), this->completed.end(), task);
+    if (it != this->completed.end()) {
+      this->completed.erase(it);
+      delete task;
+    } else {
+      // Still running. The worker deletes it when it returns.
+      task->abandoned = true;
+    }
+  }
+  pthread_mutex_unlock(&this->mutex);
+}
+
+void SmbWorkerPool::CloseIdleConnections() {
+  pthread_mutex_lock(&this->mutex);
+  this->purgeGeneration++;
+  pthread_cond_broadcast(&this->workAvailable);
+  pthread_mutex_unlock(&this->mutex);
+}
+
+size_t SmbWorkerPool::workerCount() {
+  pthread_mutex_lock(&this->mutex);
+  size_t count = this->workers.size();
+  pthread_mutex_unlock(&this->mutex);
+  return count;
+}
+
+void* SmbWorkerPool::workerMain(void* arg) {
+  static_cast<SmbWorkerPool*>(arg)->runWorker();
+  return NULL;
+}
+
+void SmbWorkerPool::runWorker() {
+  SMBCCTX* context = NULL;
+
+  pthread_mutex_lock(&this->mutex);
+  uint64_t purged = this->purgeGeneration;
+  for (;;) {
+    this->idleWorkers++;
+    while (!this->stopping && this->pending.empty() &&
+           purged == this->purgeGeneration) {
+      pthread_cond_wait(&this->workAvailable, &this->mutex);
+    }
+    this->idleWorkers--;
+
+    if (this->stopping) {
+      break;
+    }
+
+    if (purged != this->purgeGeneration) {
+      purged = this->purgeGeneration;
+      pthread_mutex_unlock(&this->mutex);
+      if (context != NULL) {
+        smbc_getFunctionPurgeCachedServers(context)(context);
+      }
+      pthread_mutex_lock(&this->mutex);
+      continue;
+    }
+
+    SmbTask* task = this->pending.front();
+    this->pending.pop_front();
+    pthread_mutex_unlock(&this->mutex);
+
+    // Contexts are created on the thread that uses them.
+    if (context == NULL) {
+      context = this->createContext();
+    }
+
+    if (context != NULL) {
+      if (task->timeoutMs > 0) {
+        smbc_setTimeout(context, task->timeoutMs);
+      }
+
+      task->Run(context);
+    } else {
+      task->error = EIO;
+    }
+
+    pthread_mutex_lock(&this->mutex);
+    if (task->abandoned) {
+      delete task;
+    } else {
+      this->completed.push_back(task);
+      pthread_cond_signal(&this->taskCompleted);
+      if (this->completedHook != NULL) {
+        CompletedHook hook = this->completedHook;
+        pthread_mutex_unlock(&this->mutex);
+        hook();
+        pthread_mutex_lock(&this->mutex);
+      }
+    }
+  }
+  pthread_mutex_unlock(&this->mutex);
+
+  if (context != NULL) {
+    smbc_free_context(context, 1);
+  }
+}
+
+SMBCCTX* SmbWorkerPool::createContext() {
+  SMBCCTX* context = smbc_new_context();
+  if (!context) {
+    return NULL;
+  }
+
+  smbc_setDebug(context, 0);
+  smbc_setFunctionAuthData(context, this->authFn);
+  smbc_setOptionUseKerberos(context, 1);
+  smbc_setOptionFallbackAfterKerberos(context, 1);
+
+  if (!smbc_init_context(context)) {
+    smbc_free_context(context, 0);
+    return NULL;
+  }
+
+  return context;
+}
+
+SmbTaskRunner::SmbTaskRunner(SmbWorkerPool* pool, size_t maxConcurrent,
+                             uint64_t timeoutMicros)
+    : pool(pool),
+      maxConcurrent(std::max(maxConcurrent, static_cast<size_t>(1))),
+      timeoutMicros(timeoutMicros),
+      lastCompleted(NULL),
+      lastTimedOut(NULL) {}
+
+SmbTaskRunner::~SmbTaskRunner() {
+  this->releaseLast();
+
+  for (size_t i = 0; i < this->waiting.size(); i++) {
+    delete this->waiting[i];
+  }
+
+  for (size_t i = 0; i < this->running.size(); i++) {
+    this->pool->Abandon(this->running[i].first);
+  }
+}
+
+void SmbTaskRunner::Add(SmbTask* task) { this->waiting.push_back(task); }
+
+bool SmbTaskRunner::Next(SmbTask** task, bool* timedOut) {
+  this->releaseLast();
+
+  while (this->running.size() < this->maxConcurrent && !this->waiting.empty()) {
+    SmbTask* next = this->waiting.front();
+    this->waiting.pop_front();
+    this->pool->Submit(next);
+    this->running.push_back(std::make_pair(next, Util::monotonicMicros()));
+  }
+
+  if (this->running.empty()) {
+    return false;
+  }
+
+  // Tasks are submitted in order so the first one is the next to expire.
+  uint64_t deadline = this->running.front().second + this->timeoutMicros;
+  SmbTask* completed = this->pool->WaitForCompleted(deadline);
+
+  if (completed != NULL) {
+    for (size_t i = 0; i < this->running.size(); i++) {
+      if (this->running[i].first == completed) {
+        this->running.erase(this->running.begin() + i);
+        break;
+      }
+    }
+
+    this->lastCompleted = completed;
+    *task = completed;
+    *timedOut = false;
+    return true;
+  }
+
+  this->lastTimedOut = this->running.front().first;
+  this->running.erase(this->running.begin());
+  *task = this->lastTimedOut;
+  *timedOut = true;
+  return true;
+}
+
+void SmbTaskRunner::releaseLast() {
+  delete this->lastCompleted;
+  this->lastCompleted = NULL;
+
+  if (this->lastTimedOut != NULL) {
+    this->pool->Abandon(this->lastTimedOut);
+    this->lastTimedOut = NULL;
+  }
+}
+
+}  // namespace NaclFsp
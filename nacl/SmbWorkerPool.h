@@ -0,0 +1,156 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_SMB_WORKER_POOL_H_
+#define NACL_SMB_WORKER_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "samba/libsmbclient.h"
+
+namespace NaclFsp {
+
+// A unit of work run on one of the pool's threads. Each thread has its own
+// SMBCCTX so tasks must only use the context API with the context they are
+// given, never the smbc_* compat functions.
+class SmbTask {
+ public:
+  SmbTask() : timeoutMs(0), error(0), abandoned(false) {}
+  virtual ~SmbTask() {}
+
+  // Should set error to the errno of a failure.
+  virtual void Run(SMBCCTX* context) = 0;
+
+  // Applied to the context with smbc_setTimeout before Run when non zero.
+  int timeoutMs;
+
+  // Set to EIO without calling Run if the thread has no context.
+  int error;
+
+ private:
+  friend class SmbWorkerPool;
+  bool abandoned;
+};
+
+// Runs SmbTasks on a set of threads that is grown on demand up to
+// maxWorkers. The threads are kept for reuse once started since setting up
+// a context and connecting to a server is the expensive part.
+//
+// The thread handling messages submits tasks and collects them with
+// WaitForCompleted. A task that is taking too long can be abandoned; the
+// pool deletes it when it eventually finishes.
+class SmbWorkerPool {
+ public:
+  // Called on the worker thread after a task completes, for a thread that
+  // waits for the task by other means than WaitForCompleted.
+  typedef void (*CompletedHook)();
+
+  SmbWorkerPool(smbc_get_auth_data_fn authFn, size_t maxWorkers);
+  ~SmbWorkerPool();
+
+  // Takes ownership of the task until it is returned by WaitForCompleted.
+  void Submit(SmbTask* task);
+
+  // Returns the next completed task or NULL if none completed before
+  // deadlineMicros (monotonic).
+  SmbTask* WaitForCompleted(uint64_t deadlineMicros);
+  bool HasCompleted() const;
+
+  void SetCompletedHook(CompletedHook hook);
+
+  // Gives up on a submitted task. It must not be used after this.
+  void Abandon(SmbTask* task);
+
+  // Has every worker drop its connections to servers, straight away if it
+  // is idle or else once its task is done. The threads and their contexts
+  // are kept and connect again when they are next used.
+  void CloseIdleConnections();
+
+  size_t workerCount();
+
+ private:
+  smbc_get_auth_data_fn authFn;
+  size_t maxWorkers;
+  CompletedHook completedHook;
+
+  mutable pthread_mutex_t mutex;
+  pthread_cond_t workAvailable;
+  pthread_cond_t taskCompleted;
+  std::deque<SmbTask*> pending;
+  std::deque<SmbTask*> completed;
+  std::vector<pthread_t> workers;
+  size_t idleWorkers;
+  bool stopping;
+  // Bumped by CloseIdleConnections. Each worker purges its context when it
+  // sees a new value.
+  uint64_t purgeGeneration;
+
+  static void* workerMain(void* arg);
+  void runWorker();
+  SMBCCTX* createContext();
+
+  // Prevent copy and assignment.
+  SmbWorkerPool(const SmbWorkerPool&);
+  SmbWorkerPool& operator=(const SmbWorkerPool&);
+};
+
+// Runs a set of tasks on a pool with at most maxConcurrent in flight and
+// gives up on any that run longer than timeoutMicros:
+//
+//   SmbTaskRunner runner(&pool, 16, timeoutMicros);
+//   runner.Add(task);
+//   while (runner.Next(&task, &timedOut)) { ... }
+//
+// The runner owns the tasks. A task returned by Next is valid until the
+// following call. A timed out task is still running so only the fields set
+// before it was added may be read.
+class SmbTaskRunner {
+ public:
+  SmbTaskRunner(SmbWorkerPool* pool, size_t maxConcurrent,
+                uint64_t timeoutMicros);
+  ~SmbTaskRunner();
+
+  void Add(SmbTask* task);
+
+  // Waits for the next task to finish or time out. Returns false once every
+  // task has been returned.
+  bool Next(SmbTask** task, bool* timedOut);
+
+ private:
+  SmbWorkerPool* pool;
+  size_t maxConcurrent;
+  uint64_t timeoutMicros;
+  std::deque<SmbTask*> waiting;
+
+  // Submitted tasks and when they were submitted.
+  std::vector<std::pair<SmbTask*, uint64_t> > running;
+
+  SmbTask* lastCompleted;
+  SmbTask* lastTimedOut;
+
+  void releaseLast();
+
+  // Prevent copy and assignment.
+  SmbTaskRunner(const SmbTaskRunner&);
+  SmbTaskRunner& operator=(const SmbTaskRunner&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_SMB_WORKER_POOL_H_
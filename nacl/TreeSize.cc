@@ -0,0 +1,128 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "TreeSize.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+TreeSizeCache::TreeSizeCache(size_t maxDirectories, uint64_t ttlMicros)
+    : maxDirectories(maxDirectories), ttlMicros(ttlMicros), totalBytes(0) {}
+
+bool TreeSizeCache::Lookup(const std::string& directory,
+                           DirectoryTotals* totals) const {
+  EntryMap::const_iterator it = this->entries.find(directory);
+  if (it == this->entries.end() ||
+      it->second.expiresMicros <= Util::monotonicMicros()) {
+    return false;
+  }
+
+  *totals = it->second.totals;
+  return true;
+}
+
+void TreeSizeCache::Store(const std::string& directory,
+                          const DirectoryTotals& totals) {
+  this->Invalidate(directory);
+
+  while (!this->ages.empty() && this->entries.size() >= this->maxDirectories) {
+    this->Invalidate(this->ages.front());
+  }
+
+  Entry& entry = this->entries[directory];
+  entry.totals = totals;
+  entry.expiresMicros = Util::monotonicMicros() + this->ttlMicros;
+  entry.age = this->ages.insert(this->ages.end(), directory);
+
+  // The path is held by both the map and the age list.
+  entry.bytes = sizeof(Entry) + 2 * directory.size();
+  for (size_t i = 0; i < totals.subdirectories.size(); i++) {
+    entry.bytes += sizeof(std::string) + totals.subdirectories[i].size();
+  }
+  this->totalBytes += entry.bytes;
+}
+
+void TreeSizeCache::Invalidate(const std::string& directory) {
+  EntryMap::iterator it = this->entries.find(directory);
+  if (it != this->entries.end()) {
+    this->totalBytes -= it->second.bytes;
+    this->ages.erase(it->second.age);
+    this->entries.erase(it);
+  }
+}
+
+void TreeSizeCache::TrimMemory(size_t targetBytes) {
+  while (!this->ages.empty() && this->totalBytes > targetBytes) {
+    this->Invalidate(this->ages.front());
+  }
+}
+
+TreeSizeTask::TreeSizeTask(const std::string& directory, int depth,
+                           const TreeSizeCache* cache)
+    : WalkDirectoryTask(directory, depth),
+      fromCache(false),
+      failedEntries(0),
+      cache(cache) {
+  this->haveCached = cache->Lookup(directory, &this->cached);
+}
+
+void TreeSizeTask::Run(SMBCCTX* context) {
+  struct stat statInfo;
+  if (smbc_getFunctionStat(context)(context, this->directory.c_str(),
+                                    &statInfo) < 0) {
+    this->error = errno;
+    return;
+  }
+
+  if (this->haveCached &&
+      this->cached.modificationTime == statInfo.st_mtime) {
+    this->totals = this->cached;
+    this->subdirectories = this->cached.subdirectories;
+    this->fromCache = true;
+    return;
+  }
+
+  this->totals.modificationTime = statInfo.st_mtime;
+  WalkDirectoryTask::Run(context);
+  this->totals.subdirectories = this->subdirectories;
+}
+
+WalkDirectoryTask* TreeSizeTask::CreateChild(const std::string& directory,
+                                             int depth) const {
+  return new TreeSizeTask(directory, depth, this->cache);
+}
+
+void TreeSizeTask::visitEntry(SMBCCTX* context, const std::string& name,
+                              const std::string& fullPath, bool isDirectory) {
+  if (isDirectory) {
+    return;
+  }
+
+  struct stat statInfo;
+  if (smbc_getFunctionStat(context)(context, fullPath.c_str(), &statInfo) <
+      0) {
+    this->failedEntries++;
+    return;
+  }
+
+  this->totals.bytes += statInfo.st_size;
+  this->totals.files++;
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,111 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_TREE_SIZE_H_
+#define NACL_TREE_SIZE_H_
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "MemoryBudget.h"
+#include "TreeWalk.h"
+
+namespace NaclFsp {
+
+// What one directory holds directly. Subdirectories have their own.
+class DirectoryTotals {
+ public:
+  DirectoryTotals() : modificationTime(-1), bytes(0), files(0) {}
+
+  int modificationTime;
+  double bytes;
+  uint64_t files;
+  std::vector<std::string> subdirectories;
+};
+
+// Remembers DirectoryTotals from earlier custom_computeTreeSize walks. An
+// entry is reused while the directory's modification time is unchanged,
+// which catches files being added, removed or renamed. Files that change
+// size in place don't touch the directory time so entries also expire.
+//
+// Only used from the thread handling messages.
+class TreeSizeCache : public MemoryConsumer {
+ public:
+  TreeSizeCache(size_t maxDirectories, uint64_t ttlMicros);
+
+  bool Lookup(const std::string& directory, DirectoryTotals* totals) const;
+  void Store(const std::string& directory, const DirectoryTotals& totals);
+  void Invalidate(const std::string& directory);
+
+  virtual size_t MemoryUsage() const { return this->totalBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Entry {
+   public:
+    DirectoryTotals totals;
+    uint64_t expiresMicros;
+    size_t bytes;
+    std::list<std::string>::iterator age;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  size_t maxDirectories;
+  uint64_t ttlMicros;
+  size_t totalBytes;
+  EntryMap entries;
+  // Directories from oldest to newest.
+  std::list<std::string> ages;
+
+  // Prevent copy and assignment.
+  TreeSizeCache(const TreeSizeCache&);
+  TreeSizeCache& operator=(const TreeSizeCache&);
+};
+
+// Totals one directory of a custom_computeTreeSize walk. The directory is
+// stat()'d first and when the cache has it at the same modification time
+// nothing else is read. Otherwise it is listed and each file stat()'d,
+// since getdents doesn't return sizes.
+class TreeSizeTask : public WalkDirectoryTask {
+ public:
+  // The cache is only read here, on the thread handling messages.
+  TreeSizeTask(const std::string& directory, int depth,
+               const TreeSizeCache* cache);
+
+  virtual void Run(SMBCCTX* context);
+  virtual WalkDirectoryTask* CreateChild(const std::string& directory,
+                                         int depth) const;
+
+  DirectoryTotals totals;
+  bool fromCache;
+  size_t failedEntries;
+
+ protected:
+  virtual void visitEntry(SMBCCTX* context, const std::string& name,
+                          const std::string& fullPath, bool isDirectory);
+
+ private:
+  const TreeSizeCache* cache;
+  bool haveCached;
+  DirectoryTotals cached;
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_TREE_SIZE_H_
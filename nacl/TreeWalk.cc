@@ -0,0 +1,118 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "TreeWalk.h"
+
+#include <errno.h>
+
+#include "util.h"
+
+namespace NaclFsp {
+
+void WalkDirectoryTask::Run(SMBCCTX* context) {
+  SMBCFILE* dir =
+      smbc_getFunctionOpendir(context)(context, this->directory.c_str());
+  if (dir == NULL) {
+    this->error = errno;
+    return;
+  }
+
+  smbc_getdents_fn getdents = smbc_getFunctionGetdents(context);
+  const int bufferSize = 1024 * 32;
+  std::vector<unsigned char> buffer(bufferSize);
+  int bytesRemaining = 0;
+
+  while ((bytesRemaining = getdents(
+              context, dir, reinterpret_cast<struct smbc_dirent*>(&buffer[0]),
+              bufferSize)) > 0) {
+    // Same variable length walk as SambaFsp::listDirectory.
+    struct smbc_dirent* dirent =
+        reinterpret_cast<struct smbc_dirent*>(&buffer[0]);
+
+    while (bytesRemaining > 0) {
+      bool isFile = dirent->smbc_type == SMBC_FILE;
+      bool isDirectory = dirent->smbc_type == SMBC_DIR;
+      std::string name = dirent->name;
+
+      if ((isFile || isDirectory) && name != "." && name != "..") {
+        std::string fullPath = this->directory + "/" + name;
+        if (isDirectory) {
+          this->subdirectories.push_back(fullPath);
+        }
+
+        this->visitEntry(context, name, fullPath, isDirectory);
+      }
+
+      bytesRemaining -= dirent->dirlen;
+      dirent = reinterpret_cast<struct smbc_dirent*>(
+          reinterpret_cast<uint8_t*>(dirent) + dirent->dirlen);
+    }
+  }
+
+  if (bytesRemaining < 0) {
+    this->error = errno;
+  }
+
+  smbc_getFunctionClosedir(context)(context, dir);
+}
+
+TreeWalk::TreeWalk(SmbWorkerPool* pool, size_t maxConcurrent,
+                   uint64_t timeoutMicros, int maxDepth,
+                   uint64_t deadlineMicros)
+    : runner(pool, maxConcurrent, timeoutMicros),
+      maxDepth(maxDepth),
+      deadlineMicros(deadlineMicros),
+      stopped(false),
+      listed(0),
+      failed(0) {}
+
+void TreeWalk::Add(WalkDirectoryTask* task) { this->runner.Add(task); }
+
+bool TreeWalk::Next(WalkDirectoryTask** task, bool* timedOut) {
+  if (this->stopped) {
+    return false;
+  }
+
+  // Checked between directories. Anything still running is abandoned when
+  // the walk is destroyed.
+  if (Util::monotonicMicros() >= this->deadlineMicros) {
+    this->stopped = true;
+    return false;
+  }
+
+  SmbTask* finished;
+  if (!this->runner.Next(&finished, timedOut)) {
+    return false;
+  }
+
+  WalkDirectoryTask* walkTask = static_cast<WalkDirectoryTask*>(finished);
+  if (*timedOut || walkTask->error != 0) {
+    this->failed++;
+  } else {
+    this->listed++;
+    int childDepth = walkTask->depth + 1;
+    if (this->maxDepth < 0 || childDepth <= this->maxDepth) {
+      for (size_t i = 0; i < walkTask->subdirectories.size(); i++) {
+        this->runner.Add(
+            walkTask->CreateChild(walkTask->subdirectories[i], childDepth));
+      }
+    }
+  }
+
+  *task = walkTask;
+  return true;
+}
+
+}  // namespace NaclFsp
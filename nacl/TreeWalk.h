@@ -0,0 +1,89 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_TREE_WALK_H_
+#define NACL_TREE_WALK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "SmbWorkerPool.h"
+
+namespace NaclFsp {
+
+// Lists one directory of a TreeWalk on a worker thread. Subclasses see each
+// entry there too, so per entry work runs on as many connections as the
+// walk uses.
+class WalkDirectoryTask : public SmbTask {
+ public:
+  WalkDirectoryTask(const std::string& directory, int depth)
+      : directory(directory), depth(depth) {}
+
+  virtual void Run(SMBCCTX* context);
+
+  // Returns a task of the same kind for a subdirectory.
+  virtual WalkDirectoryTask* CreateChild(const std::string& directory,
+                                         int depth) const = 0;
+
+  std::string directory;
+  int depth;
+  std::vector<std::string> subdirectories;
+
+ protected:
+  // Called for every file and directory except . and ..
+  virtual void visitEntry(SMBCCTX* context, const std::string& name,
+                          const std::string& fullPath, bool isDirectory) {}
+};
+
+// Walks a tree breadth first with up to maxConcurrent directories being
+// listed at once:
+//
+//   TreeWalk walk(&pool, 8, timeoutMicros, maxDepth, deadlineMicros);
+//   walk.Add(new MyTask(root, 0));
+//   while (walk.Next(&task, &timedOut)) { ... }
+//
+// Subdirectories of each finished directory are queued before Next returns
+// it, down to maxDepth (negative for no limit). Next returns false once the
+// tree is done or deadlineMicros (monotonic) has passed, in which case
+// stoppedEarly() is true. Tasks follow the SmbTaskRunner rules.
+class TreeWalk {
+ public:
+  TreeWalk(SmbWorkerPool* pool, size_t maxConcurrent, uint64_t timeoutMicros,
+           int maxDepth, uint64_t deadlineMicros);
+
+  void Add(WalkDirectoryTask* task);
+  bool Next(WalkDirectoryTask** task, bool* timedOut);
+
+  bool stoppedEarly() const { return this->stopped; }
+  size_t directoriesListed() const { return this->listed; }
+  size_t directoriesFailed() const { return this->failed; }
+
+ private:
+  SmbTaskRunner runner;
+  int maxDepth;
+  uint64_t deadlineMicros;
+  bool stopped;
+  size_t listed;
+  size_t failed;
+
+  // Prevent copy and assignment.
+  TreeWalk(const TreeWalk&);
+  TreeWalk& operator=(const TreeWalk&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_TREE_WALK_H_
@@ -0,0 +1,187 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "VarKeys.h"
+
+namespace NaclFsp {
+
+const VarKeys& VarKeys::Get() {
+  // Only ever touched from the message handling thread.
+  static VarKeys* keys = NULL;
+  if (keys == NULL) {
+    keys = new VarKeys();
+  }
+
+  return *keys;
+}
+
+VarKeys::VarKeys()
+    : functionName("functionName"),
+      messageId("messageId"),
+      args("args"),
+      result("result"),
+      hasMore("hasMore"),
+      value("value"),
+      error("error"),
+      fileSystemId("fileSystemId"),
+      requestId("requestId"),
+      directoryPath("directoryPath"),
+      openRequestId("openRequestId"),
+      offset("offset"),
+      length("length"),
+      data("data"),
+      displayName("displayName"),
+      writable("writable"),
+      openedFilesLimit("openedFilesLimit"),
+      fieldMask("fieldMask"),
+      entryPath("entryPath"),
+      entries("entries"),
+      recursive("recursive"),
+      filePath("filePath"),
+      mode("mode"),
+      sourcePath("sourcePath"),
+      targetPath("targetPath"),
+      maxConcurrentHosts("maxConcurrentHosts"),
+      hostTimeoutMs("hostTimeoutMs"),
+      cacheTtlSeconds("cacheTtlSeconds"),
+      maxConcurrentMounts("maxConcurrentMounts"),
+      mountTimeoutMs("mountTimeoutMs"),
+      pattern("pattern"),
+      maxDepth("maxDepth"),
+      maxResults("maxResults"),
+      timeLimitMs("timeLimitMs"),
+      algorithm("algorithm"),
+      archivePath("archivePath"),
+      memberPath("memberPath"),
+      expiresInMs("expiresInMs"),
+      versionToken("versionToken"),
+      stale("stale"),
+      isDirectory("isDirectory"),
+      name("name"),
+      fullPath("fullPath"),
+      size("size"),
+      modificationTime("modificationTime"),
+      mimeType("mimeType"),
+      thumbnail("thumbnail"),
+      mountInfo("mountInfo"),
+      options("options"),
+      sharePath("sharePath"),
+      domain("domain"),
+      user("user"),
+      password("password"),
+      server("server"),
+      path("path"),
+      share("share"),
+      serverIP("serverIP"),
+      batching("batching"),
+      enabled("enabled"),
+      maxResponses("maxResponses"),
+      windowMicros("windowMicros"),
+      memory("memory"),
+      limitBytes("limitBytes"),
+      hashPaths("hashPaths"),
+      samba("samba"),
+      debugLevel("debugLevel"),
+      useKerberos("useKerberos"),
+      sniffMimeTypes("sniffMimeTypes"),
+      prefetchDirectories("prefetchDirectories"),
+      persistentCache("persistentCache"),
+      deltaUpload("deltaUpload"),
+      hedging("hedging"),
+      idleSessionSeconds("idleSessionSeconds"),
+      idleHandleSeconds("idleHandleSeconds"),
+      added("added"),
+      modified("modified"),
+      unchanged("unchanged"),
+      removed("removed"),
+      full("full"),
+      matches("matches"),
+      directories("directories"),
+      files("files"),
+      bytes("bytes"),
+      bytesRead("bytesRead"),
+      failedDirectories("failedDirectories"),
+      failedEntries("failedEntries"),
+      failedFiles("failedFiles"),
+      cachedDirectories("cachedDirectories"),
+      complete("complete"),
+      resultLimitReached("resultLimitReached"),
+      timeLimitReached("timeLimitReached"),
+      digest("digest"),
+      memberSize("memberSize"),
+      records("records"),
+      singleFlight("singleFlight"),
+      executed("executed"),
+      joinedQueued("joinedQueued"),
+      joinedCompleted("joinedCompleted"),
+      responses("responses"),
+      messages("messages"),
+      deadlines("deadlines"),
+      expiredQueued("expiredQueued"),
+      expiredRunning("expiredRunning"),
+      subsystems("subsystems"),
+      priority("priority"),
+      usedBytes("usedBytes"),
+      peakBytes("peakBytes"),
+      trimmedBytes("trimmedBytes"),
+      trims("trims"),
+      overLimit("overLimit"),
+      session("session"),
+      reconnects("reconnects"),
+      replayedOperations("replayedOperations"),
+      reopenedFiles("reopenedFiles"),
+      idleClosed("idleClosed"),
+      sessionsClosed("sessionsClosed"),
+      handlesReaped("handlesReaped"),
+      probes("probes"),
+      staleFound("staleFound"),
+      requests("requests"),
+      thumbnails("thumbnails"),
+      extracted("extracted"),
+      missing("missing"),
+      cacheHits("cacheHits"),
+      hits("hits"),
+      misses("misses"),
+      saved("saved"),
+      stored("stored"),
+      prefetch("prefetch"),
+      started("started"),
+      cancelled("cancelled"),
+      used("used"),
+      hashing("hashing"),
+      crc32cKernel("crc32cKernel"),
+      archives("archives"),
+      listed("listed"),
+      directoryHits("directoryHits"),
+      membersRead("membersRead"),
+      bytesInflated("bytesInflated"),
+      listingDiffs("listingDiffs"),
+      diffs("diffs"),
+      fullListings("fullListings"),
+      entriesSent("entriesSent"),
+      entriesUnchanged("entriesUnchanged"),
+      delta("delta"),
+      bytesSaved("bytesSaved"),
+      bytesWritten("bytesWritten"),
+      signatureHits("signatureHits"),
+      crcChecked("crcChecked"),
+      hedgeWins("hedgeWins"),
+      hedgesSent("hedgesSent"),
+      hedgesSkipped("hedgesSkipped"),
+      delayMicros("delayMicros"),
+      stat("stat"),
+      list("list") {}
+
+}  // namespace NaclFsp
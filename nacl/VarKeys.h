@@ -0,0 +1,212 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_VAR_KEYS_H_
+#define NACL_VAR_KEYS_H_
+
+#include "ppapi/cpp/var.h"
+
+namespace NaclFsp {
+
+// Interned pp::Var strings for every dictionary key the module reads or
+// writes. Building a pp::Var from a C string allocates and registers a new
+// string with the browser each time so the hot paths use these instead.
+//
+// They can't be plain statics because the Var interface is not available
+// until the module is initialized, so they are created on first use.
+class VarKeys {
+ public:
+  static const VarKeys& Get();
+
+  // Message envelope.
+  pp::Var functionName;
+  pp::Var messageId;
+  pp::Var args;
+  pp::Var result;
+  pp::Var hasMore;
+  pp::Var value;
+  pp::Var error;
+
+  // Options.
+  pp::Var fileSystemId;
+  pp::Var requestId;
+  pp::Var directoryPath;
+  pp::Var openRequestId;
+  pp::Var offset;
+  pp::Var length;
+  pp::Var data;
+  pp::Var displayName;
+  pp::Var writable;
+  pp::Var openedFilesLimit;
+  pp::Var fieldMask;
+  pp::Var entryPath;
+  pp::Var entries;
+  pp::Var recursive;
+  pp::Var filePath;
+  pp::Var mode;
+  pp::Var sourcePath;
+  pp::Var targetPath;
+  pp::Var maxConcurrentHosts;
+  pp::Var hostTimeoutMs;
+  pp::Var cacheTtlSeconds;
+  pp::Var maxConcurrentMounts;
+  pp::Var mountTimeoutMs;
+  pp::Var pattern;
+  pp::Var maxDepth;
+  pp::Var maxResults;
+  pp::Var timeLimitMs;
+  pp::Var algorithm;
+  pp::Var archivePath;
+  pp::Var memberPath;
+  pp::Var expiresInMs;
+  pp::Var versionToken;
+  pp::Var stale;
+
+  // EntryMetadata.
+  pp::Var isDirectory;
+  pp::Var name;
+  pp::Var fullPath;
+  pp::Var size;
+  pp::Var modificationTime;
+  pp::Var mimeType;
+  pp::Var thumbnail;
+
+  // Mount info.
+  pp::Var mountInfo;
+  pp::Var options;
+  pp::Var sharePath;
+  pp::Var domain;
+  pp::Var user;
+  pp::Var password;
+  pp::Var server;
+  pp::Var path;
+  pp::Var share;
+  pp::Var serverIP;
+
+  // custom_configure.
+  pp::Var batching;
+  pp::Var enabled;
+  pp::Var maxResponses;
+  pp::Var windowMicros;
+  pp::Var memory;
+  pp::Var limitBytes;
+  pp::Var hashPaths;
+  pp::Var samba;
+  pp::Var debugLevel;
+  pp::Var useKerberos;
+  pp::Var sniffMimeTypes;
+  pp::Var prefetchDirectories;
+  pp::Var persistentCache;
+  pp::Var deltaUpload;
+  pp::Var hedging;
+  pp::Var idleSessionSeconds;
+  pp::Var idleHandleSeconds;
+
+  // Results of custom operations.
+  pp::Var added;
+  pp::Var modified;
+  pp::Var unchanged;
+  pp::Var removed;
+  pp::Var full;
+  pp::Var matches;
+  pp::Var directories;
+  pp::Var files;
+  pp::Var bytes;
+  pp::Var bytesRead;
+  pp::Var failedDirectories;
+  pp::Var failedEntries;
+  pp::Var failedFiles;
+  pp::Var cachedDirectories;
+  pp::Var complete;
+  pp::Var resultLimitReached;
+  pp::Var timeLimitReached;
+  pp::Var digest;
+  pp::Var memberSize;
+  pp::Var records;
+
+  // custom_getStats and custom_getMemoryReport.
+  pp::Var singleFlight;
+  pp::Var executed;
+  pp::Var joinedQueued;
+  pp::Var joinedCompleted;
+  pp::Var responses;
+  pp::Var messages;
+  pp::Var deadlines;
+  pp::Var expiredQueued;
+  pp::Var expiredRunning;
+  pp::Var subsystems;
+  pp::Var priority;
+  pp::Var usedBytes;
+  pp::Var peakBytes;
+  pp::Var trimmedBytes;
+  pp::Var trims;
+  pp::Var overLimit;
+  pp::Var session;
+  pp::Var reconnects;
+  pp::Var replayedOperations;
+  pp::Var reopenedFiles;
+  pp::Var idleClosed;
+  pp::Var sessionsClosed;
+  pp::Var handlesReaped;
+  pp::Var probes;
+  pp::Var staleFound;
+  pp::Var requests;
+  pp::Var thumbnails;
+  pp::Var extracted;
+  pp::Var missing;
+  pp::Var cacheHits;
+  pp::Var hits;
+  pp::Var misses;
+  pp::Var saved;
+  pp::Var stored;
+  pp::Var prefetch;
+  pp::Var started;
+  pp::Var cancelled;
+  pp::Var used;
+  pp::Var hashing;
+  pp::Var crc32cKernel;
+  pp::Var archives;
+  pp::Var listed;
+  pp::Var directoryHits;
+  pp::Var membersRead;
+  pp::Var bytesInflated;
+  pp::Var listingDiffs;
+  pp::Var diffs;
+  pp::Var fullListings;
+  pp::Var entriesSent;
+  pp::Var entriesUnchanged;
+  pp::Var delta;
+  pp::Var bytesSaved;
+  pp::Var bytesWritten;
+  pp::Var signatureHits;
+  pp::Var crcChecked;
+  pp::Var hedgeWins;
+  pp::Var hedgesSent;
+  pp::Var hedgesSkipped;
+  pp::Var delayMicros;
+  pp::Var stat;
+  pp::Var list;
+
+ private:
+  VarKeys();
+
+  // Prevent copy and assignment.
+  VarKeys(const VarKeys&);
+  VarKeys& operator=(const VarKeys&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_VAR_KEYS_H_
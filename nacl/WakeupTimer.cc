@@ -0,0 +1,78 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "WakeupTimer.h"
+
+#include "util.h"
+
+namespace NaclFsp {
+
+WakeupTimer::WakeupTimer(Hook hook)
+    : hook(hook), deadlineMicros(0), stopping(false) {
+  pthread_mutex_init(&this->mutex, NULL);
+  pthread_cond_init(&this->deadlineChanged, NULL);
+  pthread_create(&this->thread, NULL, &WakeupTimer::threadMain, this);
+}
+
+WakeupTimer::~WakeupTimer() {
+  pthread_mutex_lock(&this->mutex);
+  this->stopping = true;
+  pthread_cond_signal(&this->deadlineChanged);
+  pthread_mutex_unlock(&this->mutex);
+
+  pthread_join(this->thread, NULL);
+  pthread_cond_destroy(&this->deadlineChanged);
+  pthread_mutex_destroy(&this->mutex);
+}
+
+void WakeupTimer::Arm(uint64_t deadlineMicros) {
+  pthread_mutex_lock(&this->mutex);
+  if (deadlineMicros != this->deadlineMicros) {
+    this->deadlineMicros = deadlineMicros;
+    pthread_cond_signal(&this->deadlineChanged);
+  }
+  pthread_mutex_unlock(&this->mutex);
+}
+
+void* WakeupTimer::threadMain(void* arg) {
+  static_cast<WakeupTimer*>(arg)->run();
+  return NULL;
+}
+
+void WakeupTimer::run() {
+  pthread_mutex_lock(&this->mutex);
+  while (!this->stopping) {
+    if (this->deadlineMicros == 0) {
+      pthread_cond_wait(&this->deadlineChanged, &this->mutex);
+      continue;
+    }
+
+    if (Util::monotonicMicros() < this->deadlineMicros) {
+      struct timespec deadline = Util::realtimeDeadline(this->deadlineMicros);
+      pthread_cond_timedwait(&this->deadlineChanged, &this->mutex, &deadline);
+      continue;
+    }
+
+    // Each deadline fires once. The hook runs unlocked so it can't hold up
+    // the next Arm.
+    this->deadlineMicros = 0;
+    pthread_mutex_unlock(&this->mutex);
+    this->hook();
+    pthread_mutex_lock(&this->mutex);
+  }
+  pthread_mutex_unlock(&this->mutex);
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,57 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_WAKEUP_TIMER_H_
+#define NACL_WAKEUP_TIMER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+namespace NaclFsp {
+
+// Calls a hook from its own thread once a deadline has passed. The message
+// loop blocks in PSEventWaitAcquire, which can't time out, so this is how
+// it gets woken up for work that is due at a given time, like a response
+// batch to flush.
+class WakeupTimer {
+ public:
+  typedef void (*Hook)();
+
+  explicit WakeupTimer(Hook hook);
+  ~WakeupTimer();
+
+  // Replaces the deadline (monotonic micros). Zero disarms the timer. A
+  // deadline that has passed calls the hook straight away.
+  void Arm(uint64_t deadlineMicros);
+
+ private:
+  Hook hook;
+  pthread_mutex_t mutex;
+  pthread_cond_t deadlineChanged;
+  pthread_t thread;
+  uint64_t deadlineMicros;
+  bool stopping;
+
+  static void* threadMain(void* arg);
+  void run();
+
+  // Prevent copy and assignment.
+  WakeupTimer(const WakeupTimer&);
+  WakeupTimer& operator=(const WakeupTimer&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_WAKEUP_TIMER_H_
@@ -0,0 +1,572 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "ZipArchive.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+
+namespace NaclFsp {
+
+namespace {
+
+const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+const uint32_t END_SIGNATURE = 0x06054b50;
+const uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+const uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+
+const size_t LOCAL_HEADER_BYTES = 30;
+const size_t CENTRAL_HEADER_BYTES = 46;
+const size_t END_BYTES = 22;
+const size_t ZIP64_END_BYTES = 56;
+const size_t ZIP64_LOCATOR_BYTES = 20;
+const size_t MAX_COMMENT_BYTES = 0xffff;
+
+// Most archives have no comment so the end record is in the first read.
+const size_t FIRST_TAIL_BYTES = 4096;
+const uint64_t MAX_CENTRAL_DIRECTORY_BYTES = 64 * 1024 * 1024;
+const size_t STORED_READ_BYTES = 256 * 1024;
+
+const uint16_t FLAG_ENCRYPTED = 1;
+const uint16_t FLAG_UTF8 = 1 << 11;
+const uint16_t METHOD_STORED = 0;
+const uint16_t METHOD_DEFLATED = 8;
+
+const uint16_t EXTRA_ZIP64 = 0x0001;
+const uint16_t EXTRA_EXTENDED_TIMESTAMP = 0x5455;
+
+// Names without the UTF-8 flag are in code page 437. These are the
+// characters for bytes 0x80 to 0xff.
+const uint16_t CP437_HIGH[128] = {
+    0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7,
+    0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5,
+    0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9,
+    0x00ff, 0x00d6, 0x00dc, 0x00a2, 0x00a3, 0x00a5, 0x20a7, 0x0192,
+    0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba,
+    0x00bf, 0x2310, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510,
+    0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f,
+    0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b,
+    0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580,
+    0x03b1, 0x00df, 0x0393, 0x03c0, 0x03a3, 0x03c3, 0x00b5, 0x03c4,
+    0x03a6, 0x0398, 0x03a9, 0x03b4, 0x221e, 0x03c6, 0x03b5, 0x2229,
+    0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248,
+    0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0};
+
+inline uint16_t load16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t load32(const uint8_t* p) {
+  return static_cast<uint32_t>(load16(p)) |
+         (static_cast<uint32_t>(load16(p + 2)) << 16);
+}
+
+inline uint64_t load64(const uint8_t* p) {
+  return static_cast<uint64_t>(load32(p)) |
+         (static_cast<uint64_t>(load32(p + 4)) << 32);
+}
+
+std::string cp437ToUtf8(const uint8_t* name, size_t length) {
+  std::string utf8;
+  utf8.reserve(length);
+  for (size_t i = 0; i < length; i++) {
+    uint16_t c = name[i] < 0x80 ? name[i] : CP437_HIGH[name[i] - 0x80];
+    if (c < 0x80) {
+      utf8 += static_cast<char>(c);
+    } else if (c < 0x800) {
+      utf8 += static_cast<char>(0xc0 | (c >> 6));
+      utf8 += static_cast<char>(0x80 | (c & 0x3f));
+    } else {
+      utf8 += static_cast<char>(0xe0 | (c >> 12));
+      utf8 += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      utf8 += static_cast<char>(0x80 | (c & 0x3f));
+    }
+  }
+
+  return utf8;
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+int daysFromCivil(int year, int month, int day) {
+  year -= month <= 2;
+  int era = (year >= 0 ? year : year - 399) / 400;
+  int yearOfEra = year - era * 400;
+  int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int dayOfEra =
+      yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+// DOS times have no time zone. They are taken as UTC.
+int dosTimeToUnix(uint16_t date, uint16_t time) {
+  int day = std::max(date & 0x1f, 1);
+  int month = std::min(std::max((date >> 5) & 0xf, 1), 12);
+  int year = 1980 + (date >> 9);
+  int seconds = ((time >> 11) * 60 + ((time >> 5) & 0x3f)) * 60 +
+                (time & 0x1f) * 2;
+  return daysFromCivil(year, month, day) * 86400 + seconds;
+}
+
+// Fills in what the central header left out for the ZIP64 extra field and
+// takes the Unix time from the extended timestamp field when there is one.
+bool parseExtraFields(const uint8_t* extra, size_t length, ZipEntry* entry) {
+  size_t position = 0;
+  while (position + 4 <= length) {
+    uint16_t id = load16(extra + position);
+    uint16_t size = load16(extra + position + 2);
+    const uint8_t* data = extra + position + 4;
+    if (position + 4 + size > length) {
+      return false;
+    }
+
+    if (id == EXTRA_ZIP64) {
+      size_t used = 0;
+      uint64_t* fields[] = {&entry->uncompressedSize, &entry->compressedSize,
+                            &entry->localHeaderOffset};
+      for (size_t i = 0; i < 3; i++) {
+        if (*fields[i] != 0xffffffff) {
+          continue;
+        } else if (used + 8 > size) {
+          return false;
+        }
+
+        *fields[i] = load64(data + used);
+        used += 8;
+      }
+    } else if (id == EXTRA_EXTENDED_TIMESTAMP && size >= 5 &&
+               (data[0] & 1) != 0) {
+      entry->modificationTime = static_cast<int32_t>(load32(data + 1));
+    }
+
+    position += 4 + size;
+  }
+
+  return true;
+}
+
+ZipResult parseCentralDirectory(const std::vector<uint8_t>& directory,
+                                uint64_t base,
+                                std::vector<ZipEntry>* entries) {
+  size_t position = 0;
+  while (position + CENTRAL_HEADER_BYTES <= directory.size()) {
+    const uint8_t* header = &directory[position];
+    if (load32(header) != CENTRAL_HEADER_SIGNATURE) {
+      return ZIP_BAD_ARCHIVE;
+    }
+
+    size_t nameLength = load16(header + 28);
+    size_t extraLength = load16(header + 30);
+    size_t commentLength = load16(header + 32);
+    size_t recordLength =
+        CENTRAL_HEADER_BYTES + nameLength + extraLength + commentLength;
+    if (position + recordLength > directory.size()) {
+      return ZIP_BAD_ARCHIVE;
+    }
+
+    ZipEntry entry;
+    entry.flags = load16(header + 8);
+    entry.method = load16(header + 10);
+    entry.modificationTime = dosTimeToUnix(load16(header + 14),
+                                           load16(header + 12));
+    entry.crc32 = load32(header + 16);
+    entry.compressedSize = load32(header + 20);
+    entry.uncompressedSize = load32(header + 24);
+    entry.localHeaderOffset = load32(header + 42);
+
+    const uint8_t* name = header + CENTRAL_HEADER_BYTES;
+    if ((entry.flags & FLAG_UTF8) != 0) {
+      entry.name.assign(reinterpret_cast<const char*>(name), nameLength);
+    } else {
+      entry.name = cp437ToUtf8(name, nameLength);
+    }
+
+    if (!entry.name.empty() && entry.name[entry.name.size() - 1] == '/') {
+      entry.isDirectory = true;
+      entry.name.erase(entry.name.size() - 1);
+    }
+
+    if (!parseExtraFields(name + nameLength, extraLength, &entry)) {
+      return ZIP_BAD_ARCHIVE;
+    }
+
+    entry.localHeaderOffset += base;
+    entries->push_back(entry);
+    position += recordLength;
+  }
+
+  return ZIP_OK;
+}
+
+// Returns where the end of central directory record starts in |tail|, or
+// -1. A comment can itself contain the signature so a record whose comment
+// runs exactly to the end of the file is preferred. Failing that the last
+// one that fits is taken, for archives with something appended.
+ssize_t findEndRecord(const std::vector<uint8_t>& tail) {
+  ssize_t fits = -1;
+  for (ssize_t i = static_cast<ssize_t>(tail.size()) - END_BYTES; i >= 0;
+       i--) {
+    if (load32(&tail[i]) != END_SIGNATURE) {
+      continue;
+    }
+
+    size_t recordEnd = i + END_BYTES + load16(&tail[i + 20]);
+    if (recordEnd == tail.size()) {
+      return i;
+    } else if (recordEnd < tail.size() && fits < 0) {
+      fits = i;
+    }
+  }
+
+  return fits;
+}
+
+// Reads exactly |length| bytes at |offset|. An archive that ends before
+// its records say it does is damaged.
+ZipResult readFully(RangeReader* reader, uint64_t offset, size_t length,
+                    std::vector<uint8_t>* data) {
+  if (!reader->ReadRange(offset, length, data)) {
+    return ZIP_READ_FAILED;
+  }
+
+  return data->size() == length ? ZIP_OK : ZIP_BAD_ARCHIVE;
+}
+
+// CRC-32 as used by zip, which is not the Castagnoli one in FileHash.
+pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+uint32_t crcTable[256];
+
+void initCrcTable() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) != 0 ? 0xedb88320 : 0);
+    }
+    crcTable[i] = crc;
+  }
+}
+
+// Feeds compressed data from the archive to Inflate.
+class MemberSource : public InflateSource {
+ public:
+  MemberSource(RangeReader* reader, uint64_t offset, uint64_t length)
+      : reader(reader), offset(offset), remaining(length) {}
+
+  virtual ssize_t Read(uint8_t* buffer, size_t length) {
+    length = static_cast<size_t>(std::min<uint64_t>(length, this->remaining));
+    if (length == 0) {
+      return 0;
+    } else if (!this->reader->ReadRange(this->offset, length, &this->data)) {
+      return -1;
+    }
+
+    if (!this->data.empty()) {
+      memcpy(buffer, &this->data[0], this->data.size());
+    }
+    this->offset += this->data.size();
+    this->remaining -= this->data.size();
+    return this->data.size();
+  }
+
+ private:
+  RangeReader* reader;
+  uint64_t offset;
+  uint64_t remaining;
+  std::vector<uint8_t> data;
+};
+
+// Passes the requested range of a member on and keeps the CRC of all of
+// it. Stops the member once the range is done unless the CRC is wanted.
+class RangeSink : public InflateSink {
+ public:
+  RangeSink(InflateSink* sink, uint64_t offset, uint64_t length,
+            bool checkCrc)
+      : sink(sink),
+        start(offset),
+        end(offset + length < offset ? ~static_cast<uint64_t>(0)
+                                     : offset + length),
+        checkCrc(checkCrc),
+        position(0),
+        crc(0xffffffff) {
+    pthread_once(&crcOnce, initCrcTable);
+  }
+
+  virtual bool Write(const uint8_t* data, size_t length) {
+    if (this->checkCrc) {
+      for (size_t i = 0; i < length; i++) {
+        this->crc = crcTable[(this->crc ^ data[i]) & 0xff] ^ (this->crc >> 8);
+      }
+    }
+
+    uint64_t from = std::max(this->position, this->start);
+    uint64_t to = std::min(this->position + length, this->end);
+    this->position += length;
+    if (from < to &&
+        !this->sink->Write(data + (from - (this->position - length)),
+                           static_cast<size_t>(to - from))) {
+      return false;
+    }
+
+    return this->checkCrc || this->position < this->end;
+  }
+
+  uint64_t size() const { return this->position; }
+  uint32_t finalCrc() const { return ~this->crc; }
+
+ private:
+  InflateSink* sink;
+  uint64_t start;
+  uint64_t end;
+  bool checkCrc;
+  uint64_t position;
+  uint32_t crc;
+};
+
+}  // namespace
+
+ZipResult ReadZipDirectory(RangeReader* reader, uint64_t archiveSize,
+                           std::vector<ZipEntry>* entries) {
+  if (archiveSize < END_BYTES) {
+    return ZIP_BAD_ARCHIVE;
+  }
+
+  // The end record is at the very end unless the archive has a comment.
+  uint64_t longestTail = END_BYTES + MAX_COMMENT_BYTES + ZIP64_LOCATOR_BYTES;
+  size_t tailLength =
+      static_cast<size_t>(std::min<uint64_t>(archiveSize, FIRST_TAIL_BYTES));
+  std::vector<uint8_t> tail;
+  ZipResult result =
+      readFully(reader, archiveSize - tailLength, tailLength, &tail);
+  ssize_t endAt = result == ZIP_OK ? findEndRecord(tail) : -1;
+  if (result == ZIP_OK && endAt < 0 && tailLength < archiveSize &&
+      tailLength < longestTail) {
+    tailLength =
+        static_cast<size_t>(std::min<uint64_t>(archiveSize, longestTail));
+    result = readFully(reader, archiveSize - tailLength, tailLength, &tail);
+    endAt = result == ZIP_OK ? findEndRecord(tail) : -1;
+  }
+
+  if (result != ZIP_OK) {
+    return result;
+  } else if (endAt < 0) {
+    return ZIP_BAD_ARCHIVE;
+  }
+
+  const uint8_t* end = &tail[endAt];
+  uint64_t endOffset = archiveSize - tailLength + endAt;
+  uint32_t disk = load16(end + 4);
+  uint32_t directoryDisk = load16(end + 6);
+  uint64_t directorySize = load32(end + 12);
+  uint64_t directoryOffset = load32(end + 16);
+  // Where the central directory should finish.
+  uint64_t recordOffset = endOffset;
+
+  // ZIP64 archives have a locator just before the end record that says
+  // where the ZIP64 end record is.
+  std::vector<uint8_t> locator;
+  if (endAt >= static_cast<ssize_t>(ZIP64_LOCATOR_BYTES)) {
+    locator.assign(end - ZIP64_LOCATOR_BYTES, end);
+  } else if (endOffset >= ZIP64_LOCATOR_BYTES &&
+             readFully(reader, endOffset - ZIP64_LOCATOR_BYTES,
+                       ZIP64_LOCATOR_BYTES, &locator) != ZIP_OK) {
+    locator.clear();
+  }
+
+  if (locator.size() == ZIP64_LOCATOR_BYTES &&
+      load32(&locator[0]) == ZIP64_LOCATOR_SIGNATURE) {
+    uint64_t zip64Offset = load64(&locator[8]);
+    std::vector<uint8_t> zip64End;
+    if (zip64Offset + ZIP64_END_BYTES > endOffset) {
+      return ZIP_BAD_ARCHIVE;
+    }
+
+    result = readFully(reader, zip64Offset, ZIP64_END_BYTES, &zip64End);
+    if (result != ZIP_OK) {
+      return result;
+    } else if (load32(&zip64End[0]) != ZIP64_END_SIGNATURE) {
+      return ZIP_BAD_ARCHIVE;
+    }
+
+    disk = load32(&zip64End[16]);
+    directoryDisk = load32(&zip64End[20]);
+    directorySize = load64(&zip64End[40]);
+    directoryOffset = load64(&zip64End[48]);
+    recordOffset = zip64Offset;
+  }
+
+  if (disk != 0 || directoryDisk != 0) {
+    return ZIP_UNSUPPORTED;
+  } else if (directorySize > recordOffset ||
+             directoryOffset > recordOffset - directorySize) {
+    return ZIP_BAD_ARCHIVE;
+  } else if (directorySize > MAX_CENTRAL_DIRECTORY_BYTES) {
+    return ZIP_UNSUPPORTED;
+  }
+
+  // Anything in front of the archive, like a self extractor, moves every
+  // offset in it along.
+  uint64_t base = recordOffset - directorySize - directoryOffset;
+  std::vector<uint8_t> directory;
+  if (directorySize > 0) {
+    result = readFully(reader, directoryOffset + base,
+                       static_cast<size_t>(directorySize), &directory);
+    if (result != ZIP_OK) {
+      return result;
+    }
+  }
+
+  entries->clear();
+  entries->reserve(directory.size() / CENTRAL_HEADER_BYTES);
+  return parseCentralDirectory(directory, base, entries);
+}
+
+ZipResult ReadZipMember(RangeReader* reader, const ZipEntry& entry,
+                        uint64_t offset, uint64_t length, InflateSink* sink) {
+  if ((entry.flags & FLAG_ENCRYPTED) != 0 ||
+      (entry.method != METHOD_STORED && entry.method != METHOD_DEFLATED)) {
+    return ZIP_UNSUPPORTED;
+  } else if (offset >= entry.uncompressedSize || length == 0) {
+    return ZIP_OK;
+  }
+
+  // The local header can have a different extra field from the central
+  // one so its lengths are read to find where the data starts.
+  std::vector<uint8_t> header;
+  ZipResult result = readFully(reader, entry.localHeaderOffset,
+                               LOCAL_HEADER_BYTES, &header);
+  if (result != ZIP_OK) {
+    return result;
+  } else if (load32(&header[0]) != LOCAL_HEADER_SIGNATURE) {
+    return ZIP_BAD_ARCHIVE;
+  }
+
+  uint64_t dataOffset = entry.localHeaderOffset + LOCAL_HEADER_BYTES +
+                        load16(&header[26]) + load16(&header[28]);
+  bool wholeMember = offset == 0 && length >= entry.uncompressedSize;
+  RangeSink rangeSink(sink, offset, length, wholeMember);
+  if (entry.method == METHOD_STORED) {
+    // Stored data can be read from the offset straight away. The range
+    // sink only sees it all when the CRC is wanted.
+    uint64_t end = offset + std::min(length, entry.uncompressedSize - offset);
+    uint64_t position = offset;
+    std::vector<uint8_t> buffer;
+    while (position < end) {
+      size_t count = static_cast<size_t>(
+          std::min<uint64_t>(STORED_READ_BYTES, end - position));
+      result = readFully(reader, dataOffset + position, count, &buffer);
+      if (result != ZIP_OK) {
+        return result;
+      }
+
+      position += count;
+      InflateSink* target = wholeMember ? &rangeSink : sink;
+      if (!target->Write(&buffer[0], count)) {
+        return ZIP_OK;
+      }
+    }
+  } else {
+    MemberSource source(reader, dataOffset, entry.compressedSize);
+    switch (Inflate(&source, &rangeSink)) {
+      case INFLATE_DONE:
+        break;
+      case INFLATE_STOPPED:
+        // The range is done, or |sink| wanted no more.
+        return ZIP_OK;
+      case INFLATE_BAD_DATA:
+        return ZIP_BAD_ARCHIVE;
+      case INFLATE_READ_FAILED:
+        return ZIP_READ_FAILED;
+    }
+  }
+
+  if (wholeMember && (rangeSink.size() != entry.uncompressedSize ||
+                      rangeSink.finalCrc() != entry.crc32)) {
+    return ZIP_BAD_ARCHIVE;
+  }
+
+  return ZIP_OK;
+}
+
+ZipDirectoryCache::ZipDirectoryCache(size_t maxArchives, size_t maxEntries)
+    : maxArchives(maxArchives),
+      maxEntries(maxEntries),
+      totalEntries(0),
+      totalBytes(0) {}
+
+const std::vector<ZipEntry>* ZipDirectoryCache::Lookup(
+    const std::string& archivePath, int modificationTime, double size) {
+  EntryMap::iterator it = this->archives.find(archivePath);
+  if (it == this->archives.end()) {
+    return NULL;
+  } else if (it->second.modificationTime != modificationTime ||
+             it->second.size != size) {
+    this->Invalidate(archivePath);
+    return NULL;
+  }
+
+  this->ages.splice(this->ages.end(), this->ages, it->second.age);
+  return &it->second.entries;
+}
+
+const std::vector<ZipEntry>* ZipDirectoryCache::Store(
+    const std::string& archivePath, int modificationTime, double size,
+    std::vector<ZipEntry>* entries) {
+  this->Invalidate(archivePath);
+  if (entries->size() > this->maxEntries) {
+    return NULL;
+  }
+
+  while (!this->ages.empty() &&
+         (this->archives.size() >= this->maxArchives ||
+          this->totalEntries + entries->size() > this->maxEntries)) {
+    this->Invalidate(this->ages.front());
+  }
+
+  Entry& entry = this->archives[archivePath];
+  entry.modificationTime = modificationTime;
+  entry.size = size;
+  entry.entries.swap(*entries);
+  entry.age = this->ages.insert(this->ages.end(), archivePath);
+  this->totalEntries += entry.entries.size();
+
+  entry.bytes = sizeof(Entry) + 2 * archivePath.size();
+  for (size_t i = 0; i < entry.entries.size(); i++) {
+    entry.bytes += sizeof(ZipEntry) + entry.entries[i].name.size();
+  }
+  this->totalBytes += entry.bytes;
+  return &entry.entries;
+}
+
+void ZipDirectoryCache::Invalidate(const std::string& archivePath) {
+  EntryMap::iterator it = this->archives.find(archivePath);
+  if (it != this->archives.end()) {
+    this->totalEntries -= it->second.entries.size();
+    this->totalBytes -= it->second.bytes;
+    this->ages.erase(it->second.age);
+    this->archives.erase(it);
+  }
+}
+
+void ZipDirectoryCache::TrimMemory(size_t targetBytes) {
+  while (!this->ages.empty() && this->totalBytes > targetBytes) {
+    this->Invalidate(this->ages.front());
+  }
+}
+
+}  // namespace NaclFsp
@@ -0,0 +1,129 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NACL_ZIP_ARCHIVE_H_
+#define NACL_ZIP_ARCHIVE_H_
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Inflate.h"
+#include "MemoryBudget.h"
+#include "RangeReader.h"
+
+namespace NaclFsp {
+
+// One member of a zip file as described by the central directory.
+class ZipEntry {
+ public:
+  ZipEntry()
+      : isDirectory(false),
+        flags(0),
+        method(0),
+        crc32(0),
+        compressedSize(0),
+        uncompressedSize(0),
+        localHeaderOffset(0),
+        modificationTime(0) {}
+
+  // The full path inside the archive, as UTF-8.
+  std::string name;
+  bool isDirectory;
+  uint16_t flags;
+  uint16_t method;
+  uint32_t crc32;
+  uint64_t compressedSize;
+  uint64_t uncompressedSize;
+  // From the start of the archive file.
+  uint64_t localHeaderOffset;
+  int modificationTime;
+};
+
+enum ZipResult {
+  ZIP_OK,
+  ZIP_READ_FAILED,
+  // Not a zip file, or a damaged one.
+  ZIP_BAD_ARCHIVE,
+  // Encrypted members, compression other than deflate, split archives or
+  // a central directory too big to hold.
+  ZIP_UNSUPPORTED
+};
+
+// Finds the end of central directory record, and its ZIP64 form when
+// there is one, then reads the whole central directory in one go. Nothing
+// else of the archive is read so listing costs a few KB whatever its size.
+ZipResult ReadZipDirectory(RangeReader* reader, uint64_t archiveSize,
+                           std::vector<ZipEntry>* entries);
+
+// Streams bytes [offset, offset + length) of the uncompressed member to
+// |sink|, stopping early at the end of the member. Only the compressed data
+// up to the end of the range is read. When the whole member is read its
+// CRC is checked too.
+ZipResult ReadZipMember(RangeReader* reader, const ZipEntry& entry,
+                        uint64_t offset, uint64_t length, InflateSink* sink);
+
+// Central directories of recently listed archives. One is only reused
+// while its archive has the modification time and size it was read at.
+//
+// Only used from the thread handling messages.
+class ZipDirectoryCache : public MemoryConsumer {
+ public:
+  ZipDirectoryCache(size_t maxArchives, size_t maxEntries);
+
+  // The result stays valid until the cache is next changed.
+  const std::vector<ZipEntry>* Lookup(const std::string& archivePath,
+                                      int modificationTime, double size);
+
+  // Takes the contents of |entries|. Returns the stored copy.
+  const std::vector<ZipEntry>* Store(const std::string& archivePath,
+                                     int modificationTime, double size,
+                                     std::vector<ZipEntry>* entries);
+
+  void Invalidate(const std::string& archivePath);
+
+  virtual size_t MemoryUsage() const { return this->totalBytes; }
+  virtual void TrimMemory(size_t targetBytes);
+
+ private:
+  class Entry {
+   public:
+    int modificationTime;
+    double size;
+    size_t bytes;
+    std::vector<ZipEntry> entries;
+    std::list<std::string>::iterator age;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  size_t maxArchives;
+  size_t maxEntries;
+  size_t totalEntries;
+  size_t totalBytes;
+  EntryMap archives;
+  // Archives from least to most recently used.
+  std::list<std::string> ages;
+
+  // Prevent copy and assignment.
+  ZipDirectoryCache(const ZipDirectoryCache&);
+  ZipDirectoryCache& operator=(const ZipDirectoryCache&);
+};
+
+}  // namespace NaclFsp
+
+#endif  // NACL_ZIP_ARCHIVE_H_
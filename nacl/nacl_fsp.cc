@@ -21,16 +21,49 @@
 #include "ppapi_simple/ps_main.h"
 
 #include "SambaFsp.h"
+#include "WakeupTimer.h"
+
+// Wakes the message loop out of PSEventWaitAcquire. The event is a message
+// without a value, which JS never sends. Safe to call from any thread.
+static void postWakeup() {
+  PSEventPostVar(PSE_INSTANCE_HANDLEMESSAGE, pp::Var().pp_var());
+}
 
 int plugin_main(int argc, char* argv[]) {
   printf("plugin main: XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXx");
   NaclFsp::SambaFsp fsp;
+  NaclFsp::WakeupTimer wakeupTimer(&postWakeup);
   PSEvent* ps_event = NULL;
   PSEventSetFilter(PSE_INSTANCE_HANDLEMESSAGE);
+  fsp.SetWakeupHook(&postWakeup);
+
+  for (;;) {
+    // Only block when there is nothing left to do between requests.
+    bool hasPendingWork = fsp.HasPendingWork();
+    ps_event = PSEventTryAcquire();
+    if (ps_event == NULL && !hasPendingWork) {
+      // Nothing arrived while the last request ran, so whatever comes next
+      // can't share its result however long it takes.
+      fsp.ExpireCompletedRequests();
+      wakeupTimer.Arm(fsp.NextWakeupMicros());
+      ps_event = PSEventWaitAcquire();
+      if (ps_event == NULL) {
+        break;
+      }
+    }
+
+    if (ps_event != NULL && pp::Var(ps_event->as_var).is_undefined()) {
+      PSEventRelease(ps_event);
+      ps_event = NULL;
+    }
+
+    if (ps_event == NULL) {
+      fsp.OnIdle();
+      continue;
+    }
 
-  while ((ps_event = PSEventWaitAcquire()) != NULL) {
     pp::Var var(ps_event->as_var);
-    fsp.HandleMessage(var);
+    fsp.QueueMessage(var);
     PSEventRelease(ps_event);
   }
 
@@ -0,0 +1,506 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// A stand-in for the parts of libsmbclient that SambaFsp uses. It is linked
+// into the replay build instead of the real library and serves a synthetic
+// share, so a trace (even one with hashed paths) can be replayed without a
+// server. Every path exists. Whether it is a file or a directory, its size
+// and its children are derived from a hash of the path so repeated runs see
+// exactly the same tree. Writes, truncates and deletes are remembered so the
+// module sees a consistent view within a run.
+//
+// STANDIN_LATENCY_US (an embed attribute, exposed as an environment variable
+// by ppapi_simple) adds a fixed delay to every call to model a slow link.
+// The delay is taken outside the state lock so worker threads overlap like
+// they would against a real server.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "samba/libsmbclient.h"
+#include "util.h"
+
+namespace {
+
+const size_t MAX_CHILDREN = 48;
+const off_t MAX_FILE_SIZE = 8 * 1024 * 1024;
+
+class StandInNode {
+ public:
+  StandInNode() : isDirectory(false), size(0), mtime(0), deleted(false) {}
+
+  bool isDirectory;
+  off_t size;
+  time_t mtime;
+  bool deleted;
+};
+
+class StandInHandle {
+ public:
+  StandInHandle() : offset(0), nextChild(0) {}
+
+  std::string url;
+  off_t offset;
+  size_t nextChild;
+  std::vector<std::string> children;
+};
+
+std::map<std::string, StandInNode> overrides;
+std::map<int, StandInHandle> handles;
+int nextHandle = 1;
+char contextStorage[64];
+pthread_mutex_t stateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Guards the maps above for the length of a call.
+class StateLock {
+ public:
+  StateLock() { pthread_mutex_lock(&stateMutex); }
+  ~StateLock() { pthread_mutex_unlock(&stateMutex); }
+};
+
+uint64_t hashString(const std::string& value) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < value.size(); i++) {
+    hash ^= static_cast<uint8_t>(value[i]);
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+void simulateLatency() {
+  static int latencyMicros = -1;
+  if (latencyMicros < 0) {
+    const char* configured = getenv("STANDIN_LATENCY_US");
+    latencyMicros = configured ? atoi(configured) : 0;
+  }
+
+  if (latencyMicros > 0) {
+    usleep(latencyMicros);
+  }
+}
+
+std::string trimUrl(const std::string& url) {
+  std::string trimmed = url;
+  while (trimmed.size() > 1 && trimmed[trimmed.size() - 1] == '/') {
+    trimmed.erase(trimmed.size() - 1);
+  }
+
+  return trimmed;
+}
+
+StandInNode describe(const std::string& rawUrl) {
+  std::string url = trimUrl(rawUrl);
+  std::map<std::string, StandInNode>::iterator it = overrides.find(url);
+  if (it != overrides.end()) {
+    return it->second;
+  }
+
+  StandInNode node;
+  uint64_t hash = hashString(url);
+  node.mtime = 1400000000 + static_cast<time_t>(hash % 100000000);
+
+  // smb://server/share and anything above it is a directory.
+  size_t depth = 0;
+  for (size_t i = 0; i < url.size(); i++) {
+    depth += url[i] == '/';
+  }
+
+  std::string name = url.substr(url.rfind('/') + 1);
+  if (depth <= 3 || Util::stringStartsWith(name, "d")) {
+    node.isDirectory = true;
+  } else if (Util::stringStartsWith(name, "f") ||
+             name.find('.') != std::string::npos) {
+    node.isDirectory = false;
+  } else {
+    node.isDirectory = (hash % 4) == 0;
+  }
+
+  if (!node.isDirectory) {
+    node.size = static_cast<off_t>((hash >> 8) % MAX_FILE_SIZE);
+  }
+
+  return node;
+}
+
+void fillStat(const StandInNode& node, struct stat* st) {
+  memset(st, 0, sizeof(*st));
+  st->st_mode = node.isDirectory ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+  st->st_size = node.size;
+  st->st_mtime = node.mtime;
+}
+
+StandInHandle* findHandle(int fd) {
+  std::map<int, StandInHandle>::iterator it = handles.find(fd);
+  if (it == handles.end()) {
+    errno = EBADF;
+    return NULL;
+  }
+
+  return &it->second;
+}
+
+}  // namespace
+
+extern "C" {
+
+SMBCCTX* smbc_new_context(void) {
+  return reinterpret_cast<SMBCCTX*>(contextStorage);
+}
+
+int smbc_free_context(SMBCCTX* context, int shutdown_ctx) { return 0; }
+
+SMBCCTX* smbc_init_context(SMBCCTX* context) { return context; }
+
+SMBCCTX* smbc_set_context(SMBCCTX* new_context) {
+  return reinterpret_cast<SMBCCTX*>(contextStorage);
+}
+
+void smbc_setDebug(SMBCCTX* c, int debug) {}
+
+void smbc_setFunctionAuthData(SMBCCTX* c, smbc_get_auth_data_fn fn) {}
+
+void smbc_setOptionUseKerberos(SMBCCTX* c, smbc_bool b) {}
+
+void smbc_setOptionFallbackAfterKerberos(SMBCCTX* c, smbc_bool b) {}
+
+static int standInPurgeCachedServers(SMBCCTX* c) { return 0; }
+
+smbc_purge_cached_fn smbc_getFunctionPurgeCachedServers(SMBCCTX* c) {
+  return standInPurgeCachedServers;
+}
+
+void smbc_setTimeout(SMBCCTX* c, int timeout) {}
+
+// libsmbclient's default.
+int smbc_getTimeout(SMBCCTX* c) { return 20000; }
+
+void smbc_thread_posix(void) {}
+
+// The context API maps onto the compat calls below. Descriptors are small
+// positive ints so they are passed around as the SMBCFILE pointer.
+static SMBCFILE* toFile(int fd) {
+  return fd < 0 ? NULL : reinterpret_cast<SMBCFILE*>(static_cast<intptr_t>(fd));
+}
+
+static int fromFile(SMBCFILE* file) {
+  return static_cast<int>(reinterpret_cast<intptr_t>(file));
+}
+
+static SMBCFILE* standInOpendir(SMBCCTX* c, const char* fname) {
+  return toFile(smbc_opendir(fname));
+}
+
+static int standInClosedir(SMBCCTX* c, SMBCFILE* dir) {
+  return smbc_closedir(fromFile(dir));
+}
+
+static int standInGetdents(SMBCCTX* c, SMBCFILE* dir,
+                           struct smbc_dirent* dirp, int count) {
+  return smbc_getdents(fromFile(dir), dirp, count);
+}
+
+smbc_opendir_fn smbc_getFunctionOpendir(SMBCCTX* c) { return standInOpendir; }
+
+smbc_closedir_fn smbc_getFunctionClosedir(SMBCCTX* c) {
+  return standInClosedir;
+}
+
+smbc_getdents_fn smbc_getFunctionGetdents(SMBCCTX* c) {
+  return standInGetdents;
+}
+
+static int standInStat(SMBCCTX* c, const char* fname, struct stat* st) {
+  return smbc_stat(fname, st);
+}
+
+smbc_stat_fn smbc_getFunctionStat(SMBCCTX* c) { return standInStat; }
+
+static SMBCFILE* standInOpen(SMBCCTX* c, const char* fname, int flags,
+                             mode_t mode) {
+  return toFile(smbc_open(fname, flags, mode));
+}
+
+static ssize_t standInRead(SMBCCTX* c, SMBCFILE* file, void* buf,
+                           size_t count) {
+  return smbc_read(fromFile(file), buf, count);
+}
+
+static int standInClose(SMBCCTX* c, SMBCFILE* file) {
+  return smbc_close(fromFile(file));
+}
+
+smbc_open_fn smbc_getFunctionOpen(SMBCCTX* c) { return standInOpen; }
+
+smbc_read_fn smbc_getFunctionRead(SMBCCTX* c) { return standInRead; }
+
+smbc_close_fn smbc_getFunctionClose(SMBCCTX* c) { return standInClose; }
+
+int smbc_opendir(const char* durl) {
+  simulateLatency();
+  StateLock lock;
+  std::string url = trimUrl(durl);
+  StandInNode node = describe(url);
+  if (node.deleted) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (!node.isDirectory) {
+    errno = ENOTDIR;
+    return -1;
+  }
+
+  StandInHandle handle;
+  handle.url = url;
+  size_t childCount = hashString(url) % MAX_CHILDREN;
+  for (size_t i = 0; i < childCount; i++) {
+    // Roughly one in six children is a directory.
+    std::string name = (i % 6 == 0) ? "d" + Util::ToString(i)
+                                    : "f" + Util::ToString(i) + ".bin";
+    if (!describe(url + "/" + name).deleted) {
+      handle.children.push_back(name);
+    }
+  }
+
+  int fd = nextHandle++;
+  handles[fd] = handle;
+  return fd;
+}
+
+int smbc_closedir(int dh) {
+  StateLock lock;
+  handles.erase(dh);
+  return 0;
+}
+
+int smbc_getdents(unsigned int dh, struct smbc_dirent* dirp, int count) {
+  simulateLatency();
+  StateLock lock;
+  StandInHandle* handle = findHandle(dh);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  // The children of smb://host are its shares.
+  bool isServer = handle->url.find('/', strlen("smb://")) == std::string::npos;
+  uint8_t* out = reinterpret_cast<uint8_t*>(dirp);
+  int used = 0;
+  while (handle->nextChild < handle->children.size()) {
+    const std::string& name = handle->children[handle->nextChild];
+    size_t length = offsetof(struct smbc_dirent, name) + name.size() + 1;
+    length = (length + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (used + static_cast<int>(length) > count) {
+      break;
+    }
+
+    struct smbc_dirent* dirent =
+        reinterpret_cast<struct smbc_dirent*>(out + used);
+    StandInNode node = describe(handle->url + "/" + name);
+    if (isServer) {
+      dirent->smbc_type = SMBC_FILE_SHARE;
+    } else {
+      dirent->smbc_type = node.isDirectory ? SMBC_DIR : SMBC_FILE;
+    }
+    dirent->dirlen = length;
+    dirent->commentlen = 0;
+    dirent->comment = NULL;
+    dirent->namelen = name.size();
+    memcpy(dirent->name, name.c_str(), name.size() + 1);
+
+    used += length;
+    handle->nextChild++;
+  }
+
+  return used;
+}
+
+int smbc_stat(const char* url, struct stat* st) {
+  simulateLatency();
+  StateLock lock;
+  StandInNode node = describe(url);
+  if (node.deleted) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  fillStat(node, st);
+  return 0;
+}
+
+int smbc_fstat(int fd, struct stat* st) {
+  StateLock lock;
+  StandInHandle* handle = findHandle(fd);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  fillStat(describe(handle->url), st);
+  return 0;
+}
+
+int smbc_open(const char* furl, int flags, mode_t mode) {
+  simulateLatency();
+  StateLock lock;
+  std::string url = trimUrl(furl);
+  StandInNode node = describe(url);
+  if (node.deleted && (flags & O_CREAT) == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (node.deleted || (flags & O_TRUNC) != 0) {
+    node = StandInNode();
+    node.mtime = time(NULL);
+    overrides[url] = node;
+  }
+
+  StandInHandle handle;
+  handle.url = url;
+  int fd = nextHandle++;
+  handles[fd] = handle;
+  return fd;
+}
+
+int smbc_creat(const char* furl, mode_t mode) {
+  return smbc_open(furl, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int smbc_close(int fd) {
+  StateLock lock;
+  if (handles.erase(fd) == 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  return 0;
+}
+
+ssize_t smbc_read(int fd, void* buf, size_t bufsize) {
+  simulateLatency();
+  StateLock lock;
+  StandInHandle* handle = findHandle(fd);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  StandInNode node = describe(handle->url);
+  off_t remaining = node.size - handle->offset;
+  size_t count = remaining <= 0 ? 0 : static_cast<size_t>(remaining);
+  if (count > bufsize) {
+    count = bufsize;
+  }
+
+  memset(buf, 0, count);
+  handle->offset += count;
+  return count;
+}
+
+ssize_t smbc_write(int fd, const void* buf, size_t bufsize) {
+  simulateLatency();
+  StateLock lock;
+  StandInHandle* handle = findHandle(fd);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  StandInNode node = describe(handle->url);
+  handle->offset += bufsize;
+  if (handle->offset > node.size) {
+    node.size = handle->offset;
+  }
+
+  node.mtime = time(NULL);
+  overrides[handle->url] = node;
+  return bufsize;
+}
+
+off_t smbc_lseek(int fd, off_t offset, int whence) {
+  StateLock lock;
+  StandInHandle* handle = findHandle(fd);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  if (whence == SEEK_SET) {
+    handle->offset = offset;
+  } else if (whence == SEEK_CUR) {
+    handle->offset += offset;
+  } else {
+    handle->offset = describe(handle->url).size + offset;
+  }
+
+  return handle->offset;
+}
+
+int smbc_ftruncate(int fd, off_t size) {
+  simulateLatency();
+  StateLock lock;
+  StandInHandle* handle = findHandle(fd);
+  if (handle == NULL) {
+    return -1;
+  }
+
+  StandInNode node = describe(handle->url);
+  node.size = size;
+  overrides[handle->url] = node;
+  return 0;
+}
+
+int smbc_mkdir(const char* durl, mode_t mode) {
+  simulateLatency();
+  StateLock lock;
+  StandInNode node;
+  node.isDirectory = true;
+  node.mtime = time(NULL);
+  overrides[trimUrl(durl)] = node;
+  return 0;
+}
+
+int smbc_rmdir(const char* durl) {
+  simulateLatency();
+  StateLock lock;
+  StandInNode node = describe(durl);
+  node.deleted = true;
+  overrides[trimUrl(durl)] = node;
+  return 0;
+}
+
+int smbc_unlink(const char* furl) { return smbc_rmdir(furl); }
+
+int smbc_rename(const char* ourl, const char* nurl) {
+  simulateLatency();
+  StateLock lock;
+  StandInNode node = describe(ourl);
+  if (node.deleted) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  overrides[trimUrl(nurl)] = node;
+  node.deleted = true;
+  overrides[trimUrl(ourl)] = node;
+  return 0;
+}
+
+}  // extern "C"
@@ -0,0 +1,161 @@
+// Copyright 2015 Google Inc.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Replays a request trace recorded with custom_startTrace into SambaFsp
+// backed by StandInSmbClient.cc and reports per-operation latency.
+//
+// Traces are recorded into the app's html5fs and can be copied out from
+// filesystem:chrome-extension://<app id>/persistent/<path>. Put the trace
+// next to index.html in this directory and run:
+//
+//   make TOOLCHAIN=linux run
+//
+// Embed attributes (see index.html) control the run:
+//   TRACE_FILE          Trace file name relative to the page.
+//   REPLAY_REALTIME     When 1 requests are issued with the recorded gaps,
+//                       otherwise back to back.
+//   STANDIN_LATENCY_US  Simulated server latency per SMB call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_dictionary.h"
+#include "ppapi_simple/ps.h"
+#include "ppapi_simple/ps_interface.h"
+#include "ppapi_simple/ps_main.h"
+#include "sys/mount.h"
+
+#include "RequestTrace.h"
+#include "SambaFsp.h"
+#include "util.h"
+
+namespace {
+
+class LatencySamples {
+ public:
+  LatencySamples() : recordedTotalMicros(0) {}
+
+  std::vector<uint64_t> replayedMicros;
+  uint64_t recordedTotalMicros;
+
+  uint64_t percentile(double fraction) {
+    if (this->replayedMicros.empty()) {
+      return 0;
+    }
+
+    size_t index = static_cast<size_t>(fraction * (replayedMicros.size() - 1));
+    return this->replayedMicros[index];
+  }
+};
+
+void report(const std::string& line) {
+  printf("%s\n", line.c_str());
+  // common.js prints "log:" messages into the page.
+  pp::Var message("log:" + line);
+  PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), message.pp_var());
+}
+
+bool isEnabled(const char* name) {
+  const char* value = getenv(name);
+  return value != NULL && strcmp(value, "1") == 0;
+}
+
+}  // namespace
+
+int replay_main(int argc, char* argv[]) {
+  const char* traceFile = getenv("TRACE_FILE");
+  if (traceFile == NULL) {
+    report("TRACE_FILE attribute is not set");
+    return 1;
+  }
+
+  ::mount("", "/http", "httpfs", 0, "");
+  NaclFsp::TraceReader reader;
+  if (!reader.Open(std::string("/http/") + traceFile)) {
+    report(std::string("Could not read trace ") + traceFile);
+    return 1;
+  }
+
+  bool realtime = isEnabled("REPLAY_REALTIME");
+  NaclFsp::SambaFsp fsp;
+  std::map<std::string, LatencySamples> samples;
+  NaclFsp::TraceRecord record;
+  uint64_t startMicros = Util::monotonicMicros();
+  uint64_t scheduledMicros = 0;
+  size_t count = 0;
+
+  while (reader.Next(&record)) {
+    if (realtime) {
+      scheduledMicros += record.arrivalDeltaMicros;
+      uint64_t elapsed = Util::monotonicMicros() - startMicros;
+      if (scheduledMicros > elapsed) {
+        usleep(scheduledMicros - elapsed);
+      }
+    }
+
+    pp::VarDictionary message;
+    message.Set(pp::Var("functionName"), pp::Var(record.functionName));
+    message.Set(pp::Var("messageId"), pp::Var(record.messageId));
+    message.Set(pp::Var("args"), record.args);
+
+    uint64_t begin = Util::monotonicMicros();
+    fsp.HandleMessage(message);
+    uint64_t latency = Util::monotonicMicros() - begin;
+
+    LatencySamples& opSamples = samples[record.functionName];
+    opSamples.replayedMicros.push_back(latency);
+    opSamples.recordedTotalMicros += record.serviceMicros;
+    count++;
+  }
+
+  fsp.FlushResponses();
+
+  report("Replayed " + Util::ToString(count) + " requests in " +
+         Util::ToString((Util::monotonicMicros() - startMicros) / 1000) +
+         "ms" + (reader.hasHashedPaths() ? " (hashed paths)" : ""));
+  report("operation count recorded_mean_us mean_us p50_us p90_us p99_us max_us");
+
+  for (std::map<std::string, LatencySamples>::iterator it = samples.begin();
+       it != samples.end(); ++it) {
+    LatencySamples& opSamples = it->second;
+    std::vector<uint64_t>& replayed = opSamples.replayedMicros;
+    std::sort(replayed.begin(), replayed.end());
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < replayed.size(); i++) {
+      total += replayed[i];
+    }
+
+    report(it->first + " " + Util::ToString(replayed.size()) + " " +
+           Util::ToString(opSamples.recordedTotalMicros / replayed.size()) +
+           " " + Util::ToString(total / replayed.size()) + " " +
+           Util::ToString(opSamples.percentile(0.5)) + " " +
+           Util::ToString(opSamples.percentile(0.9)) + " " +
+           Util::ToString(opSamples.percentile(0.99)) + " " +
+           Util::ToString(replayed.back()));
+  }
+
+  return 0;
+}
+
+PPAPI_SIMPLE_REGISTER_MAIN(replay_main);
@@ -13,6 +13,8 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <stdint.h>
+#include <time.h>
 #include <sstream>
 #include <string>
 
@@ -41,4 +43,24 @@ inline bool stringStartsWith(const std::string& s, const std::string& prefix) {
   return s.compare(0, prefix.length(), prefix) == 0;
 }
 
+// Microseconds from an arbitrary fixed point. Only useful for intervals.
+inline uint64_t monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+// pthread_cond_timedwait takes a CLOCK_REALTIME deadline.
+inline struct timespec realtimeDeadline(uint64_t deadlineMicros) {
+  uint64_t now = monotonicMicros();
+  uint64_t remaining = deadlineMicros > now ? deadlineMicros - now : 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  uint64_t nanos = deadline.tv_nsec + (remaining % 1000000) * 1000;
+  deadline.tv_sec += remaining / 1000000 + nanos / 1000000000;
+  deadline.tv_nsec = nanos % 1000000000;
+  return deadline;
+}
+
 }  // namespace Util
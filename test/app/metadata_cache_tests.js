@@ -17,10 +17,18 @@ require('../../app/metadata_cache');
 require('../../app/log');
 var chai = require('chai');
 var assert = chai.assert;
+var fs = require('fs');
+var path = require('path');
+var vm = require('vm');
 
 // Declare global `log` because of implicit dependency in MetadataCache
 global.log = new JsLogger();
 
+// MetadataCache also uses isDef and getPromiseResolver from utils.js, which
+// only declares them globally when loaded as a script.
+vm.runInThisContext(
+    fs.readFileSync(path.join(__dirname, '../../app/utils.js'), 'utf8'));
+
 describe('MetadataCache', function() {
 
   describe("Inserting and deleting value", function() {
@@ -57,4 +65,228 @@ describe('MetadataCache', function() {
       assert.isNull(deletedItem);
     });
   });
+
+  describe("Incomplete entries", function() {
+    const fileSystemId = "smb://127.0.0.1/testshare";
+    const directoryPath = "/tmp";
+    var now = 1000;
+
+    it("should batch entries without a size", function() {
+      var cache = new MetadataCache();
+      cache.cacheDirectoryContents(fileSystemId, directoryPath, [
+        {name : "a.txt", isDirectory : false},
+        {name : "b.txt", isDirectory : false, size : -1},
+        {name : "c.txt", isDirectory : false, size : 5}
+      ], now);
+      var batch = cache.getBatchToUpdate(fileSystemId, "/tmp/a.txt", 10);
+      assert.sameMembers(batch, ["/tmp/a.txt", "/tmp/b.txt"]);
+    });
+
+    it("should reject a pending stat when invalidated with an error",
+       function() {
+      var cache = new MetadataCache();
+      cache.cacheDirectoryContents(fileSystemId, directoryPath,
+          [{name : "a.txt", isDirectory : false}], now);
+      cache.getBatchToUpdate(fileSystemId, "/tmp/a.txt", 10);
+      var resolver = cache.lookupMetadata(fileSystemId, "/tmp/a.txt", now)
+          .stat_resolver;
+      cache.invalidateEntry(fileSystemId, "/tmp/a.txt", "NOT_FOUND");
+      assert.isNull(cache.lookupMetadata(fileSystemId, "/tmp/a.txt", now));
+      return resolver.promise.then(function() {
+        assert.fail("stat_resolver was resolved");
+      }, function(err) {
+        assert.equal(err, "NOT_FOUND");
+      });
+    });
+
+    it("should put a released entry back in the next batch", function() {
+      var cache = new MetadataCache();
+      cache.cacheDirectoryContents(fileSystemId, directoryPath,
+          [{name : "a.txt", isDirectory : false}], now);
+      cache.getBatchToUpdate(fileSystemId, "/tmp/a.txt", 10);
+      var resolver = cache.lookupMetadata(fileSystemId, "/tmp/a.txt", now)
+          .stat_resolver;
+      cache.releaseEntry(fileSystemId, "/tmp/a.txt", "ABORT");
+      var batch = cache.getBatchToUpdate(fileSystemId, "/tmp/b.txt", 10);
+      assert.sameMembers(batch, ["/tmp/b.txt", "/tmp/a.txt"]);
+      return resolver.promise.then(function() {
+        assert.fail("stat_resolver was resolved");
+      }, function(err) {
+        assert.equal(err, "ABORT");
+      });
+    });
+  });
+
+  describe("Version tokens", function() {
+    const fileSystemId = "smb://127.0.0.1/testshare";
+    const directoryPath = "/tmp";
+    const cacheTimeMs = 5 * 60 * 1000;
+    var now = 1000;
+    var cache;
+
+    beforeEach(function() {
+      cache = new MetadataCache();
+      cache.cacheDirectoryContents(fileSystemId, directoryPath, [
+        {name : "a.txt", isDirectory : false, size : 1},
+        {name : "b.txt", isDirectory : false, size : 2}
+      ], now, "token1");
+    });
+
+    it("should return the token of a cached listing", function() {
+      assert.equal(
+          cache.getVersionToken(fileSystemId, directoryPath, now), "token1");
+    });
+
+    it("should not return a token for an uncached directory", function() {
+      assert.isNull(cache.getVersionToken(fileSystemId, "/other", now));
+    });
+
+    it("should not return a token once the listing expires", function() {
+      assert.equal(
+          cache.getVersionToken(
+              fileSystemId, directoryPath, now + cacheTimeMs - 1),
+          "token1");
+      assert.isNull(cache.getVersionToken(
+          fileSystemId, directoryPath, now + cacheTimeMs));
+    });
+
+    it("should clear the token when an entry is invalidated", function() {
+      cache.invalidateEntry(fileSystemId, "/tmp/a.txt");
+      assert.isNull(cache.getVersionToken(fileSystemId, directoryPath, now));
+    });
+
+    it("should clear the token when a new entry is added", function() {
+      cache.updateMetadata(fileSystemId, "/tmp/c.txt",
+          {name : "c.txt", isDirectory : false, size : 3});
+      assert.isNull(cache.getVersionToken(fileSystemId, directoryPath, now));
+    });
+
+    it("should keep the token when a listed entry is updated", function() {
+      cache.updateMetadata(fileSystemId, "/tmp/a.txt",
+          {name : "a.txt", isDirectory : false, size : 10});
+      assert.equal(
+          cache.getVersionToken(fileSystemId, directoryPath, now), "token1");
+    });
+
+    it("should clear the token when asked to", function() {
+      cache.clearVersionToken(fileSystemId, directoryPath);
+      assert.isNull(cache.getVersionToken(fileSystemId, directoryPath, now));
+    });
+
+    it("should copy the cached entries", function() {
+      var entries = cache.getDirectoryEntries(fileSystemId, directoryPath);
+      assert.sameMembers(Object.keys(entries), ["a.txt", "b.txt"]);
+      cache.invalidateEntry(fileSystemId, "/tmp/a.txt");
+      assert.equal(entries["a.txt"].size, 1);
+      assert.isNull(cache.getDirectoryEntries(fileSystemId, "/other"));
+    });
+  });
+
+  describe("Applying a directory diff", function() {
+    const fileSystemId = "smb://127.0.0.1/testshare";
+    const directoryPath = "/tmp";
+    var now = 1000;
+    var cache;
+
+    beforeEach(function() {
+      cache = new MetadataCache();
+      cache.cacheDirectoryContents(fileSystemId, directoryPath, [
+        {name : "a.txt", isDirectory : false, size : 1},
+        {name : "b.txt", isDirectory : false, size : 2},
+        {name : "c.txt", isDirectory : false, size : 3}
+      ], now, "token1");
+    });
+
+    var makeDiff = function() {
+      return {
+        added : [{name : "d.txt", isDirectory : false, size : 4}],
+        modified : [{name : "b.txt", isDirectory : false, size : 20}],
+        removed : ["c.txt"],
+        versionToken : "token2"
+      };
+    };
+
+    it("should not apply a diff against a stale token", function() {
+      var entries = cache.applyDirectoryDiff(
+          fileSystemId, directoryPath, "token0", makeDiff(), now + 1);
+      assert.isNull(entries);
+      assert.equal(
+          cache.lookupMetadata(fileSystemId, "/tmp/b.txt", now).size, 2);
+      assert(cache.lookupMetadata(fileSystemId, "/tmp/c.txt", now));
+      assert.isNull(cache.lookupMetadata(fileSystemId, "/tmp/d.txt", now));
+      assert.equal(
+          cache.getVersionToken(fileSystemId, directoryPath, now), "token1");
+    });
+
+    it("should not apply a diff to an uncached directory", function() {
+      assert.isNull(cache.applyDirectoryDiff(
+          fileSystemId, "/other", "token1", makeDiff(), now + 1));
+    });
+
+    it("should add, modify and remove entries", function() {
+      var entries = cache.applyDirectoryDiff(
+          fileSystemId, directoryPath, "token1", makeDiff(), now + 1);
+      assert.sameMembers(entries.map(function(entry) {
+        return entry.name;
+      }), ["a.txt", "b.txt", "d.txt"]);
+      assert.equal(
+          cache.lookupMetadata(fileSystemId, "/tmp/a.txt", now).size, 1);
+      assert.equal(
+          cache.lookupMetadata(fileSystemId, "/tmp/b.txt", now).size, 20);
+      assert.isNull(cache.lookupMetadata(fileSystemId, "/tmp/c.txt", now));
+      var added = cache.lookupMetadata(fileSystemId, "/tmp/d.txt", now);
+      assert.equal(added.size, 4);
+      assert.equal(added.entryPath, "/tmp/d.txt");
+    });
+
+    it("should move to the diff's token", function() {
+      cache.applyDirectoryDiff(
+          fileSystemId, directoryPath, "token1", makeDiff(), now + 1);
+      assert.equal(
+          cache.getVersionToken(fileSystemId, directoryPath, now + 1),
+          "token2");
+      assert.isNull(cache.applyDirectoryDiff(
+          fileSystemId, directoryPath, "token1", makeDiff(), now + 2));
+    });
+
+    it("should reject a pending stat of a removed entry", function() {
+      cache.cacheDirectoryContents(fileSystemId, directoryPath,
+          [{name : "c.txt", isDirectory : false}], now, "token1");
+      cache.getBatchToUpdate(fileSystemId, "/tmp/c.txt", 10);
+      var resolver = cache.lookupMetadata(fileSystemId, "/tmp/c.txt", now)
+          .stat_resolver;
+      cache.applyDirectoryDiff(
+          fileSystemId, directoryPath, "token1",
+          {added : [], modified : [], removed : ["c.txt"]}, now + 1);
+      return resolver.promise.then(function() {
+        assert.fail("stat_resolver was resolved");
+      }, function(err) {
+        assert.equal(err, "NOT_FOUND");
+      });
+    });
+
+    it("should resolve a pending stat of a modified entry", function() {
+      cache.cacheDirectoryContents(fileSystemId, directoryPath,
+          [{name : "b.txt", isDirectory : false}], now, "token1");
+      cache.getBatchToUpdate(fileSystemId, "/tmp/b.txt", 10);
+      var resolver = cache.lookupMetadata(fileSystemId, "/tmp/b.txt", now)
+          .stat_resolver;
+      var diff = makeDiff();
+      cache.applyDirectoryDiff(fileSystemId, directoryPath, "token1",
+          {added : [], modified : diff.modified, removed : []}, now + 1);
+      return resolver.promise.then(function(entry) {
+        assert.equal(entry.size, 20);
+      });
+    });
+
+    it("should keep incomplete entries for the next batch", function() {
+      cache.applyDirectoryDiff(fileSystemId, directoryPath, "token1", {
+        added : [{name : "e.txt", isDirectory : false, size : -1}],
+        modified : [],
+        removed : []
+      }, now + 1);
+      var batch = cache.getBatchToUpdate(fileSystemId, "/tmp/a.txt", 10);
+      assert.sameMembers(batch, ["/tmp/a.txt", "/tmp/e.txt"]);
+    });
+  });
 });